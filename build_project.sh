@@ -8,6 +8,9 @@ cmake -G "Ninja" -B build -S .
 cmake --build build 
 cmake --install build
 
+# The build also reports the static RAM and flash used by each RAM profile
+cat build/secil_size_report.txt
+
 # Run the tests
 echo "Running tests..."
 ./build/loopback_test
@@ -16,6 +19,78 @@ if [ $? -ne 0 ]; then
     exit 1
 fi
 
+./build/link_test
+if [ $? -ne 0 ]; then
+    echo "Link test failed."
+    exit 1
+fi
+
+./build/receive_test
+if [ $? -ne 0 ]; then
+    echo "Receive test failed."
+    exit 1
+fi
+
+./build/bench_burst
+if [ $? -ne 0 ]; then
+    echo "Burst benchmark failed."
+    exit 1
+fi
+
+./build/bench_reliable
+if [ $? -ne 0 ]; then
+    echo "Reliable benchmark failed."
+    exit 1
+fi
+
+./build/baud_test
+if [ $? -ne 0 ]; then
+    echo "Baud rate test failed."
+    exit 1
+fi
+
+./build/bench_compression
+if [ $? -ne 0 ]; then
+    echo "Compression benchmark failed."
+    exit 1
+fi
+
+./build/bench_bulk
+if [ $? -ne 0 ]; then
+    echo "Bulk benchmark failed."
+    exit 1
+fi
+
+./build/bench_priority
+if [ $? -ne 0 ]; then
+    echo "Priority benchmark failed."
+    exit 1
+fi
+
+./build/bench_flow
+if [ $? -ne 0 ]; then
+    echo "Flow control benchmark failed."
+    exit 1
+fi
+
+./build/bench_rate
+if [ $? -ne 0 ]; then
+    echo "Rate limit benchmark failed."
+    exit 1
+fi
+
+./build/bench_heartbeat
+if [ $? -ne 0 ]; then
+    echo "Heartbeat benchmark failed."
+    exit 1
+fi
+
+./build/bench_clock
+if [ $? -ne 0 ]; then
+    echo "Clock sync benchmark failed."
+    exit 1
+fi
+
 # Now check that our installed library can be built from source
 echo "Building installation from source..."
 cmake -G "Ninja" -B build/test -S build/install
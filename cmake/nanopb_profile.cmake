@@ -0,0 +1,106 @@
+# Writes the nanopb configuration header used to build secil, based on the fields of the generated schema.
+#
+# Usage: cmake -DSCHEMA=<secil.pb.h> -DOUTPUT=<secil_pb_config.h> -DMINIMAL=<ON|OFF> -DBUFFER_ONLY=<ON|OFF> -P nanopb_profile.cmake
+#
+# Every field of the schema is listed in the generated header as X(a, ALLOCATION, LABEL, TYPE, name, tag).
+# Any nanopb feature that none of these fields need is compiled out (see the options at the top of pb.h).
+# BUFFER_ONLY tells us if secil itself needs stream callbacks (cut-through decode and streaming TX do).
+# With MINIMAL=OFF the header only includes the system headers and nanopb keeps all of its features.
+
+cmake_minimum_required(VERSION 3.10)
+
+# Read the whole header rather than line by line: the field lists end each line with a backslash,
+# which would escape the list separator and join the lines of a message together.
+file(READ ${SCHEMA} SCHEMA_TEXT)
+string(REGEX MATCHALL "\nX\\(a, [^\n\\]*" FIELD_LINES "${SCHEMA_TEXT}")
+
+set(ALLOCATIONS "")
+set(LABELS "")
+set(TYPES "")
+foreach(FIELD_LINE ${FIELD_LINES})
+   if(NOT FIELD_LINE MATCHES "^\nX\\(a, *([A-Z]+), *([A-Z]+), *([A-Z0-9_]+),")
+      message(FATAL_ERROR "Cannot parse field of ${SCHEMA}: ${FIELD_LINE}")
+   endif()
+   list(APPEND ALLOCATIONS ${CMAKE_MATCH_1})
+   list(APPEND LABELS ${CMAKE_MATCH_2})
+   list(APPEND TYPES ${CMAKE_MATCH_3})
+endforeach()
+
+if(POINTER IN_LIST ALLOCATIONS)
+   message(FATAL_ERROR "${SCHEMA} uses pointer fields, but secil does not use dynamic memory. Give the field a max_size or max_count.")
+endif()
+
+# Returns TRUE in RESULT if none of the VALUES are found in LIST
+function(schema_uses_none RESULT LIST)
+   set(${RESULT} TRUE PARENT_SCOPE)
+   foreach(VALUE ${ARGN})
+      if(VALUE IN_LIST ${LIST})
+         set(${RESULT} FALSE PARENT_SCOPE)
+      endif()
+   endforeach()
+endfunction()
+
+set(CONFIG "")
+if(NOT MINIMAL)
+   string(APPEND CONFIG "\n/* SECIL_MINIMAL_NANOPB is OFF, so nanopb keeps all of its features */\n")
+endif()
+
+macro(add_option NAME REASON)
+   if(MINIMAL)
+      string(APPEND CONFIG "\n/* ${REASON} */\n#define ${NAME} 1\n")
+   endif()
+endmacro()
+
+add_option(PB_NO_ERRMSG "secil only logs that a message could not be decoded")
+
+if(BUFFER_ONLY)
+   add_option(PB_BUFFER_ONLY "Cut-through decode and streaming TX are disabled, so every stream is a memory buffer")
+endif()
+
+schema_uses_none(UNUSED TYPES INT64 UINT64 SINT64 FIXED64 SFIXED64 DOUBLE)
+if(UNUSED)
+   add_option(PB_WITHOUT_64BIT "No 64-bit fields")
+endif()
+
+schema_uses_none(UNUSED ALLOCATIONS CALLBACK)
+if(UNUSED)
+   add_option(PB_WITHOUT_CALLBACK_FIELDS "No callback fields")
+endif()
+
+schema_uses_none(UNUSED TYPES EXTENSION)
+if(UNUSED)
+   add_option(PB_WITHOUT_EXTENSIONS "No extension ranges")
+endif()
+
+schema_uses_none(UNUSED LABELS REPEATED FIXARRAY)
+if(UNUSED)
+   add_option(PB_WITHOUT_REPEATED "No repeated fields")
+endif()
+
+schema_uses_none(UNUSED TYPES BYTES FIXED_LENGTH_BYTES)
+if(UNUSED)
+   add_option(PB_WITHOUT_BYTES "No bytes fields")
+endif()
+
+schema_uses_none(UNUSED TYPES FIXED32 SFIXED32 FLOAT FIXED64 SFIXED64 DOUBLE)
+if(UNUSED)
+   add_option(PB_WITHOUT_FIXED_TYPES "No fixed32, fixed64, float or double fields")
+endif()
+
+get_filename_component(SCHEMA_NAME ${SCHEMA} NAME)
+set(HEADER "/* Generated from ${SCHEMA_NAME} by cmake/nanopb_profile.cmake - do not edit.
+ * Selected by PB_SYSTEM_HEADER, so it also provides the system headers that pb.h needs. */
+
+#ifndef SECIL_PB_CONFIG_H
+#define SECIL_PB_CONFIG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+${CONFIG}
+#endif
+")
+
+file(WRITE ${OUTPUT} "${HEADER}")
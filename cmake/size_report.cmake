@@ -0,0 +1,75 @@
+# Writes a table of the static RAM and flash used by each profile of the library.
+#
+# Usage: cmake -DSIZE_TOOL=<size> -DMANIFEST=<secil_profiles.txt> -DOUTPUT=<report.txt> -P size_report.cmake
+#
+# Each line of the manifest is: <profile>|<generated secil.pb.h>|<secil library>|<schema library>
+# Flash is text + data, RAM is data + bss, summed over every object in the listed libraries.
+# Codec flash is the part of the flash used by the schema library, i.e. the field tables and nanopb itself.
+# The largest encoded message (secil_message_size) is taken from the generated schema header,
+# it sets the size of the frame buffers and of the secil_message structure the application declares.
+
+function(append_column TEXT WIDTH)
+   string(LENGTH "${TEXT}" TEXT_LENGTH)
+   set(TEXT_PADDING "")
+   if(WIDTH GREATER 0)
+      math(EXPR PADDING "${WIDTH} - ${TEXT_LENGTH}")
+      if(PADDING LESS 1)
+         set(PADDING 1)
+      endif()
+      string(REPEAT " " ${PADDING} TEXT_PADDING)
+   endif()
+   set(REPORT_LINE "${REPORT_LINE}${TEXT}${TEXT_PADDING}" PARENT_SCOPE)
+endfunction()
+
+# Sets FLASH and RAM in the parent scope to the totals of the given libraries
+function(measure_libraries)
+   execute_process(
+      COMMAND ${SIZE_TOOL} -t ${ARGN}
+      OUTPUT_VARIABLE SIZE_OUTPUT
+      RESULT_VARIABLE SIZE_RESULT
+   )
+   if(NOT SIZE_RESULT EQUAL 0)
+      message(FATAL_ERROR "Failed to run ${SIZE_TOOL} on ${ARGN}")
+   endif()
+
+   # The last line is the total: text data bss dec hex (TOTALS)
+   string(REGEX MATCH "([0-9]+)[ \t]+([0-9]+)[ \t]+([0-9]+)[ \t]+[0-9]+[ \t]+[0-9a-fA-F]+[ \t]+\\(TOTALS\\)" TOTALS "${SIZE_OUTPUT}")
+   math(EXPR TOTAL_FLASH "${CMAKE_MATCH_1} + ${CMAKE_MATCH_2}")
+   math(EXPR TOTAL_RAM "${CMAKE_MATCH_2} + ${CMAKE_MATCH_3}")
+   set(FLASH ${TOTAL_FLASH} PARENT_SCOPE)
+   set(RAM ${TOTAL_RAM} PARENT_SCOPE)
+endfunction()
+
+file(STRINGS ${MANIFEST} PROFILES)
+
+set(REPORT "Profile              Flash (bytes)  RAM (bytes)    Codec flash    Max message (bytes)\n")
+string(APPEND REPORT "-------------------  -------------  -------------  -------------  -------------------\n")
+
+foreach(PROFILE_LINE ${PROFILES})
+   string(REPLACE "|" ";" PROFILE_FIELDS "${PROFILE_LINE}")
+   list(GET PROFILE_FIELDS 0 PROFILE_NAME)
+   list(GET PROFILE_FIELDS 1 PROFILE_HEADER)
+   list(GET PROFILE_FIELDS 3 PROFILE_SCHEMA)
+   list(REMOVE_AT PROFILE_FIELDS 0 1)
+
+   measure_libraries(${PROFILE_SCHEMA})
+   set(CODEC_FLASH ${FLASH})
+   measure_libraries(${PROFILE_FIELDS})
+
+   file(STRINGS ${PROFILE_HEADER} MESSAGE_SIZE_LINE REGEX "#define secil_message_size[ \t]+[0-9]+")
+   string(REGEX MATCH "[0-9]+$" MESSAGE_SIZE "${MESSAGE_SIZE_LINE}")
+
+   set(REPORT_LINE "")
+   append_column("${PROFILE_NAME}" 21)
+   append_column("${FLASH}" 15)
+   append_column("${RAM}" 15)
+   append_column("${CODEC_FLASH}" 15)
+   append_column("${MESSAGE_SIZE}" 0)
+   string(APPEND REPORT "${REPORT_LINE}\n")
+endforeach()
+
+string(APPEND REPORT "\nNOTE: Constant nanopb field tables are counted as data on hosts that build position independent code.\n")
+string(APPEND REPORT "      On a microcontroller they are placed in flash, so the RAM figures above are an upper bound.\n")
+
+file(WRITE ${OUTPUT} "${REPORT}")
+message("${REPORT}")
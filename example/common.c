@@ -9,10 +9,12 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/select.h>
+#include <poll.h>
 #include <string.h>
 #include <errno.h>
 #include <termios.h>
 #include <pthread.h>
+#include <time.h>
 
 // Use this to trace all UART reads and writes
 #define TRACE_UART 1
@@ -20,7 +22,25 @@
 static struct
 {
     int uart_fd; // File descriptor for UART
-} g_secil_context;
+    pthread_mutex_t lock; // Shared by the receive thread and the threads that send
+} g_secil_context = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void lock_secil(void *user_data)
+{
+    pthread_mutex_lock(&g_secil_context.lock);
+}
+
+static void unlock_secil(void *user_data)
+{
+    pthread_mutex_unlock(&g_secil_context.lock);
+}
+
+static uint32_t clock_ms(void *user_data)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
 
 // This function will fork and launch the socat command below:
 // socat pty,link=dev_uart1,raw,echo=0 pty,link=dev_uart2,raw,echo=0
@@ -170,6 +190,34 @@ bool read_uart(void *user_data, unsigned char *buf, size_t required_count)
     return true; // Successfully read the required number of bytes
 }
 
+// Reads whatever arrives within the time limit, so that secil_receive_until() never waits past its deadline and gaps
+// within a frame are timed
+static int32_t read_uart_within(void *user_data, unsigned char *buf, size_t max_count, uint32_t timeout_ms)
+{
+    struct pollfd pfd = { .fd = g_secil_context.uart_fd, .events = POLLIN };
+    int poll_result = poll(&pfd, 1, (int)timeout_ms);
+    if (poll_result < 0)
+    {
+        return errno == EINTR ? 0 : -1;
+    }
+    if (poll_result == 0)
+    {
+        return 0; // Nothing arrived in time
+    }
+
+    ssize_t bytes_read = read(g_secil_context.uart_fd, buf, max_count);
+    if (bytes_read < 0)
+    {
+        return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    }
+
+    #ifdef TRACE_UART
+    printf("Read %zd bytes from UART within %u ms\n", bytes_read, (unsigned)timeout_ms);
+    #endif
+
+    return bytes_read > 0 ? (int32_t)bytes_read : -1;
+}
+
 static bool write_uart(void *user_data, const unsigned char *buf, size_t count)
 {
     ssize_t bytes_written = write(g_secil_context.uart_fd, buf, count);
@@ -196,6 +244,58 @@ static bool write_uart(void *user_data, const unsigned char *buf, size_t count)
     return true;
 }
 
+/// @brief Find the termios speed of a rate.
+/// @return The speed, or B0 if termios has none for the rate.
+static speed_t termios_speed(uint32_t baud)
+{
+    switch (baud)
+    {
+    case 9600:    return B9600;
+    case 19200:   return B19200;
+    case 38400:   return B38400;
+    case 57600:   return B57600;
+    case 115200:  return B115200;
+    case 230400:  return B230400;
+    case 460800:  return B460800;
+    case 921600:  return B921600;
+    case 1000000: return B1000000;
+    case 1500000: return B1500000;
+    case 2000000: return B2000000;
+    case 3000000: return B3000000;
+    default:      return B0;
+    }
+}
+
+// Rates the UART can be switched to once connected
+#define UART_BAUD_RATES (SECIL_BAUD_115200 | SECIL_BAUD_230400 | SECIL_BAUD_460800 | SECIL_BAUD_921600)
+#define UART_BOOT_BAUD 115200
+
+// A frame is abandoned once its bytes stop arriving for this many character times. The tty (and socat, between the
+// pseudo UARTs) hands bytes over in bursts, so the gap is never shorter than UART_GAP_MIN_MS.
+#define UART_GAP_CHAR_TIMES 32
+#define UART_GAP_MIN_MS 20
+
+static bool set_speed_uart(void *user_data, uint32_t baud)
+{
+    struct termios options;
+    speed_t speed = termios_speed(baud);
+    if (speed == B0 || tcgetattr(g_secil_context.uart_fd, &options) == -1)
+    {
+        return false;
+    }
+
+    cfsetispeed(&options, speed);
+    cfsetospeed(&options, speed);
+
+    // TCSADRAIN lets the bytes already written go out at the old rate first
+    if (tcsetattr(g_secil_context.uart_fd, TCSADRAIN, &options) == -1)
+    {
+        perror("Failed to set UART speed");
+        return false;
+    }
+    return true;
+}
+
 /// @brief Log the message received.
 /// @param type - The type of the message.
 /// @param payload - The payload of the message.
@@ -277,6 +377,13 @@ bool initialise_comms_library_with_psuedo_uarts(const char *uart_local, const ch
         return false;
     }
 
+    // We send from the main thread while the receive thread is running
+    secil_set_lock_callbacks(lock_secil, unlock_secil);
+    secil_set_clock_callback(clock_ms);
+    secil_set_read_within_callback(read_uart_within);
+    secil_set_inter_byte_timeout(UART_GAP_CHAR_TIMES, UART_BOOT_BAUD, UART_GAP_MIN_MS);
+    secil_set_speed_callback(set_speed_uart, UART_BAUD_RATES, UART_BOOT_BAUD);
+
     return true;
 }
 
@@ -301,8 +408,8 @@ bool initialise_comms_library(const char *uart_device)
         return false;
     }
 
-    cfsetispeed(&options, B115200);
-    cfsetospeed(&options, B115200);
+    cfsetispeed(&options, termios_speed(UART_BOOT_BAUD));
+    cfsetospeed(&options, termios_speed(UART_BOOT_BAUD));
     options.c_cflag |= (CLOCAL | CREAD); // Enable receiver, ignore modem control lines
     options.c_cflag &= ~PARENB;          // No parity
     options.c_cflag &= ~CSTOPB;          // 1 stop bit
@@ -323,6 +430,15 @@ bool initialise_comms_library(const char *uart_device)
         return false;
     }
 
+    // We send from the main thread while the receive thread is running
+    secil_set_lock_callbacks(lock_secil, unlock_secil);
+    secil_set_clock_callback(clock_ms);
+    secil_set_read_within_callback(read_uart_within);
+    secil_set_inter_byte_timeout(UART_GAP_CHAR_TIMES, UART_BOOT_BAUD, UART_GAP_MIN_MS);
+
+    // Start at the boot rate and let the application move to a faster one once connected
+    secil_set_speed_callback(set_speed_uart, UART_BAUD_RATES, UART_BOOT_BAUD);
+
     return true;
 }
 
@@ -335,8 +451,25 @@ void test_uart_loopback()
     // read into buffer until newline or buffer full
     scanf(" %[^\n]", buffer); // Read string with spaces
 
-    // Now do the loopback test
-    secil_error_t result = secil_loopback_test(buffer);
+    // Now do the loopback test - the receive thread picks up the reply, so we only wait for it here
+    secil_request_handle_t handle;
+    secil_error_t result = secil_loopback_test_start(buffer, NULL, NULL, &handle);
+    if (result == SECIL_OK)
+    {
+        int waited_ms = 0;
+        while ((result = secil_request_poll(handle)) == SECIL_ERROR_REQUEST_PENDING && waited_ms < 1000)
+        {
+            usleep(10000);
+            waited_ms += 10;
+        }
+
+        if (result == SECIL_ERROR_REQUEST_PENDING)
+        {
+            secil_request_cancel(handle);
+            result = SECIL_ERROR_REQUEST_TIMEOUT;
+        }
+    }
+
     if (result == SECIL_OK)
     {
         printf("Loopback test successful. Sent and received: %s\n", buffer);
@@ -370,12 +503,24 @@ static void receive_thread()
    }
 }
 
+static void poll_thread()
+{
+   // Time based work: handshake retries, request timeouts and retransmissions
+   while (1)
+   {
+      secil_poll();
+      usleep(10000);
+   }
+}
+
 void launch_receive_thread()
 {
    printf("Launching receive thread...\n");
 
    pthread_t thread_id;
-   if (pthread_create(&thread_id, NULL, (void*(*)(void*))receive_thread, NULL) != 0)
+   if (pthread_create(&thread_id, NULL, (void*(*)(void*))receive_thread, NULL) != 0 ||
+       pthread_detach(thread_id) != 0 ||
+       pthread_create(&thread_id, NULL, (void*(*)(void*))poll_thread, NULL) != 0)
    {
       perror("Failed to create receive thread");
    }
@@ -1,5 +1,4 @@
 #include <stdio.h>
-#include <unistd.h> // For sleep function
 #include "common.h"
 #include "secil.h"
 
@@ -18,19 +17,14 @@ int main()
 
    printf("SE Comms Library initialized successfully.\n");
    
-   printf("Starting up as server...\n");
+   printf("Connecting as server...\n");
 
-   secil_error_t startup_result = SECIL_ERROR_READ_TIMEOUT;
-   
-   while (startup_result != SECIL_OK)
+   // The receive thread completes the handshake, and the poll thread repeats it until the remote end answers
+   secil_error_t connect_result = secil_connect(secil_operating_mode_t_SERVER);
+   if (connect_result != SECIL_OK)
    {
-      startup_result = secil_startup(secil_operating_mode_t_SERVER);
-      if (startup_result != SECIL_OK)
-      {
-         fprintf(stderr, "Startup failed: %s\n", secil_error_string(startup_result));
-         printf("Retrying in 5 seconds...\n");
-         sleep(5);
-      }
+      fprintf(stderr, "Connect failed: %s\n", secil_error_string(connect_result));
+      return 1;
    }
 
    launch_receive_thread();
@@ -1,5 +1,4 @@
 #include <stdio.h>
-#include <unistd.h> // For sleep function
 
 #include "common.h"
 #include "secil.h"
@@ -18,19 +17,14 @@ int main()
 
    printf("SE Comms Library initialized successfully.\n");
 
-   printf("Starting up as client...\n");
+   printf("Connecting as client...\n");
 
-   secil_error_t startup_result = SECIL_ERROR_READ_TIMEOUT;
-
-   while (startup_result != SECIL_OK)
+   // The receive thread completes the handshake, and the poll thread repeats it until the remote end answers
+   secil_error_t connect_result = secil_connect(secil_operating_mode_t_CLIENT);
+   if (connect_result != SECIL_OK)
    {
-      startup_result = secil_startup(secil_operating_mode_t_CLIENT);
-      if (startup_result != SECIL_OK)
-      {
-         fprintf(stderr, "Startup failed: %s\n", secil_error_string(startup_result));
-         printf("Retrying in 5 seconds...\n");
-         sleep(5);
-      }
+      fprintf(stderr, "Connect failed: %s\n", secil_error_string(connect_result));
+      return 1;
    }
 
    launch_receive_thread();
@@ -44,8 +38,9 @@ int main()
       printf(" 2. Send Auto Wake\n");
       printf(" 3. Send Away Mode\n");
       printf(" 4. UART loopback test\n");
-      printf(" 5. Exit\n");
-      printf("Please select an option (1-5):\n");
+      printf(" 5. Switch UART rate\n");
+      printf(" 6. Exit\n");
+      printf("Please select an option (1-6):\n");
 
       scanf("%d", &option);
       switch (option)
@@ -81,13 +76,22 @@ int main()
             test_uart_loopback();
             break;
          case 5:
+            {
+               unsigned baud;
+               printf("Enter the new rate (e.g. 921600): ");
+               scanf("%u", &baud);
+               secil_error_t result = secil_switch_baud(baud);
+               printf("Switch to %u baud %s\n", baud, result == SECIL_OK ? "proposed" : secil_error_string(result));
+            }
+            break;
+         case 6:
             printf("Exiting...\n");
             break;
          default:
             printf("Invalid option. Please try again.\n");
       }
    }
-   while(option != 5);
+   while(option != 6);
 
    // Deinitialize the library
    secil_deinit();
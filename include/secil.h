@@ -8,10 +8,44 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <secil_config.h>
 #include <secil.pb.h>
 
 #define SECIL_VERSION "0.1.0"
 
+/// The bit that stands for the values carried by a payload tag in queries and subscriptions,
+/// e.g. SECIL_TAG_BIT(secil_message_heatingSetpoint_tag). Only payload tags below 32 have a bit.
+#define SECIL_TAG_BIT(tag) ((uint32_t)1 << (tag))
+
+/// Subscribe to every value (the default).
+#define SECIL_SUBSCRIBE_ALL 0xFFFFFFFFu
+
+/// Features offered in the handshake. Each one is only used once both ends have offered it.
+#define SECIL_CAPABILITY_COMPACT_FRAMES (1u << 0) ///< v2 frames: one length byte, no length prefix and no footer magic bytes
+#define SECIL_CAPABILITY_STATE_DIGEST   (1u << 1) ///< Values that differ are sent again on connecting (see SECIL_STATE_DIGEST)
+#define SECIL_CAPABILITY_COMPRESSION    (1u << 2) ///< Large messages go out LZ compressed in v2 frames when that saves bytes (see SECIL_COMPRESSION)
+#define SECIL_CAPABILITY_FRAGMENTS      (1u << 3) ///< Long frames go out in v2 fragments, so urgent frames can be sent between them (see SECIL_FRAGMENTATION)
+#define SECIL_CAPABILITY_FLOW_CONTROL   (1u << 4) ///< Each end tells the other how much more its receive buffer can take (see SECIL_FLOW_CONTROL)
+#define SECIL_CAPABILITY_HEARTBEAT      (1u << 5) ///< Heartbeats are answered, so either end can measure the link (see secil_set_heartbeat())
+
+/// Every feature this version of the library knows. Those that the build supports are offered unless changed with secil_set_capabilities().
+#define SECIL_CAPABILITIES_SUPPORTED (SECIL_CAPABILITY_COMPACT_FRAMES | SECIL_CAPABILITY_STATE_DIGEST | SECIL_CAPABILITY_COMPRESSION \
+                                      | SECIL_CAPABILITY_FRAGMENTS | SECIL_CAPABILITY_FLOW_CONTROL | SECIL_CAPABILITY_HEARTBEAT)
+
+/// UART rates that the two ends can switch to with secil_switch_baud(), offered in the handshake.
+#define SECIL_BAUD_9600    (1u << 0)
+#define SECIL_BAUD_19200   (1u << 1)
+#define SECIL_BAUD_38400   (1u << 2)
+#define SECIL_BAUD_57600   (1u << 3)
+#define SECIL_BAUD_115200  (1u << 4)
+#define SECIL_BAUD_230400  (1u << 5)
+#define SECIL_BAUD_460800  (1u << 6)
+#define SECIL_BAUD_921600  (1u << 7)
+#define SECIL_BAUD_1000000 (1u << 8)
+#define SECIL_BAUD_1500000 (1u << 9)
+#define SECIL_BAUD_2000000 (1u << 10)
+#define SECIL_BAUD_3000000 (1u << 11)
+
 #if defined(__cplusplus)
 extern "C"
 {
@@ -32,6 +66,40 @@ extern "C"
     /// @return True if we wrote count bytes successfully, false otherwise.
     typedef bool (*secil_write_fn)(void *user_data, const unsigned char *buf, size_t count);
 
+    /// @brief Signature for an optional callback that reports how many bytes can be read from the stream without blocking.
+    /// @param user_data The user data.
+    /// @return The number of bytes that are already buffered and can be read immediately.
+    typedef size_t (*secil_available_fn)(void *user_data);
+
+    /// @brief Signature for an optional callback that reads whatever bytes arrive within a time limit.
+    /// @param user_data The user data.
+    /// @param buf The buffer to write to.
+    /// @param max_count The most bytes to read.
+    /// @param timeout_ms The longest to wait for the first byte, 0 to only take bytes already buffered.
+    /// @return The number of bytes read (0 if none arrived in time), or -1 if the transport failed.
+    typedef int32_t (*secil_read_within_fn)(void *user_data, unsigned char *buf, size_t max_count, uint32_t timeout_ms);
+
+    /// @brief Signature for an optional callback that reports the time.
+    /// @param user_data The user data.
+    /// @return A free running millisecond counter (it may wrap around).
+    typedef uint32_t (*secil_clock_fn)(void *user_data);
+
+    /// @brief Signature for the optional callbacks that lock and unlock the library's shared state.
+    /// @param user_data The user data.
+    typedef void (*secil_lock_fn)(void *user_data);
+
+    /// @brief Signature for an optional callback that lets the calling thread wait.
+    /// @param user_data The user data.
+    /// @param ms How long to wait, in milliseconds.
+    typedef void (*secil_sleep_fn)(void *user_data, uint32_t ms);
+
+    /// @brief Signature for an optional callback that changes the rate of the UART.
+    /// @param user_data The user data.
+    /// @param baud The new rate in bits per second.
+    /// @return True if the UART now runs at the new rate, false otherwise.
+    /// @note Bytes already written must go out at the old rate first (e.g. tcsetattr() with TCSADRAIN).
+    typedef bool (*secil_set_speed_fn)(void *user_data, uint32_t baud);
+
     /// @brief The severity of a log message.
     typedef enum
     {
@@ -57,7 +125,15 @@ extern "C"
         SECIL_ERROR_SEND_FAILED = 12,
         SECIL_ERROR_RECEIVE_FAILED = 13,
         SECIL_ERROR_STARTUP_FAILED = 14,
-        SECIL_ERROR_VERSION_MISMATCH = 15
+        SECIL_ERROR_VERSION_MISMATCH = 15,
+        SECIL_ERROR_WINDOW_FULL = 16,
+        SECIL_ERROR_REQUEST_PENDING = 17,
+        SECIL_ERROR_REQUEST_TIMEOUT = 18,
+        SECIL_ERROR_TOO_MANY_REQUESTS = 19,
+        SECIL_ERROR_TRANSFER_CANCELLED = 20,
+        SECIL_ERROR_QUEUE_FULL = 21,
+        SECIL_ERROR_RATE_LIMITED = 22,
+        SECIL_ERROR_DEADLINE_EXPIRED = 23
 
     } secil_error_t;
 
@@ -101,26 +177,315 @@ extern "C"
     /// @brief Sends data to the remote end and expects to receive the same data back.
     /// @param test_data The data to send - must be a null-terminated printable string.
     /// @return SECIL_OK if the test was successful, otherwise an error code.
+    /// @warning This function receives frames itself until the reply arrives, so it must not be used while another thread
+    ///          is inside secil_receive(). Use secil_loopback_test_start() in that case.
+    /// @note Application messages that arrive in the meantime are returned by the next receives. If more than
+    ///       SECIL_LOOPBACK_HOLD of them arrive, the test gives up with SECIL_ERROR_QUEUE_FULL rather than drop one.
     secil_error_t secil_loopback_test(const char *test_data);
 
+    /// @brief Identifies a request that is waiting for its response.
+    typedef uint16_t secil_request_handle_t;
+
+    /// @brief A callback function that is told how a request completed.
+    /// @param context The context pointer given when the request was started.
+    /// @param result SECIL_OK if the expected response arrived, otherwise an error code (e.g. SECIL_ERROR_REQUEST_TIMEOUT).
+    /// @param response The response, or null if there is none - only valid for the duration of the callback.
+    /// @note The callback is called from the thread that receives the response (or calls secil_poll() on a timeout).
+    typedef void (*secil_response_fn)(void *context, secil_error_t result, const secil_message *response);
+
+    /// @brief Start a loopback test without waiting for the reply.
+    /// @param test_data The data to send - must be a null-terminated printable string.
+    /// @param on_response Called when the test completes, or null to poll for the result with secil_request_poll().
+    /// @param context Pointer passed to the callback (optional - can be null).
+    /// @param handle Receives the handle of the request (required if on_response is null).
+    /// @return SECIL_OK if the request was sent, otherwise an error code.
+    /// @note The reply is picked up by whichever thread calls secil_receive() and is not returned to the application.
+    ///       Up to SECIL_MAX_PENDING_REQUESTS requests may be waiting for a reply at the same time.
+    secil_error_t secil_loopback_test_start(const char *test_data, secil_response_fn on_response, void *context, secil_request_handle_t *handle);
+
+    /// @brief A callback function that supplies the current value asked for by a query from the remote end.
+    /// @param user_data The user data.
+    /// @param value The value to fill in - which_payload holds the payload tag asked for.
+    /// @return true if the value was filled in, false if it is not known.
+    /// @note Called from the thread that receives the query.
+    typedef bool (*secil_value_provider_fn)(void *user_data, secil_message *value);
+
+    /// @brief Set the optional callback that answers queries from the remote end.
+    /// @param provider The value provider (can be null to remove it).
+    /// @return SECIL_OK if the callback was set, otherwise an error code.
+    /// @note Queries are answered automatically inside secil_receive(). Each value comes from the provider if it knows it,
+    ///       otherwise from the last value of that type sent by this end (when built with SECIL_QUERY_SHADOW).
+    secil_error_t secil_set_value_provider(secil_value_provider_fn provider);
+
+    /// @brief Ask the remote end for its current values, which it sends back in a single queryReply.
+    /// @param tags The values to ask for - combine SECIL_TAG_BIT() of each payload tag.
+    /// @param on_response Called with the queryReply, or null to poll for the result with secil_request_poll().
+    /// @param context Pointer passed to the callback (optional - can be null).
+    /// @param handle Receives the handle of the request (required if on_response is null).
+    /// @return SECIL_OK if the query was sent, otherwise an error code.
+    /// @note Values the remote end does not know are left out of the reply. Use secil_query_reply_get() to read each value.
+    secil_error_t secil_query_values(uint32_t tags, secil_response_fn on_response, void *context, secil_request_handle_t *handle);
+
+    /// @brief Take one value out of a queryReply.
+    /// @param reply The queryReply message.
+    /// @param tag The payload tag of the value.
+    /// @param value Receives the value as if it had been received on its own.
+    /// @return SECIL_OK if the reply holds the value, otherwise an error code.
+    secil_error_t secil_query_reply_get(const secil_message *reply, pb_size_t tag, secil_message *value);
+
+    /// @brief Check if a request started without a callback has completed.
+    /// @param handle The handle of the request.
+    /// @return SECIL_ERROR_REQUEST_PENDING while waiting for the response, otherwise the result of the request.
+    /// @note Once the result has been returned the handle is released and must not be used again.
+    secil_error_t secil_request_poll(secil_request_handle_t handle);
+
+    /// @brief Give up waiting for a request. Its callback is not called and a late response is ignored.
+    /// @param handle The handle of the request.
+    /// @return SECIL_OK if the request was cancelled, otherwise an error code.
+    secil_error_t secil_request_cancel(secil_request_handle_t handle);
+
     /// @brief Start up the SECIL library as either a client or server.
     /// @param mode The mode to start up in (client or server).
     /// @return SECIL_OK if the startup was successful, otherwise an error code.
     /// @note This function must be called after secil_init() and before any other functions in the library.
     /// @note After calling this function, the library will be in either client or server mode.
     /// @note The version strings exchanged during startup must match between client and server - if they don't match, SECIL_ERROR_VERSION_MISMATCH will be returned.
+    /// @note This function blocks until the remote end's handshake arrives. Messages received before it are dropped.
     secil_error_t secil_startup(secil_operating_mode_t mode);
 
     /// @brief Start up the SECIL library as either a client or server, ignoring version mismatches.
     /// @see secil_startup()
     secil_error_t secil_startup_ignore_mismatch(secil_operating_mode_t mode);
 
+    /// @brief State of the connection with the remote end.
+    typedef enum
+    {
+        SECIL_DISCONNECTED = 0, ///< Not started up, or the startup failed
+        SECIL_CONNECTING,       ///< Our handshake has been sent, the remote end's has not arrived yet
+        SECIL_CONNECTED,        ///< Handshakes exchanged
+    } secil_connection_state_t;
+
+    /// @brief Statistics of the connection with the remote end.
+    typedef struct
+    {
+        uint32_t handshakes_sent;      ///< Handshakes sent that ask for a reply, including retries
+        uint32_t connects;             ///< Times the connection was made, including after the remote end restarted
+        uint32_t remote_restarts;      ///< Handshakes received from the remote end while already connected
+        uint32_t last_connect_ms;      ///< Time from secil_connect() until the remote end's handshake arrived
+        uint32_t resumptions;          ///< Resumption tickets accepted by the remote end
+        uint32_t resumptions_rejected; ///< Resumption tickets rejected by the remote end, which fell back to a full handshake
+    } secil_connection_stats_t;
+
+    /// @brief What was agreed with the remote end, kept so that a restarting end can carry on without waiting for a handshake.
+    /// @note Store it where it survives a restart (e.g. RAM that is not cleared on reset) and hand it to secil_resume().
+    typedef struct
+    {
+        uint32_t session;        ///< Session of the connection (never 0)
+        uint32_t capabilities;   ///< SECIL_CAPABILITY_* bits agreed
+        uint32_t subscriptions;  ///< Values the remote end wants
+        uint16_t max_frame_size; ///< Largest frame the remote end can receive (0 if it did not say)
+        uint8_t reliable_window; ///< Window of the reliable channel (0 if it was not in use)
+    } secil_resumption_ticket_t;
+
+    /// @brief Start up the SECIL library as either a client or server without waiting for the remote end.
+    /// @param mode The mode to start up in (client or server).
+    /// @return SECIL_OK if our handshake was sent, otherwise an error code.
+    /// @note The connection is made when secil_receive() picks up the remote end's handshake. Until then, messages
+    ///       received are still returned, and secil_poll() sends the handshake again after SECIL_HANDSHAKE_RETRY_MS,
+    ///       doubling the wait after each attempt up to SECIL_HANDSHAKE_RETRY_MAX_MS (this needs a clock callback).
+    /// @note Version mismatches are not treated as errors - check secil_get_remote_version() in the on_connect callback.
+    secil_error_t secil_connect(secil_operating_mode_t mode);
+
+    /// @brief Get the ticket of the current connection, to resume it with secil_resume() after a restart.
+    /// @param ticket Receives the ticket.
+    /// @return SECIL_OK if the ticket was returned, otherwise an error code (e.g. SECIL_ERROR_INVALID_STATE when not connected).
+    /// @note Get the ticket again after every connect, as the session changes whenever a full handshake takes place.
+    secil_error_t secil_get_resumption_ticket(secil_resumption_ticket_t *ticket);
+
+    /// @brief Start up the SECIL library as either a client or server, carrying on the connection of a resumption ticket.
+    /// @param mode The mode to start up in (client or server), which must be the one the ticket was made in.
+    /// @param ticket The ticket from secil_get_resumption_ticket() before the restart.
+    /// @return SECIL_OK if our handshake was sent, otherwise an error code.
+    /// @note The connection is taken as made straight away, so messages can be sent as soon as this returns.
+    ///       If the remote end no longer knows the session (e.g. it has restarted too), it answers with a full handshake
+    ///       instead: the capabilities are agreed again and, with SECIL_CAPABILITY_STATE_DIGEST, any values it missed are resent.
+    /// @note The handshake is not sent again if it is lost - fall back to secil_connect() if no reply comes.
+    secil_error_t secil_resume(secil_operating_mode_t mode, const secil_resumption_ticket_t *ticket);
+
+    /// @brief Get the state of the connection with the remote end.
+    secil_connection_state_t secil_get_connection_state(void);
+
+    /// @brief Get the statistics of the connection with the remote end.
+    /// @param stats Receives the statistics.
+    /// @return SECIL_OK if the statistics were retrieved, otherwise an error code.
+    secil_error_t secil_get_connection_stats(secil_connection_stats_t *stats);
+
     /// @brief Get the version string of the remote end (the other MCU).
     /// @param version A buffer to receive the version string.
     /// @param version_size The size of the version buffer (should be at least 32 bytes).
     /// @return SECIL_OK if the version was retrieved successfully, otherwise an error code. 
     secil_error_t secil_get_remote_version(char *version, size_t version_size);
 
+    /// @brief Choose which values we want the remote end to send us.
+    /// @param tags Combine SECIL_TAG_BIT() of each payload tag wanted, or SECIL_SUBSCRIBE_ALL.
+    /// @return SECIL_OK if the subscriptions were set, otherwise an error code.
+    /// @note The subscriptions are sent in the handshake. When already connected they are also sent straight away.
+    secil_error_t secil_set_subscriptions(uint32_t tags);
+
+    /// @brief Check if the remote end wants the values with the given payload tag.
+    /// @param tag The payload tag, e.g. secil_message_heatingSetpoint_tag.
+    /// @return true unless the remote end has left the tag out of its subscriptions.
+    /// @note The secil_send_* functions already skip values nobody wants (and return SECIL_OK) - use this to avoid
+    ///       even working out a value that will not be sent.
+    bool secil_remote_wants(pb_size_t tag);
+
+    /// @brief Choose which features to offer the remote end.
+    /// @param capabilities Combine SECIL_CAPABILITY_* bits - only those supported by this build are offered.
+    /// @return SECIL_OK if the capabilities were set, otherwise an error code.
+    /// @note The capabilities are sent in the handshake, so call this before secil_startup().
+    secil_error_t secil_set_capabilities(uint32_t capabilities);
+
+    /// @brief Get the features that both ends offered in the last handshake.
+    /// @param capabilities Receives the SECIL_CAPABILITY_* bits in use.
+    /// @return SECIL_OK if the capabilities were returned, otherwise an error code.
+    /// @note Frames of both versions are always received, whatever was agreed.
+    secil_error_t secil_get_agreed_capabilities(uint32_t *capabilities);
+
+    /// @brief What compression has saved on the frames sent so far.
+    typedef struct
+    {
+        uint32_t compressed_frames; ///< Frames sent compressed
+        uint32_t bytes_before;      ///< Size of the messages in those frames before compression
+        uint32_t bytes_after;       ///< Size of the messages in those frames after compression
+    } secil_compression_stats_t;
+
+    /// @brief Get what compression has saved on the frames sent so far.
+    /// @param stats Receives the counts, which stay at zero if SECIL_CAPABILITY_COMPRESSION was not agreed.
+    /// @return SECIL_OK if the counts were retrieved, otherwise an error code.
+    secil_error_t secil_get_compression_stats(secil_compression_stats_t *stats);
+
+    /// @brief Set the string dictionary: the fixed warning texts that go over the link as their index instead of in full.
+    /// @param entries The texts, which must stay valid and unchanged (null and 0 to have none). Texts sent with arguments
+    ///                are printf formats whose conversions each take one int32_t, e.g. "Sensor %d read %d". Only %%
+    ///                and up to 4 integer conversions (d, i, o, u, x, X or c, without a length modifier or '*') may be
+    ///                used, otherwise SECIL_ERROR_INVALID_PARAMETER is returned.
+    /// @param count The number of texts.
+    /// @param expand True to expand the index of each warning received back into its text, false to leave the text
+    ///               empty and read message_id and args of the warning instead.
+    /// @return SECIL_OK if the dictionary was set, otherwise an error code.
+    /// @note A hash of the dictionary goes out in the handshake, so call this before secil_startup(). The index is only
+    ///       sent once the remote end has offered the same hash - until then the text is sent in full.
+    secil_error_t secil_set_dictionary(const char *const *entries, uint16_t count, bool expand);
+
+    /// @brief Check whether both ends have the same string dictionary, so that warnings are sent as their index.
+    bool secil_dictionary_in_use(void);
+
+    /// @brief Send a warning from the string dictionary, with the arguments of its format.
+    /// @param type The type of warning.
+    /// @param id The index of the text in the dictionary.
+    /// @param args The arguments of the format (can be null if there are none).
+    /// @param arg_count The number of arguments, at most 4.
+    /// @return SECIL_OK if the warning was sent, otherwise an error code.
+    /// @note If the remote end has a different dictionary the text is formatted here and sent in full.
+    secil_error_t secil_send_warning_id(secil_warning_type_t type, uint16_t id, const int32_t *args, size_t arg_count);
+
+    /// @brief Send the hashes of the values received so far, so that the remote end sends again any that differ from its own.
+    /// @return SECIL_OK if the digest was sent, otherwise an error code.
+    /// @note This happens by itself on connecting. Call it now and then to catch any drift, e.g. after lost frames.
+    ///       It needs SECIL_CAPABILITY_STATE_DIGEST to have been agreed.
+    secil_error_t secil_send_state_digest(void);
+
+    /// @brief Rate of the UART and the outcome of the switches so far.
+    typedef struct
+    {
+        uint32_t baud;      ///< Rate in use, in bits per second
+        bool switching;     ///< A switch is under way
+        uint32_t switches;  ///< Switches that were verified at the new rate
+        uint32_t rejected;  ///< Proposals that either end turned down
+        uint32_t rollbacks; ///< Switches that failed to verify, after which both ends went back to the old rate
+    } secil_baud_stats_t;
+
+    /// @brief Set the optional callback that changes the rate of the UART, and the rates it can switch to.
+    /// @param set_speed_callback The callback (can be null to remove it, which also offers no rates).
+    /// @param baud_rates Combine the SECIL_BAUD_* bits of the rates the UART supports. They are offered in the handshake.
+    /// @param boot_baud The rate the UART runs at now, which is also the one both ends start at after a restart.
+    /// @return SECIL_OK if the callback was set, otherwise an error code.
+    secil_error_t secil_set_speed_callback(secil_set_speed_fn set_speed_callback, uint32_t baud_rates, uint32_t boot_baud);
+
+    /// @brief Start moving both ends of the link to another UART rate.
+    /// @param baud The new rate in bits per second, which both ends must have offered in the handshake.
+    /// @return SECIL_OK if the proposal was sent, otherwise an error code.
+    /// @note The switch is driven by secil_receive() and secil_poll(), so it needs a clock callback:
+    ///       the remote end accepts and switches after its reply, we switch on receiving it and send a probe at the new rate.
+    ///       Either end that does not hear back within SECIL_BAUD_SWITCH_TIMEOUT_MS goes back to the old rate.
+    /// @note Messages sent while the switch is under way may be lost - use the reliable channel or resend them.
+    ///       secil_connect() always goes back to the boot rate, as the remote end starts there after a restart.
+    secil_error_t secil_switch_baud(uint32_t baud);
+
+    /// @brief Get the rate of the UART and the outcome of the switches so far.
+    /// @param stats Receives the statistics.
+    /// @return SECIL_OK if the statistics were retrieved, otherwise an error code.
+    secil_error_t secil_get_baud_stats(secil_baud_stats_t *stats);
+
+    /// @brief Signature for the callback that accepts a bulk transfer opened by the remote end.
+    /// @param user_data The user data.
+    /// @param kind What the blob is, as agreed between the applications.
+    /// @param size Size of the blob in bytes.
+    /// @param resume_offset Set this to the number of bytes already stored from an earlier attempt, to carry on from there (0 by default).
+    /// @return True to accept the transfer, false to refuse it.
+    typedef bool (*secil_bulk_open_fn)(void *user_data, uint32_t kind, uint32_t size, uint32_t *resume_offset);
+
+    /// @brief Signature for the callback that stores the chunks of an incoming bulk transfer, which arrive in order.
+    /// @return True if the chunk was stored, false to cancel the transfer.
+    typedef bool (*secil_bulk_write_fn)(void *user_data, uint32_t offset, const uint8_t *data, size_t count);
+
+    /// @brief Signature for the callback that reads the chunks of an outgoing bulk transfer.
+    /// @return True if count bytes from offset were read into data, false to cancel the transfer.
+    /// @note The same chunk is read again if it has to be resent.
+    typedef bool (*secil_bulk_read_fn)(void *user_data, uint32_t offset, uint8_t *data, size_t count);
+
+    /// @brief Signature for the callback that is told when a bulk transfer has ended.
+    /// @param outgoing True for the transfer we were sending, false for the one we were receiving.
+    /// @param result SECIL_OK if every byte arrived, SECIL_ERROR_TRANSFER_CANCELLED if either end ended it early.
+    typedef void (*secil_bulk_done_fn)(void *user_data, bool outgoing, secil_error_t result);
+
+    /// @brief Progress of the outgoing bulk transfer.
+    typedef struct
+    {
+        bool active;            ///< A transfer is under way
+        uint32_t size;          ///< Size of the blob in bytes
+        uint32_t acked;         ///< Bytes that the remote end has confirmed
+        uint32_t retransmitted; ///< Bytes sent more than once
+        uint32_t elapsed_ms;    ///< Time since the transfer started, or that it took once it has ended
+    } secil_bulk_stats_t;
+
+    /// @brief Set the callbacks that stream bulk transfers to and from the application, so that no blob has to sit in RAM.
+    /// @param on_open Accepts incoming transfers (null to refuse them all).
+    /// @param on_write Stores incoming chunks.
+    /// @param on_read Reads outgoing chunks.
+    /// @param on_done Told when a transfer ends (can be null).
+    /// @return SECIL_OK if the callbacks were set, otherwise an error code.
+    secil_error_t secil_set_bulk_callbacks(secil_bulk_open_fn on_open, secil_bulk_write_fn on_write,
+                                           secil_bulk_read_fn on_read, secil_bulk_done_fn on_done);
+
+    /// @brief Start sending a blob to the remote end, in chunks read through the on_read callback.
+    /// @param kind What the blob is, as agreed between the applications (e.g. support package, log or firmware image).
+    /// @param size Size of the blob in bytes.
+    /// @return SECIL_OK if the transfer was opened, otherwise an error code (SECIL_ERROR_INVALID_STATE if one is under way).
+    /// @note The chunks are sent by secil_poll() and as acknowledgements arrive, between the other messages.
+    ///       After a reconnect the transfer carries on from the last offset acknowledged.
+    secil_error_t secil_bulk_send(uint32_t kind, uint32_t size);
+
+    /// @brief End a bulk transfer early. The remote end's on_done callback is told the transfer was cancelled.
+    /// @param outgoing True for the transfer we are sending, false for the one we are receiving.
+    /// @return SECIL_OK if the transfer was ended, otherwise an error code.
+    secil_error_t secil_bulk_cancel(bool outgoing);
+
+    /// @brief Get the progress of the outgoing bulk transfer.
+    /// @param stats Receives the progress.
+    /// @return SECIL_OK if the progress was retrieved, otherwise an error code.
+    secil_error_t secil_get_bulk_stats(secil_bulk_stats_t *stats);
+
     /// @brief The main loop of the eme_se_comms library - this function should be called repeatedly in a loop.
     /// @param message A pointer to a valid instance of message that will be filled with the received message.
     /// @return SECIL_OK if a message was received successfully, otherwise an error code.
@@ -128,9 +493,336 @@ extern "C"
     /// @note If there was a problem receiving a message, the function will attempt to log the error internally using the logger callback function.
     secil_error_t secil_receive(secil_message *message);
 
+    /// @brief Receive a message, giving up at a deadline.
+    /// @param message A pointer to a valid instance of message that will be filled with the received message.
+    /// @param deadline Time by the clock callback at which to give up (e.g. the clock now plus 100 to wait 100 ms, or
+    ///                 the clock now to only take a message whose bytes have already arrived).
+    /// @return SECIL_OK if a message was received, SECIL_ERROR_DEADLINE_EXPIRED if none was complete by the deadline,
+    ///         SECIL_ERROR_READ_TIMEOUT if the transport failed, otherwise an error code.
+    /// @note The deadline covers the whole call: looking for a header, reading the body, skipping corrupt frames and
+    ///       handling the library's own messages. A frame cut short by the deadline is kept, and the next receive
+    ///       carries on with it, so a trickle of bytes is not lost (unless SECIL_HALF_DUPLEX is enabled, as sending
+    ///       shares its buffer).
+    /// @note Needs the clock callback. With the read within callback no read waits past the deadline. Without it the
+    ///       deadline is only checked before each read, which can then block for the read callback's own timeout.
+    secil_error_t secil_receive_until(secil_message *message, uint32_t deadline);
+
+    /// @brief Set the optional callback used to ask the transport how many received bytes are already buffered.
+    /// @param available_callback The available callback function (can be null to remove it).
+    /// @return SECIL_OK if the callback was set, otherwise an error code.
+    /// @note Without this callback (or the read within callback) secil_receive_many() cannot tell if more frames are
+    ///       pending and delivers one message per call.
+    secil_error_t secil_set_available_callback(secil_available_fn available_callback);
+
+    /// @brief Set the optional callback used to read with a time limit, so secil_receive_until() never waits past its
+    ///        deadline.
+    /// @param read_within_callback The read within callback function (can be null to remove it).
+    /// @return SECIL_OK if the callback was set, otherwise an error code.
+    /// @note It is only used inside secil_receive_until() and to time the inter-byte timeout, every other read is made
+    ///       with the read callback.
+    secil_error_t secil_set_read_within_callback(secil_read_within_fn read_within_callback);
+
+    /// @brief Set how long the bytes of a frame may stop arriving before the frame is abandoned.
+    /// @param char_times The longest gap allowed once a header has been found, in character times (10 bit times), or 0
+    ///                   to wait for the rest of a frame for as long as the read callback does (the default).
+    /// @param baud The rate the UART runs at now, in bits per second. The gap follows the rate when the two ends switch
+    ///             with secil_switch_baud().
+    /// @param min_ms The shortest gap allowed whatever the rate, for the time the transport takes to hand bytes over
+    ///               (e.g. a Linux tty passes them on a few ms at a time).
+    /// @return SECIL_OK if the timeout was set, otherwise an error code.
+    /// @note A frame cut short, e.g. because the remote end restarted part way through it, then costs only itself: the
+    ///       receive that abandons it returns SECIL_ERROR_DECODE_FAILED, and the next looks for a header in the bytes
+    ///       after its first, rather than taking the frames that follow as the rest of it. Under SECIL_HALF_DUPLEX those
+    ///       bytes are dropped instead, as sending shares their buffer.
+    /// @note Needs the read within callback to time the gaps.
+    secil_error_t secil_set_inter_byte_timeout(uint16_t char_times, uint32_t baud, uint16_t min_ms);
+
+    /// @brief Receive every complete message that is already buffered by the transport in a single call.
+    /// @param messages An array of at least max_messages messages that will be filled with the received messages.
+    /// @param max_messages The maximum number of messages to receive.
+    /// @param count Receives the number of messages written to the messages array.
+    /// @return SECIL_OK if at least one message was received, otherwise an error code.
+    /// @warning This function will **block** until the first message is received, just like secil_receive().
+    ///          Further messages are only read from bytes already buffered, as told by the read within callback or
+    ///          the available callback, so the batch never waits for a frame that is still arriving, noise or a frame
+    ///          with nothing for the application.
+    /// @note A frame that has only partly arrived when the batch ends is kept, and the next receive carries on with it
+    ///       (unless SECIL_HALF_DUPLEX is enabled, as sending shares its buffer - see secil_receive_until()).
+    /// @note Corrupt frames part way through a batch are logged and skipped, they do not end the batch.
+    secil_error_t secil_receive_many(secil_message *messages, size_t max_messages, size_t *count);
+
+    /// @brief A callback function that is given a view of each message received by secil_receive_many_view().
+    /// @param context The context pointer given to secil_receive_many_view().
+    /// @param message The received message - only valid for the duration of the callback.
+    typedef void (*secil_message_view_fn)(void *context, const secil_message *message);
+
+    /// @brief Receive every complete message that is already buffered, handing each one to a callback.
+    /// @param on_message The callback that is given each message in turn (required).
+    /// @param context Pointer passed to the callback (optional - can be null).
+    /// @param max_messages The maximum number of messages to receive.
+    /// @param count Receives the number of messages passed to the callback.
+    /// @return SECIL_OK if at least one message was received, otherwise an error code.
+    /// @note This behaves like secil_receive_many() but decodes every message into a single internal message,
+    ///       so the caller does not need to provide storage for the whole batch.
+    secil_error_t secil_receive_many_view(secil_message_view_fn on_message, void *context, size_t max_messages, size_t *count);
+
+    /// @brief Set the optional callback used to read the time (required for retransmission and request timeouts).
+    /// @param clock_callback The clock callback function (can be null to remove it).
+    /// @return SECIL_OK if the callback was set, otherwise an error code.
+    secil_error_t secil_set_clock_callback(secil_clock_fn clock_callback);
+
+    /// @brief Set the optional callback used to wait (required for SECIL_RATE_BLOCK).
+    /// @param sleep_callback The sleep callback function (can be null to remove it).
+    /// @return SECIL_OK if the callback was set, otherwise an error code.
+    secil_error_t secil_set_sleep_callback(secil_sleep_fn sleep_callback);
+
+    /// @brief Set the optional callbacks that make sending from one thread and receiving from another safe.
+    /// @param lock Called before the library touches state shared between sending and receiving (e.g. a mutex lock).
+    /// @param unlock Called afterwards (e.g. a mutex unlock).
+    /// @return SECIL_OK if the callbacks were set, otherwise an error code.
+    /// @note The reliable channel sends acknowledgements and retransmissions from inside secil_receive(),
+    ///       so these callbacks are required if you send from another thread while it is in use.
+    secil_error_t secil_set_lock_callbacks(secil_lock_fn lock, secil_lock_fn unlock);
+
+    /// @brief Statistics of the reliable channel.
+    typedef struct
+    {
+        uint32_t frames_sent;        ///< Reliable frames sent for the first time
+        uint32_t retransmissions;    ///< Reliable frames sent again, after a timeout or a gap in the selective acks
+        uint32_t acks_sent;          ///< Frames sent only to carry an acknowledgement
+        uint32_t duplicates_dropped; ///< Received frames that had already been delivered
+        uint32_t out_of_order;       ///< Received frames held back until the frames before them arrived
+        uint32_t in_flight;          ///< Frames sent but not acknowledged yet
+    } secil_reliable_stats_t;
+
+    /// @brief Set the receive window offered for the reliable channel in the next handshake.
+    /// @param window The number of frames (1 to SECIL_RELIABLE_WINDOW), or 0 to not offer the reliable channel.
+    /// @return SECIL_OK if the window was set, otherwise an error code.
+    /// @note The channel is used when both ends offer a window, with the smaller of the two windows.
+    ///       By default the full SECIL_RELIABLE_WINDOW is offered when the library is built with SECIL_RELIABLE.
+    secil_error_t secil_set_reliable_window(uint8_t window);
+
+    /// @brief Get the statistics of the reliable channel.
+    /// @param stats Receives the statistics.
+    /// @return SECIL_OK if the statistics were retrieved, otherwise an error code.
+    secil_error_t secil_get_reliable_stats(secil_reliable_stats_t *stats);
+
+    /// @brief Priority classes of outgoing frames, highest first (used when built with SECIL_TX_SCHEDULER, and by rate limits).
+    typedef enum
+    {
+        SECIL_TX_CONTROL, ///< Handshakes, acknowledgements, warnings, factory resets and other small protocol steps
+        SECIL_TX_STATE,   ///< Values and requests
+        SECIL_TX_BULK,    ///< Support packages, loopback tests, query replies and bulk transfer chunks
+        SECIL_TX_CLASSES
+    } secil_tx_class_t;
+
+    /// @brief Queue statistics of one priority class.
+    typedef struct
+    {
+        uint32_t queued;      ///< Frames put in the queue
+        uint32_t sent;        ///< Frames written to the transport
+        uint32_t rejected;    ///< Frames refused with SECIL_ERROR_QUEUE_FULL
+        uint32_t failed;      ///< Frames the transport failed to write
+        uint32_t fragments;   ///< Fragments written of the frames that were too long to go out whole
+        uint8_t depth;        ///< Frames waiting now
+        uint8_t peak_depth;   ///< Most frames that have waited at once
+        uint32_t max_wait_ms; ///< Longest time a frame has waited before being written (needs the clock callback)
+    } secil_tx_class_stats_t;
+
+    /// @brief Get the queue statistics of a priority class.
+    /// @param tx_class The class.
+    /// @param stats Receives the statistics, which stay at zero unless the library is built with SECIL_TX_SCHEDULER.
+    /// @return SECIL_OK if the statistics were retrieved, otherwise an error code.
+    secil_error_t secil_get_tx_stats(secil_tx_class_t tx_class, secil_tx_class_stats_t *stats);
+
+    /// @brief Statistics of flow control.
+    typedef struct
+    {
+        uint16_t remote_window;    ///< Most bytes the remote end lets us have in flight, 0 if it does not limit us
+        uint32_t credit;           ///< Bytes we may send now before we have to wait for more credit
+        uint32_t stalls;           ///< Times frames were held back for lack of credit
+        uint32_t stalled_ms;       ///< Total time frames were held back for lack of credit (needs the clock callback)
+        uint32_t credits_sent;     ///< Frames sent that told the remote end how much more it may send
+        uint32_t credits_received; ///< Frames received that gave us more credit
+        uint16_t rx_peak;          ///< Most bytes seen waiting in our receive buffer (needs the available callback)
+    } secil_flow_stats_t;
+
+    /// @brief Set the size of the transport's receive buffer, so that the remote end never sends more than it can take.
+    /// @param size The size in bytes (more than 64, of which 64 are kept for frames that only carry credit),
+    ///             or 0 to not limit the remote end.
+    /// @return SECIL_OK if the size was set, otherwise an error code.
+    /// @note Call this before secil_startup(). The size goes out in the handshake, and the remote end is told how much
+    ///       more it may send as the buffer is read. It is only used when both ends offer SECIL_CAPABILITY_FLOW_CONTROL,
+    ///       and only a remote end built with SECIL_TX_SCHEDULER holds frames back.
+    /// @note The buffer should hold the largest frame (or fragment, see SECIL_FRAGMENTATION) plus 64 bytes, as a frame
+    ///       that does not fit goes out once everything before it has been read.
+    secil_error_t secil_set_rx_buffer(uint16_t size);
+
+    /// @brief Get the statistics of flow control.
+    /// @param stats Receives the statistics, which stay at zero unless the library is built with SECIL_FLOW_CONTROL.
+    /// @return SECIL_OK if the statistics were retrieved, otherwise an error code.
+    secil_error_t secil_get_flow_stats(secil_flow_stats_t *stats);
+
+    /// @brief What happens to an application message sent while its class is over its rate limit.
+    typedef enum
+    {
+        SECIL_RATE_DROP,     ///< The send function returns SECIL_ERROR_RATE_LIMITED and the message is not sent
+        SECIL_RATE_CONFLATE, ///< A value is held back, and only the latest of each type goes out once there is room again
+        SECIL_RATE_BLOCK     ///< The send function waits until there is room
+    } secil_rate_overflow_t;
+
+    /// @brief Rate limit statistics of one priority class.
+    typedef struct
+    {
+        uint32_t passed;     ///< Messages sent within the limit (or, for a class without one, sent at all)
+        uint32_t bytes;      ///< Bytes of frames sent within the limit, counted while the class has one
+        uint32_t dropped;    ///< Messages refused with SECIL_ERROR_RATE_LIMITED
+        uint32_t conflated;  ///< Values held back with SECIL_RATE_CONFLATE, of which only the latest of each type is sent
+        uint32_t blocked;    ///< Sends that waited for room with SECIL_RATE_BLOCK
+        uint32_t blocked_ms; ///< Total time those sends waited
+    } secil_rate_stats_t;
+
+    /// @brief Limit the bytes per second that the application messages of a priority class may take on the link.
+    /// @param tx_class The class (see secil_tx_class_t for the messages of each).
+    /// @param bytes_per_second The average rate, counting whole frames before any compression, or 0 for no limit.
+    /// @param burst The most bytes that may go out at once after the class has been quiet, which should hold its
+    ///              largest message (a larger one goes out once the class has been quiet for burst bytes).
+    /// @param overflow What happens to a message that would go over the limit.
+    /// @return SECIL_OK if the limit was set, otherwise an error code.
+    /// @note Each class has a token bucket that fills at bytes_per_second up to burst bytes, and every message of the
+    ///       class takes its size from it. The library's own frames (handshakes, acknowledgements, credit, the steps
+    ///       of bulk transfers and UART rate switches, and its answers to queries and loopback tests) are never
+    ///       limited. Limits need the clock callback, and SECIL_ERROR_INVALID_STATE is returned without it.
+    /// @note SECIL_RATE_CONFLATE holds back values that can be queried, and sends the latest of each from secil_poll()
+    ///       once there is room. It needs SECIL_QUERY_SHADOW, and other messages are dropped as with SECIL_RATE_DROP.
+    /// @note SECIL_RATE_BLOCK waits with the sleep callback until there is room, for at most SECIL_RATE_BLOCK_MAX_MS
+    ///       before the message is dropped, so only use it for classes sent from threads that can afford to wait. It
+    ///       needs the sleep callback, and SECIL_ERROR_INVALID_STATE is returned without it.
+    secil_error_t secil_set_rate_limit(secil_tx_class_t tx_class, uint32_t bytes_per_second, uint16_t burst,
+                                       secil_rate_overflow_t overflow);
+
+    /// @brief Get the rate limit statistics of a priority class.
+    /// @param tx_class The class.
+    /// @param stats Receives the statistics, which stay at zero unless the library is built with SECIL_RATE_LIMITS.
+    /// @return SECIL_OK if the statistics were retrieved, otherwise an error code.
+    secil_error_t secil_get_rate_stats(secil_tx_class_t tx_class, secil_rate_stats_t *stats);
+
+    /// @brief Called from secil_poll() when nothing has arrived from the remote end for too long (see secil_set_heartbeat()).
+    /// @param user_data The user data pointer given to secil_init().
+    /// @param silent_ms Time since the last frame arrived.
+    typedef void (*secil_link_down_fn)(void *user_data, uint32_t silent_ms);
+
+    /// @brief Health of the link, measured with heartbeats.
+    typedef struct
+    {
+        bool up;                      ///< False from the link down callback until a frame arrives again
+        uint8_t quality;              ///< 0 to 100: the share of heartbeats that arrive, scaled down as the jitter grows
+                                      ///< against the round trip time, and 0 while the link is down
+        uint32_t rtt_ms;              ///< Smoothed round trip time, 0 until one of our heartbeats has been answered
+        uint32_t rtt_min_ms;          ///< Shortest round trip time measured
+        uint32_t jitter_ms;           ///< Smoothed deviation of the round trip time from rtt_ms
+        uint16_t loss_permille;       ///< Recent share of the remote end's heartbeats that went missing, in thousandths
+        uint32_t silent_ms;           ///< Time since the last frame arrived
+        uint32_t heartbeats_sent;     ///< Heartbeats sent, answers included
+        uint32_t heartbeats_received; ///< Heartbeats received, answers included
+        uint32_t heartbeats_lost;     ///< Heartbeats of the remote end that never arrived, from the gaps in their numbers
+        uint32_t link_downs;          ///< Times the link down callback was due
+    } secil_link_stats_t;
+
+    /// @brief Send heartbeats while the link is quiet, and watch for the remote end going silent.
+    /// @param interval_ms Send a heartbeat whenever nothing else has been sent for this long, or 0 to send none.
+    /// @param missed_limit Heartbeat intervals of the remote end without any frame from it, after which the link is down,
+    ///                     or 0 to not watch the link.
+    /// @param on_link_down Called once each time the link goes down (may be NULL).
+    /// @return SECIL_OK if the heartbeat was set, otherwise an error code.
+    /// @note Call this before secil_startup(), as the interval goes out in the handshake. Heartbeats are only used once
+    ///       both ends offer SECIL_CAPABILITY_HEARTBEAT, and they need the clock callback.
+    /// @note The remote end answers each heartbeat at once, and every heartbeat echoes the last one received, so both
+    ///       ends measure the round trip time without a shared clock.
+    ///       Any frame keeps the link up, so heartbeats only go out while there is no other traffic, and the link is
+    ///       only watched while the remote end sends heartbeats of its own.
+    /// @note With flow control, heartbeats also carry credit.
+    secil_error_t secil_set_heartbeat(uint16_t interval_ms, uint8_t missed_limit, secil_link_down_fn on_link_down);
+
+    /// @brief Get the health of the link.
+    /// @param stats Receives the statistics, which stay at zero if the heartbeat message is excluded from the build.
+    /// @return SECIL_OK if the statistics were retrieved, otherwise an error code.
+    secil_error_t secil_get_link_stats(secil_link_stats_t *stats);
+
+    /// @brief How the remote end's clock relates to ours, measured with heartbeats.
+    typedef struct
+    {
+        bool synced;          ///< An offset has been measured since the remote end's last handshake
+        int32_t offset_ms;    ///< The remote end's clock less ours, now (the clocks wrap, so this does too)
+        int32_t drift_ppm;    ///< How much faster the remote end's clock runs than ours, in millionths, 0 until measured
+        uint32_t delay_ms;    ///< Round trip time of the heartbeat the offset was measured with
+        uint32_t samples;     ///< Offsets measured since the remote end's last handshake
+    } secil_clock_stats_t;
+
+    /// @brief When a received message was sent and how long it took, by our clock.
+    typedef struct
+    {
+        uint32_t sent_at;     ///< The remote end's sent_at, mapped onto our clock
+        uint32_t received_at; ///< When the frame arrived
+        int32_t latency_ms;   ///< received_at less sent_at
+    } secil_message_time_t;
+
+    /// @brief Measure the offset and drift of the remote end's clock against ours, and optionally timestamp every
+    ///        application message sent.
+    /// @param interval_ms Ask the remote end for a timed answer at least this often, even while other traffic keeps
+    ///                    heartbeats from going out, or 0 to measure only from the heartbeats that do.
+    /// @param timestamps True to put our clock into the sent_at of every application message sent.
+    /// @return SECIL_OK if the clock sync was set, otherwise an error code.
+    /// @note Each heartbeat that echoes one of ours carries the four times of an NTP exchange: when we sent ours, when
+    ///       it arrived, when the answer was sent, and when that arrived. The offset is worked out from each, and the
+    ///       one of the last SECIL_CLOCK_SAMPLES measured over the shortest round trip is used. The drift comes from
+    ///       offsets at least SECIL_CLOCK_DRIFT_MS apart.
+    /// @note Both ends need heartbeats (see secil_set_heartbeat()) and the clock callback, whose resolution of a
+    ///       millisecond bounds the accuracy. The offset assumes the link takes as long each way.
+    secil_error_t secil_set_clock_sync(uint16_t interval_ms, bool timestamps);
+
+    /// @brief Get the offset and drift of the remote end's clock.
+    /// @param stats Receives the statistics, which stay at zero if the heartbeat message is excluded from the build.
+    /// @return SECIL_OK if the statistics were retrieved, otherwise an error code.
+    secil_error_t secil_get_clock_stats(secil_clock_stats_t *stats);
+
+    /// @brief Map a time read from the remote end's clock (e.g. one carried in a message) onto ours.
+    /// @param remote_ms The remote end's time.
+    /// @param local_ms Receives the same moment by our clock.
+    /// @return SECIL_OK if the time was mapped, SECIL_ERROR_INVALID_STATE until an offset has been measured.
+    secil_error_t secil_map_remote_time(uint32_t remote_ms, uint32_t *local_ms);
+
+    /// @brief Get when a received message was sent and how long it took to arrive.
+    /// @param message A message received since the remote end timestamped its messages (see secil_set_clock_sync()).
+    /// @param time Receives the times.
+    /// @return SECIL_OK if the times were worked out, SECIL_ERROR_INVALID_STATE if the message carries no timestamp or
+    ///         no offset has been measured yet.
+    /// @note The latency includes any time the message waited in the remote end's send queue or for a retransmission.
+    secil_error_t secil_get_message_time(const secil_message *message, secil_message_time_t *time);
+
+    /// @brief Perform the time based work of the library - call this regularly (e.g. every 10ms).
+    /// @return SECIL_OK if successful, otherwise an error code.
+    /// @note When the reliable channel is in use, this retransmits frames whose acknowledgement is overdue.
+    /// @note Requests that have waited SECIL_REQUEST_TIMEOUT_MS for their response fail with SECIL_ERROR_REQUEST_TIMEOUT.
+    /// @note While connecting, this sends the handshake again when the remote end has not answered it.
+    /// @note With SECIL_TX_SCHEDULER, this writes any frames still queued.
+    /// @note With flow control, this tells the remote end again how much it may send every SECIL_CREDIT_REFRESH_MS.
+    /// @note Values held back by a rate limit with SECIL_RATE_CONFLATE go out from here once there is room for them.
+    /// @note Heartbeats go out from here, and the link down callback is called from here (see secil_set_heartbeat()).
+    secil_error_t secil_poll(void);
+
     /// @brief Send messages to the eme_se_comms library.
     /// @param <various> parameters depending on the message type.
     /// @return SECIL_OK if the message was sent successfully, otherwise an error code.
+    /// @note Message types listed in SECIL_EXCLUDED_MESSAGES are not compiled, so calling their send function fails to link.
+    /// @note A value the remote end has not subscribed to is not sent, and SECIL_OK is returned.
+    /// @note With SECIL_TX_SCHEDULER the frame is queued by its priority class and SECIL_OK only means it was queued.
+    ///       It is written by whichever thread is sending at the time, or straight away if none is.
+    ///       SECIL_ERROR_QUEUE_FULL is returned if its class has no room left - try again once the queue has drained.
+    ///       With flow control the queues are also held while the remote end's receive buffer is full.
+    /// @note A class over its rate limit (see secil_set_rate_limit()) drops, holds back or waits for the message.
+    /// @note When the reliable channel is in use, SECIL_ERROR_WINDOW_FULL is returned while SECIL_RELIABLE_WINDOW frames
+    ///       are waiting for an acknowledgement. Keep receiving (and polling) and try again.
     secil_error_t secil_send_currentTemperature(int8_t currentTemperature);
     secil_error_t secil_send_heatingSetpoint(int8_t heatingSetpoint);
     secil_error_t secil_send_awayHeatingSetpoint(int8_t awayHeatingSetpoint);
@@ -150,6 +842,7 @@ extern "C"
     secil_error_t secil_send_matterStatus(secil_system_status_t status);
     secil_error_t secil_send_factoryReset(secil_reset_state_t state);
     secil_error_t secil_send_otaStatus(secil_ota_state_t state, uint8_t progress, const char *version);
+    /// @note A message that is in the string dictionary (see secil_set_dictionary()) goes out as its index.
     secil_error_t secil_send_warning(secil_warning_type_t type, const char *message);
 
 
@@ -0,0 +1,192 @@
+/// @file secil_config.h
+/// @brief Compile time configuration of the SECIL library.
+///        Every option below can be overridden on the compiler command line (the CMake options do this for you),
+///        or by defining SECIL_CONFIG_HEADER as the name of your own header that defines them.
+/// @note  The size of the text fields and the set of message types are part of the generated schema instead.
+///        See SECIL_MAX_STRING_SIZE and SECIL_EXCLUDED_MESSAGES in CMakeLists.txt.
+
+#if !defined(SECIL_CONFIG_H)
+#define SECIL_CONFIG_H
+
+#if defined(SECIL_CONFIG_HEADER)
+#include SECIL_CONFIG_HEADER
+#endif
+
+/// Decode each message while its body is still arriving instead of waiting for the whole frame.
+/// Set to 0 to read the full frame before decoding (allows nanopb to be built with PB_BUFFER_ONLY).
+#if !defined(SECIL_CUT_THROUGH_DECODE)
+#define SECIL_CUT_THROUGH_DECODE 1
+#endif
+
+/// Encode each message straight into the transport in small chunks instead of building the whole frame first.
+/// This shrinks the outgoing frame buffer to SECIL_TX_CHUNK_SIZE bytes.
+#if !defined(SECIL_STREAMING_TX)
+#define SECIL_STREAMING_TX 0
+#endif
+
+/// Size of the outgoing chunk buffer used when SECIL_STREAMING_TX is enabled.
+#if !defined(SECIL_TX_CHUNK_SIZE)
+#define SECIL_TX_CHUNK_SIZE 32
+#endif
+
+/// Share one frame buffer between sending and receiving.
+/// Only enable this if your application never sends while another thread is inside secil_receive().
+#if !defined(SECIL_HALF_DUPLEX)
+#define SECIL_HALF_DUPLEX 0
+#endif
+
+/// Offer a reliable channel in the handshake: sequence numbers, selective acknowledgements and retransmission.
+/// It is only used when the remote end offers it too.
+#if !defined(SECIL_RELIABLE)
+#define SECIL_RELIABLE 0
+#endif
+
+/// Maximum number of unacknowledged frames in flight (a power of two, at most 32).
+/// Each one costs two secil_message buffers of RAM: one to retransmit it and one to reorder it on receipt.
+#if !defined(SECIL_RELIABLE_WINDOW)
+#define SECIL_RELIABLE_WINDOW 8
+#endif
+
+/// Time in milliseconds after which an unacknowledged frame is sent again by secil_poll().
+#if !defined(SECIL_RELIABLE_RETRANSMIT_MS)
+#define SECIL_RELIABLE_RETRANSMIT_MS 100
+#endif
+
+/// Queue outgoing frames by priority class (see secil_tx_class_t) and write the most urgent first, so that a safety
+/// message never waits for more than the one frame already being written. Costs SECIL_TX_QUEUE_SIZE bytes of RAM per class.
+/// Not available with SECIL_STREAMING_TX, as a frame has to be encoded in full before it can be queued.
+#if !defined(SECIL_TX_SCHEDULER)
+#define SECIL_TX_SCHEDULER 0
+#endif
+
+/// Size in bytes of the queue of each priority class, which must hold at least the largest frame.
+#if !defined(SECIL_TX_QUEUE_SIZE)
+#define SECIL_TX_QUEUE_SIZE 512
+#endif
+
+/// While bulk frames are waiting, one goes out after every this many frames of the higher classes, so it is never starved.
+#if !defined(SECIL_TX_BULK_SHARE)
+#define SECIL_TX_BULK_SHARE 4
+#endif
+
+/// Offer v2 fragments in the handshake: with SECIL_TX_SCHEDULER, state and bulk frames longer than SECIL_FRAGMENT_SIZE
+/// go out in fragments and control frames can be sent between any two of them, so they wait for one fragment at most.
+/// Builds without the scheduler only reassemble the fragments they receive. Costs a buffer of the largest frame of RAM.
+#if !defined(SECIL_FRAGMENTATION)
+#define SECIL_FRAGMENTATION 0
+#endif
+
+/// Bytes of the original frame carried by each fragment, which adds 7 bytes of its own (at most 253).
+#if !defined(SECIL_FRAGMENT_SIZE)
+#define SECIL_FRAGMENT_SIZE 32
+#endif
+
+/// Offer credit based flow control in the handshake. Once secil_set_rx_buffer() has given the size of the transport's
+/// receive buffer, the remote end is told how much more it can take as it is read, and never sends more than that.
+/// Holding frames back needs SECIL_TX_SCHEDULER, builds without it only tell the remote end how much they can take.
+#if !defined(SECIL_FLOW_CONTROL)
+#define SECIL_FLOW_CONTROL 0
+#endif
+
+/// Time in milliseconds after which secil_poll() tells the remote end again how much it may send, in case that was lost.
+#if !defined(SECIL_CREDIT_REFRESH_MS)
+#define SECIL_CREDIT_REFRESH_MS 100
+#endif
+
+/// Let secil_set_rate_limit() cap the bytes per second of the application messages of each priority class, so that a
+/// runaway caller cannot take the whole link. Costs about 100 bytes of RAM.
+#if !defined(SECIL_RATE_LIMITS)
+#define SECIL_RATE_LIMITS 1
+#endif
+
+/// Longest a send waits for room with SECIL_RATE_BLOCK before the message is dropped with SECIL_ERROR_RATE_LIMITED.
+#if !defined(SECIL_RATE_BLOCK_MAX_MS)
+#define SECIL_RATE_BLOCK_MAX_MS 1000
+#endif
+
+/// Clock offsets measured from heartbeats that secil_set_clock_sync() chooses between. The one measured over the
+/// shortest round trip is used, as it was least held up on the way. Each costs 16 bytes of RAM.
+#if !defined(SECIL_CLOCK_SAMPLES)
+#define SECIL_CLOCK_SAMPLES 8
+#endif
+
+/// Shortest time in milliseconds between the two clock offsets that the drift of the remote end's clock is worked out
+/// from. The clocks count whole milliseconds, so a pair only gives the drift to about 1000000 / SECIL_CLOCK_DRIFT_MS
+/// parts per million, which smoothing over several pairs then improves on.
+#if !defined(SECIL_CLOCK_DRIFT_MS)
+#define SECIL_CLOCK_DRIFT_MS 10000
+#endif
+
+/// Maximum number of requests (such as non-blocking loopback tests) waiting for a response at the same time.
+#if !defined(SECIL_MAX_PENDING_REQUESTS)
+#define SECIL_MAX_PENDING_REQUESTS 4
+#endif
+
+/// Maximum number of application messages that secil_loopback_test() keeps for the next receives while it waits for the
+/// reply (at most 255). Costs one secil_message of RAM each.
+#if !defined(SECIL_LOOPBACK_HOLD)
+#define SECIL_LOOPBACK_HOLD 4
+#endif
+
+/// Time in milliseconds after which secil_poll() fails a request that has had no response.
+#if !defined(SECIL_REQUEST_TIMEOUT_MS)
+#define SECIL_REQUEST_TIMEOUT_MS 1000
+#endif
+
+/// Remember the last value sent of each type that can be queried, so that queries are answered even without a value provider.
+/// Costs one secil_queryReply of RAM.
+#if !defined(SECIL_QUERY_SHADOW)
+#define SECIL_QUERY_SHADOW 1
+#endif
+
+/// Keep a hash of the last value received of each type that can be queried, and exchange these hashes on connecting,
+/// so that only the values that differ are sent again. Needs SECIL_QUERY_SHADOW and costs 64 bytes of RAM.
+#if !defined(SECIL_STATE_DIGEST)
+#define SECIL_STATE_DIGEST 1
+#endif
+
+/// Offer LZ compression of large messages in the handshake, for the repetitive text of warnings and support packages.
+/// Costs a buffer of the largest message and one of the largest v2 frame of RAM (shared when SECIL_HALF_DUPLEX is enabled).
+/// Not available with SECIL_STREAMING_TX, as the whole message has to be encoded before it can be compressed.
+#if !defined(SECIL_COMPRESSION)
+#define SECIL_COMPRESSION 0
+#endif
+
+/// Messages that encode to fewer bytes than this are never compressed.
+#if !defined(SECIL_COMPRESSION_MIN_SIZE)
+#define SECIL_COMPRESSION_MIN_SIZE 32
+#endif
+
+/// Time in milliseconds after which secil_poll() sends the handshake again while connecting.
+/// Keep it above the time the remote end takes to answer, or it will see the repeat as a restart.
+#if !defined(SECIL_HANDSHAKE_RETRY_MS)
+#define SECIL_HANDSHAKE_RETRY_MS 50
+#endif
+
+/// Longest wait in milliseconds between handshakes while connecting (the wait doubles after each attempt).
+#if !defined(SECIL_HANDSHAKE_RETRY_MAX_MS)
+#define SECIL_HANDSHAKE_RETRY_MAX_MS 1000
+#endif
+
+/// Time in milliseconds that each end of a UART rate switch waits for the next step before going back to the old rate.
+#if !defined(SECIL_BAUD_SWITCH_TIMEOUT_MS)
+#define SECIL_BAUD_SWITCH_TIMEOUT_MS 200
+#endif
+
+/// Time in milliseconds after which secil_poll() sends the probe at the new rate again while a switch is being verified.
+#if !defined(SECIL_BAUD_PROBE_MS)
+#define SECIL_BAUD_PROBE_MS 20
+#endif
+
+/// Number of bulk transfer chunks that may be in flight without an acknowledgement.
+/// The receiver acknowledges every half window, so it needs no buffer of its own.
+#if !defined(SECIL_BULK_WINDOW)
+#define SECIL_BULK_WINDOW 8
+#endif
+
+/// Time in milliseconds after which secil_poll() sends the unacknowledged chunks of a bulk transfer again.
+#if !defined(SECIL_BULK_RETRY_MS)
+#define SECIL_BULK_RETRY_MS 200
+#endif
+
+#endif // SECIL_CONFIG_H
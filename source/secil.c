@@ -1,96 +1,257 @@
-#include "secil.h"
+#include "secil_internal.h"
 
 #include <stdarg.h>
 #include <stdio.h>
-#include <pb.h>
-#include <pb_encode.h>
-#include <pb_decode.h>
-#include "secil.pb.h"
-
-#define RETURN_IF_ERROR(operation, log) \
-    do                  \
-    {                   \
-        secil_error_t err = (operation); \
-        if (err != SECIL_OK) \
-        { \
-            if (log) secil_log(secil_LOG_DEBUG, log); \
-            return err; \
-        } \
-    } while (0)
-
-#define HEADER_SIZE 4
-#define FOOTER_SIZE 4
-#define HEADROOM 8
-#define MAX_MESSAGE_SIZE (HEADER_SIZE + secil_message_size + FOOTER_SIZE + HEADROOM)
-
-static struct
-{
-    secil_read_fn read_callback;
-    secil_write_fn write_callback;
-    secil_on_connect_fn on_connect;
-    secil_log_fn logger;
-    secil_operating_mode_t mode;
-    char remote_version[32]; // Version string of the remote end
-    void *user_data; // User data pointer passed to callbacks
-
-    char log_buffer[128]; // Buffer for logging messages
-    uint8_t outgoingMessage[MAX_MESSAGE_SIZE]; // Buffer for encoding messages
-    uint8_t incomingMessage[MAX_MESSAGE_SIZE]; // Buffer for decoding messages
-
-} state;
-
-static secil_error_t secil_send(const secil_message *message);
-static secil_error_t secil_send_startup_message(secil_operating_mode_t mode, bool needs_ack);
+
+/// The one instance of the library secil_state.
+secil_state_t secil_state;
+
+static secil_error_t secil_send_app(secil_message *message);
+static secil_error_t secil_send_value(secil_message *message);
+static secil_error_t secil_send_startup_message(secil_operating_mode_t mode, bool needs_ack, bool resumed);
 
 
 /// @brief Check if the current state is valid.
 /// @return True if the current state is valid, false otherwise.
 static secil_error_t secil_io_callbacks_valid()
 {
-    if (!state.read_callback || !state.write_callback)
+    if (!secil_state.read_callback || !secil_state.write_callback)
     {
         return SECIL_ERROR_NOT_INITIALIZED;
     }
     return SECIL_OK;
 }
 
-static void secil_log(secil_log_severity_t severity, const char *format, ...)
+void secil_log(secil_log_severity_t severity, const char *format, ...)
 {
     // Call the user-provided logger if available
-    if (state.logger)
+    if (secil_state.logger)
     {
         va_list args;
         va_start(args, format);
-        vsnprintf(state.log_buffer, sizeof(state.log_buffer) - 1, format, args);
+        vsnprintf(secil_state.log_buffer, sizeof(secil_state.log_buffer) - 1, format, args);
         va_end(args);
-        state.logger(state.user_data, severity, state.log_buffer);
+        secil_state.logger(secil_state.user_data, severity, secil_state.log_buffer);
+    }
+}
+
+/// @brief Work out the inter-byte timeout at a rate of the UART.
+/// @param baud The rate in bits per second.
+void secil_update_gap(uint32_t baud)
+{
+    // 10 bit times per character (8N1), rounded up to whole ms
+    uint32_t gap = secil_state.receive.gap_chars > 0 ? (uint32_t)(((uint64_t)secil_state.receive.gap_chars * 10000u + baud - 1) / baud) : 0;
+    secil_state.receive.gap_ms = gap > 0 && gap < secil_state.receive.gap_min_ms ? secil_state.receive.gap_min_ms : gap;
+}
+
+/// @brief Give up on a frame whose bytes stopped arriving part way, e.g. because the remote end restarted.
+/// @param offset The bytes of the frame read so far.
+static void secil_abandon_frame(size_t offset)
+{
+    secil_log(secil_LOG_WARNING, "Abandoned a frame after %u bytes - nothing more arrived for %u ms.", (unsigned)offset,
+              (unsigned)secil_state.receive.gap_ms);
+    secil_state.receive.abandoned = true;
+    secil_state.receive.kept = 0;
+#if !SECIL_HALF_DUPLEX
+    // Its header may have been a false one that hid a real one, so the next receive looks through the bytes after its
+    // first again before reading any more. Sending shares the buffer when SECIL_HALF_DUPLEX is enabled, so there they
+    // are dropped.
+    secil_state.receive.rescan_at = 1;
+    secil_state.receive.rescan_end = (uint16_t)offset;
+#endif
+}
+
+/// @brief Read from the transport, giving up at the deadline of secil_receive_until() if there is one, or on a frame
+///        whose bytes stop arriving for longer than the inter-byte timeout.
+/// @param buf The buffer.
+/// @param count The count.
+/// @param offset Where buf is in the incoming message buffer, so that a frame cut short can be kept.
+/// @return true if the read was successful, false otherwise.
+static bool secil_read_transport(pb_byte_t *buf, size_t count, size_t offset)
+{
+    bool expired = false;
+    bool gap = false;
+    while (count > 0 && !expired && !gap)
+    {
+        // Gaps are only timed once a header has been found, as looking for one finds the next frame anyway
+        bool timed_gap = secil_state.receive.gap_ms > 0 && offset >= COMPACT_HEADER_SIZE && secil_state.read_within_callback;
+        if (!secil_state.receive.has_deadline && !timed_gap)
+        {
+            break;
+        }
+
+        uint32_t timeout = secil_state.receive.gap_ms;
+        if (secil_state.receive.has_deadline)
+        {
+            int32_t left = (int32_t)(secil_state.receive.deadline - secil_now());
+            timeout = left > 0 ? (uint32_t)left : 0;
+
+            if (!secil_state.read_within_callback)
+            {
+                // Without a bounded read the deadline can only be checked before reading, which then blocks as usual.
+                // Bytes already buffered are still read once the deadline has passed.
+                expired = timeout == 0 && !(secil_state.available_callback && secil_state.available_callback(secil_state.user_data) >= count);
+                break;
+            }
+        }
+        bool gap_first = timed_gap && secil_state.receive.gap_ms <= timeout;
+        if (gap_first)
+        {
+            timeout = secil_state.receive.gap_ms;
+        }
+
+        int32_t got = secil_state.read_within_callback(secil_state.user_data, buf, count, timeout);
+        if (got < 0)
+        {
+            return false;
+        }
+        gap = got == 0 && gap_first;
+        expired = got == 0 && timeout == 0;
+        buf += got;
+        count -= (size_t)got;
+        offset += (size_t)got;
+#if SECIL_FLOW_CONTROL
+        // Only the receiving thread counts, so this needs no lock
+        secil_state.flow.consumed += (uint32_t)got;
+#endif
+    }
+
+    if (gap)
+    {
+        secil_abandon_frame(offset);
+        return false;
+    }
+    if (expired)
+    {
+#if SECIL_HALF_DUPLEX
+        // Sending shares the buffer the frame is in, so it cannot be kept, and the next receive looks for a new header
+        secil_state.receive.kept = 0;
+#else
+        // The frame read so far is kept, so the next receive carries on with it
+        secil_state.receive.kept = (uint16_t)offset;
+#endif
+        secil_state.receive.expired = true;
+        return false;
+    }
+    if (count == 0)
+    {
+        return true;
+    }
+
+#if SECIL_FLOW_CONTROL
+    if (!secil_state.read_callback(secil_state.user_data, buf, count))
+    {
+        return false;
     }
+    secil_state.flow.consumed += (uint32_t)count;
+    return true;
+#else
+    return secil_state.read_callback(secil_state.user_data, buf, count);
+#endif
 }
 
 /// @brief Callback function for reading from the stream.
-/// @param buf - The buffer.
+/// @param buf - The buffer, which is always in the incoming message buffer at the offset of the bytes in the frame.
 /// @param count - The count.
 /// @return true if the read was successful, false otherwise.
 static bool secil_read(pb_byte_t *buf, size_t count)
 {
-    return state.read_callback(state.user_data, buf, count);
+#if SECIL_FRAGMENTS
+    if (secil_state.fragments.replaying)
+    {
+        // A frame put back together from fragments is read from its buffer, and never runs on into the transport
+        if (count > (size_t)(secil_state.fragments.size - secil_state.fragments.replayed))
+        {
+            return false;
+        }
+        memcpy(buf, secil_state.fragments.buf + secil_state.fragments.replayed, count);
+        secil_state.fragments.replayed += (uint16_t)count;
+        return true;
+    }
+#endif
+#if !SECIL_HALF_DUPLEX
+    if (secil_state.receive.rescan_at < secil_state.receive.rescan_end)
+    {
+        // The bytes of an abandoned frame are read again first. Each lands before the one it was read from, as a frame
+        // found among them starts after the abandoned one did, so none is overwritten before it has been read.
+        size_t rescan = secil_state.receive.rescan_end - secil_state.receive.rescan_at;
+        size_t take = rescan < count ? rescan : count;
+        memmove(buf, secil_state.incomingMessage + secil_state.receive.rescan_at, take);
+        secil_state.receive.rescan_at += (uint16_t)take;
+        buf += take;
+        count -= take;
+        if (count == 0)
+        {
+            return true;
+        }
+    }
+#endif
+
+    // The start of a frame that a deadline cut short is still in place, as the frame is read again in the same order.
+    // Only the rest comes from the transport.
+    size_t offset = (size_t)(buf - secil_state.incomingMessage);
+    if (secil_state.receive.kept > offset)
+    {
+        size_t skip = secil_state.receive.kept - offset < count ? secil_state.receive.kept - offset : count;
+        buf += skip;
+        count -= skip;
+        offset += skip;
+        if (count == 0)
+        {
+            return true;
+        }
+    }
+    secil_state.receive.kept = 0;
+
+    return secil_read_transport(buf, count, offset);
 }
 
 /// @brief Callback function for writing to the stream.
 /// @param buf - The buffer.
 /// @param count - The count.
-static bool secil_write(const pb_byte_t *buf, size_t count)
+bool secil_write(const pb_byte_t *buf, size_t count)
+{
+#if SECIL_HEARTBEAT
+    // Any frame going out keeps the link alive, so heartbeats are only sent once it has been quiet
+    if (secil_state.heartbeat.interval > 0)
+    {
+        secil_state.heartbeat.tx_at = secil_now();
+    }
+#endif
+    return secil_state.write_callback(secil_state.user_data, buf, count);
+}
+
+/// @brief Lock the state shared between sending and receiving, if the application gave us a lock.
+void secil_lock()
+{
+    if (secil_state.lock_callback)
+    {
+        secil_state.lock_callback(secil_state.user_data);
+    }
+}
+
+void secil_unlock()
+{
+    if (secil_state.unlock_callback)
+    {
+        secil_state.unlock_callback(secil_state.user_data);
+    }
+}
+
+/// @brief Read the application's millisecond clock.
+/// @return The current time, or 0 if no clock callback was given.
+uint32_t secil_now()
 {
-    return state.write_callback(state.user_data, buf, count);
+    return secil_state.clock_callback ? secil_state.clock_callback(secil_state.user_data) : 0;
 }
 
 static void secil_notify_on_connect()
 {
-    if (state.on_connect)
+    if (secil_state.on_connect)
     {
-        state.on_connect(state.user_data, 
-                         state.mode == secil_operating_mode_t_CLIENT ? secil_operating_mode_t_SERVER : secil_operating_mode_t_CLIENT,
-                         state.remote_version);
+        secil_state.on_connect(secil_state.user_data, 
+                         secil_state.mode == secil_operating_mode_t_CLIENT ? secil_operating_mode_t_SERVER : secil_operating_mode_t_CLIENT,
+                         secil_state.remote_version);
     }
 }
 
@@ -99,7 +260,7 @@ static void secil_notify_on_connect()
 /// @param mem Pointer to the memory block.
 /// @param len Length of the memory block.
 /// @return The computed CRC value.
-static uint16_t crc16arc_bit(uint16_t crc, void const *mem, size_t len) 
+uint16_t crc16arc_bit(uint16_t crc, void const *mem, size_t len) 
 {
     const uint8_t *data = (const uint8_t*)(mem);
     if (data == NULL)
@@ -117,20 +278,6 @@ static uint16_t crc16arc_bit(uint16_t crc, void const *mem, size_t len)
 extern pb_istream_t pb_istream_from_buffer(const pb_byte_t *buf, size_t msglen);
 extern pb_ostream_t pb_ostream_from_buffer(pb_byte_t *buf, size_t bufsize);
 
-/// @brief Creates an pb input stream from the given state.
-/// @return An instance of a pb_istream_t structure.
-static pb_istream_t secil_create_istream(uint16_t msglen)
-{
-    return pb_istream_from_buffer(state.incomingMessage + 4, msglen);
-}
-
-/// @brief Creates an pb output stream from the given state.
-/// @return An instance of a pb_ostream_t structure.
-static pb_ostream_t secil_create_ostream()
-{
-    return pb_ostream_from_buffer(state.outgoingMessage + 4, sizeof(state.outgoingMessage) - 8); // Leave space for header and footer
-}
-
 secil_error_t secil_init(secil_read_fn read_callback,
                          secil_write_fn write_callback,
                          secil_on_connect_fn on_connect,
@@ -142,28 +289,92 @@ secil_error_t secil_init(secil_read_fn read_callback,
         return SECIL_ERROR_ALREADY_INITIALIZED;
     }
 
-    state.read_callback = read_callback;
-    state.write_callback = write_callback;
-    state.on_connect = on_connect;
-    state.logger = logger;
-    state.user_data = user_data;
-    memset(state.remote_version, 0, sizeof(state.remote_version));
-    memset(state.log_buffer, 0, sizeof(state.log_buffer));
-    memset(state.outgoingMessage, 0, sizeof(state.outgoingMessage));
-    memset(state.incomingMessage, 0, sizeof(state.incomingMessage));
-    state.mode = secil_operating_mode_t_UNINITIALIZED;
+    secil_state.read_callback = read_callback;
+    secil_state.write_callback = write_callback;
+    secil_state.available_callback = NULL;
+    secil_state.read_within_callback = NULL;
+    secil_state.clock_callback = NULL;
+    secil_state.sleep_callback = NULL;
+    secil_state.lock_callback = NULL;
+    secil_state.unlock_callback = NULL;
+    secil_state.value_provider = NULL;
+    secil_state.on_connect = on_connect;
+    secil_state.logger = logger;
+    secil_state.user_data = user_data;
+    memset(secil_state.remote_version, 0, sizeof(secil_state.remote_version));
+    memset(secil_state.log_buffer, 0, sizeof(secil_state.log_buffer));
+    secil_state.local_subscriptions = SECIL_SUBSCRIBE_ALL;
+    secil_state.remote_subscriptions = SECIL_SUBSCRIBE_ALL;
+    secil_state.local_capabilities = SECIL_BUILD_CAPABILITIES;
+    secil_state.agreed_capabilities = 0;
+    secil_state.remote_max_frame_size = 0;
+    memset(secil_state.outgoingMessage, 0, sizeof(secil_state.outgoingMessage));
+    memset(secil_state.incomingMessage, 0, sizeof(secil_state.incomingMessage));
+    memset(&secil_state.receive, 0, sizeof(secil_state.receive));
+    secil_state.mode = secil_operating_mode_t_UNINITIALIZED;
+    memset(&secil_state.requests, 0, sizeof(secil_state.requests));
+#if defined(secil_message_loopbackTest_tag)
+    memset(&secil_state.held, 0, sizeof(secil_state.held));
+#endif
+    memset(&secil_state.connection, 0, sizeof(secil_state.connection));
+#if SECIL_QUERIES && SECIL_QUERY_SHADOW
+    memset(&secil_state.shadow, 0, sizeof(secil_state.shadow));
+#endif
+#if SECIL_RESYNC
+    memset(secil_state.received_hashes, 0, sizeof(secil_state.received_hashes));
+#endif
+#if SECIL_BAUD_SWITCH
+    memset(&secil_state.baud, 0, sizeof(secil_state.baud));
+#endif
+#if SECIL_BULK
+    memset(&secil_state.bulk, 0, sizeof(secil_state.bulk));
+#endif
+#if SECIL_HEARTBEAT
+    memset(&secil_state.heartbeat, 0, sizeof(secil_state.heartbeat));
+    memset(&secil_state.clock, 0, sizeof(secil_state.clock));
+#endif
+#if SECIL_DICTIONARY
+    memset(&secil_state.dictionary, 0, sizeof(secil_state.dictionary));
+#endif
+#if SECIL_LZ
+    memset(&secil_state.lz, 0, sizeof(secil_state.lz));
+#endif
+#if SECIL_TX_QUEUES
+    memset(&secil_state.tx, 0, sizeof(secil_state.tx));
+#endif
+#if SECIL_RATE_LIMITS
+    memset(&secil_state.rate, 0, sizeof(secil_state.rate));
+#endif
+#if SECIL_FRAGMENTS
+    memset(&secil_state.fragments, 0, sizeof(secil_state.fragments));
+#endif
+#if SECIL_FLOW_CONTROL
+    memset(&secil_state.flow, 0, sizeof(secil_state.flow));
+#endif
+#if SECIL_RELIABLE
+    memset(&secil_state.reliable, 0, sizeof(secil_state.reliable));
+    secil_state.reliable.local_window = SECIL_RELIABLE_WINDOW;
+#endif
 
     return secil_io_callbacks_valid();
 }
 
 void secil_deinit()
 {
-    state.read_callback = NULL;
-    state.write_callback = NULL;
-    state.logger = NULL;
-    state.user_data = NULL;
-    memset(state.remote_version, 0, sizeof(state.remote_version));
-    state.mode = secil_operating_mode_t_UNINITIALIZED;
+    secil_state.read_callback = NULL;
+    secil_state.write_callback = NULL;
+    secil_state.available_callback = NULL;
+    secil_state.read_within_callback = NULL;
+    secil_state.clock_callback = NULL;
+    secil_state.sleep_callback = NULL;
+    secil_state.lock_callback = NULL;
+    secil_state.unlock_callback = NULL;
+    secil_state.value_provider = NULL;
+    secil_state.logger = NULL;
+    secil_state.user_data = NULL;
+    memset(secil_state.remote_version, 0, sizeof(secil_state.remote_version));
+    secil_state.mode = secil_operating_mode_t_UNINITIALIZED;
+    secil_state.connection.state = SECIL_DISCONNECTED;
 }
 
 const char *secil_error_string(secil_error_t error_code)
@@ -202,312 +413,2538 @@ const char *secil_error_string(secil_error_t error_code)
         return "Startup failed";
     case SECIL_ERROR_VERSION_MISMATCH:
         return "Version mismatch";
+    case SECIL_ERROR_WINDOW_FULL:
+        return "Send window full";
+    case SECIL_ERROR_REQUEST_PENDING:
+        return "Request still waiting for a response";
+    case SECIL_ERROR_REQUEST_TIMEOUT:
+        return "Request timed out";
+    case SECIL_ERROR_TOO_MANY_REQUESTS:
+        return "Too many requests waiting for a response";
+    case SECIL_ERROR_TRANSFER_CANCELLED:
+        return "Transfer cancelled";
+    case SECIL_ERROR_QUEUE_FULL:
+        return "Send queue full";
+    case SECIL_ERROR_RATE_LIMITED:
+        return "Rate limit exceeded";
+    case SECIL_ERROR_DEADLINE_EXPIRED:
+        return "Deadline expired before a message arrived";
     default:
         return "Unknown error code";
     }
 }
 
-static secil_error_t secil_handle_remote_restarted(secil_message *handshake_message)
+/// @brief Find a pending request by its request_id.
+/// @return The entry, or NULL if no request with that id is pending.
+/// @note The caller must hold the lock.
+static secil_pending_request_t *secil_find_request(uint16_t id)
 {
-    // Handshake messages may be received at any time, if the remote end has restarted
-    secil_log(secil_LOG_INFO, "Remote end has restarted.");
-
-    if (state.mode == secil_operating_mode_t_UNINITIALIZED)
+    for (size_t i = 0; id != 0 && i < SECIL_MAX_PENDING_REQUESTS; i++)
     {
-        secil_log(secil_LOG_ERROR, "Cannot handle remote restart - local end not started up.");
-        return SECIL_ERROR_INVALID_STATE;
+        if (secil_state.requests.pending[i].id == id)
+        {
+            return &secil_state.requests.pending[i];
+        }
     }
-    
-    // We can't have both local and remote end in the same mode
-    if (state.mode == handshake_message->payload.handshake.mode)
+    return NULL;
+}
+
+#if defined(secil_message_loopbackTest_tag) || SECIL_QUERIES
+/// @brief Send a request and add it to the table of requests waiting for a response.
+/// @param request The request to send - its request_id is filled in here.
+/// @param response_tag The payload that the response must carry.
+/// @param echo The data that the response must carry (loopback tests only, otherwise NULL).
+/// @param on_response Called when the request completes, or NULL to poll for the result.
+/// @param context Passed to on_response.
+/// @param handle Receives the handle of the request (optional).
+/// @return SECIL_OK if the request was sent, otherwise an error code.
+static secil_error_t secil_request_start(secil_message *request, pb_size_t response_tag, const char *echo,
+                                         secil_response_fn on_response, void *context, secil_request_handle_t *handle)
+{
+    secil_lock();
+
+    secil_pending_request_t *entry = NULL;
+    for (size_t i = 0; !entry && i < SECIL_MAX_PENDING_REQUESTS; i++)
     {
-        secil_log(secil_LOG_ERROR, "Remote end has restarted in unexpected mode.");
-        return SECIL_ERROR_INVALID_STATE;
+        if (secil_state.requests.pending[i].id == 0)
+        {
+            entry = &secil_state.requests.pending[i];
+        }
     }
 
-    // Always make a note of the new version string of the remote connection
-    strncpy(state.remote_version, handshake_message->payload.handshake.version, sizeof(state.remote_version) - 1);
-    state.remote_version[sizeof(state.remote_version) - 1] = '\0'; // Ensure null termination
+    if (!entry)
+    {
+        secil_unlock();
+        secil_log(secil_LOG_ERROR, "Cannot send request - %u requests are already waiting for a response.", (unsigned)SECIL_MAX_PENDING_REQUESTS);
+        return SECIL_ERROR_TOO_MANY_REQUESTS;
+    }
 
-    if (handshake_message->payload.handshake.needs_ack)
+    // 0 marks a free entry, so it is never used as a request_id
+    uint16_t id;
+    do
     {
-        // Send an ack back to the remote end
-        RETURN_IF_ERROR(secil_send_startup_message(state.mode, false), "Failed to send handshake ack to remote end.");
+        id = ++secil_state.requests.next_id;
+    } while (id == 0 || secil_find_request(id));
+
+    *entry = (secil_pending_request_t){
+        .id = id,
+        .response_tag = response_tag,
+        .sent_at = secil_now(),
+        .on_response = on_response,
+        .context = context
+    };
+#if defined(secil_message_loopbackTest_tag)
+    if (echo)
+    {
+        strncpy(entry->echo, echo, sizeof(entry->echo) - 1);
+    }
+#else
+    (void)echo;
+#endif
 
-        // Notify the application of the new connection
-        secil_notify_on_connect();
-    }   
+    secil_unlock();
 
-    return SECIL_OK;
-}
+    request->has_request_id = true;
+    request->request_id = id;
 
-static secil_error_t secil_read_next_header()
-{
-    // First try reading the full header at once
-    if (!secil_read(state.incomingMessage, 4))
+    secil_error_t result = secil_send_app(request);
+    if (result != SECIL_OK)
     {
-        return SECIL_ERROR_READ_TIMEOUT;
+        secil_lock();
+        entry->id = 0;
+        secil_unlock();
+        return result;
     }
 
-    while (true)
+    if (handle)
     {
-        // Check for header magic bytes
-        if (   state.incomingMessage[0] == 0xCA 
-            && state.incomingMessage[1] == 0xFE)
-        {
-            // Valid header found
-            return SECIL_OK;
-        }
-
-        // Shift the buffer left by one byte and continue reading
-        state.incomingMessage[0] = state.incomingMessage[1];
-        state.incomingMessage[1] = state.incomingMessage[2];
-        state.incomingMessage[2] = state.incomingMessage[3];
-        if (!secil_read(&state.incomingMessage[3], 1))
-        {
-            return SECIL_ERROR_READ_TIMEOUT;
-        }
+        *handle = id;
     }
+    return SECIL_OK;
 }
+#endif
 
-/// @brief Internal implementation of secil_receive
-/// @param message 
-/// @return 
-static secil_error_t secil_receive_internal(secil_message *message)
+/// @brief Finish a request: call its callback, or keep the result for secil_request_poll().
+/// @note The caller must hold the lock, which is released here so that the callback may send.
+static void secil_complete_request(secil_pending_request_t *entry, secil_error_t result, const secil_message *response)
 {
-    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+    if (entry->on_response)
+    {
+        secil_response_fn on_response = entry->on_response;
+        void *context = entry->context;
+        entry->id = 0;
+        secil_unlock();
 
-    if (!message)
+        on_response(context, result, response);
+    }
+    else
     {
-        secil_log(secil_LOG_ERROR, "Cannot invoke loop - message buffer is NULL.");
-        return SECIL_ERROR_INVALID_PARAMETER;
+        entry->completed = true;
+        entry->result = result;
+        secil_unlock();
     }
+}
 
-    RETURN_IF_ERROR(secil_read_next_header(), NULL);
+/// @brief Complete the request that a received response answers.
+/// @param response The received response - it is consumed here and not returned to the application.
+static void secil_handle_response(const secil_message *response)
+{
+    secil_lock();
 
-    // Read message length from header
-    uint16_t message_length = (uint16_t)state.incomingMessage[2] | ((uint16_t)state.incomingMessage[3] << 8);
-    if (message_length > secil_message_size)
+    secil_pending_request_t *entry = secil_find_request((uint16_t)response->response_to);
+    if (!entry || entry->completed)
     {
-        secil_log(secil_LOG_ERROR, "Incoming message too large.");
-        return SECIL_ERROR_MESSAGE_TOO_LARGE;
+        secil_unlock();
+        secil_log(secil_LOG_WARNING, "Dropping response to request %u - it is no longer pending.", (unsigned)response->response_to);
+        return;
     }
 
-    // Read the message body
-    if (!secil_read(state.incomingMessage + HEADER_SIZE, message_length + FOOTER_SIZE))
-    {
-        secil_log(secil_LOG_ERROR, "Failed to read message body.");
-        return SECIL_ERROR_READ_TIMEOUT;
-    }
-    // Verify footer magic bytes
-    if (state.incomingMessage[message_length + 6] != 0xFA || state.incomingMessage[message_length + 7] != 0xDE)
+    secil_error_t result = SECIL_OK;
+    if (response->which_payload != entry->response_tag)
     {
-        secil_log(secil_LOG_ERROR, "Invalid footer magic bytes.");
-        return SECIL_ERROR_DECODE_FAILED;
+        secil_log(secil_LOG_ERROR, "Response to request %u has an unexpected message type.", (unsigned)entry->id);
+        result = SECIL_ERROR_UNKNOWN_MESSAGE_TYPE;
     }
-
-    // Verify the CRC
-    uint16_t received_crc = (uint16_t)state.incomingMessage[message_length + 4] | ((uint16_t)state.incomingMessage[message_length + 5] << 8);
-    uint16_t computed_crc = crc16arc_bit(0, state.incomingMessage, message_length + 4);
-    if (received_crc != computed_crc)
+#if defined(secil_message_loopbackTest_tag)
+    else if (   response->which_payload == secil_message_loopbackTest_tag
+             && strncmp(response->payload.loopbackTest.data, entry->echo, sizeof(entry->echo)) != 0)
     {
-        secil_log(secil_LOG_ERROR, "Invalid message CRC: expected 0x%04X, got 0x%04X", computed_crc, received_crc);
-        return SECIL_ERROR_DECODE_FAILED;
+        secil_log(secil_LOG_ERROR, "Loopback test data does not match sent data: %s != %s", response->payload.loopbackTest.data, entry->echo);
+        result = SECIL_ERROR_RECEIVE_FAILED;
     }
+#endif
 
-    message->which_payload = 0;
+    secil_complete_request(entry, result, response);
+}
 
-    // Decode the message from
-    pb_istream_t stream = secil_create_istream(message_length);
-    if (!pb_decode_ex(&stream, secil_message_fields, message, PB_DECODE_NOINIT | PB_DECODE_DELIMITED))
+/// @brief Fail the requests that have waited too long for their response.
+static void secil_expire_requests()
+{
+    if (!secil_state.clock_callback)
     {
-        secil_log(secil_LOG_WARNING, "Cannot decode message");
-        secil_log(secil_LOG_WARNING, stream.errmsg ? stream.errmsg : "Unknown error");
-
-        return SECIL_ERROR_DECODE_FAILED;
+        return;
     }
 
-    return SECIL_OK;
-}
-
-secil_error_t secil_receive(secil_message *message)
-{
-    while (true)
+    uint32_t now = secil_now();
+    for (size_t i = 0; i < SECIL_MAX_PENDING_REQUESTS; i++)
     {
-        RETURN_IF_ERROR(secil_receive_internal(message), "Could not receive message");
+        secil_lock();
 
-        // Some messages need to be handled internally, such as loopback test messages and handshake messages
-        switch (message->which_payload)
+        secil_pending_request_t *entry = &secil_state.requests.pending[i];
+        if (entry->id != 0 && !entry->completed && now - entry->sent_at >= SECIL_REQUEST_TIMEOUT_MS)
         {
-        case secil_message_loopbackTest_tag:
-            // Just echo the message back
-            RETURN_IF_ERROR(secil_send(message), "Failed to send loopback test message.");
-            break;
-
-        case secil_message_handshake_tag:
-            RETURN_IF_ERROR(secil_handle_remote_restarted(message), "Failed to handle remote restart handshake.");
-            break;
-
-        default:
-            // Normal message, return it to the caller
-            return SECIL_OK;
+            secil_log(secil_LOG_WARNING, "Request %u has had no response.", (unsigned)entry->id);
+            secil_complete_request(entry, SECIL_ERROR_REQUEST_TIMEOUT, NULL);
+        }
+        else
+        {
+            secil_unlock();
         }
     }
 }
 
+#if SECIL_QUERIES
 
-static void secil_write_header(uint16_t msglen)
+/// @brief Find the field of a queryReply that carries the value with the given payload tag.
+/// @return true if that value can be queried.
+bool secil_find_query_field(pb_field_iter_t *field, const secil_queryReply *reply, pb_size_t tag)
 {
-    // Write the header, which is two "magic" bytes, followed by the message length as two bytes (little-endian)
-    uint8_t *header = state.outgoingMessage;
-    header[0] = 0xCA;
-    header[1] = 0xFE;
-    header[2] = (uint8_t)(msglen & 0xFF);
-    header[3] = (uint8_t)((msglen >> 8) & 0xFF);
-}
-
-static void secil_write_footer(uint16_t msglen)
-{
-    // Calculate CRC of header + message
-    uint16_t crc = crc16arc_bit(0, state.outgoingMessage, HEADER_SIZE + msglen);
-    uint8_t *footer = state.outgoingMessage + HEADER_SIZE + msglen;
-    footer[0] = (uint8_t)(crc & 0xFF);
-    footer[1] = (uint8_t)((crc >> 8) & 0xFF);
-    // Footer magic bytes (0xFADE)
-    footer[2] = 0xFA;
-    footer[3] = 0xDE;
+    return pb_field_iter_begin_const(field, secil_queryReply_fields, reply) && pb_field_iter_find(field, tag);
 }
 
-/// @brief Send a secil message
-/// @param message The message to send
-/// @note The message is sent with a header consisting of two null bytes followed by the message length as two bytes (little-endian).
-///       The message itself is encoded using nanopb with a varint length prefix.
-///       A footer is then added consisting of a CRC16-ARC checksum of the header and message.
-/// @return SECIL_OK if the message was sent successfully, otherwise an error code.
-static secil_error_t secil_send(const secil_message *message)
+/// @brief Put a value into its field of a queryReply.
+/// @param reply The reply.
+/// @param value A message carrying the value, as it would be sent on its own.
+/// @return true if the value was put into the reply, false if it is not a value that can be queried.
+static bool secil_query_reply_put(secil_queryReply *reply, const secil_message *value)
 {
-    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
-    
-    if (!message)
+    pb_field_iter_t field;
+    if (!secil_find_query_field(&field, reply, value->which_payload))
     {
-        secil_log(secil_LOG_ERROR, "Cannot send message - message is NULL.");
-        return SECIL_ERROR_INVALID_PARAMETER;
+        return false;
     }
 
-    pb_ostream_t stream = secil_create_ostream();
+    // Each field holds the same submessage as the payload with the same tag
+    memcpy(field.pData, &value->payload, field.data_size);
+    *(bool *)field.pSize = true;
+    return true;
+}
 
-    if (!pb_encode_ex(&stream, secil_message_fields, message, PB_ENCODE_DELIMITED))
+/// @brief Take a value out of its field of a queryReply.
+/// @param reply The reply.
+/// @param tag The payload tag of the value.
+/// @param value Receives the value, as if it had been received on its own.
+/// @return true if the reply holds the value.
+static bool secil_query_reply_take(const secil_queryReply *reply, pb_size_t tag, secil_message *value)
+{
+    pb_field_iter_t field;
+    if (!secil_find_query_field(&field, reply, tag) || !*(const bool *)field.pSize)
     {
-        return SECIL_ERROR_ENCODE_FAILED;
+        return false;
     }
 
-    uint16_t encoded_message_size = (uint16_t)stream.bytes_written;
+    value->which_payload = tag;
+    memcpy(&value->payload, field.pData, field.data_size);
+    return true;
+}
+
+/// @brief Get our current value with the given payload tag, from the value provider or else the last value sent.
+/// @param tag The payload tag.
+/// @param value Receives the value - its payload is overwritten even if the value is not known.
+/// @return true if the value is known.
+bool secil_current_value(pb_size_t tag, secil_message *value)
+{
+    memset(&value->payload, 0, sizeof(value->payload));
+    value->which_payload = tag;
+    bool known = secil_state.value_provider && secil_state.value_provider(secil_state.user_data, value) && value->which_payload == tag;
 
-    if (encoded_message_size > secil_message_size)
+#if SECIL_QUERY_SHADOW
+    if (!known)
     {
-        secil_log(secil_LOG_ERROR, "Cannot send message - encoded message too large.");
-        return SECIL_ERROR_MESSAGE_TOO_LARGE;
+        secil_lock();
+        known = secil_query_reply_take(&secil_state.shadow, tag, value);
+        secil_unlock();
     }
+#endif
 
-    // Write the header to the outgoing message buffer
-    secil_write_header(encoded_message_size);
+    return known;
+}
 
-    // Write the footer (CRC + magic bytes) to the end of the outgoing message buffer
-    secil_write_footer(encoded_message_size);
+/// @brief Answer a query from the remote end with a single queryReply holding every value asked for that we know.
+/// @param message The query - it is reused to fetch each value while the reply is built.
+static secil_error_t secil_answer_query(secil_message *message)
+{
+    uint32_t tags = message->payload.query.tags;
+    secil_message reply = {
+        .which_payload = secil_message_queryReply_tag,
+        .has_response_to = message->has_request_id,
+        .response_to = message->request_id
+    };
 
-    // Finally, write the entire message (header + message + footer) to the stream
-    if (!secil_write(state.outgoingMessage,  HEADER_SIZE + encoded_message_size + FOOTER_SIZE))
+    for (pb_size_t tag = 1; tag < 32; tag++)
     {
-        secil_log(secil_LOG_ERROR, "Failed to write message.");
-        return SECIL_ERROR_WRITE_FAILED;
+        pb_field_iter_t field;
+        if (!(tags & SECIL_TAG_BIT(tag)) || !secil_find_query_field(&field, &reply.payload.queryReply, tag))
+        {
+            continue;
+        }
+
+        if (secil_current_value(tag, message))
+        {
+            secil_query_reply_put(&reply.payload.queryReply, message);
+        }
     }
 
-    return SECIL_OK;
+    // Answers are the library's own frames, so they are never rate limited
+    return secil_send_admitted(&reply);
 }
 
-#define SECIL_SEND_MSG(MSG, FIELD, VALUE) \
-    secil_message message = { \
-        .which_payload = secil_message_##MSG##_tag, \
-        .payload = { .MSG = { .FIELD = VALUE } } \
-    }; \
-    return secil_send(&message)
+#endif // SECIL_QUERIES
 
-// Use this macro when the name of the message is equal to the one and only msg field it contains
-#define SECIL_SEND(FIELD, VALUE) SECIL_SEND_MSG(FIELD, FIELD, VALUE)
+#if SECIL_RESYNC
 
-secil_error_t secil_send_currentTemperature(int8_t currentTemperature)   { SECIL_SEND(currentTemperature, currentTemperature);   }
-secil_error_t secil_send_heatingSetpoint(int8_t heatingSetpoint)         { SECIL_SEND(heatingSetpoint, heatingSetpoint);         }
-secil_error_t secil_send_awayHeatingSetpoint(int8_t awayHeatingSetpoint) { SECIL_SEND(awayHeatingSetpoint, awayHeatingSetpoint); }
-secil_error_t secil_send_coolingSetpoint(int8_t coolingSetpoint)         { SECIL_SEND(coolingSetpoint, coolingSetpoint);         }
-secil_error_t secil_send_awayCoolingSetpoint(int8_t awayCoolingSetpoint) { SECIL_SEND(awayCoolingSetpoint, awayCoolingSetpoint); }
-secil_error_t secil_send_hvacMode(int8_t hvacMode)                       { SECIL_SEND(hvacMode, hvacMode);                       }
-secil_error_t secil_send_relativeHumidity(bool relativeHumidity)         { SECIL_SEND(relativeHumidity, relativeHumidity);       }
-secil_error_t secil_send_accessoryState(bool accessoryState)             { SECIL_SEND(accessoryState, accessoryState);           }
-secil_error_t secil_send_demandResponse(bool demandResponse)             { SECIL_SEND(demandResponse, demandResponse);           }
-secil_error_t secil_send_awayMode(bool awayMode)                         { SECIL_SEND(awayMode, awayMode);                       }
-secil_error_t secil_send_autoWake(bool autoWake)                         { SECIL_SEND(autoWake, autoWake);                       }
-secil_error_t secil_send_localUiState(int8_t localUiState)               { SECIL_SEND(localUiState, localUiState);               }
-secil_error_t secil_send_dateTime(uint64_t dateTime)                     { SECIL_SEND(dateAndTime, dateTime);                    }
-secil_error_t secil_send_pairingState(secil_pairing_state_t state)       { SECIL_SEND_MSG(pairingState, state, state);           }
-secil_error_t secil_send_wifiStatus(secil_system_status_t status)        { SECIL_SEND_MSG(wifiStatus, state, status);           }
-secil_error_t secil_send_matterStatus(secil_system_status_t status)      { SECIL_SEND_MSG(matterStatus, state, status);         }
-secil_error_t secil_send_factoryReset(secil_reset_state_t state)         { SECIL_SEND_MSG(factoryReset, state, state);         }
+/// @brief Stream callback that adds the encoded bytes to a hash instead of storing them.
+static bool secil_hash_write(pb_ostream_t *stream, const pb_byte_t *buf, size_t count)
+{
+    uint16_t *hash = (uint16_t *)stream->state;
+    *hash = crc16arc_bit(*hash, buf, count);
+    return true;
+}
 
-secil_error_t secil_send_otaStatus(secil_ota_state_t state, uint8_t progress, const char *version) 
+/// @brief Hash a value as it is encoded, so that both ends get the same hash whatever the layout of their structs.
+/// @return The hash, or 0 if the message does not carry a value that can be queried.
+static uint16_t secil_value_hash(const secil_message *value)
 {
-    if (!version)
+    pb_field_iter_t field;
+    if (!secil_find_query_field(&field, &secil_state.shadow, value->which_payload))
     {
-        version = "";
+        return 0;
     }
-    if (progress > 100)
+
+    uint16_t hash = 0;
+    pb_ostream_t stream = { .callback = secil_hash_write, .state = &hash, .max_size = SIZE_MAX };
+    if (!pb_encode(&stream, field.submsg_desc, &value->payload))
     {
-        progress = 100;
+        return 0;
     }
 
-    secil_message message = {
-        .which_payload = secil_message_otaStatus_tag,
-        .payload = { .otaStatus = { 
-            .state = state,
-            .progress = progress
-        } }
-    };
-
-    strncpy(message.payload.otaStatus.version, version, sizeof(message.payload.otaStatus.version) - 1);
-
-    return secil_send(&message);
+    return hash != 0 ? hash : 1; // 0 is kept for "no value"
 }
 
-secil_error_t secil_send_warning(secil_warning_type_t type, const char *message) 
+/// @brief Make a note of the hash of a value received from the remote end.
+static void secil_note_received(const secil_message *message)
 {
-    if (!message)
+    uint16_t hash = message->which_payload < 32 ? secil_value_hash(message) : 0;
+    if (hash != 0)
     {
-        secil_log(secil_LOG_ERROR, "Cannot send warning - message is NULL.");
-        return SECIL_ERROR_INVALID_PARAMETER;
+        secil_lock();
+        secil_state.received_hashes[message->which_payload] = hash;
+        secil_unlock();
     }
-
-    secil_message msg = {
-        .which_payload = secil_message_warning_tag,
-        .payload = { .warning = { .type = type } }
-    };
-    strncpy(msg.payload.warning.message, message, sizeof(msg.payload.warning.message) - 1);
-    return secil_send(&msg);
 }
 
-// NOTE: This message is different from the others, as it contains a string and cannot be directly assigned like the others.
-secil_error_t secil_send_supportPackageData(const char *supportPackageData) 
+/// @brief Hash the per-value hashes of a digest, so that two equal digests can be spotted at a glance.
+static uint16_t secil_digest_overall(uint32_t tags, const uint16_t *hashes, pb_size_t count)
 {
-    secil_message message = {
-        .which_payload = secil_message_supportPackageData_tag,
-    };
-    strncpy(message.payload.supportPackageData.supportPackageData, supportPackageData, sizeof(message.payload.supportPackageData.supportPackageData) - 1);
-    return secil_send(&message);
-}
+    uint8_t bytes[4] = { (uint8_t)tags, (uint8_t)(tags >> 8), (uint8_t)(tags >> 16), (uint8_t)(tags >> 24) };
+    uint16_t overall = crc16arc_bit(0, bytes, sizeof(bytes));
 
-secil_error_t secil_loopback_test(const char *test_data)
+    for (pb_size_t i = 0; i < count; i++)
+    {
+        bytes[0] = (uint8_t)hashes[i];
+        bytes[1] = (uint8_t)(hashes[i] >> 8);
+        overall = crc16arc_bit(overall, bytes, 2);
+    }
+    return overall;
+}
+
+/// @brief Fill in a digest with the hashes of the values received so far.
+static void secil_fill_digest(secil_stateDigest *digest)
+{
+    digest->tags = 0;
+    digest->hashes_count = 0;
+
+    secil_lock();
+    for (pb_size_t tag = 1; tag < 32; tag++)
+    {
+        if (secil_state.received_hashes[tag] != 0)
+        {
+            digest->tags |= SECIL_TAG_BIT(tag);
+            digest->hashes[digest->hashes_count++] = secil_state.received_hashes[tag];
+        }
+    }
+    secil_unlock();
+
+    digest->overall = secil_digest_overall(digest->tags, digest->hashes, digest->hashes_count);
+}
+
+/// @brief Send again each of our values that the remote end does not have, as told by its digest.
+/// @param digest The digest received from the remote end.
+/// @param message Used to fetch each value - it may hold the digest, which is read first.
+static void secil_resync(const secil_stateDigest *digest, secil_message *message)
+{
+    // Spread the remote hashes out by tag before the message is reused
+    uint16_t remote_hashes[32] = { 0 };
+    if (secil_digest_overall(digest->tags, digest->hashes, digest->hashes_count) != digest->overall)
+    {
+        secil_log(secil_LOG_WARNING, "Ignoring state digest that does not add up.");
+        return;
+    }
+
+    pb_size_t count = 0;
+    for (pb_size_t tag = 1; tag < 32 && count < digest->hashes_count; tag++)
+    {
+        if (digest->tags & SECIL_TAG_BIT(tag))
+        {
+            remote_hashes[tag] = digest->hashes[count++];
+        }
+    }
+
+    unsigned resent = 0;
+    for (pb_size_t tag = 1; tag < 32; tag++)
+    {
+        if (secil_current_value(tag, message) && secil_value_hash(message) != remote_hashes[tag])
+        {
+            if (secil_send_value(message) != SECIL_OK)
+            {
+                secil_log(secil_LOG_WARNING, "Failed to send value %u again.", (unsigned)tag);
+            }
+            resent++;
+        }
+    }
+
+    secil_log(secil_LOG_INFO, "Sent %u values again after comparing state digests.", resent);
+}
+
+#endif // SECIL_RESYNC
+
+#if SECIL_DICTIONARY
+/// @brief Hash a string dictionary (32-bit FNV-1a over the number of texts and each text with its terminator).
+static uint32_t secil_dictionary_hash(const char *const *entries, uint16_t count)
+{
+    uint32_t hash = 2166136261u;
+    const uint8_t count_bytes[2] = { (uint8_t)(count & 0xFF), (uint8_t)(count >> 8) };
+    for (size_t i = 0; i < sizeof(count_bytes); i++)
+    {
+        hash = (hash ^ count_bytes[i]) * 16777619u;
+    }
+    for (uint16_t i = 0; i < count; i++)
+    {
+        const char *text = entries[i];
+        do
+        {
+            hash = (hash ^ (uint8_t)*text) * 16777619u;
+        } while (*text++ != '\0');
+    }
+
+    // 0 stands for no dictionary
+    return hash != 0 ? hash : 1;
+}
+
+/// @brief Find a text in the string dictionary.
+/// @return The index of the text, or -1 if it is not there.
+static int32_t secil_dictionary_find(const char *text)
+{
+    for (uint16_t i = 0; i < secil_state.dictionary.count; i++)
+    {
+        if (strcmp(secil_state.dictionary.entries[i], text) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/// @brief Check that a text of the string dictionary is safe to use as a printf format with the arguments of a warning.
+/// @param text The text.
+/// @return true if each conversion is %% or an integer conversion without a length modifier or '*', and there are no
+///         more of them than a warning has arguments.
+static bool secil_dictionary_format_valid(const char *text)
+{
+    size_t conversions = 0;
+    while ((text = strchr(text, '%')) != NULL)
+    {
+        text++;
+        if (*text == '%')
+        {
+            text++;
+            continue;
+        }
+
+        text += strspn(text, "-+ #0");
+        text += strspn(text, "0123456789");
+        if (*text == '.')
+        {
+            text++;
+            text += strspn(text, "0123456789");
+        }
+        if (*text == '\0' || !strchr("diouxXc", *text))
+        {
+            return false;
+        }
+        text++;
+        conversions++;
+    }
+    return conversions <= sizeof(((secil_warning *)0)->args) / sizeof(int32_t);
+}
+
+/// @brief Write out a text of the string dictionary, formatted with its arguments if it has any.
+static void secil_dictionary_format(char *text, size_t size, uint16_t id, const int32_t *args, pb_size_t arg_count)
+{
+    const char *entry = secil_state.dictionary.entries[id];
+    if (arg_count == 0)
+    {
+        // Texts sent without arguments are taken as they are, even if they contain a '%'
+        strncpy(text, entry, size - 1);
+        text[size - 1] = '\0';
+        return;
+    }
+
+    int32_t all_args[sizeof(((secil_warning *)0)->args) / sizeof(int32_t)] = { 0 };
+    memcpy(all_args, args, arg_count * sizeof(int32_t));
+    // secil_set_dictionary() only takes texts whose conversions are for an int
+    snprintf(text, size, entry, (int)all_args[0], (int)all_args[1], (int)all_args[2], (int)all_args[3]);
+}
+
+/// @brief Expand the index of a warning received back into its text, unless the application reads the index itself.
+static void secil_dictionary_expand(secil_message *message)
+{
+    secil_warning *warning = &message->payload.warning;
+    if (message->which_payload != secil_message_warning_tag || !warning->has_message_id || !secil_state.dictionary.expand)
+    {
+        return;
+    }
+
+    // An index only means the same text at both ends once they have agreed on the dictionary
+    if (!secil_state.dictionary.in_use)
+    {
+        secil_log(secil_LOG_WARNING, "Warning with dictionary index %u, but the dictionaries do not match.", (unsigned)warning->message_id);
+        return;
+    }
+
+    if (warning->message_id >= secil_state.dictionary.count)
+    {
+        secil_log(secil_LOG_WARNING, "Warning with unknown dictionary index %u.", (unsigned)warning->message_id);
+        return;
+    }
+    secil_dictionary_format(warning->message, sizeof(warning->message), warning->message_id, warning->args, warning->args_count);
+}
+#endif
+
+/// @brief Make a note of the values the remote end wants and the features it supports, as given in its handshake.
+static void secil_apply_remote_handshake(const secil_handshake *handshake)
+{
+    secil_state.remote_subscriptions = handshake->has_subscriptions ? handshake->subscriptions : SECIL_SUBSCRIBE_ALL;
+
+    // Use the highest common feature set - an older remote end offers no capabilities, so it gets v1 frames only
+    secil_state.agreed_capabilities = secil_state.local_capabilities & (handshake->has_capabilities ? handshake->capabilities : 0);
+    secil_state.remote_max_frame_size = handshake->has_max_frame_size ? (uint16_t)handshake->max_frame_size : 0;
+#if SECIL_BAUD_SWITCH
+    secil_state.baud.remote_rates = handshake->has_baud_rates ? handshake->baud_rates : 0;
+#endif
+#if SECIL_DICTIONARY
+    secil_state.dictionary.in_use = secil_state.dictionary.hash != 0 && handshake->has_dictionary && handshake->dictionary == secil_state.dictionary.hash;
+#endif
+#if SECIL_HEARTBEAT
+    // A remote end that has restarted numbers its heartbeats afresh, and its clock may have started again. Its clock
+    // still runs at the same rate, so the drift is kept.
+    secil_lock();
+    secil_state.heartbeat.remote_interval = (secil_state.agreed_capabilities & SECIL_CAPABILITY_HEARTBEAT) && handshake->has_heartbeat_interval
+                                    ? (uint16_t)handshake->heartbeat_interval : 0;
+    secil_state.heartbeat.rx_seq_valid = false;
+    secil_state.clock.count = 0;
+    secil_state.clock.next = 0;
+    secil_state.clock.referenced = false;
+    secil_state.clock.measured = 0;
+    secil_unlock();
+#endif
+    secil_log(secil_LOG_INFO, "Capabilities agreed with the remote end: 0x%08X", (unsigned)secil_state.agreed_capabilities);
+}
+
+/// @brief Start a new session, as the client - the server takes its session from the client's handshakes.
+static void secil_new_session()
+{
+    // A session only has to differ from the one before, so the clock and a counter are enough
+    uint32_t previous = secil_state.connection.session;
+    do
+    {
+        secil_state.connection.session = secil_now() * 2654435761u ^ ++secil_state.connection.sessions_started;
+    } while (secil_state.connection.session == 0 || secil_state.connection.session == previous);
+}
+
+/// @brief Handle a handshake from the remote end.
+/// @note Handshakes arrive while connecting, and at any time after that if the remote end restarts.
+static secil_error_t secil_handle_handshake(secil_message *handshake_message)
+{
+    const secil_handshake *handshake = &handshake_message->payload.handshake;
+
+    if (secil_state.mode == secil_operating_mode_t_UNINITIALIZED)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot handle handshake - local end not started up.");
+        return SECIL_ERROR_INVALID_STATE;
+    }
+
+    secil_lock();
+    bool connecting = secil_state.connection.state != SECIL_CONNECTED;
+    bool resume_reply = secil_state.connection.resuming && !handshake->needs_ack;
+    secil_unlock();
+
+    // We can't have both local and remote end in the same mode
+    if (secil_state.mode == handshake->mode)
+    {
+        secil_log(secil_LOG_ERROR, "Received handshake message from remote end but it is in the same mode as us.");
+        return connecting ? SECIL_ERROR_STARTUP_FAILED : SECIL_ERROR_INVALID_STATE;
+    }
+
+    // Always make a note of the new version string of the remote connection
+    strncpy(secil_state.remote_version, handshake->version, sizeof(secil_state.remote_version) - 1);
+    secil_state.remote_version[sizeof(secil_state.remote_version) - 1] = '\0'; // Ensure null termination
+    secil_apply_remote_handshake(handshake);
+#if SECIL_FLOW_CONTROL
+    secil_flow_on_handshake(handshake_message);
+#endif
+
+    // The handshake carries a resumption ticket that we accept if it names the session we are still in
+    bool resumed = handshake->has_session && handshake->session != 0 && handshake->session == secil_state.connection.session;
+    if (secil_state.mode == secil_operating_mode_t_SERVER)
+    {
+        if (handshake->has_session)
+        {
+            secil_state.connection.session = handshake->session;
+        }
+    }
+    else if (handshake->needs_ack && !resumed && !connecting)
+    {
+        // The server has restarted without our session, so our ack starts a new one
+        secil_new_session();
+    }
+
+    if (resume_reply)
+    {
+        // Whether or not the ticket was accepted, the handshake above has agreed the capabilities again
+        secil_lock();
+        secil_state.connection.resuming = false;
+        if (handshake->has_resumed && handshake->resumed)
+        {
+            secil_state.connection.stats.resumptions++;
+        }
+        else
+        {
+            secil_state.connection.stats.resumptions_rejected++;
+        }
+        secil_unlock();
+
+        if (!handshake->has_resumed || !handshake->resumed)
+        {
+            secil_log(secil_LOG_WARNING, "Resumption ticket rejected by the remote end - fell back to a full handshake.");
+        }
+    }
+
+    // A handshake without needs_ack is only the reply to ours, so once connected it changes nothing else
+    bool connected = connecting || handshake->needs_ack;
+    if (connected)
+    {
+        if (!connecting)
+        {
+            secil_log(secil_LOG_INFO, "Remote end has restarted.");
+        }
+
+#if SECIL_RELIABLE
+        // Anything in flight belongs to the old connection
+        secil_reliable_reset(handshake->reliable_window);
+#endif
+
+        secil_lock();
+        secil_state.connection.state = SECIL_CONNECTED;
+        secil_state.connection.stats.connects++;
+        if (connecting)
+        {
+            secil_state.connection.stats.last_connect_ms = secil_now() - secil_state.connection.started_at;
+        }
+        else
+        {
+            secil_state.connection.stats.remote_restarts++;
+        }
+        secil_unlock();
+    }
+
+    if (handshake->needs_ack)
+    {
+        // Send an ack back to the remote end
+        RETURN_IF_ERROR(secil_send_startup_message(secil_state.mode, false, resumed), "Failed to send handshake ack to remote end.");
+    }
+
+    if (connecting && secil_state.connection.fail_on_version_mismatch &&
+        strncmp(secil_state.remote_version, SECIL_VERSION, sizeof(secil_state.remote_version)) != 0)
+    {
+        secil_log(secil_LOG_ERROR, "Version mismatch between client and server:");
+        secil_log(secil_LOG_ERROR, " Local version: ");
+        secil_log(secil_LOG_ERROR, SECIL_VERSION);
+        secil_log(secil_LOG_ERROR, " Remote version: ");
+        secil_log(secil_LOG_ERROR, secil_state.remote_version);
+        secil_state.connection.state = SECIL_DISCONNECTED;
+        return SECIL_ERROR_VERSION_MISMATCH;
+    }
+
+    if (connected || resume_reply)
+    {
+        // Notify the application of the new connection (when resuming, once the remote end's version is known)
+        secil_notify_on_connect();
+
+#if SECIL_RESYNC
+        // The remote end has told us what it already has, so only send again what has changed
+        if ((secil_state.agreed_capabilities & SECIL_CAPABILITY_STATE_DIGEST) && handshake->has_stateDigest)
+        {
+            secil_resync(&handshake->stateDigest, handshake_message);
+        }
+#endif
+
+#if SECIL_BULK
+        // Ask the remote end where to carry on with our transfer, as it may have lost some of it
+        if (connected && secil_state.bulk.tx.active)
+        {
+            RETURN_IF_ERROR(secil_bulk_send_open(), "Failed to open bulk transfer again.");
+        }
+#endif
+    }
+
+    return SECIL_OK;
+}
+
+const secil_frame_format_t secil_frame_v1 = { HEADER_SIZE, FOOTER_SIZE, true };
+const secil_frame_format_t secil_frame_compact = { COMPACT_HEADER_SIZE, COMPACT_FOOTER_SIZE, false };
+#if SECIL_FRAGMENTS
+const secil_frame_format_t secil_frame_fragment = { COMPACT_HEADER_SIZE, COMPACT_FOOTER_SIZE, false };
+static secil_error_t secil_receive_fragment(uint16_t message_length);
+#endif
+#if SECIL_LZ
+const secil_frame_format_t secil_frame_compressed = { COMPACT_HEADER_SIZE, COMPACT_FOOTER_SIZE, false };
+#endif
+
+/// @brief Log that the body of a frame could not be read, which is only worth a debug line when it was cut short by the
+///        deadline of secil_receive_until() or abandoned after a gap, as that has been dealt with.
+static void secil_log_body_read_failed()
+{
+    secil_log(secil_state.receive.expired || secil_state.receive.abandoned ? secil_LOG_DEBUG : secil_LOG_ERROR, "Failed to read message body.");
+}
+
+/// @brief Find the next frame header of either version in the stream.
+/// @param format Set to the layout of the frame found.
+/// @param message_length Set to the length of the message body given in the header.
+static secil_error_t secil_read_next_header(const secil_frame_format_t **format, uint16_t *message_length)
+{
+    // First try reading the shorter of the two headers at once
+    if (!secil_read(secil_state.incomingMessage, COMPACT_HEADER_SIZE))
+    {
+        return SECIL_ERROR_READ_TIMEOUT;
+    }
+
+    while (true)
+    {
+        // Check for header magic bytes
+        if (secil_state.incomingMessage[0] == 0xCA && secil_state.incomingMessage[1] == 0xFE)
+        {
+            // A v1 header has a second length byte
+            if (!secil_read(&secil_state.incomingMessage[3], 1))
+            {
+                return SECIL_ERROR_READ_TIMEOUT;
+            }
+            *format = &secil_frame_v1;
+            *message_length = (uint16_t)secil_state.incomingMessage[2] | ((uint16_t)secil_state.incomingMessage[3] << 8);
+            return SECIL_OK;
+        }
+
+        if (secil_state.incomingMessage[0] == 0xCA && secil_state.incomingMessage[1] == 0xF2)
+        {
+            *format = &secil_frame_compact;
+            *message_length = secil_state.incomingMessage[2];
+            return SECIL_OK;
+        }
+
+#if SECIL_LZ
+        if (secil_state.incomingMessage[0] == 0xCA && secil_state.incomingMessage[1] == 0xF3)
+        {
+            *format = &secil_frame_compressed;
+            *message_length = secil_state.incomingMessage[2];
+            return SECIL_OK;
+        }
+#endif
+
+#if SECIL_FRAGMENTS
+        if (secil_state.incomingMessage[0] == 0xCA && secil_state.incomingMessage[1] == 0xF4 && !secil_state.fragments.replaying)
+        {
+            // Take the fragment in - once the last one is in, the header of the frame they make up is read from it
+            RETURN_IF_ERROR(secil_receive_fragment(secil_state.incomingMessage[2]), NULL);
+            if (!secil_read(secil_state.incomingMessage, COMPACT_HEADER_SIZE))
+            {
+                return SECIL_ERROR_READ_TIMEOUT;
+            }
+            continue;
+        }
+#endif
+
+        // Shift the buffer left by one byte and continue reading
+        secil_state.incomingMessage[0] = secil_state.incomingMessage[1];
+        secil_state.incomingMessage[1] = secil_state.incomingMessage[2];
+        if (!secil_read(&secil_state.incomingMessage[2], 1))
+        {
+            return SECIL_ERROR_READ_TIMEOUT;
+        }
+    }
+}
+
+/// @brief Verify the footer of the frame held in the incoming message buffer.
+/// @param format The layout of the frame.
+/// @param message_length The length of the message body.
+/// @param computed_crc The CRC computed over the header and message body.
+/// @return SECIL_OK if the footer magic bytes and CRC are valid, otherwise an error code.
+static secil_error_t secil_verify_footer(const secil_frame_format_t *format, uint16_t message_length, uint16_t computed_crc)
+{
+    const uint8_t *footer = secil_state.incomingMessage + format->header_size + message_length;
+
+    // Verify footer magic bytes (compact frames have none)
+    if (format == &secil_frame_v1 && (footer[2] != 0xFA || footer[3] != 0xDE))
+    {
+        secil_log(secil_LOG_ERROR, "Invalid footer magic bytes.");
+        return SECIL_ERROR_DECODE_FAILED;
+    }
+
+    // Verify the CRC
+    uint16_t received_crc = (uint16_t)footer[0] | ((uint16_t)footer[1] << 8);
+    if (received_crc != computed_crc)
+    {
+        secil_log(secil_LOG_ERROR, "Invalid message CRC: expected 0x%04X, got 0x%04X", computed_crc, received_crc);
+        return SECIL_ERROR_DECODE_FAILED;
+    }
+
+    return SECIL_OK;
+}
+
+#if SECIL_FRAGMENTS
+/// @brief Read a fragment and add its piece to the frame being put back together.
+/// @param message_length The length of the fragment body given in its header.
+/// @return SECIL_OK if the piece was added (and, if it was the last, the frame is ready to be read again), otherwise an error code.
+static secil_error_t secil_receive_fragment(uint16_t message_length)
+{
+    const secil_frame_format_t *format = &secil_frame_fragment;
+    if (!secil_read(secil_state.incomingMessage + format->header_size, message_length + format->footer_size))
+    {
+        secil_log_body_read_failed();
+        return SECIL_ERROR_READ_TIMEOUT;
+    }
+
+    RETURN_IF_ERROR(secil_verify_footer(format, message_length, crc16arc_bit(0, secil_state.incomingMessage, format->header_size + message_length)), NULL);
+
+    const uint8_t *body = secil_state.incomingMessage + format->header_size;
+    uint8_t index = body[1] & FRAGMENT_INDEX_MASK;
+    uint16_t count = message_length > FRAGMENT_HEADER_SIZE ? (uint16_t)(message_length - FRAGMENT_HEADER_SIZE) : 0;
+    if (index == 0)
+    {
+        // The first fragment of a frame replaces whatever was left of an earlier one
+        secil_state.fragments.active = true;
+        secil_state.fragments.stream = body[0];
+        secil_state.fragments.size = 0;
+        secil_state.fragments.next_index = 0;
+    }
+
+    if (!secil_state.fragments.active || body[0] != secil_state.fragments.stream || index != secil_state.fragments.next_index || count == 0)
+    {
+        secil_state.fragments.active = false;
+        secil_log(secil_LOG_WARNING, "Dropping fragment %u of stream %u - an earlier fragment is missing.", (unsigned)index, (unsigned)body[0]);
+        return SECIL_ERROR_DECODE_FAILED;
+    }
+
+    if (secil_state.fragments.size + count > sizeof(secil_state.fragments.buf))
+    {
+        secil_state.fragments.active = false;
+        secil_log(secil_LOG_ERROR, "Incoming message too large.");
+        return SECIL_ERROR_MESSAGE_TOO_LARGE;
+    }
+
+    memcpy(secil_state.fragments.buf + secil_state.fragments.size, body + FRAGMENT_HEADER_SIZE, count);
+    secil_state.fragments.size += count;
+    secil_state.fragments.next_index++;
+
+    if (body[1] & FRAGMENT_LAST)
+    {
+        secil_state.fragments.active = false;
+        secil_state.fragments.replaying = true;
+        secil_state.fragments.replayed = 0;
+    }
+    return SECIL_OK;
+}
+#endif
+
+#if SECIL_CUT_THROUGH_DECODE
+
+/// @brief Progress of a message body that is decoded while it is still arriving.
+typedef struct
+{
+    uint16_t crc;      // Running CRC of the header and the body bytes read so far
+    uint16_t received; // Number of frame bytes stored in the incoming message buffer so far
+    bool read_failed;  // True if the transport failed part way through the body
+} secil_cut_through_t;
+
+/// @brief Stream callback that reads body bytes from the transport as the decoder asks for them.
+/// @note Every byte is also kept in the incoming message buffer and added to the running CRC.
+static bool secil_cut_through_read(pb_istream_t *stream, pb_byte_t *buf, size_t count)
+{
+    secil_cut_through_t *progress = (secil_cut_through_t *)stream->state;
+    pb_byte_t *dest = secil_state.incomingMessage + progress->received;
+
+    if (!secil_read(dest, count))
+    {
+        progress->read_failed = true;
+        return false;
+    }
+
+    progress->crc = crc16arc_bit(progress->crc, dest, count);
+    progress->received += (uint16_t)count;
+    memcpy(buf, dest, count);
+    return true;
+}
+
+/// @brief Read and decode the message body at the same time, then verify the footer.
+/// @param message The message to decode into - only valid if SECIL_OK is returned.
+/// @param format The layout of the frame.
+/// @param message_length The length of the message body given in the header.
+/// @return SECIL_OK if the message was decoded and the CRC is valid, otherwise an error code.
+static secil_error_t secil_receive_body(secil_message *message, const secil_frame_format_t *format, uint16_t message_length)
+{
+    secil_cut_through_t progress = {
+        .crc = crc16arc_bit(0, secil_state.incomingMessage, format->header_size),
+        .received = format->header_size,
+        .read_failed = false
+    };
+    pb_istream_t stream = {
+        .callback = secil_cut_through_read,
+        .state = &progress,
+        .bytes_left = message_length
+    };
+
+    // Decode speculatively - the result is only committed once the footer has been verified
+    bool decoded = pb_decode_ex(&stream, secil_message_fields, message, PB_DECODE_NOINIT | (format->delimited ? PB_DECODE_DELIMITED : 0));
+    if (progress.read_failed)
+    {
+        secil_log_body_read_failed();
+        return SECIL_ERROR_READ_TIMEOUT;
+    }
+
+    // Read any body bytes the decoder did not consume (e.g. after a decode error) followed by the footer
+    uint16_t remaining = (uint16_t)(format->header_size + message_length - progress.received);
+    if (!secil_read(secil_state.incomingMessage + progress.received, remaining + format->footer_size))
+    {
+        secil_log_body_read_failed();
+        return SECIL_ERROR_READ_TIMEOUT;
+    }
+    progress.crc = crc16arc_bit(progress.crc, secil_state.incomingMessage + progress.received, remaining);
+
+    RETURN_IF_ERROR(secil_verify_footer(format, message_length, progress.crc), NULL);
+
+    if (!decoded)
+    {
+        secil_log(secil_LOG_WARNING, "Cannot decode message");
+        secil_log(secil_LOG_WARNING, PB_GET_ERROR(&stream));
+
+        return SECIL_ERROR_DECODE_FAILED;
+    }
+
+    return SECIL_OK;
+}
+
+#else
+
+/// @brief Creates an pb input stream from the given secil_state.
+/// @return An instance of a pb_istream_t structure.
+static pb_istream_t secil_create_istream(const secil_frame_format_t *format, uint16_t msglen)
+{
+    return pb_istream_from_buffer(secil_state.incomingMessage + format->header_size, msglen);
+}
+
+/// @brief Read the whole message body and footer, verify them and then decode the message.
+/// @param message The message to decode into - only valid if SECIL_OK is returned.
+/// @param format The layout of the frame.
+/// @param message_length The length of the message body given in the header.
+/// @return SECIL_OK if the message was decoded and the CRC is valid, otherwise an error code.
+static secil_error_t secil_receive_body(secil_message *message, const secil_frame_format_t *format, uint16_t message_length)
+{
+    // Read the message body
+    if (!secil_read(secil_state.incomingMessage + format->header_size, message_length + format->footer_size))
+    {
+        secil_log_body_read_failed();
+        return SECIL_ERROR_READ_TIMEOUT;
+    }
+
+    RETURN_IF_ERROR(secil_verify_footer(format, message_length, crc16arc_bit(0, secil_state.incomingMessage, format->header_size + message_length)), NULL);
+
+    // Decode the message from
+    pb_istream_t stream = secil_create_istream(format, message_length);
+    if (!pb_decode_ex(&stream, secil_message_fields, message, PB_DECODE_NOINIT | (format->delimited ? PB_DECODE_DELIMITED : 0)))
+    {
+        secil_log(secil_LOG_WARNING, "Cannot decode message");
+        secil_log(secil_LOG_WARNING, PB_GET_ERROR(&stream));
+
+        return SECIL_ERROR_DECODE_FAILED;
+    }
+
+    return SECIL_OK;
+}
+
+#endif // SECIL_CUT_THROUGH_DECODE
+
+#if SECIL_LZ
+/// @brief Read the whole of a compressed message body and footer, verify them, then expand and decode the message.
+/// @param message The message to decode into - only valid if SECIL_OK is returned.
+/// @param message_length The length of the compressed message body given in the header.
+/// @return SECIL_OK if the message was decoded and the CRC is valid, otherwise an error code.
+static secil_error_t secil_receive_compressed_body(secil_message *message, uint16_t message_length)
+{
+    const secil_frame_format_t *format = &secil_frame_compressed;
+    if (!secil_read(secil_state.incomingMessage + format->header_size, message_length + format->footer_size))
+    {
+        secil_log_body_read_failed();
+        return SECIL_ERROR_READ_TIMEOUT;
+    }
+
+    RETURN_IF_ERROR(secil_verify_footer(format, message_length, crc16arc_bit(0, secil_state.incomingMessage, format->header_size + message_length)), NULL);
+
+    size_t inflated_size;
+    if (!secil_lz_inflate(secil_state.incomingMessage + format->header_size, message_length,
+                          secil_state.lz.inflated, sizeof(secil_state.lz.inflated), &inflated_size))
+    {
+        secil_log(secil_LOG_WARNING, "Cannot expand compressed message");
+        return SECIL_ERROR_DECODE_FAILED;
+    }
+
+    pb_istream_t stream = pb_istream_from_buffer(secil_state.lz.inflated, inflated_size);
+    if (!pb_decode_ex(&stream, secil_message_fields, message, PB_DECODE_NOINIT))
+    {
+        secil_log(secil_LOG_WARNING, "Cannot decode message");
+        secil_log(secil_LOG_WARNING, PB_GET_ERROR(&stream));
+
+        return SECIL_ERROR_DECODE_FAILED;
+    }
+
+    return SECIL_OK;
+}
+#endif
+
+/// @brief Read and decode the next frame from the stream.
+/// @param message The message to decode into.
+/// @return SECIL_OK if a valid frame was received, otherwise an error code.
+/// @note The caller is responsible for checking the I/O callbacks and the message pointer.
+static secil_error_t secil_read_frame(secil_message *message)
+{
+    const secil_frame_format_t *format;
+    uint16_t message_length;
+    RETURN_IF_ERROR(secil_read_next_header(&format, &message_length), NULL);
+
+    if (message_length > secil_message_size)
+    {
+        secil_log(secil_LOG_ERROR, "Incoming message too large.");
+        return SECIL_ERROR_MESSAGE_TOO_LARGE;
+    }
+
+    // Messages are decoded without being cleared first, so reset everything that is optional
+    message->which_payload = 0;
+    message->has_seq = false;
+    message->has_ack = false;
+    message->has_sack = false;
+    message->has_request_id = false;
+    message->has_response_to = false;
+    message->has_credit = false;
+    message->has_sent_at = false;
+
+#if SECIL_LZ
+    secil_error_t result = format == &secil_frame_compressed ? secil_receive_compressed_body(message, message_length)
+                                                             : secil_receive_body(message, format, message_length);
+#else
+    secil_error_t result = secil_receive_body(message, format, message_length);
+#endif
+    if (result != SECIL_OK)
+    {
+        // Never hand a partially decoded message back to the caller
+        message->which_payload = 0;
+    }
+
+    return result;
+}
+
+/// @brief Read and decode the next frame from the stream, whether it arrives whole or in fragments.
+/// @param message The message to decode into.
+/// @return SECIL_OK if a valid frame was received, otherwise an error code.
+static secil_error_t secil_receive_frame(secil_message *message)
+{
+    secil_error_t result = secil_read_frame(message);
+
+#if SECIL_FRAGMENTS
+    if (secil_state.fragments.replaying)
+    {
+        // Fragments that do not make up exactly one frame are corrupt, not a sign that the link has gone quiet
+        secil_state.fragments.replaying = false;
+        if (result == SECIL_ERROR_READ_TIMEOUT)
+        {
+            secil_log(secil_LOG_ERROR, "Fragments do not make up a whole frame.");
+            result = SECIL_ERROR_DECODE_FAILED;
+        }
+    }
+#endif
+
+    if (secil_state.receive.expired)
+    {
+        // The transport is fine, the deadline of secil_receive_until() just came first
+        secil_state.receive.expired = false;
+        result = SECIL_ERROR_DEADLINE_EXPIRED;
+    }
+    if (secil_state.receive.abandoned)
+    {
+        // The frame stopped arriving part way, which is a corrupt frame rather than a failed transport
+        secil_state.receive.abandoned = false;
+        result = SECIL_ERROR_DECODE_FAILED;
+    }
+
+    return result;
+}
+
+/// @brief Receive one frame and handle it here if it is meant for the library rather than the application.
+/// @param message The message to decode into.
+/// @param deliver Set to true if the message should be returned to the application.
+/// @return SECIL_OK if a frame was received, otherwise an error code.
+static secil_error_t secil_receive_and_handle(secil_message *message, bool *deliver)
+{
+    *deliver = false;
+
+#if SECIL_RELIABLE
+    if (!secil_reliable_take_held(message))
+    {
+        RETURN_IF_ERROR(secil_receive_frame(message), "Could not receive message");
+#if SECIL_HEARTBEAT
+        secil_heartbeat_on_receipt(message);
+#endif
+#if SECIL_TX_CREDITS
+        secil_flow_on_receipt(message);
+#endif
+
+        if (!secil_reliable_receive(message))
+        {
+            return SECIL_OK;
+        }
+    }
+#else
+    RETURN_IF_ERROR(secil_receive_frame(message), "Could not receive message");
+#if SECIL_HEARTBEAT
+    secil_heartbeat_on_receipt(message);
+#endif
+#if SECIL_TX_CREDITS
+    secil_flow_on_receipt(message);
+#endif
+#endif
+
+    // Responses complete a pending request instead of interrupting the application's stream of messages
+    if (message->has_response_to)
+    {
+        secil_handle_response(message);
+        return SECIL_OK;
+    }
+
+    // Some messages need to be handled internally, such as loopback test messages and handshake messages
+    switch (message->which_payload)
+    {
+#if defined(secil_message_loopbackTest_tag)
+    case secil_message_loopbackTest_tag:
+        // Echo the message back, as the response to the request if it is one. It is the library's own frame, so it
+        // is never rate limited.
+        message->has_response_to = message->has_request_id;
+        message->response_to = message->request_id;
+        message->has_request_id = false;
+        if (secil_send_admitted(message) != SECIL_OK)
+        {
+            // The test message itself was received, so the rest of the stream is still good
+            secil_log(secil_LOG_WARNING, "Failed to send loopback test message.");
+        }
+        break;
+#endif
+
+#if SECIL_QUERIES
+    case secil_message_query_tag:
+        if (secil_answer_query(message) != SECIL_OK)
+        {
+            // The remote end's request times out, and the query itself was received fine
+            secil_log(secil_LOG_WARNING, "Failed to answer query.");
+        }
+        break;
+#endif
+
+#if SECIL_RESYNC
+    case secil_message_stateDigest_tag:
+        secil_resync(&message->payload.stateDigest, message);
+        break;
+#endif
+
+#if defined(secil_message_subscribe_tag)
+    case secil_message_subscribe_tag:
+        secil_state.remote_subscriptions = message->payload.subscribe.tags;
+        break;
+#endif
+
+#if SECIL_BULK
+    case secil_message_bulk_tag:
+        RETURN_IF_ERROR(secil_handle_bulk(&message->payload.bulk), "Failed to handle bulk transfer.");
+        break;
+#endif
+
+#if SECIL_BAUD_SWITCH
+    case secil_message_baudSwitch_tag:
+        RETURN_IF_ERROR(secil_handle_baud_switch(&message->payload.baudSwitch), "Failed to handle switch of UART rate.");
+        break;
+#endif
+
+#if SECIL_HEARTBEAT
+    case secil_message_heartbeat_tag:
+        RETURN_IF_ERROR(secil_handle_heartbeat(&message->payload.heartbeat), "Failed to answer heartbeat.");
+        break;
+#endif
+
+    case secil_message_handshake_tag:
+        RETURN_IF_ERROR(secil_handle_handshake(message), "Failed to handle handshake.");
+        break;
+
+    case 0:
+        // Only an acknowledgement or credit, already taken
+        break;
+
+    default:
+        // Normal message, return it to the caller
+        *deliver = true;
+#if SECIL_DICTIONARY
+        secil_dictionary_expand(message);
+#endif
+#if SECIL_RESYNC
+        secil_note_received(message);
+#endif
+        break;
+    }
+
+    return SECIL_OK;
+}
+
+/// @brief Give the remote end any credit it is due and write the frames queued while receiving (such as acknowledgements).
+static void secil_receive_settle()
+{
+#if SECIL_FLOW_CONTROL
+    secil_flow_update(false); // Now that frames have been read, the remote end may be due more credit
+#endif
+    secil_tx_flush(); // A write error has been logged, and the frames received are still good
+}
+
+/// @brief Receive one frame and handle it, then write any frames queued while handling it (such as acknowledgements).
+/// @param message The message to decode into.
+/// @param deliver Set to true if the message should be returned to the application.
+/// @return SECIL_OK if a frame was received, otherwise an error code.
+static secil_error_t secil_receive_one(secil_message *message, bool *deliver)
+{
+    secil_error_t result = secil_receive_and_handle(message, deliver);
+    secil_receive_settle();
+    return result;
+}
+
+#if defined(secil_message_loopbackTest_tag)
+/// @brief Keep an application message that arrived while secil_loopback_test() waited, for the next receive.
+/// @param message The message to keep.
+/// @return true if it was kept, false if the hold is full.
+static bool secil_hold_message(const secil_message *message)
+{
+    bool held = secil_state.held.count < SECIL_LOOPBACK_HOLD;
+    if (held)
+    {
+        secil_state.held.messages[(secil_state.held.head + secil_state.held.count) % SECIL_LOOPBACK_HOLD] = *message;
+        secil_state.held.count++;
+    }
+
+    return held;
+}
+
+/// @brief Take the oldest message kept by secil_hold_message(), if there is one.
+/// @param message Receives the message.
+/// @return true if a message was taken.
+static bool secil_take_held_message(secil_message *message)
+{
+    bool taken = secil_state.held.count > 0;
+    if (taken)
+    {
+        *message = secil_state.held.messages[secil_state.held.head];
+        secil_state.held.head = (uint8_t)((secil_state.held.head + 1) % SECIL_LOOPBACK_HOLD);
+        secil_state.held.count--;
+    }
+
+    return taken;
+}
+#endif
+
+/// @brief Receive frames until one holds a message for the application.
+/// @param message The message to decode into.
+/// @param settle True to give credit and write queued frames after every frame, false to leave that to the caller.
+/// @return SECIL_OK if an application message was received, otherwise an error code.
+static secil_error_t secil_receive_next(secil_message *message, bool settle)
+{
+#if defined(secil_message_loopbackTest_tag)
+    if (secil_take_held_message(message))
+    {
+        return SECIL_OK;
+    }
+#endif
+
+    bool deliver = false;
+    while (!deliver)
+    {
+        RETURN_IF_ERROR(settle ? secil_receive_one(message, &deliver) : secil_receive_and_handle(message, &deliver), NULL);
+    }
+    return SECIL_OK;
+}
+
+secil_error_t secil_receive(secil_message *message)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+    if (!message)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot receive - message buffer is NULL.");
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
+
+    return secil_receive_next(message, true);
+}
+
+secil_error_t secil_receive_until(secil_message *message, uint32_t deadline)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+    if (!message)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot receive - message buffer is NULL.");
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
+
+    if (!secil_state.clock_callback)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot receive until a deadline - no clock callback.");
+        return SECIL_ERROR_INVALID_STATE;
+    }
+
+    secil_state.receive.has_deadline = true;
+    secil_state.receive.deadline = deadline;
+    secil_error_t result;
+    do
+    {
+        // A corrupt frame has been logged - look for the next one, until the deadline
+        result = secil_receive_next(message, true);
+    } while (result == SECIL_ERROR_DECODE_FAILED || result == SECIL_ERROR_MESSAGE_TOO_LARGE);
+    secil_state.receive.has_deadline = false;
+
+    return result;
+}
+
+secil_error_t secil_set_available_callback(secil_available_fn available_callback)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+    secil_state.available_callback = available_callback;
+    return SECIL_OK;
+}
+
+secil_error_t secil_set_read_within_callback(secil_read_within_fn read_within_callback)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+    secil_state.read_within_callback = read_within_callback;
+    return SECIL_OK;
+}
+
+secil_error_t secil_set_inter_byte_timeout(uint16_t char_times, uint32_t baud, uint16_t min_ms)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+    if (char_times > 0 && baud == 0)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot set the inter-byte timeout - the rate of the UART is 0.");
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
+
+    if (char_times > 0 && !secil_state.read_within_callback)
+    {
+        secil_log(secil_LOG_WARNING, "The inter-byte timeout needs the read within callback - gaps are not timed without it.");
+    }
+
+    secil_lock();
+    secil_state.receive.gap_chars = char_times;
+    secil_state.receive.gap_min_ms = min_ms;
+    secil_update_gap(baud);
+    secil_unlock();
+    return SECIL_OK;
+}
+
+secil_error_t secil_set_clock_callback(secil_clock_fn clock_callback)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+    secil_state.clock_callback = clock_callback;
+    return SECIL_OK;
+}
+
+secil_error_t secil_set_sleep_callback(secil_sleep_fn sleep_callback)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+    secil_state.sleep_callback = sleep_callback;
+    return SECIL_OK;
+}
+
+secil_error_t secil_set_lock_callbacks(secil_lock_fn lock, secil_lock_fn unlock)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+    if (!lock != !unlock)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot set lock callbacks - both lock and unlock are required.");
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
+
+    secil_state.lock_callback = lock;
+    secil_state.unlock_callback = unlock;
+    return SECIL_OK;
+}
+
+secil_error_t secil_set_reliable_window(uint8_t window)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+#if SECIL_RELIABLE
+    if (window > SECIL_RELIABLE_WINDOW)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot set reliable window - at most %u frames are supported.", (unsigned)SECIL_RELIABLE_WINDOW);
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
+
+    secil_state.reliable.local_window = window;
+    return SECIL_OK;
+#else
+    if (window > 0)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot set reliable window - this build does not support the reliable channel.");
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
+    return SECIL_OK;
+#endif
+}
+
+secil_error_t secil_get_reliable_stats(secil_reliable_stats_t *stats)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+    if (!stats)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot get reliable stats - stats is NULL.");
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
+
+#if SECIL_RELIABLE
+    secil_lock();
+    *stats = secil_state.reliable.stats;
+    stats->in_flight = (uint32_t)secil_seq_distance(secil_state.reliable.tx_base, secil_state.reliable.tx_next);
+    secil_unlock();
+#else
+    memset(stats, 0, sizeof(*stats));
+#endif
+    return SECIL_OK;
+}
+
+secil_error_t secil_get_tx_stats(secil_tx_class_t tx_class, secil_tx_class_stats_t *stats)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+    if (!stats || tx_class >= SECIL_TX_CLASSES)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot get send queue stats - stats is NULL or the class is unknown.");
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
+
+#if SECIL_TX_QUEUES
+    secil_lock();
+    *stats = secil_state.tx.queues[tx_class].stats;
+    secil_unlock();
+#else
+    memset(stats, 0, sizeof(*stats));
+#endif
+    return SECIL_OK;
+}
+
+secil_error_t secil_set_rx_buffer(uint16_t size)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+#if SECIL_FLOW_CONTROL
+    if (size > 0 && size <= CREDIT_RESERVE)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot set receive buffer - it must be larger than %u bytes.", (unsigned)CREDIT_RESERVE);
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
+
+    secil_lock();
+    secil_state.flow.rx_buffer = size;
+    secil_unlock();
+    return SECIL_OK;
+#else
+    if (size > 0)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot set receive buffer - this build does not support flow control.");
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
+    return SECIL_OK;
+#endif
+}
+
+secil_error_t secil_get_flow_stats(secil_flow_stats_t *stats)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+    if (!stats)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot get flow control stats - stats is NULL.");
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
+
+#if SECIL_FLOW_CONTROL
+    secil_lock();
+    *stats = secil_state.flow.stats;
+#if SECIL_TX_CREDITS
+    int32_t credit = (int32_t)(secil_state.flow.limit - secil_state.flow.sent);
+    stats->remote_window = secil_state.flow.remote_window;
+    stats->credit = secil_state.flow.remote_window > 0 && credit > 0 ? (uint32_t)credit : 0;
+    if (secil_state.flow.stalled)
+    {
+        stats->stalled_ms += secil_now() - secil_state.flow.stalled_at;
+    }
+#endif
+    secil_unlock();
+#else
+    memset(stats, 0, sizeof(*stats));
+#endif
+    return SECIL_OK;
+}
+
+secil_error_t secil_set_rate_limit(secil_tx_class_t tx_class, uint32_t bytes_per_second, uint16_t burst,
+                                   secil_rate_overflow_t overflow)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+    if (tx_class >= SECIL_TX_CLASSES || overflow > SECIL_RATE_BLOCK || (bytes_per_second > 0 && burst == 0))
+    {
+        secil_log(secil_LOG_ERROR, "Cannot set rate limit - the class or overflow is unknown, or the burst is 0.");
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
+
+#if SECIL_RATE_LIMITS
+    if (bytes_per_second > 0 && !secil_state.clock_callback)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot set rate limit - no clock callback.");
+        return SECIL_ERROR_INVALID_STATE;
+    }
+
+    if (bytes_per_second > 0 && overflow == SECIL_RATE_BLOCK && !secil_state.sleep_callback)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot set rate limit - waiting for room needs the sleep callback.");
+        return SECIL_ERROR_INVALID_STATE;
+    }
+
+    // The bucket starts full, and any values held back go out from the next secil_poll() as the new limit allows
+    secil_lock();
+    secil_state.rate[tx_class].rate = bytes_per_second;
+    secil_state.rate[tx_class].burst = burst;
+    secil_state.rate[tx_class].overflow = overflow;
+    secil_state.rate[tx_class].tokens = (uint32_t)burst * 1000;
+    secil_state.rate[tx_class].filled_at = secil_now();
+    secil_unlock();
+    return SECIL_OK;
+#else
+    if (bytes_per_second > 0)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot set rate limit - this build does not support rate limits.");
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
+    return SECIL_OK;
+#endif
+}
+
+secil_error_t secil_get_rate_stats(secil_tx_class_t tx_class, secil_rate_stats_t *stats)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+    if (!stats || tx_class >= SECIL_TX_CLASSES)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot get rate limit stats - stats is NULL or the class is unknown.");
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
+
+#if SECIL_RATE_LIMITS
+    secil_lock();
+    *stats = secil_state.rate[tx_class].stats;
+    secil_unlock();
+#else
+    memset(stats, 0, sizeof(*stats));
+#endif
+    return SECIL_OK;
+}
+
+secil_error_t secil_set_heartbeat(uint16_t interval_ms, uint8_t missed_limit, secil_link_down_fn on_link_down)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+#if SECIL_HEARTBEAT
+    if ((interval_ms > 0 || missed_limit > 0) && !secil_state.clock_callback)
+    {
+        secil_log(secil_LOG_WARNING, "Heartbeats need the clock callback - none are sent and the link is not watched without it.");
+    }
+
+    secil_lock();
+    secil_state.heartbeat.interval = interval_ms;
+    secil_state.heartbeat.missed_limit = missed_limit;
+    secil_state.heartbeat.on_link_down = on_link_down;
+    secil_state.heartbeat.tx_at = secil_now();
+    secil_unlock();
+    return SECIL_OK;
+#else
+    (void)missed_limit;
+    (void)on_link_down;
+    if (interval_ms > 0)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot set heartbeat - the heartbeat message is excluded from this build.");
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
+    return SECIL_OK;
+#endif
+}
+
+secil_error_t secil_get_link_stats(secil_link_stats_t *stats)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+    if (!stats)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot get link stats - stats is NULL.");
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
+
+#if SECIL_HEARTBEAT
+    secil_lock();
+    *stats = secil_state.heartbeat.stats;
+    stats->up = !secil_state.heartbeat.down;
+    stats->rtt_ms = (secil_state.heartbeat.srtt + 4) / 8;
+    stats->jitter_ms = (secil_state.heartbeat.rttvar + 2) / 4;
+    stats->loss_permille = (uint16_t)(secil_state.heartbeat.loss / 16);
+    stats->silent_ms = secil_state.connection.state == SECIL_CONNECTED && secil_state.clock_callback ? secil_now() - secil_state.heartbeat.rx_at : 0;
+
+    // The share of heartbeats that arrive, scaled down as jitter grows against the round trip time. Both times are in
+    // eighths of a ms, and a ms of clock resolution is added so that a link too fast to measure is not marked down.
+    uint32_t quality = 1000u - stats->loss_permille;
+    if (secil_state.heartbeat.measured)
+    {
+        quality = quality * (secil_state.heartbeat.srtt + 8) / (secil_state.heartbeat.srtt + 8 + 2 * secil_state.heartbeat.rttvar);
+    }
+    stats->quality = secil_state.heartbeat.down ? 0 : (uint8_t)((quality + 5) / 10);
+    secil_unlock();
+#else
+    memset(stats, 0, sizeof(*stats));
+#endif
+    return SECIL_OK;
+}
+
+secil_error_t secil_set_clock_sync(uint16_t interval_ms, bool timestamps)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+#if SECIL_HEARTBEAT
+    if ((interval_ms > 0 || timestamps) && !secil_state.clock_callback)
+    {
+        secil_log(secil_LOG_WARNING, "Clock sync needs the clock callback - nothing is measured or timestamped without it.");
+    }
+
+    secil_lock();
+    secil_state.clock.interval = interval_ms;
+    secil_state.clock.timestamps = timestamps;
+    secil_state.clock.asked_at = secil_now();
+    secil_unlock();
+    return SECIL_OK;
+#else
+    if (interval_ms > 0 || timestamps)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot set clock sync - the heartbeat message is excluded from this build.");
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
+    return SECIL_OK;
+#endif
+}
+
+secil_error_t secil_get_clock_stats(secil_clock_stats_t *stats)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+    if (!stats)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot get clock stats - stats is NULL.");
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+#if SECIL_HEARTBEAT
+    secil_lock();
+    stats->synced = secil_state.clock.count > 0;
+    if (stats->synced)
+    {
+        stats->offset_ms = secil_clock_thousandths(secil_clock_offset_at(secil_now()));
+        stats->delay_ms = secil_state.clock.best.delay;
+    }
+    stats->drift_ppm = secil_clock_thousandths(secil_state.clock.drift_ppb);
+    stats->samples = secil_state.clock.measured;
+    secil_unlock();
+#endif
+    return SECIL_OK;
+}
+
+secil_error_t secil_map_remote_time(uint32_t remote_ms, uint32_t *local_ms)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+    if (!local_ms)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot map remote time - local_ms is NULL.");
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
+
+#if SECIL_HEARTBEAT
+    secil_lock();
+    bool synced = secil_state.clock.count > 0;
+    if (synced)
+    {
+        // The offset changes so slowly that it makes no odds whether it is taken at the remote time or ours
+        *local_ms = remote_ms - (uint32_t)secil_clock_thousandths(secil_clock_offset_at(secil_now()));
+    }
+    secil_unlock();
+    return synced ? SECIL_OK : SECIL_ERROR_INVALID_STATE;
+#else
+    (void)remote_ms;
+    return SECIL_ERROR_INVALID_STATE;
+#endif
+}
+
+secil_error_t secil_get_message_time(const secil_message *message, secil_message_time_t *time)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+    if (!message || !time)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot get message time - message or time is NULL.");
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
+
+#if SECIL_HEARTBEAT
+    if (!message->has_sent_at || !message->has_received_at)
+    {
+        return SECIL_ERROR_INVALID_STATE;
+    }
+
+    secil_lock();
+    bool synced = secil_state.clock.count > 0;
+    if (synced)
+    {
+        time->received_at = message->received_at;
+        time->sent_at = message->sent_at - (uint32_t)secil_clock_thousandths(secil_clock_offset_at(message->received_at));
+        time->latency_ms = (int32_t)(time->received_at - time->sent_at);
+    }
+    secil_unlock();
+    return synced ? SECIL_OK : SECIL_ERROR_INVALID_STATE;
+#else
+    return SECIL_ERROR_INVALID_STATE;
+#endif
+}
+
+/// @brief Send a handshake that asks for a reply, and work out when to send it again if none arrives.
+static secil_error_t secil_send_connect_handshake()
+{
+    secil_lock();
+    secil_state.connection.retry_at = secil_now() + secil_state.connection.retry_interval;
+    secil_state.connection.stats.handshakes_sent++;
+    secil_unlock();
+
+    return secil_send_startup_message(secil_state.mode, true, false);
+}
+
+/// @brief Send the handshake again if the remote end has not answered in time, backing off after each attempt.
+static secil_error_t secil_connection_poll()
+{
+    if (!secil_state.clock_callback)
+    {
+        return SECIL_OK;
+    }
+
+    secil_lock();
+    bool retry = secil_state.connection.state == SECIL_CONNECTING && (int32_t)(secil_now() - secil_state.connection.retry_at) >= 0;
+    if (retry)
+    {
+        secil_state.connection.retry_interval *= 2;
+        if (secil_state.connection.retry_interval > SECIL_HANDSHAKE_RETRY_MAX_MS)
+        {
+            secil_state.connection.retry_interval = SECIL_HANDSHAKE_RETRY_MAX_MS;
+        }
+    }
+    secil_unlock();
+
+    return retry ? secil_send_connect_handshake() : SECIL_OK;
+}
+
+secil_error_t secil_poll(void)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+    secil_error_t result = SECIL_OK;
+#if SECIL_RELIABLE
+    secil_lock();
+    result = secil_reliable_poll();
+    secil_unlock();
+#endif
+
+    secil_expire_requests();
+
+#if SECIL_BAUD_SWITCH
+    secil_error_t baud_result = secil_baud_poll();
+    result = result != SECIL_OK ? result : baud_result;
+#endif
+
+#if SECIL_BULK
+    secil_error_t bulk_result = secil_bulk_poll();
+    result = result != SECIL_OK ? result : bulk_result;
+#endif
+
+    secil_error_t connection_result = secil_connection_poll();
+    result = result != SECIL_OK ? result : connection_result;
+
+#if SECIL_HEARTBEAT
+    secil_error_t heartbeat_result = secil_heartbeat_poll();
+    result = result != SECIL_OK ? result : heartbeat_result;
+#endif
+
+#if SECIL_RATE_LIMITS
+    secil_error_t rate_result = secil_rate_poll();
+    result = result != SECIL_OK ? result : rate_result;
+#endif
+
+#if SECIL_FLOW_CONTROL
+    secil_error_t flow_result = secil_flow_update(true);
+    result = result != SECIL_OK ? result : flow_result;
+#endif
+
+    secil_error_t flush_result = secil_tx_flush();
+    return result != SECIL_OK ? result : flush_result;
+}
+
+/// @brief Receive a batch of messages, stopping when the transport holds no more complete frames.
+/// @note Credit and queued frames go out once for the frames after the first rather than after each of them.
+/// @param messages Storage for the batch, or a single scratch message when on_message is given.
+/// @param max_messages The maximum number of messages to receive.
+/// @param on_message Optional callback that is given each message as a view.
+/// @param context Pointer passed to on_message.
+/// @param count Receives the number of messages delivered.
+/// @return SECIL_OK if at least one message was delivered, otherwise the error for the first message.
+static secil_error_t secil_receive_batch(secil_message *messages, size_t max_messages,
+                                         secil_message_view_fn on_message, void *context, size_t *count)
+{
+    secil_error_t result = SECIL_OK;
+    bool deferred = false;
+    *count = 0;
+
+    while (*count < max_messages)
+    {
+        // The first message blocks like secil_receive(), and answers what it reads on the way as that does, so the
+        // remote end is never left waiting on a frame held back here. The rest are read against a deadline that has
+        // already passed, so only bytes that are already buffered are read, and a frame that has only partly arrived
+        // is kept for the next receive rather than waited for.
+        if (*count > 0 && !secil_state.receive.has_deadline)
+        {
+            secil_state.receive.has_deadline = true;
+            secil_state.receive.deadline = secil_now();
+        }
+
+        secil_message *message = on_message ? messages : &messages[*count];
+        deferred |= *count > 0;
+        result = secil_receive_next(message, *count == 0);
+        if (result != SECIL_OK)
+        {
+            if (*count == 0 || result == SECIL_ERROR_READ_TIMEOUT || result == SECIL_ERROR_DEADLINE_EXPIRED)
+            {
+                break;
+            }
+
+            // A corrupt frame part way through a batch has already been logged, resynchronise and keep draining
+            continue;
+        }
+
+        if (on_message)
+        {
+            on_message(context, message);
+        }
+        (*count)++;
+    }
+    secil_state.receive.has_deadline = false;
+
+    if (deferred)
+    {
+        secil_receive_settle();
+    }
+
+    return *count > 0 ? SECIL_OK : result;
+}
+
+secil_error_t secil_receive_many(secil_message *messages, size_t max_messages, size_t *count)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+    if (!messages || !count || max_messages == 0)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot receive many - Invalid parameters.");
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
+
+    return secil_receive_batch(messages, max_messages, NULL, NULL, count);
+}
+
+secil_error_t secil_receive_many_view(secil_message_view_fn on_message, void *context, size_t max_messages, size_t *count)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+    if (!on_message || !count || max_messages == 0)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot receive many - Invalid parameters.");
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
+
+    secil_message message;
+    return secil_receive_batch(&message, max_messages, on_message, context, count);
+}
+
+
+/// @brief Choose the layout of the frame for a message.
+/// @note Compact frames only hold up to COMPACT_MAX_BODY bytes, so longer messages still go out as v1.
+const secil_frame_format_t *secil_tx_format(const secil_message *message)
+{
+    // Handshakes always go out as v1, as the remote end may have restarted with firmware that only reads v1
+    if (   (secil_state.agreed_capabilities & SECIL_CAPABILITY_COMPACT_FRAMES)
+        && message->which_payload != secil_message_handshake_tag)
+    {
+        return &secil_frame_compact;
+    }
+    return &secil_frame_v1;
+}
+
+/// @brief Check that an encoded message fits in a frame, at both ends of the link.
+/// @param format The layout of the frame it goes out in.
+/// @param message_size The size of the encoded message body (including the length prefix of a v1 frame).
+static secil_error_t secil_check_frame_size(const secil_frame_format_t *format, size_t message_size)
+{
+    if (message_size > secil_message_size)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot send message - encoded message too large.");
+        return SECIL_ERROR_MESSAGE_TOO_LARGE;
+    }
+
+    // The remote end may have been built with shorter strings, so it tells us the largest v1 frame it takes. It reads a
+    // body of the same size in any layout, so the largest frame of this layout has its own header and footer instead.
+    int32_t frame_size = (int32_t)(format->header_size + message_size + format->footer_size);
+    int32_t max_frame_size = (int32_t)secil_state.remote_max_frame_size - HEADER_SIZE - FOOTER_SIZE + format->header_size + format->footer_size;
+    if (secil_state.remote_max_frame_size != 0 && frame_size > max_frame_size)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot send message - too large for the remote end.");
+        return SECIL_ERROR_MESSAGE_TOO_LARGE;
+    }
+
+    return SECIL_OK;
+}
+
+static void secil_write_header(const secil_frame_format_t *format, uint16_t msglen)
+{
+    // Write the header, which is two "magic" bytes, followed by the message length
+    uint8_t *header = secil_state.outgoingMessage;
+    header[0] = 0xCA;
+    if (format != &secil_frame_v1)
+    {
+        // One length byte
+        header[1] = format == &secil_frame_compact ? 0xF2 : 0xF3;
+        header[2] = (uint8_t)msglen;
+        return;
+    }
+
+    // Two length bytes (little-endian)
+    header[1] = 0xFE;
+    header[2] = (uint8_t)(msglen & 0xFF);
+    header[3] = (uint8_t)((msglen >> 8) & 0xFF);
+}
+
+#if SECIL_TX_QUEUES || SECIL_RATE_LIMITS
+
+/// @brief Choose the priority class of an outgoing frame.
+secil_tx_class_t secil_tx_class(const secil_message *message)
+{
+    switch (message->which_payload)
+    {
+    case 0: // Only an acknowledgement
+    case secil_message_handshake_tag:
+#if defined(secil_message_warning_tag)
+    case secil_message_warning_tag:
+#endif
+#if defined(secil_message_factoryReset_tag)
+    case secil_message_factoryReset_tag:
+#endif
+#if defined(secil_message_subscribe_tag)
+    case secil_message_subscribe_tag:
+#endif
+#if SECIL_BAUD_SWITCH
+    case secil_message_baudSwitch_tag:
+#endif
+#if SECIL_HEARTBEAT
+    case secil_message_heartbeat_tag:
+#endif
+        return SECIL_TX_CONTROL;
+
+#if SECIL_BULK
+    case secil_message_bulk_tag:
+        // The steps that open, acknowledge and close a transfer are small and keep the data flowing
+        return message->payload.bulk.step == secil_bulk_step_t_BULK_DATA ? SECIL_TX_BULK : SECIL_TX_CONTROL;
+#endif
+#if defined(secil_message_supportPackageData_tag)
+    case secil_message_supportPackageData_tag:
+#endif
+#if defined(secil_message_loopbackTest_tag)
+    case secil_message_loopbackTest_tag:
+#endif
+#if SECIL_QUERIES
+    case secil_message_queryReply_tag:
+#endif
+        return SECIL_TX_BULK;
+
+    default:
+        return SECIL_TX_STATE;
+    }
+}
+
+#endif
+
+#if !SECIL_TX_QUEUES
+
+/// @brief Without the scheduler every frame is written as it is sent, so there is never anything to flush.
+secil_error_t secil_tx_flush()
+{
+    return SECIL_OK;
+}
+
+#endif // SECIL_TX_QUEUES
+
+#if SECIL_STREAMING_TX
+
+/// @brief Progress of a frame that is being streamed to the transport one chunk at a time.
+typedef struct
+{
+    uint16_t crc;       // Running CRC of all bytes handed to the transport so far
+    size_t used;        // Number of bytes waiting in the outgoing chunk buffer
+    bool write_failed;  // True if the transport failed part way through the frame
+} secil_tx_stream_t;
+
+/// @brief Write the bytes waiting in the outgoing chunk buffer to the transport.
+static bool secil_flush_chunk(secil_tx_stream_t *tx)
+{
+    if (tx->used == 0)
+    {
+        return true;
+    }
+
+    tx->crc = crc16arc_bit(tx->crc, secil_state.outgoingMessage, tx->used);
+    if (!secil_write(secil_state.outgoingMessage, tx->used))
+    {
+        tx->write_failed = true;
+        return false;
+    }
+
+    tx->used = 0;
+    return true;
+}
+
+/// @brief Stream callback that collects encoded bytes into the chunk buffer and writes each full chunk.
+static bool secil_streaming_write(pb_ostream_t *stream, const pb_byte_t *buf, size_t count)
+{
+    secil_tx_stream_t *tx = (secil_tx_stream_t *)stream->state;
+
+    while (count > 0)
+    {
+        size_t space = sizeof(secil_state.outgoingMessage) - tx->used;
+        size_t chunk = count < space ? count : space;
+
+        memcpy(secil_state.outgoingMessage + tx->used, buf, chunk);
+        tx->used += chunk;
+        buf += chunk;
+        count -= chunk;
+
+        if (tx->used == sizeof(secil_state.outgoingMessage) && !secil_flush_chunk(tx))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/// @brief Send a secil message
+/// @param message The message to send
+/// @note The frame layouts are identical to the buffered version of this function.
+///       The message is sized up front so that the header can be written immediately,
+///       then the message is encoded straight into the transport in chunks while the CRC is accumulated.
+/// @return SECIL_OK if the message was sent successfully, otherwise an error code.
+secil_error_t secil_send(const secil_message *message)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+    
+    if (!message)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot send message - message is NULL.");
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
+
+    // Size the message, including any varint length prefix, so that the header can go out first
+    size_t message_size;
+    if (!pb_get_encoded_size(&message_size, secil_message_fields, message))
+    {
+        return SECIL_ERROR_ENCODE_FAILED;
+    }
+
+    const secil_frame_format_t *format = secil_tx_format(message);
+    if (message_size > COMPACT_MAX_BODY)
+    {
+        format = &secil_frame_v1;
+    }
+
+    size_t encoded_message_size = message_size;
+    if (format->delimited)
+    {
+        pb_ostream_t sizing_stream = PB_OSTREAM_SIZING;
+        pb_encode_varint(&sizing_stream, message_size);
+        encoded_message_size += sizing_stream.bytes_written;
+    }
+
+    RETURN_IF_ERROR(secil_check_frame_size(format, encoded_message_size), NULL);
+
+    secil_write_header(format, (uint16_t)encoded_message_size);
+
+    secil_tx_stream_t tx = { .crc = 0, .used = format->header_size, .write_failed = false };
+    pb_ostream_t stream = {
+        .callback = secil_streaming_write,
+        .state = &tx,
+        .max_size = encoded_message_size
+    };
+
+    if (   (format->delimited && !pb_encode_varint(&stream, message_size))
+        || !pb_encode(&stream, secil_message_fields, message)
+        || !secil_flush_chunk(&tx))
+    {
+        if (tx.write_failed)
+        {
+            secil_log(secil_LOG_ERROR, "Failed to write message.");
+            return SECIL_ERROR_WRITE_FAILED;
+        }
+        return SECIL_ERROR_ENCODE_FAILED;
+    }
+
+    // Finally write the footer (CRC + magic bytes of a v1 frame)
+    uint8_t *footer = secil_state.outgoingMessage;
+    footer[0] = (uint8_t)(tx.crc & 0xFF);
+    footer[1] = (uint8_t)((tx.crc >> 8) & 0xFF);
+    footer[2] = 0xFA;
+    footer[3] = 0xDE;
+
+    if (!secil_write(footer, format->footer_size))
+    {
+        secil_log(secil_LOG_ERROR, "Failed to write message.");
+        return SECIL_ERROR_WRITE_FAILED;
+    }
+
+    return SECIL_OK;
+}
+
+#else
+
+/// @brief Creates an pb output stream from the given secil_state.
+/// @return An instance of a pb_ostream_t structure.
+static pb_ostream_t secil_create_ostream(const secil_frame_format_t *format)
+{
+    return pb_ostream_from_buffer(secil_state.outgoingMessage + format->header_size, sizeof(secil_state.outgoingMessage) - HEADER_SIZE - FOOTER_SIZE); // Leave space for header and footer
+}
+
+/// @brief Encode a message into the outgoing message buffer, after the header.
+static secil_error_t secil_encode_body(const secil_message *message, const secil_frame_format_t *format, uint16_t *msglen)
+{
+    pb_ostream_t stream = secil_create_ostream(format);
+
+    if (!pb_encode_ex(&stream, secil_message_fields, message, format->delimited ? PB_ENCODE_DELIMITED : 0))
+    {
+        return SECIL_ERROR_ENCODE_FAILED;
+    }
+
+    *msglen = (uint16_t)stream.bytes_written;
+    return SECIL_OK;
+}
+
+#if SECIL_LZ
+/// @brief Compress the message body held in the outgoing message buffer after a v2 header, if that saves bytes.
+/// @param msglen The size of the body, updated to its compressed size.
+/// @return True if the body was compressed and should go out in a compressed frame.
+static bool secil_compress_body(uint16_t *msglen)
+{
+    const uint32_t both = SECIL_CAPABILITY_COMPACT_FRAMES | SECIL_CAPABILITY_COMPRESSION;
+    if ((secil_state.agreed_capabilities & both) != both || *msglen < SECIL_COMPRESSION_MIN_SIZE)
+    {
+        return false;
+    }
+
+    // Only worth it if the result is shorter, and it has to fit a v2 header
+    size_t limit = *msglen - 1u < sizeof(secil_state.lz.deflated) ? *msglen - 1u : sizeof(secil_state.lz.deflated);
+    size_t compressed_size;
+    uint8_t *body = secil_state.outgoingMessage + COMPACT_HEADER_SIZE;
+    if (!secil_lz_deflate(body, *msglen, secil_state.lz.deflated, limit, &compressed_size))
+    {
+        return false;
+    }
+
+    secil_state.lz.compressed_frames++;
+    secil_state.lz.bytes_before += *msglen;
+    secil_state.lz.bytes_after += (uint32_t)compressed_size;
+    memcpy(body, secil_state.lz.deflated, compressed_size);
+    *msglen = (uint16_t)compressed_size;
+    return true;
+}
+#endif
+
+static void secil_write_footer(const secil_frame_format_t *format, uint16_t msglen)
+{
+    // Calculate CRC of header + message
+    uint16_t crc = crc16arc_bit(0, secil_state.outgoingMessage, format->header_size + msglen);
+    uint8_t *footer = secil_state.outgoingMessage + format->header_size + msglen;
+    footer[0] = (uint8_t)(crc & 0xFF);
+    footer[1] = (uint8_t)((crc >> 8) & 0xFF);
+    // Footer magic bytes (0xFADE), which are not written out for compact frames
+    footer[2] = 0xFA;
+    footer[3] = 0xDE;
+}
+
+/// @brief Send a secil message
+/// @param message The message to send
+/// @note The message is sent with a header consisting of two magic bytes followed by the message length as two bytes (little-endian).
+///       The message itself is encoded using nanopb with a varint length prefix.
+///       A footer is then added consisting of a CRC16-ARC checksum of the header and message, and two more magic bytes.
+///       Once compact frames have been agreed, the length is one byte and both the prefix and the footer magic bytes are left out.
+/// @return SECIL_OK if the message was sent successfully, otherwise an error code.
+secil_error_t secil_send(const secil_message *message)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+    
+    if (!message)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot send message - message is NULL.");
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
+
+    const secil_frame_format_t *format = secil_tx_format(message);
+    uint16_t encoded_message_size;
+    RETURN_IF_ERROR(secil_encode_body(message, format, &encoded_message_size), NULL);
+
+#if SECIL_LZ
+    // The remote end has to take the message once it has been expanded again
+    if (format == &secil_frame_compact && secil_check_frame_size(format, encoded_message_size) == SECIL_OK && secil_compress_body(&encoded_message_size))
+    {
+        format = &secil_frame_compressed;
+    }
+#endif
+
+    if (format == &secil_frame_compact && encoded_message_size > COMPACT_MAX_BODY)
+    {
+        // Too long for a compact header, but the remote end reads v1 frames too
+        format = &secil_frame_v1;
+        RETURN_IF_ERROR(secil_encode_body(message, format, &encoded_message_size), NULL);
+    }
+
+    RETURN_IF_ERROR(secil_check_frame_size(format, encoded_message_size), NULL);
+
+    // Write the header to the outgoing message buffer
+    secil_write_header(format, encoded_message_size);
+
+    // Write the footer (CRC + magic bytes) to the end of the outgoing message buffer
+    secil_write_footer(format, encoded_message_size);
+
+#if SECIL_TX_QUEUES
+    size_t frame_size = format->header_size + encoded_message_size + format->footer_size;
+#if SECIL_TX_CREDITS
+    if (message->which_payload == 0 && frame_size <= CREDIT_FRAME_SIZE)
+    {
+        // Only credit (and an acknowledgement), which is never held back and supersedes any that has not gone out yet
+        memcpy(secil_state.tx.credit_frame, secil_state.outgoingMessage, frame_size);
+        secil_state.tx.credit_frame_size = (uint8_t)frame_size;
+        return SECIL_OK;
+    }
+#endif
+
+    // Queue the entire message (header + message + footer) behind the others of its class, secil_tx_flush() writes it
+    return secil_tx_enqueue(secil_tx_class(message), frame_size,
+                            message->which_payload == secil_message_handshake_tag ? TX_ENTRY_HANDSHAKE : 0);
+#else
+    // Finally, write the entire message (header + message + footer) to the stream
+    if (!secil_write(secil_state.outgoingMessage, format->header_size + encoded_message_size + format->footer_size))
+    {
+        secil_log(secil_LOG_ERROR, "Failed to write message.");
+        return SECIL_ERROR_WRITE_FAILED;
+    }
+
+    return SECIL_OK;
+#endif
+}
+
+#endif // SECIL_STREAMING_TX
+
+/// @brief Send a message while holding the lock shared with the receiving thread.
+secil_error_t secil_send_locked(const secil_message *message)
+{
+    secil_lock();
+    secil_error_t result = secil_send(message);
+    secil_unlock();
+
+    secil_error_t flush_result = secil_tx_flush();
+    return result != SECIL_OK ? result : flush_result;
+}
+
+/// @brief Send an application message that is within its rate limit, over the reliable channel when it is in use.
+secil_error_t secil_send_admitted(secil_message *message)
+{
+    secil_lock();
+#if SECIL_HEARTBEAT
+    secil_clock_stamp(message);
+#endif
+
+#if SECIL_RELIABLE
+    secil_error_t result = secil_state.reliable.window > 0 ? secil_reliable_send(message) : secil_send(message);
+#else
+    secil_error_t result = secil_send(message);
+#endif
+
+    secil_unlock();
+
+    secil_error_t flush_result = secil_tx_flush();
+    return result != SECIL_OK ? result : flush_result;
+}
+
+/// @brief Send an application message, within the rate limit of its class.
+static secil_error_t secil_send_app(secil_message *message)
+{
+#if SECIL_RATE_LIMITS
+    bool send;
+    secil_error_t result = secil_rate_admit(message, &send);
+    if (result != SECIL_OK || !send)
+    {
+        return result;
+    }
+#endif
+
+    return secil_send_admitted(message);
+}
+
+/// @brief Send a value from one of the secil_send_* functions, unless the remote end has not subscribed to it.
+static secil_error_t secil_send_value(secil_message *message)
+{
+#if SECIL_QUERIES && SECIL_QUERY_SHADOW
+    // Remember the value to answer queries with, even if it is not sent (anything that cannot be queried is ignored)
+    secil_lock();
+    secil_query_reply_put(&secil_state.shadow, message);
+    secil_unlock();
+#endif
+
+    if (!secil_remote_wants(message->which_payload))
+    {
+        return SECIL_OK;
+    }
+
+    return secil_send_app(message);
+}
+
+#define SECIL_SEND_MSG(MSG, FIELD, VALUE) \
+    secil_message message = { \
+        .which_payload = secil_message_##MSG##_tag, \
+        .payload = { .MSG = { .FIELD = VALUE } } \
+    }; \
+    return secil_send_value(&message)
+
+// Use this macro when the name of the message is equal to the one and only msg field it contains
+#define SECIL_SEND(FIELD, VALUE) SECIL_SEND_MSG(FIELD, FIELD, VALUE)
+
+#if defined(secil_message_currentTemperature_tag)
+secil_error_t secil_send_currentTemperature(int8_t currentTemperature)   { SECIL_SEND(currentTemperature, currentTemperature);   }
+#endif
+#if defined(secil_message_heatingSetpoint_tag)
+secil_error_t secil_send_heatingSetpoint(int8_t heatingSetpoint)         { SECIL_SEND(heatingSetpoint, heatingSetpoint);         }
+#endif
+#if defined(secil_message_awayHeatingSetpoint_tag)
+secil_error_t secil_send_awayHeatingSetpoint(int8_t awayHeatingSetpoint) { SECIL_SEND(awayHeatingSetpoint, awayHeatingSetpoint); }
+#endif
+#if defined(secil_message_coolingSetpoint_tag)
+secil_error_t secil_send_coolingSetpoint(int8_t coolingSetpoint)         { SECIL_SEND(coolingSetpoint, coolingSetpoint);         }
+#endif
+#if defined(secil_message_awayCoolingSetpoint_tag)
+secil_error_t secil_send_awayCoolingSetpoint(int8_t awayCoolingSetpoint) { SECIL_SEND(awayCoolingSetpoint, awayCoolingSetpoint); }
+#endif
+#if defined(secil_message_hvacMode_tag)
+secil_error_t secil_send_hvacMode(int8_t hvacMode)                       { SECIL_SEND(hvacMode, hvacMode);                       }
+#endif
+#if defined(secil_message_relativeHumidity_tag)
+secil_error_t secil_send_relativeHumidity(bool relativeHumidity)         { SECIL_SEND(relativeHumidity, relativeHumidity);       }
+#endif
+#if defined(secil_message_accessoryState_tag)
+secil_error_t secil_send_accessoryState(bool accessoryState)             { SECIL_SEND(accessoryState, accessoryState);           }
+#endif
+#if defined(secil_message_demandResponse_tag)
+secil_error_t secil_send_demandResponse(bool demandResponse)             { SECIL_SEND(demandResponse, demandResponse);           }
+#endif
+#if defined(secil_message_awayMode_tag)
+secil_error_t secil_send_awayMode(bool awayMode)                         { SECIL_SEND(awayMode, awayMode);                       }
+#endif
+#if defined(secil_message_autoWake_tag)
+secil_error_t secil_send_autoWake(bool autoWake)                         { SECIL_SEND(autoWake, autoWake);                       }
+#endif
+#if defined(secil_message_localUiState_tag)
+secil_error_t secil_send_localUiState(int8_t localUiState)               { SECIL_SEND(localUiState, localUiState);               }
+#endif
+#if defined(secil_message_dateAndTime_tag)
+secil_error_t secil_send_dateTime(uint64_t dateTime)                     { SECIL_SEND(dateAndTime, dateTime);                    }
+#endif
+#if defined(secil_message_pairingState_tag)
+secil_error_t secil_send_pairingState(secil_pairing_state_t state)       { SECIL_SEND_MSG(pairingState, state, state);           }
+#endif
+#if defined(secil_message_wifiStatus_tag)
+secil_error_t secil_send_wifiStatus(secil_system_status_t status)        { SECIL_SEND_MSG(wifiStatus, state, status);           }
+#endif
+#if defined(secil_message_matterStatus_tag)
+secil_error_t secil_send_matterStatus(secil_system_status_t status)      { SECIL_SEND_MSG(matterStatus, state, status);         }
+#endif
+#if defined(secil_message_factoryReset_tag)
+secil_error_t secil_send_factoryReset(secil_reset_state_t state)         { SECIL_SEND_MSG(factoryReset, state, state);         }
+#endif
+
+#if defined(secil_message_otaStatus_tag)
+secil_error_t secil_send_otaStatus(secil_ota_state_t state, uint8_t progress, const char *version) 
+{
+    if (!version)
+    {
+        version = "";
+    }
+    if (progress > 100)
+    {
+        progress = 100;
+    }
+
+    secil_message message = {
+        .which_payload = secil_message_otaStatus_tag,
+        .payload = { .otaStatus = { 
+            .state = state,
+            .progress = progress
+        } }
+    };
+
+    strncpy(message.payload.otaStatus.version, version, sizeof(message.payload.otaStatus.version) - 1);
+
+    return secil_send_value(&message);
+}
+#endif
+
+#if defined(secil_message_warning_tag)
+secil_error_t secil_send_warning(secil_warning_type_t type, const char *message) 
+{
+    if (!message)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot send warning - message is NULL.");
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
+
+    secil_message msg = {
+        .which_payload = secil_message_warning_tag,
+        .payload = { .warning = { .type = type } }
+    };
+
+    // Known texts go out as their index, leaving the text itself empty
+    int32_t id = secil_dictionary_find(message);
+    if (id >= 0 && secil_state.dictionary.in_use)
+    {
+        msg.payload.warning.has_message_id = true;
+        msg.payload.warning.message_id = (uint16_t)id;
+        return secil_send_value(&msg);
+    }
+
+    strncpy(msg.payload.warning.message, message, sizeof(msg.payload.warning.message) - 1);
+    return secil_send_value(&msg);
+}
+
+secil_error_t secil_send_warning_id(secil_warning_type_t type, uint16_t id, const int32_t *args, size_t arg_count)
+{
+    secil_message msg = {
+        .which_payload = secil_message_warning_tag,
+        .payload = { .warning = { .type = type } }
+    };
+
+    if (id >= secil_state.dictionary.count || arg_count > sizeof(msg.payload.warning.args) / sizeof(msg.payload.warning.args[0]) ||
+        (arg_count > 0 && !args))
+    {
+        secil_log(secil_LOG_ERROR, "Cannot send warning - Invalid parameters.");
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
+
+    if (!secil_state.dictionary.in_use)
+    {
+        // The remote end cannot expand the index, so send the text in full
+        secil_dictionary_format(msg.payload.warning.message, sizeof(msg.payload.warning.message), id, args, (pb_size_t)arg_count);
+        return secil_send_value(&msg);
+    }
+
+    msg.payload.warning.has_message_id = true;
+    msg.payload.warning.message_id = id;
+    msg.payload.warning.args_count = (pb_size_t)arg_count;
+    if (arg_count > 0)
+    {
+        memcpy(msg.payload.warning.args, args, arg_count * sizeof(int32_t));
+    }
+    return secil_send_value(&msg);
+}
+#endif
+
+#if defined(secil_message_supportPackageData_tag)
+// NOTE: This message is different from the others, as it contains a string and cannot be directly assigned like the others.
+secil_error_t secil_send_supportPackageData(const char *supportPackageData) 
+{
+    secil_message message = {
+        .which_payload = secil_message_supportPackageData_tag,
+    };
+    strncpy(message.payload.supportPackageData.supportPackageData, supportPackageData, sizeof(message.payload.supportPackageData.supportPackageData) - 1);
+    return secil_send_value(&message);
+}
+#endif
+
+secil_error_t secil_loopback_test_start(const char *test_data, secil_response_fn on_response, void *context, secil_request_handle_t *handle)
 {
     RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
 
-    if (!test_data)
+#if !defined(secil_message_loopbackTest_tag)
+    secil_log(secil_LOG_ERROR, "Cannot invoke loopback test - loopbackTest messages are excluded from this build.");
+    return SECIL_ERROR_UNKNOWN_MESSAGE_TYPE;
+#else
+    if (!test_data || (!on_response && !handle))
     {
         secil_log(secil_LOG_ERROR, "Cannot invoke loopback test - Invalid parameters.");
         return SECIL_ERROR_INVALID_PARAMETER;
@@ -516,42 +2953,294 @@ secil_error_t secil_loopback_test(const char *test_data)
     size_t test_data_size = strlen(test_data);
     if (test_data_size == 0 || test_data_size >= sizeof(((secil_message*)0)->payload.loopbackTest.data))
     {
-        secil_log(secil_LOG_ERROR, "Cannot invoke loopback test - Test data is empty or too large. Must be non-empty and less than 256 characters.");
+        secil_log(secil_LOG_ERROR, "Cannot invoke loopback test - Test data is empty or too large. Must be non-empty and less than %u characters.",
+                  (unsigned)sizeof(((secil_message*)0)->payload.loopbackTest.data));
         return SECIL_ERROR_INVALID_PARAMETER;
     }
 
     secil_message message = { .which_payload = secil_message_loopbackTest_tag };
     strncpy(message.payload.loopbackTest.data, test_data, sizeof(message.payload.loopbackTest.data) - 1);
-    
-    RETURN_IF_ERROR(secil_send(&message), "Failed to send loopback test message.");
 
-    memset(&message, 0, sizeof(message));
+    return secil_request_start(&message, secil_message_loopbackTest_tag, test_data, on_response, context, handle);
+#endif
+}
+
+secil_error_t secil_loopback_test(const char *test_data)
+{
+    secil_request_handle_t handle;
+    RETURN_IF_ERROR(secil_loopback_test_start(test_data, NULL, NULL, &handle), "Failed to send loopback test message.");
+
+    // Receive frames ourselves until the reply completes the request, keeping any application messages for later
+    secil_error_t result;
+    while ((result = secil_request_poll(handle)) == SECIL_ERROR_REQUEST_PENDING)
+    {
+        secil_message message;
+        bool deliver;
+        result = secil_receive_one(&message, &deliver);
+        if (result != SECIL_OK)
+        {
+            secil_request_cancel(handle);
+            secil_log(secil_LOG_DEBUG, "Failed to receive loopback test message.");
+            return result;
+        }
+
+#if defined(secil_message_loopbackTest_tag)
+        if (deliver && !secil_hold_message(&message))
+        {
+            // Rather than lose a message, give up on the test - the held ones are returned by the next receives
+            secil_request_cancel(handle);
+            secil_log(secil_LOG_ERROR, "Cannot finish loopback test - %u messages received meanwhile are waiting to be received.",
+                      (unsigned)SECIL_LOOPBACK_HOLD);
+            return SECIL_ERROR_QUEUE_FULL;
+        }
+#else
+        (void)deliver; // Without loopbackTest messages the test fails to start, so there is never a message to keep
+#endif
+    }
+
+    return result;
+}
+
+secil_error_t secil_set_subscriptions(uint32_t tags)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+    secil_state.local_subscriptions = tags;
+    if (secil_state.mode == secil_operating_mode_t_UNINITIALIZED)
+    {
+        // They go out in our handshake
+        return SECIL_OK;
+    }
+
+#if defined(secil_message_subscribe_tag)
+    secil_message message = {
+        .which_payload = secil_message_subscribe_tag,
+        .payload = { .subscribe = { .tags = tags } }
+    };
+    return secil_send_app(&message);
+#else
+    secil_log(secil_LOG_ERROR, "Cannot change subscriptions while connected - subscribe messages are excluded from this build.");
+    return SECIL_ERROR_UNKNOWN_MESSAGE_TYPE;
+#endif
+}
+
+bool secil_remote_wants(pb_size_t tag)
+{
+    return tag >= 32 || (secil_state.remote_subscriptions & SECIL_TAG_BIT(tag)) != 0;
+}
+
+secil_error_t secil_set_capabilities(uint32_t capabilities)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+    // Takes effect at the next handshake - until then both ends keep to what they agreed
+    secil_state.local_capabilities = capabilities & SECIL_BUILD_CAPABILITIES;
+    return SECIL_OK;
+}
+
+secil_error_t secil_send_state_digest(void)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+#if !SECIL_RESYNC
+    secil_log(secil_LOG_ERROR, "Cannot send state digest - not supported by this build.");
+    return SECIL_ERROR_UNKNOWN_MESSAGE_TYPE;
+#else
+    if (!(secil_state.agreed_capabilities & SECIL_CAPABILITY_STATE_DIGEST))
+    {
+        secil_log(secil_LOG_ERROR, "Cannot send state digest - the remote end does not support it.");
+        return SECIL_ERROR_INVALID_STATE;
+    }
+
+    secil_message message = { .which_payload = secil_message_stateDigest_tag };
+    secil_fill_digest(&message.payload.stateDigest);
+    return secil_send_app(&message);
+#endif
+}
+
+secil_error_t secil_get_agreed_capabilities(uint32_t *capabilities)
+{
+    if (!capabilities)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot get capabilities - Invalid parameters.");
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
+
+    *capabilities = secil_state.agreed_capabilities;
+    return SECIL_OK;
+}
+
+secil_error_t secil_set_dictionary(const char *const *entries, uint16_t count, bool expand)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
 
-    RETURN_IF_ERROR(secil_receive_internal(&message), "Failed to receive loopback test message.");
+    if (count > 0 && !entries)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot set dictionary - Invalid parameters.");
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
 
-    if (message.which_payload != secil_message_loopbackTest_tag)
+#if !SECIL_DICTIONARY
+    (void)expand;
+    if (count > 0)
     {
-        secil_log(secil_LOG_ERROR, "Loopback test expected to receive a loopbackTest message.");
+        secil_log(secil_LOG_ERROR, "Cannot set dictionary - warnings are not supported by this build.");
         return SECIL_ERROR_UNKNOWN_MESSAGE_TYPE;
     }
+    return SECIL_OK;
+#else
+    // Each text may be formatted with the arguments of a warning, at this end or the remote one
+    for (uint16_t i = 0; i < count; i++)
+    {
+        if (!entries[i] || !secil_dictionary_format_valid(entries[i]))
+        {
+            secil_log(secil_LOG_ERROR, "Cannot set dictionary - text %u is not a valid format.", (unsigned)i);
+            return SECIL_ERROR_INVALID_PARAMETER;
+        }
+    }
+
+    secil_lock();
+    secil_state.dictionary.entries = entries;
+    secil_state.dictionary.count = count;
+    secil_state.dictionary.expand = expand;
+    secil_state.dictionary.hash = count > 0 ? secil_dictionary_hash(entries, count) : 0;
+    secil_state.dictionary.in_use = false; // Until the remote end offers the same hash
+    secil_unlock();
+    return SECIL_OK;
+#endif
+}
+
+bool secil_dictionary_in_use(void)
+{
+#if SECIL_DICTIONARY
+    return secil_state.dictionary.in_use;
+#else
+    return false;
+#endif
+}
+
+secil_error_t secil_get_compression_stats(secil_compression_stats_t *stats)
+{
+    if (!stats)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot get compression stats - Invalid parameters.");
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+#if SECIL_LZ
+    secil_lock();
+    stats->compressed_frames = secil_state.lz.compressed_frames;
+    stats->bytes_before = secil_state.lz.bytes_before;
+    stats->bytes_after = secil_state.lz.bytes_after;
+    secil_unlock();
+#endif
+    return SECIL_OK;
+}
+
+secil_error_t secil_set_value_provider(secil_value_provider_fn provider)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+    secil_state.value_provider = provider;
+    return SECIL_OK;
+}
+
+secil_error_t secil_query_values(uint32_t tags, secil_response_fn on_response, void *context, secil_request_handle_t *handle)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+#if !SECIL_QUERIES
+    secil_log(secil_LOG_ERROR, "Cannot send query - query messages are excluded from this build.");
+    return SECIL_ERROR_UNKNOWN_MESSAGE_TYPE;
+#else
+    if (tags == 0 || (!on_response && !handle))
+    {
+        secil_log(secil_LOG_ERROR, "Cannot send query - Invalid parameters.");
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
+
+    secil_message message = {
+        .which_payload = secil_message_query_tag,
+        .payload = { .query = { .tags = tags } }
+    };
+    return secil_request_start(&message, secil_message_queryReply_tag, NULL, on_response, context, handle);
+#endif
+}
+
+secil_error_t secil_query_reply_get(const secil_message *reply, pb_size_t tag, secil_message *value)
+{
+#if !SECIL_QUERIES
+    secil_log(secil_LOG_ERROR, "Cannot read query reply - query messages are excluded from this build.");
+    return SECIL_ERROR_UNKNOWN_MESSAGE_TYPE;
+#else
+    if (!reply || !value || reply->which_payload != secil_message_queryReply_tag)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot read query reply - Invalid parameters.");
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
+
+    return secil_query_reply_take(&reply->payload.queryReply, tag, value) ? SECIL_OK : SECIL_ERROR_UNKNOWN_MESSAGE_TYPE;
+#endif
+}
+
+secil_error_t secil_request_poll(secil_request_handle_t handle)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+    secil_lock();
+
+    secil_error_t result;
+    secil_pending_request_t *entry = secil_find_request(handle);
+    if (!entry || entry->on_response)
+    {
+        result = SECIL_ERROR_INVALID_PARAMETER;
+    }
+    else if (!entry->completed)
+    {
+        result = SECIL_ERROR_REQUEST_PENDING;
+    }
+    else
+    {
+        result = entry->result;
+        entry->id = 0;
+    }
+
+    secil_unlock();
+
+    if (result == SECIL_ERROR_INVALID_PARAMETER)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot poll request %u - it is not pending or completes through a callback.", (unsigned)handle);
+    }
+    return result;
+}
+
+secil_error_t secil_request_cancel(secil_request_handle_t handle)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
 
-    if (strncmp(message.payload.loopbackTest.data, test_data, sizeof(message.payload.loopbackTest.data)) != 0)
+    secil_lock();
+    secil_pending_request_t *entry = secil_find_request(handle);
+    if (entry)
     {
-        secil_log(secil_LOG_ERROR, "Loopback test data does not match sent data: ");
-        secil_log(secil_LOG_ERROR, message.payload.loopbackTest.data);
-        secil_log(secil_LOG_ERROR, " != ");
-        secil_log(secil_LOG_ERROR, test_data);
-        return SECIL_ERROR_RECEIVE_FAILED;
+        entry->id = 0;
     }
+    secil_unlock();
 
+    if (!entry)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot cancel request %u - it is not pending.", (unsigned)handle);
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
     return SECIL_OK;
 }
 
 /// @brief Sends a startup message to the remote end.
 /// @param mode The operating mode of this end (client or server).
 /// @param needs_ack True if this is the first handshake message and an ack is expected.
+/// @param resumed In an ack, true if the handshake answered carried our session.
 /// @return SECIL_OK if the message was sent successfully, otherwise an error code.
-static secil_error_t secil_send_startup_message(secil_operating_mode_t mode, bool needs_ack)
+static secil_error_t secil_send_startup_message(secil_operating_mode_t mode, bool needs_ack, bool resumed)
 {
     RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
 
@@ -566,87 +3255,399 @@ static secil_error_t secil_send_startup_message(secil_operating_mode_t mode, boo
     };
     strncpy(message.payload.handshake.version, SECIL_VERSION, sizeof(message.payload.handshake.version) - 1);
 
-    return secil_send(&message);
+    // Leaving the subscriptions out asks for everything
+    message.payload.handshake.has_subscriptions = secil_state.local_subscriptions != SECIL_SUBSCRIBE_ALL;
+    message.payload.handshake.subscriptions = secil_state.local_subscriptions;
+    message.payload.handshake.has_capabilities = true;
+    message.payload.handshake.capabilities = secil_state.local_capabilities;
+    message.payload.handshake.has_max_frame_size = true;
+    message.payload.handshake.max_frame_size = HEADER_SIZE + secil_message_size + FOOTER_SIZE;
+    message.payload.handshake.has_session = secil_state.connection.session != 0;
+    message.payload.handshake.session = secil_state.connection.session;
+    message.payload.handshake.has_resumed = !needs_ack;
+    message.payload.handshake.resumed = resumed;
+#if SECIL_BAUD_SWITCH
+    message.payload.handshake.has_baud_rates = secil_state.baud.local_rates != 0;
+    message.payload.handshake.baud_rates = secil_state.baud.local_rates;
+#endif
+#if SECIL_DICTIONARY
+    message.payload.handshake.has_dictionary = secil_state.dictionary.hash != 0;
+    message.payload.handshake.dictionary = secil_state.dictionary.hash;
+#endif
+#if SECIL_HEARTBEAT
+    message.payload.handshake.has_heartbeat_interval = secil_state.heartbeat.interval > 0;
+    message.payload.handshake.heartbeat_interval = secil_state.heartbeat.interval;
+#endif
+
+#if SECIL_RESYNC
+    // Tell the remote end what we already have, so that on connecting it only sends again what has changed
+    message.payload.handshake.has_stateDigest = (secil_state.local_capabilities & SECIL_CAPABILITY_STATE_DIGEST) != 0;
+    if (message.payload.handshake.has_stateDigest)
+    {
+        secil_fill_digest(&message.payload.handshake.stateDigest);
+    }
+#endif
+
+#if SECIL_RELIABLE
+    message.payload.handshake.has_reliable_window = secil_state.reliable.local_window > 0;
+    message.payload.handshake.reliable_window = secil_state.reliable.local_window;
+#endif
+
+#if SECIL_FLOW_CONTROL
+    message.payload.handshake.has_rx_buffer = secil_state.flow.rx_buffer > 0;
+    message.payload.handshake.rx_buffer = secil_state.flow.rx_buffer;
+    secil_lock();
+    secil_flow_add_credit(&message);
+    secil_unlock();
+#endif
+
+    return secil_send_locked(&message);
 }
 
-static secil_error_t secil_receive_handshake(secil_operating_mode_t our_mode)
+secil_error_t secil_connect(secil_operating_mode_t mode)
 {
-    secil_operating_mode_t expected_mode = (our_mode == secil_operating_mode_t_CLIENT) ? secil_operating_mode_t_SERVER : secil_operating_mode_t_CLIENT;
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
 
-    // Wait for the server's startup message
-    secil_message response_message;
-    RETURN_IF_ERROR(secil_receive_internal(&response_message), NULL);
-    if( response_message.which_payload != secil_message_handshake_tag)
+    if (mode == secil_operating_mode_t_UNINITIALIZED)
     {
-        secil_log(secil_LOG_ERROR, "Expected handshake message from server MCU.");
-        return SECIL_ERROR_UNKNOWN_MESSAGE_TYPE;
+        secil_log(secil_LOG_ERROR, "Cannot connect - Invalid mode.");
+        return SECIL_ERROR_INVALID_PARAMETER;
     }
 
-    if (response_message.payload.handshake.mode != expected_mode)
+    secil_lock();
+    secil_state.mode = mode;
+    secil_state.connection.state = SECIL_CONNECTING;
+    secil_state.connection.resuming = false;
+    secil_state.connection.started_at = secil_now();
+    secil_state.connection.retry_interval = SECIL_HANDSHAKE_RETRY_MS;
+    if (mode == secil_operating_mode_t_CLIENT)
     {
-        if (expected_mode == secil_operating_mode_t_SERVER)
-        {
-            secil_log(secil_LOG_ERROR, "Received handshake message from remote end but expected a 'server' and got a 'client'.");
-        }
-        else
-        {
-            secil_log(secil_LOG_ERROR, "Received handshake message from remote end but expected a 'client' and got a 'server'.");
-        }        
-        return SECIL_ERROR_STARTUP_FAILED;
+        secil_new_session();
+    }
+#if SECIL_DICTIONARY
+    // The remote end may come back with other texts, so send them in full until its handshake says otherwise
+    secil_state.dictionary.in_use = false;
+#endif
+#if SECIL_BAUD_SWITCH
+    secil_state.baud.phase = BAUD_IDLE;
+    bool back_to_boot_baud = secil_state.baud.set_speed && secil_state.baud.stats.baud != secil_state.baud.boot_baud;
+#endif
+    secil_unlock();
+
+#if SECIL_BAUD_SWITCH
+    // The remote end starts at the boot rate after a restart, so that is where handshakes are exchanged
+    if (back_to_boot_baud)
+    {
+        secil_apply_baud(secil_state.baud.boot_baud);
+    }
+#endif
+
+    // If we are a client, the server answers with its own handshake and vice versa
+    // NOTE: When we are a server and we are restarting, the client will receive a handshake from us and
+    //       should respond with its own handshake again. It allows for the client to detect that the server has restarted.
+    return secil_send_connect_handshake();
+}
+
+secil_error_t secil_resume(secil_operating_mode_t mode, const secil_resumption_ticket_t *ticket)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+    if (mode == secil_operating_mode_t_UNINITIALIZED || !ticket || ticket->session == 0)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot resume - Invalid parameters.");
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
+
+    // Take up where the ticket left off - the remote end's reply to our handshake tells us if it still holds
+    secil_lock();
+    secil_state.mode = mode;
+    secil_state.connection.state = SECIL_CONNECTED;
+    secil_state.connection.resuming = true;
+    secil_state.connection.session = ticket->session;
+    secil_state.connection.started_at = secil_now();
+    secil_state.connection.stats.connects++;
+    secil_state.connection.stats.last_connect_ms = 0;
+    secil_state.remote_subscriptions = ticket->subscriptions;
+    secil_state.agreed_capabilities = secil_state.local_capabilities & ticket->capabilities;
+    secil_state.remote_max_frame_size = ticket->max_frame_size;
+    secil_unlock();
+
+#if SECIL_RELIABLE
+    // The remote end starts its reliable channel afresh too when our handshake arrives, before any of our data
+    secil_reliable_reset(ticket->reliable_window);
+#endif
+
+    return secil_send_connect_handshake();
+}
+
+secil_error_t secil_get_resumption_ticket(secil_resumption_ticket_t *ticket)
+{
+    if (!ticket)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot get resumption ticket - Invalid parameters.");
+        return SECIL_ERROR_INVALID_PARAMETER;
     }
 
-    // Copy the server version string to the provided buffer
-    strncpy(state.remote_version, response_message.payload.handshake.version, sizeof(state.remote_version) - 1);
-    state.remote_version[sizeof(state.remote_version) - 1] = '\0'; // Ensure null termination
+    secil_lock();
+    bool valid = secil_state.connection.state == SECIL_CONNECTED && secil_state.connection.session != 0;
+    if (valid)
+    {
+        ticket->session = secil_state.connection.session;
+        ticket->capabilities = secil_state.agreed_capabilities;
+        ticket->subscriptions = secil_state.remote_subscriptions;
+        ticket->max_frame_size = secil_state.remote_max_frame_size;
+#if SECIL_RELIABLE
+        ticket->reliable_window = secil_state.reliable.window;
+#else
+        ticket->reliable_window = 0;
+#endif
+    }
+    secil_unlock();
+
+    if (!valid)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot get resumption ticket - Not connected.");
+        return SECIL_ERROR_INVALID_STATE;
+    }
+    return SECIL_OK;
+}
 
-    // If the handshake message had needs_ack set, we must respond with our own handshake message
-    if (response_message.payload.handshake.needs_ack)
+secil_connection_state_t secil_get_connection_state(void)
+{
+    secil_lock();
+    secil_connection_state_t connection_state = secil_state.connection.state;
+    secil_unlock();
+    return connection_state;
+}
+
+secil_error_t secil_get_connection_stats(secil_connection_stats_t *stats)
+{
+    if (!stats)
     {
-        RETURN_IF_ERROR(secil_send_startup_message(our_mode, false), "Failed to send handshake ack to remote end.");
+        secil_log(secil_LOG_ERROR, "Cannot get connection stats - Invalid parameters.");
+        return SECIL_ERROR_INVALID_PARAMETER;
     }
 
+    secil_lock();
+    *stats = secil_state.connection.stats;
+    secil_unlock();
     return SECIL_OK;
 }
 
-static secil_error_t secil_startup_internal(secil_operating_mode_t mode, bool fail_on_version_mismatch)
+secil_error_t secil_set_speed_callback(secil_set_speed_fn set_speed_callback, uint32_t baud_rates, uint32_t boot_baud)
 {
-    if (mode == secil_operating_mode_t_UNINITIALIZED)
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+#if !SECIL_BAUD_SWITCH
+    if (set_speed_callback)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot set speed callback - switching the UART rate is not supported by this build.");
+        return SECIL_ERROR_UNKNOWN_MESSAGE_TYPE;
+    }
+    return SECIL_OK;
+#else
+    if (set_speed_callback && boot_baud == 0)
     {
-        secil_log(secil_LOG_ERROR, "Cannot invoke startup - Invalid mode.");
+        secil_log(secil_LOG_ERROR, "Cannot set speed callback - Invalid parameters.");
         return SECIL_ERROR_INVALID_PARAMETER;
     }
 
-    // When starting up, we always send an initial startup message
-    // If we are a client, we then wait for the server's response
-    // If we are a server, we wait for the client's startup message and then respond
-    // NOTE: When we are a server and we are restarting, the client will receive a startup message from us and
-    //       should respond with its own startup message again. It allows for the client to detect that the server has restarted.
-    RETURN_IF_ERROR(secil_send_startup_message(mode, true), "Failed to send handshake message to remote end.");
-    RETURN_IF_ERROR(secil_receive_handshake(mode), "Failed to receive handshake message from remote end.");
+    secil_lock();
+    secil_state.baud.set_speed = set_speed_callback;
+    secil_state.baud.local_rates = set_speed_callback ? baud_rates & SECIL_BAUD_ALL : 0;
+    secil_state.baud.boot_baud = boot_baud;
+    secil_state.baud.stats.baud = boot_baud;
+    secil_unlock();
+    return SECIL_OK;
+#endif
+}
+
+secil_error_t secil_switch_baud(uint32_t baud)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
 
-    if (fail_on_version_mismatch)
+#if !SECIL_BAUD_SWITCH
+    secil_log(secil_LOG_ERROR, "Cannot switch UART rate - not supported by this build.");
+    return SECIL_ERROR_UNKNOWN_MESSAGE_TYPE;
+#else
+    uint32_t bit = secil_baud_bit(baud);
+    if (!secil_state.baud.set_speed || !secil_state.clock_callback || !(secil_state.baud.local_rates & secil_state.baud.remote_rates & bit))
     {
-        // Check version string matches
-        if (strncmp(state.remote_version, SECIL_VERSION, sizeof(state.remote_version)) != 0)
-        {
-            secil_log(secil_LOG_ERROR, "Version mismatch between client and server:");
-            secil_log(secil_LOG_ERROR, " Local version: ");
-            secil_log(secil_LOG_ERROR, SECIL_VERSION);
-            secil_log(secil_LOG_ERROR, " Remote version: ");
-            secil_log(secil_LOG_ERROR, state.remote_version);
-            return SECIL_ERROR_VERSION_MISMATCH;
-        }
+        secil_log(secil_LOG_ERROR, "Cannot switch to %u baud - not offered by both ends.", (unsigned)baud);
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
+
+    secil_lock();
+    bool busy = secil_state.baud.phase != BAUD_IDLE || secil_state.connection.state != SECIL_CONNECTED;
+    if (!busy)
+    {
+        secil_state.baud.phase = BAUD_PROPOSED;
+        secil_state.baud.previous_baud = secil_state.baud.stats.baud;
+        secil_state.baud.target_baud = baud;
+        secil_state.baud.deadline = secil_now() + SECIL_BAUD_SWITCH_TIMEOUT_MS;
     }
+    secil_unlock();
 
-    // Now confirm that we are fully initialized
-    state.mode = mode;
+    if (busy)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot switch to %u baud - not connected, or a switch is already under way.", (unsigned)baud);
+        return SECIL_ERROR_INVALID_STATE;
+    }
+    return secil_send_baud_step(secil_baud_switch_step_t_BAUD_PROPOSE, baud);
+#endif
+}
+
+secil_error_t secil_get_baud_stats(secil_baud_stats_t *stats)
+{
+    if (!stats)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot get baud stats - Invalid parameters.");
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
+
+#if !SECIL_BAUD_SWITCH
+    memset(stats, 0, sizeof(*stats));
+#else
+    secil_lock();
+    *stats = secil_state.baud.stats;
+    stats->switching = secil_state.baud.phase != BAUD_IDLE;
+    secil_unlock();
+#endif
+    return SECIL_OK;
+}
+
+secil_error_t secil_set_bulk_callbacks(secil_bulk_open_fn on_open, secil_bulk_write_fn on_write,
+                                       secil_bulk_read_fn on_read, secil_bulk_done_fn on_done)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+#if !SECIL_BULK
+    if (on_open || on_write || on_read || on_done)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot set bulk transfer callbacks - not supported by this build.");
+        return SECIL_ERROR_UNKNOWN_MESSAGE_TYPE;
+    }
+    return SECIL_OK;
+#else
+    secil_lock();
+    secil_state.bulk.on_open = on_open;
+    secil_state.bulk.on_write = on_write;
+    secil_state.bulk.on_read = on_read;
+    secil_state.bulk.on_done = on_done;
+    secil_unlock();
+    return SECIL_OK;
+#endif
+}
+
+secil_error_t secil_bulk_send(uint32_t kind, uint32_t size)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+#if !SECIL_BULK
+    secil_log(secil_LOG_ERROR, "Cannot send bulk transfer - not supported by this build.");
+    return SECIL_ERROR_UNKNOWN_MESSAGE_TYPE;
+#else
+    if (!secil_state.bulk.on_read)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot send bulk transfer - no read callback.");
+        return SECIL_ERROR_INVALID_STATE;
+    }
+
+    secil_lock();
+    bool busy = secil_state.bulk.tx.active || secil_state.connection.state != SECIL_CONNECTED;
+    if (!busy)
+    {
+        memset(&secil_state.bulk.tx, 0, sizeof(secil_state.bulk.tx));
+        secil_state.bulk.tx.active = true;
+        secil_state.bulk.tx.transfer = ++secil_state.bulk.last_transfer == 0 ? ++secil_state.bulk.last_transfer : secil_state.bulk.last_transfer;
+        secil_state.bulk.tx.kind = kind;
+        secil_state.bulk.tx.size = size;
+        secil_state.bulk.tx.started_at = secil_now();
+    }
+    secil_unlock();
 
-    // Notify the application of the new connection
-    secil_notify_on_connect();
+    if (busy)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot send bulk transfer - not connected, or a transfer is already under way.");
+        return SECIL_ERROR_INVALID_STATE;
+    }
+    return secil_bulk_send_open();
+#endif
+}
+
+secil_error_t secil_bulk_cancel(bool outgoing)
+{
+    RETURN_IF_ERROR(secil_io_callbacks_valid(), "I/O callbacks not set.");
+
+#if !SECIL_BULK
+    secil_log(secil_LOG_ERROR, "Cannot cancel bulk transfer - not supported by this build.");
+    return SECIL_ERROR_UNKNOWN_MESSAGE_TYPE;
+#else
+    secil_lock();
+    bool active = outgoing ? secil_state.bulk.tx.active : secil_state.bulk.rx.active;
+    uint16_t transfer = outgoing ? secil_state.bulk.tx.transfer : secil_state.bulk.rx.transfer;
+    secil_unlock();
+
+    if (!active)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot cancel bulk transfer - none under way.");
+        return SECIL_ERROR_INVALID_STATE;
+    }
+
+    secil_bulk_finish(outgoing, SECIL_ERROR_TRANSFER_CANCELLED);
+    return secil_send_bulk_close(transfer, 0, outgoing);
+#endif
+}
+
+secil_error_t secil_get_bulk_stats(secil_bulk_stats_t *stats)
+{
+    if (!stats)
+    {
+        secil_log(secil_LOG_ERROR, "Cannot get bulk stats - Invalid parameters.");
+        return SECIL_ERROR_INVALID_PARAMETER;
+    }
 
+    memset(stats, 0, sizeof(*stats));
+#if SECIL_BULK
+    secil_lock();
+    stats->active = secil_state.bulk.tx.active;
+    stats->size = secil_state.bulk.tx.size;
+    stats->acked = secil_state.bulk.tx.acked;
+    stats->retransmitted = secil_state.bulk.tx.retransmitted;
+    stats->elapsed_ms = (secil_state.bulk.tx.active ? secil_now() : secil_state.bulk.tx.finished_at) - secil_state.bulk.tx.started_at;
+    secil_unlock();
+#endif
     return SECIL_OK;
 }
 
+static secil_error_t secil_startup_internal(secil_operating_mode_t mode, bool fail_on_version_mismatch)
+{
+    secil_state.connection.fail_on_version_mismatch = fail_on_version_mismatch;
+    RETURN_IF_ERROR(secil_connect(mode), "Failed to send handshake message to remote end.");
+
+    // Wait for the remote end's handshake, which also confirms that we are fully initialized
+    while (secil_get_connection_state() == SECIL_CONNECTING)
+    {
+        secil_message message;
+        bool deliver;
+        secil_error_t result = secil_receive_one(&message, &deliver);
+        if (result != SECIL_OK)
+        {
+            secil_log(secil_LOG_ERROR, "Failed to receive handshake message from remote end.");
+            secil_state.connection.state = SECIL_DISCONNECTED;
+            return result;
+        }
+
+        if (deliver)
+        {
+            // The remote end is already sending data - there is nobody to hand it to until the startup is over
+            secil_log(secil_LOG_WARNING, "Dropping message %u received before the handshake.", (unsigned)message.which_payload);
+        }
+    }
+
+    return secil_state.connection.state == SECIL_CONNECTED ? SECIL_OK : SECIL_ERROR_STARTUP_FAILED;
+}
+
 secil_error_t secil_startup(secil_operating_mode_t mode)
 {
     return secil_startup_internal(mode, true);
@@ -659,7 +3660,7 @@ secil_error_t secil_startup_ignore_mismatch(secil_operating_mode_t mode)
 
 secil_error_t secil_get_remote_version(char *version, size_t version_size)
 {
-    if (state.remote_version[0] == '\0')
+    if (secil_state.remote_version[0] == '\0')
     {
         secil_log(secil_LOG_ERROR, "Cannot get remote version - Remote version is not set.");
         return SECIL_ERROR_NOT_INITIALIZED;
@@ -671,7 +3672,7 @@ secil_error_t secil_get_remote_version(char *version, size_t version_size)
         return SECIL_ERROR_INVALID_PARAMETER;
     }
 
-    strncpy(version, state.remote_version, version_size - 1);
+    strncpy(version, secil_state.remote_version, version_size - 1);
     version[version_size - 1] = '\0'; // Ensure null termination
 
     return SECIL_OK;
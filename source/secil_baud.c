@@ -0,0 +1,208 @@
+#include "secil_internal.h"
+
+#if SECIL_BAUD_SWITCH
+// The rate of each SECIL_BAUD_* bit
+static const uint32_t secil_baud_rates[] = { 9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600,
+                                             1000000, 1500000, 2000000, 3000000 };
+
+/// @brief Find the SECIL_BAUD_* bit of a rate.
+/// @return The bit, or 0 if the rate has none.
+uint32_t secil_baud_bit(uint32_t baud)
+{
+    for (size_t i = 0; i < sizeof(secil_baud_rates) / sizeof(secil_baud_rates[0]); i++)
+    {
+        if (secil_baud_rates[i] == baud)
+        {
+            return 1u << i;
+        }
+    }
+    return 0;
+}
+
+/// @brief Send one step of a UART rate switch.
+/// @note The steps bypass the reliable channel, as a retransmission could go out at the wrong rate.
+secil_error_t secil_send_baud_step(secil_baud_switch_step_t step, uint32_t baud)
+{
+    secil_message message = { .which_payload = secil_message_baudSwitch_tag };
+    message.payload.baudSwitch.step = step;
+    message.payload.baudSwitch.baud = baud;
+    return secil_send_locked(&message);
+}
+
+/// @brief Change the rate of the UART through the application's callback.
+/// @return True if the UART now runs at the new rate.
+bool secil_apply_baud(uint32_t baud)
+{
+#if SECIL_TX_QUEUES
+    // Whatever has been queued (such as our answer to the switch) still has to go out at the old rate
+    secil_tx_drain();
+#endif
+
+    if (!secil_state.baud.set_speed(secil_state.user_data, baud))
+    {
+        secil_log(secil_LOG_ERROR, "Failed to set the UART to %u baud.", (unsigned)baud);
+        return false;
+    }
+
+    secil_lock();
+    secil_state.baud.stats.baud = baud;
+    secil_update_gap(baud);
+    secil_unlock();
+    return true;
+}
+
+/// @brief Give up the switch under way and go back to the old rate.
+static void secil_baud_rollback()
+{
+    secil_log(secil_LOG_WARNING, "Switch to %u baud failed - going back to %u baud.",
+              (unsigned)secil_state.baud.target_baud, (unsigned)secil_state.baud.previous_baud);
+    secil_apply_baud(secil_state.baud.previous_baud);
+
+    secil_lock();
+    secil_state.baud.phase = BAUD_IDLE;
+    secil_state.baud.stats.rollbacks++;
+    secil_unlock();
+}
+
+/// @brief Finish the switch under way once the new rate has been shown to work.
+static void secil_baud_verified()
+{
+    secil_lock();
+    secil_state.baud.phase = BAUD_IDLE;
+    secil_state.baud.stats.switches++;
+    secil_unlock();
+    secil_log(secil_LOG_INFO, "UART switched to %u baud.", (unsigned)secil_state.baud.target_baud);
+}
+
+/// @brief Handle a step of a UART rate switch received from the remote end.
+secil_error_t secil_handle_baud_switch(const secil_baudSwitch *request)
+{
+    uint32_t baud = request->baud;
+
+    secil_lock();
+    secil_baud_phase_t phase = secil_state.baud.phase;
+    bool current = baud == secil_state.baud.target_baud;
+    secil_unlock();
+
+    switch (request->step)
+    {
+    case secil_baud_switch_step_t_BAUD_PROPOSE:
+    {
+        // When both ends propose at the same time, the client's proposal wins
+        bool busy = phase != BAUD_IDLE && !(phase == BAUD_PROPOSED && secil_state.mode == secil_operating_mode_t_SERVER);
+        if (busy || !secil_state.baud.set_speed || !(secil_state.baud.local_rates & secil_baud_bit(baud)))
+        {
+            secil_lock();
+            secil_state.baud.stats.rejected++;
+            secil_unlock();
+            secil_log(secil_LOG_WARNING, "Rejected the remote end's switch to %u baud.", (unsigned)baud);
+            return secil_send_baud_step(secil_baud_switch_step_t_BAUD_REJECT, baud);
+        }
+
+        // Our accept is the last frame at the old rate, then we wait at the new rate for the remote end's probe
+        RETURN_IF_ERROR(secil_send_baud_step(secil_baud_switch_step_t_BAUD_ACCEPT, baud), "Failed to accept switch of UART rate.");
+        secil_lock();
+        secil_state.baud.phase = BAUD_ACCEPTED;
+        secil_state.baud.previous_baud = secil_state.baud.stats.baud;
+        secil_state.baud.target_baud = baud;
+        secil_state.baud.deadline = secil_now() + SECIL_BAUD_SWITCH_TIMEOUT_MS;
+        secil_unlock();
+
+        if (!secil_apply_baud(baud))
+        {
+            secil_baud_rollback();
+        }
+        return SECIL_OK;
+    }
+
+    case secil_baud_switch_step_t_BAUD_ACCEPT:
+        if (phase != BAUD_PROPOSED || !current)
+        {
+            return SECIL_OK; // Too late, we have given up on this switch
+        }
+
+        secil_lock();
+        secil_state.baud.phase = BAUD_VERIFYING;
+        secil_state.baud.deadline = secil_now() + SECIL_BAUD_SWITCH_TIMEOUT_MS;
+        secil_state.baud.probe_at = secil_now() + SECIL_BAUD_PROBE_MS;
+        secil_unlock();
+
+        if (!secil_apply_baud(baud))
+        {
+            // The remote end gives up too when our probe does not arrive
+            secil_baud_rollback();
+            return SECIL_OK;
+        }
+        return secil_send_baud_step(secil_baud_switch_step_t_BAUD_VERIFY, baud);
+
+    case secil_baud_switch_step_t_BAUD_REJECT:
+        if (phase == BAUD_PROPOSED && current)
+        {
+            secil_lock();
+            secil_state.baud.phase = BAUD_IDLE;
+            secil_state.baud.stats.rejected++;
+            secil_unlock();
+            secil_log(secil_LOG_WARNING, "The remote end rejected the switch to %u baud.", (unsigned)baud);
+        }
+        return SECIL_OK;
+
+    case secil_baud_switch_step_t_BAUD_VERIFY:
+        if (phase == BAUD_ACCEPTED && current)
+        {
+            secil_baud_verified();
+        }
+
+        // Repeated probes are answered too, in case an earlier answer was lost
+        return secil_send_baud_step(secil_baud_switch_step_t_BAUD_VERIFIED, baud);
+
+    case secil_baud_switch_step_t_BAUD_VERIFIED:
+        if (phase == BAUD_VERIFYING && current)
+        {
+            secil_baud_verified();
+        }
+        return SECIL_OK;
+
+    default:
+        return SECIL_OK;
+    }
+}
+
+/// @brief Send the probe at the new rate again, or give up a switch that has taken too long.
+secil_error_t secil_baud_poll()
+{
+    if (!secil_state.clock_callback)
+    {
+        return SECIL_OK;
+    }
+
+    secil_lock();
+    uint32_t now = secil_now();
+    secil_baud_phase_t phase = secil_state.baud.phase;
+    bool expired = phase != BAUD_IDLE && (int32_t)(now - secil_state.baud.deadline) >= 0;
+    bool probe = phase == BAUD_VERIFYING && !expired && (int32_t)(now - secil_state.baud.probe_at) >= 0;
+    if (expired && phase == BAUD_PROPOSED)
+    {
+        // Nothing has changed yet, so there is nothing to go back from
+        secil_state.baud.phase = BAUD_IDLE;
+        secil_state.baud.stats.rejected++;
+    }
+    if (probe)
+    {
+        secil_state.baud.probe_at = now + SECIL_BAUD_PROBE_MS;
+    }
+    secil_unlock();
+
+    if (expired)
+    {
+        if (phase == BAUD_PROPOSED)
+        {
+            secil_log(secil_LOG_WARNING, "The remote end did not answer the switch to %u baud.", (unsigned)secil_state.baud.target_baud);
+        }
+        else
+        {
+            secil_baud_rollback();
+        }
+    }
+    return probe ? secil_send_baud_step(secil_baud_switch_step_t_BAUD_VERIFY, secil_state.baud.target_baud) : SECIL_OK;
+}
+#endif
@@ -0,0 +1,346 @@
+#include "secil_internal.h"
+
+#if SECIL_BULK
+// Largest chunk this build can send or receive
+#define SECIL_BULK_CHUNK_MAX ((uint16_t)sizeof(((secil_bulk *)0)->data.bytes))
+
+// The receiver acknowledges every this many chunks
+#define SECIL_BULK_ACK_EVERY (SECIL_BULK_WINDOW > 1 ? SECIL_BULK_WINDOW / 2 : 1)
+
+/// @brief Start a message that carries one step of a bulk transfer.
+static void secil_bulk_message(secil_message *message, secil_bulk_step_t step, uint16_t transfer, uint32_t offset)
+{
+    memset(message, 0, sizeof(*message));
+    message->which_payload = secil_message_bulk_tag;
+    message->payload.bulk.step = step;
+    message->payload.bulk.transfer = transfer;
+    message->payload.bulk.has_offset = true;
+    message->payload.bulk.offset = offset;
+}
+
+/// @brief Send one step of a bulk transfer that carries nothing but an offset.
+/// @note Bulk transfers acknowledge their own chunks, so they bypass the reliable channel.
+static secil_error_t secil_send_bulk_step(secil_bulk_step_t step, uint16_t transfer, uint32_t offset)
+{
+    secil_message message;
+    secil_bulk_message(&message, step, transfer, offset);
+    return secil_send_locked(&message);
+}
+
+/// @brief Tell the remote end that a transfer has been closed early.
+/// @param from_sender True if we are the sender of the transfer, false if we are its receiver.
+secil_error_t secil_send_bulk_close(uint16_t transfer, uint32_t offset, bool from_sender)
+{
+    secil_message message;
+    secil_bulk_message(&message, secil_bulk_step_t_BULK_CLOSE, transfer, offset);
+    message.payload.bulk.has_from_sender = true;
+    message.payload.bulk.from_sender = from_sender;
+    return secil_send_locked(&message);
+}
+
+/// @brief End a transfer and tell the application.
+void secil_bulk_finish(bool outgoing, secil_error_t result)
+{
+    secil_lock();
+    if (outgoing)
+    {
+        secil_state.bulk.tx.active = false;
+        secil_state.bulk.tx.finished_at = secil_now();
+    }
+    else
+    {
+        secil_state.bulk.rx.active = false;
+    }
+    secil_unlock();
+
+    if (secil_state.bulk.on_done)
+    {
+        secil_state.bulk.on_done(secil_state.user_data, outgoing, result);
+    }
+}
+
+/// @brief Open the outgoing transfer, or open it again so that the remote end tells us where to resume.
+secil_error_t secil_bulk_send_open()
+{
+    secil_lock();
+    secil_state.bulk.tx.opened = false;
+    secil_state.bulk.tx.progress_at = secil_now();
+    secil_message message;
+    secil_bulk_message(&message, secil_bulk_step_t_BULK_OPEN, secil_state.bulk.tx.transfer, 0);
+    message.payload.bulk.has_size = true;
+    message.payload.bulk.size = secil_state.bulk.tx.size;
+    message.payload.bulk.has_kind = true;
+    message.payload.bulk.kind = secil_state.bulk.tx.kind;
+    secil_unlock();
+
+    return secil_send_locked(&message);
+}
+
+/// @brief Send the next chunks of the outgoing transfer, as far as the window allows.
+/// @note One call sends a window of chunks at most. Acknowledgements that arrive meanwhile would otherwise keep the
+///       caller (often secil_poll()) sending until the end of the transfer, and the chunks they free go out when
+///       the next acknowledgement is handled.
+static secil_error_t secil_bulk_pump()
+{
+    for (int chunks = 0; chunks < SECIL_BULK_WINDOW; chunks++)
+    {
+        secil_lock();
+        uint16_t transfer = secil_state.bulk.tx.transfer;
+        uint32_t offset = secil_state.bulk.tx.next;
+        uint32_t count = secil_state.bulk.tx.size - offset;
+        if (count > secil_state.bulk.tx.chunk_size)
+        {
+            count = secil_state.bulk.tx.chunk_size;
+        }
+        bool send = secil_state.bulk.tx.active && secil_state.bulk.tx.opened && count > 0 &&
+                    offset - secil_state.bulk.tx.acked < (uint32_t)SECIL_BULK_WINDOW * secil_state.bulk.tx.chunk_size;
+        if (send)
+        {
+            // The retransmit timer runs from the oldest chunk that is waiting for its acknowledgement
+            if (offset == secil_state.bulk.tx.acked)
+            {
+                secil_state.bulk.tx.progress_at = secil_now();
+            }
+            secil_state.bulk.tx.next += count;
+        }
+        secil_unlock();
+
+        if (!send)
+        {
+            return SECIL_OK;
+        }
+
+        secil_message message;
+        secil_bulk_message(&message, secil_bulk_step_t_BULK_DATA, transfer, offset);
+        message.payload.bulk.has_data = true;
+        message.payload.bulk.data.size = (pb_size_t)count;
+        if (!secil_state.bulk.on_read(secil_state.user_data, offset, message.payload.bulk.data.bytes, count))
+        {
+            secil_log(secil_LOG_ERROR, "Bulk transfer cancelled - could not read %u bytes at offset %u.", (unsigned)count, (unsigned)offset);
+            secil_bulk_finish(true, SECIL_ERROR_TRANSFER_CANCELLED);
+            return secil_send_bulk_close(transfer, offset, true);
+        }
+        secil_error_t result = secil_send_locked(&message);
+        if (result == SECIL_ERROR_QUEUE_FULL)
+        {
+            // Send the chunk again once the queue has drained, from secil_poll() or the next acknowledgement
+            secil_lock();
+            if (secil_state.bulk.tx.next == offset + count)
+            {
+                secil_state.bulk.tx.next = offset;
+            }
+            secil_unlock();
+            return SECIL_OK;
+        }
+        RETURN_IF_ERROR(result, "Failed to send bulk transfer chunk.");
+    }
+    return SECIL_OK;
+}
+
+/// @brief Answer the remote end's BULK_OPEN with the offset to start from, asking the application if the transfer is new.
+static secil_error_t secil_bulk_accept(const secil_bulk *bulk)
+{
+    uint32_t size = bulk->has_size ? bulk->size : 0;
+
+    // Opened again after a reconnect: carry on from what has arrived
+    bool known = (secil_state.bulk.rx.active || secil_state.bulk.rx.complete) && secil_state.bulk.rx.transfer == bulk->transfer && secil_state.bulk.rx.size == size;
+    if (!known)
+    {
+        if (secil_state.bulk.rx.active)
+        {
+            secil_log(secil_LOG_WARNING, "Bulk transfer %u replaced by transfer %u.", (unsigned)secil_state.bulk.rx.transfer, (unsigned)bulk->transfer);
+            secil_bulk_finish(false, SECIL_ERROR_TRANSFER_CANCELLED);
+        }
+
+        uint32_t resume_offset = 0;
+        if (!secil_state.bulk.on_open || !secil_state.bulk.on_write ||
+            !secil_state.bulk.on_open(secil_state.user_data, bulk->has_kind ? bulk->kind : 0, size, &resume_offset) || resume_offset > size)
+        {
+            secil_log(secil_LOG_WARNING, "Refused bulk transfer %u of %u bytes.", (unsigned)bulk->transfer, (unsigned)size);
+            return secil_send_bulk_close(bulk->transfer, 0, false);
+        }
+
+        secil_lock();
+        memset(&secil_state.bulk.rx, 0, sizeof(secil_state.bulk.rx));
+        secil_state.bulk.rx.active = true;
+        secil_state.bulk.rx.transfer = bulk->transfer;
+        secil_state.bulk.rx.size = size;
+        secil_state.bulk.rx.received = resume_offset;
+        secil_state.bulk.rx.complete = resume_offset == size;
+        secil_unlock();
+
+        if (secil_state.bulk.rx.complete)
+        {
+            secil_bulk_finish(false, SECIL_OK);
+        }
+    }
+
+    secil_message reply;
+    secil_bulk_message(&reply, secil_bulk_step_t_BULK_ACK, bulk->transfer, secil_state.bulk.rx.received);
+    reply.payload.bulk.has_chunk_size = true;
+    reply.payload.bulk.chunk_size = SECIL_BULK_CHUNK_MAX;
+    return secil_send_locked(&reply);
+}
+
+/// @brief Store a chunk of the incoming transfer if it is the next one, and acknowledge every half window.
+static secil_error_t secil_bulk_receive_chunk(const secil_bulk *bulk, uint32_t offset)
+{
+    if (!(secil_state.bulk.rx.active || secil_state.bulk.rx.complete) || bulk->transfer != secil_state.bulk.rx.transfer)
+    {
+        // A transfer we do not know, e.g. from before we restarted - the sender opens it again once we have reconnected
+        return SECIL_OK;
+    }
+
+    if (secil_state.bulk.rx.complete || offset < secil_state.bulk.rx.received)
+    {
+        // Sent again because our acknowledgement was lost
+        return secil_send_bulk_step(secil_bulk_step_t_BULK_ACK, bulk->transfer, secil_state.bulk.rx.received);
+    }
+
+    if (offset > secil_state.bulk.rx.received)
+    {
+        // A chunk went missing - tell the sender once, then drop the rest until it has gone back
+        if (secil_state.bulk.rx.nacked)
+        {
+            return SECIL_OK;
+        }
+        secil_state.bulk.rx.nacked = true;
+        return secil_send_bulk_step(secil_bulk_step_t_BULK_NACK, bulk->transfer, secil_state.bulk.rx.received);
+    }
+
+    uint32_t count = bulk->has_data ? bulk->data.size : 0;
+    if (count > secil_state.bulk.rx.size - offset || !secil_state.bulk.on_write(secil_state.user_data, offset, bulk->data.bytes, count))
+    {
+        secil_log(secil_LOG_ERROR, "Bulk transfer cancelled - could not store %u bytes at offset %u.", (unsigned)count, (unsigned)offset);
+        secil_bulk_finish(false, SECIL_ERROR_TRANSFER_CANCELLED);
+        return secil_send_bulk_close(bulk->transfer, offset, false);
+    }
+
+    secil_lock();
+    secil_state.bulk.rx.received += count;
+    secil_state.bulk.rx.nacked = false;
+    secil_state.bulk.rx.complete = secil_state.bulk.rx.received == secil_state.bulk.rx.size;
+    bool ack = secil_state.bulk.rx.complete || ++secil_state.bulk.rx.unacked >= SECIL_BULK_ACK_EVERY;
+    if (ack)
+    {
+        secil_state.bulk.rx.unacked = 0;
+    }
+    secil_unlock();
+
+    if (secil_state.bulk.rx.complete)
+    {
+        secil_bulk_finish(false, SECIL_OK);
+    }
+    return ack ? secil_send_bulk_step(secil_bulk_step_t_BULK_ACK, bulk->transfer, secil_state.bulk.rx.received) : SECIL_OK;
+}
+
+/// @brief Move the outgoing transfer on from the remote end's acknowledgement, or back to the gap it reports.
+static secil_error_t secil_bulk_on_ack(const secil_bulk *bulk, uint32_t offset)
+{
+    secil_lock();
+    bool ours = secil_state.bulk.tx.active && bulk->transfer == secil_state.bulk.tx.transfer;
+    bool open_reply = ours && !secil_state.bulk.tx.opened;
+    if (open_reply && bulk->step == secil_bulk_step_t_BULK_ACK)
+    {
+        // The answer to BULK_OPEN: agree the chunk size and start from where the remote end has got to
+        uint16_t chunk_size = bulk->has_chunk_size && bulk->chunk_size > 0 ? (uint16_t)bulk->chunk_size : SECIL_BULK_CHUNK_MAX;
+        secil_state.bulk.tx.chunk_size = chunk_size < SECIL_BULK_CHUNK_MAX ? chunk_size : SECIL_BULK_CHUNK_MAX;
+        secil_state.bulk.tx.opened = true;
+        offset = offset < secil_state.bulk.tx.size ? offset : secil_state.bulk.tx.size;
+        if (offset < secil_state.bulk.tx.next)
+        {
+            secil_state.bulk.tx.retransmitted += secil_state.bulk.tx.next - offset;
+        }
+        secil_state.bulk.tx.acked = offset;
+        secil_state.bulk.tx.next = offset;
+        secil_state.bulk.tx.progress_at = secil_now();
+    }
+    else if (ours && !open_reply)
+    {
+        if (offset > secil_state.bulk.tx.acked && offset <= secil_state.bulk.tx.next)
+        {
+            secil_state.bulk.tx.acked = offset;
+            secil_state.bulk.tx.progress_at = secil_now();
+        }
+        if (bulk->step == secil_bulk_step_t_BULK_NACK && offset == secil_state.bulk.tx.acked && offset < secil_state.bulk.tx.next)
+        {
+            secil_state.bulk.tx.retransmitted += secil_state.bulk.tx.next - offset;
+            secil_state.bulk.tx.next = offset;
+        }
+    }
+    bool done = ours && secil_state.bulk.tx.opened && secil_state.bulk.tx.acked >= secil_state.bulk.tx.size;
+    secil_unlock();
+
+    if (done)
+    {
+        secil_log(secil_LOG_INFO, "Bulk transfer %u of %u bytes complete.", (unsigned)bulk->transfer, (unsigned)secil_state.bulk.tx.size);
+        secil_bulk_finish(true, SECIL_OK);
+        return SECIL_OK;
+    }
+    return ours ? secil_bulk_pump() : SECIL_OK;
+}
+
+/// @brief Handle a step of a bulk transfer received from the remote end.
+secil_error_t secil_handle_bulk(const secil_bulk *bulk)
+{
+    uint32_t offset = bulk->has_offset ? bulk->offset : 0;
+
+    switch (bulk->step)
+    {
+    case secil_bulk_step_t_BULK_OPEN:
+        return secil_bulk_accept(bulk);
+
+    case secil_bulk_step_t_BULK_DATA:
+        return secil_bulk_receive_chunk(bulk, offset);
+
+    case secil_bulk_step_t_BULK_ACK:
+    case secil_bulk_step_t_BULK_NACK:
+        return secil_bulk_on_ack(bulk, offset);
+
+    case secil_bulk_step_t_BULK_CLOSE:
+        // Closed by the receiver of a transfer we send, or by the sender of one we receive. An older remote end does
+        // not say which, so it may close either.
+        if (secil_state.bulk.tx.active && bulk->transfer == secil_state.bulk.tx.transfer && !(bulk->has_from_sender && bulk->from_sender))
+        {
+            secil_log(secil_LOG_WARNING, "The remote end closed bulk transfer %u.", (unsigned)bulk->transfer);
+            secil_bulk_finish(true, SECIL_ERROR_TRANSFER_CANCELLED);
+        }
+        if (secil_state.bulk.rx.active && bulk->transfer == secil_state.bulk.rx.transfer && !(bulk->has_from_sender && !bulk->from_sender))
+        {
+            secil_log(secil_LOG_WARNING, "The remote end closed bulk transfer %u.", (unsigned)bulk->transfer);
+            secil_bulk_finish(false, SECIL_ERROR_TRANSFER_CANCELLED);
+        }
+        return SECIL_OK;
+
+    default:
+        return SECIL_OK;
+    }
+}
+
+/// @brief Open the outgoing transfer again if it is still waiting for an answer, or go back to the last offset acknowledged
+///        once the acknowledgements have stopped, then send what the window allows.
+secil_error_t secil_bulk_poll()
+{
+    if (!secil_state.clock_callback)
+    {
+        return SECIL_OK;
+    }
+
+    secil_lock();
+    bool active = secil_state.bulk.tx.active;
+    bool overdue = active && (int32_t)(secil_now() - secil_state.bulk.tx.progress_at) >= SECIL_BULK_RETRY_MS;
+    bool reopen = overdue && !secil_state.bulk.tx.opened;
+    if (overdue && secil_state.bulk.tx.opened && secil_state.bulk.tx.next != secil_state.bulk.tx.acked)
+    {
+        secil_state.bulk.tx.retransmitted += secil_state.bulk.tx.next - secil_state.bulk.tx.acked;
+        secil_state.bulk.tx.next = secil_state.bulk.tx.acked;
+    }
+    secil_unlock();
+
+    if (reopen)
+    {
+        return secil_bulk_send_open();
+    }
+    return active ? secil_bulk_pump() : SECIL_OK;
+}
+#endif
@@ -0,0 +1,170 @@
+#include "secil_internal.h"
+
+#if SECIL_FLOW_CONTROL
+
+/// @brief Check whether the remote end is to be told how much it may send.
+/// @note The caller must hold the lock.
+static bool secil_flow_offered()
+{
+    return secil_state.flow.rx_buffer > 0 && (secil_state.agreed_capabilities & SECIL_CAPABILITY_FLOW_CONTROL) != 0;
+}
+
+/// @brief Give the remote end credit on an outgoing message, up to what our receive buffer can take.
+/// @note The caller must hold the lock.
+void secil_flow_add_credit(secil_message *message)
+{
+    if (!secil_flow_offered())
+    {
+        return;
+    }
+
+    secil_state.flow.granted = secil_state.flow.consumed + (uint32_t)(secil_state.flow.rx_buffer - CREDIT_RESERVE);
+    secil_state.flow.granted_at = secil_now();
+    message->has_credit = true;
+    message->credit = secil_state.flow.granted;
+    secil_state.flow.stats.credits_sent++;
+}
+
+/// @brief Send a frame that only carries credit, once the remote end may have used half of what it was given.
+/// @param refresh Also send it if the remote end has not been told for SECIL_CREDIT_REFRESH_MS, in case that was lost.
+secil_error_t secil_flow_update(bool refresh)
+{
+    secil_error_t result = SECIL_OK;
+
+    secil_lock();
+    if (secil_state.available_callback)
+    {
+        size_t pending = secil_state.available_callback(secil_state.user_data);
+        if (pending > secil_state.flow.stats.rx_peak)
+        {
+            secil_state.flow.stats.rx_peak = pending < UINT16_MAX ? (uint16_t)pending : UINT16_MAX;
+        }
+    }
+
+    uint32_t window = (uint32_t)(secil_state.flow.rx_buffer - CREDIT_RESERVE);
+    bool due = (int32_t)(secil_state.flow.granted - secil_state.flow.consumed) <= (int32_t)(window / 2)
+            || (refresh && secil_state.clock_callback && secil_now() - secil_state.flow.granted_at >= SECIL_CREDIT_REFRESH_MS);
+    if (secil_flow_offered() && due)
+    {
+        secil_message message = { .which_payload = 0 };
+#if SECIL_RELIABLE
+        // It may take the place of a frame that only carried an acknowledgement, so it carries one too
+        if (secil_state.reliable.window > 0)
+        {
+            secil_reliable_add_ack(&message);
+        }
+#endif
+        secil_flow_add_credit(&message);
+        result = secil_send(&message);
+    }
+    secil_unlock();
+
+    return result;
+}
+
+#if SECIL_TX_CREDITS
+
+/// @brief Take the credit given by the remote end.
+/// @note The caller must hold the lock.
+static void secil_flow_on_credit(uint32_t credit)
+{
+    // Credit is counted from our last handshake, so credit that would let us have more than the window in flight was
+    // given before the remote end read that handshake, and is ignored
+    if (   secil_state.flow.remote_window == 0 || (int32_t)(credit - secil_state.flow.sent) > (int32_t)secil_state.flow.remote_window
+        || (int32_t)(credit - secil_state.flow.limit) <= 0)
+    {
+        return;
+    }
+
+    secil_state.flow.limit = credit;
+    secil_state.flow.stats.credits_received++;
+}
+
+/// @brief Take the credit carried by a frame received (that of a handshake is taken once the handshake is handled).
+void secil_flow_on_receipt(const secil_message *message)
+{
+    if (message->has_credit && message->which_payload != secil_message_handshake_tag)
+    {
+        secil_lock();
+        secil_flow_on_credit(message->credit);
+        secil_unlock();
+    }
+}
+
+/// @brief Check whether the remote end has room for a write of the given size.
+/// @note The caller must hold the lock.
+bool secil_flow_allows(size_t size)
+{
+    if (secil_state.flow.remote_window == 0 || secil_state.tx.draining)
+    {
+        return true;
+    }
+
+    // A write larger than the whole window would never fit, so it goes out once everything before it has been read
+    int32_t credit = (int32_t)(secil_state.flow.limit - secil_state.flow.sent);
+    return credit >= (int32_t)size || credit >= (int32_t)secil_state.flow.remote_window;
+}
+
+/// @brief Count a write, and start counting afresh after our handshake.
+/// @note The caller must hold the lock.
+void secil_flow_wrote(size_t size, bool handshake)
+{
+    secil_state.flow.sent += (uint32_t)size;
+    if (handshake)
+    {
+        // Nothing more goes out until the remote end has read the handshake and given credit again
+        secil_state.flow.sent = 0;
+        secil_state.flow.limit = 0;
+    }
+}
+
+/// @brief Note when frames start and stop being held back for lack of credit.
+/// @note The caller must hold the lock.
+void secil_flow_stall(bool stalled)
+{
+    if (stalled == secil_state.flow.stalled)
+    {
+        return;
+    }
+
+    uint32_t now = secil_now();
+    if (stalled)
+    {
+        secil_state.flow.stats.stalls++;
+        secil_state.flow.stalled_at = now;
+    }
+    else
+    {
+        secil_state.flow.stats.stalled_ms += now - secil_state.flow.stalled_at;
+    }
+    secil_state.flow.stalled = stalled;
+}
+
+#endif // SECIL_TX_CREDITS
+
+/// @brief Count afresh after a handshake from the remote end, which also counts afresh once it has sent it.
+/// @param handshake_message The handshake, whose credit is taken once we know the remote end's window.
+void secil_flow_on_handshake(const secil_message *handshake_message)
+{
+    const secil_handshake *handshake = &handshake_message->payload.handshake;
+
+    secil_lock();
+    // The remote end is told at once how much it may send
+    secil_state.flow.consumed = 0;
+    secil_state.flow.granted = 0;
+
+#if SECIL_TX_CREDITS
+    bool limited = (secil_state.agreed_capabilities & SECIL_CAPABILITY_FLOW_CONTROL) && handshake->has_rx_buffer
+                && handshake->rx_buffer > CREDIT_RESERVE;
+    secil_state.flow.remote_window = limited ? (uint16_t)(handshake->rx_buffer - CREDIT_RESERVE) : 0;
+    if (handshake_message->has_credit)
+    {
+        secil_flow_on_credit(handshake_message->credit);
+    }
+#else
+    (void)handshake;
+#endif
+    secil_unlock();
+}
+
+#endif // SECIL_FLOW_CONTROL
@@ -0,0 +1,295 @@
+#include "secil_internal.h"
+
+#if SECIL_HEARTBEAT
+/// @brief Start a heartbeat with the next number that echoes the last one received, and carries credit when flow control
+///        is in use.
+/// @note The caller must hold the lock.
+static void secil_heartbeat_message(secil_message *message, bool needs_answer)
+{
+    memset(message, 0, sizeof(*message));
+    message->which_payload = secil_message_heartbeat_tag;
+    message->payload.heartbeat.seq = secil_state.heartbeat.next_seq++;
+    message->payload.heartbeat.sent_at = secil_now();
+    message->payload.heartbeat.has_needs_answer = needs_answer;
+    message->payload.heartbeat.needs_answer = needs_answer;
+    if (secil_state.heartbeat.echo_pending)
+    {
+        message->payload.heartbeat.has_echo_sent_at = true;
+        message->payload.heartbeat.echo_sent_at = secil_state.heartbeat.echo_sent_at;
+        message->payload.heartbeat.has_echo_received_at = true;
+        message->payload.heartbeat.echo_received_at = secil_state.heartbeat.echo_received_at;
+        secil_state.heartbeat.echo_pending = false;
+    }
+    secil_state.heartbeat.stats.heartbeats_sent++;
+#if SECIL_FLOW_CONTROL
+    secil_flow_add_credit(message);
+#endif
+}
+
+/// @brief Note that a frame has arrived, which brings the link back up if it was down, and mark the time it arrived on
+///        a message that carries a timestamp.
+void secil_heartbeat_on_receipt(secil_message *message)
+{
+    // Only the receiving end sets received_at, whatever came in it
+    message->has_received_at = message->has_sent_at && secil_state.clock_callback;
+    if (!secil_state.clock_callback)
+    {
+        return;
+    }
+
+    uint32_t now = secil_now();
+    message->received_at = now;
+    secil_lock();
+    bool was_down = secil_state.heartbeat.down;
+    secil_state.heartbeat.rx_at = now;
+    secil_state.heartbeat.down = false;
+    secil_unlock();
+
+    if (was_down)
+    {
+        secil_log(secil_LOG_INFO, "Link up again.");
+    }
+}
+
+/// @brief Count the heartbeats of the remote end that went missing before this one, into a running loss rate.
+/// @note The caller must hold the lock.
+static void secil_heartbeat_count(uint16_t seq)
+{
+    uint16_t lost = secil_state.heartbeat.rx_seq_valid ? (uint16_t)(seq - secil_state.heartbeat.rx_next_seq) : 0;
+    if (lost >= 0x8000)
+    {
+        // Older than the last one, so it is not a gap
+        return;
+    }
+    secil_state.heartbeat.rx_seq_valid = true;
+    secil_state.heartbeat.rx_next_seq = (uint16_t)(seq + 1);
+    secil_state.heartbeat.stats.heartbeats_lost += lost;
+
+    // Every heartbeat moves the rate a sixteenth of the way towards 1000 if it was lost, or 0 if it arrived.
+    // After 64 missing in a row the rate is 1000 anyway.
+    for (uint16_t i = 0; i < lost && i < 64; i++)
+    {
+        secil_state.heartbeat.loss = (uint16_t)(secil_state.heartbeat.loss - secil_state.heartbeat.loss / 16 + 1000);
+    }
+    secil_state.heartbeat.loss = (uint16_t)(secil_state.heartbeat.loss - secil_state.heartbeat.loss / 16);
+}
+
+/// @brief Take a round trip time into the smoothed round trip time and its deviation, as TCP does (RFC 6298).
+/// @note The caller must hold the lock.
+static void secil_heartbeat_measured(uint32_t rtt)
+{
+    if (!secil_state.heartbeat.measured || rtt < secil_state.heartbeat.stats.rtt_min_ms)
+    {
+        secil_state.heartbeat.stats.rtt_min_ms = rtt;
+    }
+
+    if (!secil_state.heartbeat.measured)
+    {
+        secil_state.heartbeat.measured = true;
+        secil_state.heartbeat.srtt = rtt * 8;
+        secil_state.heartbeat.rttvar = rtt * 2;
+        return;
+    }
+
+    // The smoothed time moves an eighth of the way to the new one, and the deviation a quarter of the way
+    int32_t delta = (int32_t)(rtt * 8) - (int32_t)secil_state.heartbeat.srtt;
+    secil_state.heartbeat.srtt = (uint32_t)((int32_t)secil_state.heartbeat.srtt + delta / 8);
+    int32_t deviation = (delta < 0 ? -delta : delta) / 2;
+    secil_state.heartbeat.rttvar = (uint32_t)((int32_t)secil_state.heartbeat.rttvar + (deviation - (int32_t)secil_state.heartbeat.rttvar) / 4);
+}
+
+/// @brief Divide by 1000, rounding to the nearest (such as microseconds to ms).
+int32_t secil_clock_thousandths(int64_t value)
+{
+    return (int32_t)(value >= 0 ? (value + 500) / 1000 : -((-value + 500) / 1000));
+}
+
+/// @brief Work out the offset of the remote end's clock at a time by ours, from the best sample and the drift since.
+/// @note The caller must hold the lock, and an offset must have been measured.
+int64_t secil_clock_offset_at(uint32_t at)
+{
+    int32_t elapsed = (int32_t)(at - secil_state.clock.best.at);
+    return secil_state.clock.best.offset_us + (int64_t)secil_state.clock.drift_ppb * elapsed / 1000000;
+}
+
+/// @brief Take the four times of an NTP exchange into the clock filter, which keeps the offset measured over the
+///        shortest round trip of the last few, and work out the drift once that has moved far enough from the last.
+/// @param sent Our clock when we sent the heartbeat that was echoed.
+/// @param received The remote end's clock when that arrived.
+/// @param answered The remote end's clock when it sent the echo.
+/// @param now Our clock when the echo arrived.
+/// @note The caller must hold the lock.
+static void secil_clock_sample(uint32_t sent, uint32_t received, uint32_t answered, uint32_t now)
+{
+    // The offset plus the time on the way out, and the offset less the time on the way back. The second is taken as a
+    // difference from the first, so that both stay on the same side of a wrap of the clocks.
+    int32_t out = (int32_t)(received - sent);
+    int32_t back = out + (int32_t)((answered - now) - (received - sent));
+    int32_t delay = (int32_t)((now - sent) - (answered - received));
+
+    uint8_t index = secil_state.clock.next;
+    secil_state.clock.samples[index].offset_us = ((int64_t)out + back) * 500;
+    secil_state.clock.samples[index].at = now;
+    secil_state.clock.samples[index].delay = delay > 0 ? (uint32_t)delay : 0;
+    secil_state.clock.next = (uint8_t)((index + 1) % SECIL_CLOCK_SAMPLES);
+    if (secil_state.clock.count < SECIL_CLOCK_SAMPLES)
+    {
+        secil_state.clock.count++;
+    }
+    secil_state.clock.measured++;
+
+    // The shortest round trip was held up least on the way, so its offset is the closest. Ties go to the latest.
+    uint8_t best = index;
+    for (uint8_t i = 0; i < secil_state.clock.count; i++)
+    {
+        if (secil_state.clock.samples[i].delay < secil_state.clock.samples[best].delay)
+        {
+            best = i;
+        }
+    }
+    secil_state.clock.best = secil_state.clock.samples[best];
+
+    // Until the filter is full, the best offset may still be one held up on the way, which would throw the drift out
+    if (secil_state.clock.count < SECIL_CLOCK_SAMPLES)
+    {
+        return;
+    }
+
+    if (!secil_state.clock.referenced)
+    {
+        secil_state.clock.reference = secil_state.clock.best;
+        secil_state.clock.referenced = true;
+        return;
+    }
+
+    int32_t elapsed = (int32_t)(secil_state.clock.best.at - secil_state.clock.reference.at);
+    if (elapsed < SECIL_CLOCK_DRIFT_MS)
+    {
+        return;
+    }
+
+    int64_t drift = (secil_state.clock.best.offset_us - secil_state.clock.reference.offset_us) * 1000000 / elapsed;
+    secil_state.clock.reference = secil_state.clock.best;
+    if (drift > 100000000 || drift < -100000000)
+    {
+        // Over a tenth is not an oscillator drifting but the remote end's clock being set
+        secil_log(secil_LOG_WARNING, "Remote clock jumped by %ld ms - drift not updated.",
+                  (long)secil_clock_thousandths(drift * elapsed / 1000000));
+        return;
+    }
+
+    // The drift moves a quarter of the way to each new one
+    if (!secil_state.clock.drift_measured)
+    {
+        secil_state.clock.drift_measured = true;
+        secil_state.clock.drift_ppb = (int32_t)drift;
+    }
+    else
+    {
+        secil_state.clock.drift_ppb += (int32_t)((drift - secil_state.clock.drift_ppb) / 4);
+    }
+}
+
+/// @brief Put our clock into an application message as it goes out, if timestamps are on.
+/// @note The caller must hold the lock.
+void secil_clock_stamp(secil_message *message)
+{
+    // A received message sent back (as loopback tests are) must not pass on the time it arrived
+    message->has_received_at = false;
+    message->has_sent_at = secil_state.clock.timestamps && secil_state.clock_callback;
+    message->sent_at = message->has_sent_at ? secil_now() : 0;
+}
+
+/// @brief Handle a heartbeat from the remote end: measure the round trip if it echoes one of ours, and answer it if asked.
+secil_error_t secil_handle_heartbeat(const secil_heartbeat *heartbeat)
+{
+    bool answer = heartbeat->has_needs_answer && heartbeat->needs_answer;
+    secil_message reply;
+
+    secil_lock();
+    // When the frame arrived, which was read before waiting for the lock behind any frame being sent
+    uint32_t now = secil_state.heartbeat.rx_at;
+    secil_state.heartbeat.stats.heartbeats_received++;
+    secil_heartbeat_count((uint16_t)heartbeat->seq);
+
+    if (heartbeat->has_echo_sent_at && heartbeat->has_echo_received_at && secil_state.clock_callback)
+    {
+        // The time since we sent ours, less the time the remote end held it before sending this one, by its own clock
+        int32_t rtt = (int32_t)((now - heartbeat->echo_sent_at) - (heartbeat->sent_at - heartbeat->echo_received_at));
+        secil_heartbeat_measured(rtt > 0 ? (uint32_t)rtt : 0);
+        secil_clock_sample(heartbeat->echo_sent_at, heartbeat->echo_received_at, heartbeat->sent_at, now);
+    }
+
+    // The next heartbeat we send, whether it is the answer or comes later, lets the remote end measure the round trip
+    secil_state.heartbeat.echo_pending = true;
+    secil_state.heartbeat.echo_sent_at = heartbeat->sent_at;
+    secil_state.heartbeat.echo_received_at = now;
+    if (!answer)
+    {
+        secil_unlock();
+        return SECIL_OK;
+    }
+
+    // Sent before letting go of the lock, so that no other frame goes out between the time in it and the answer
+    secil_heartbeat_message(&reply, false);
+    secil_error_t result = secil_send(&reply);
+    secil_unlock();
+
+    secil_error_t flush_result = secil_tx_flush();
+    return result != SECIL_OK ? result : flush_result;
+}
+
+/// @brief Send a heartbeat once nothing has been sent for our interval or the clock sync interval has passed, and call
+///        the link down callback once nothing has arrived for missed_limit intervals of the remote end.
+secil_error_t secil_heartbeat_poll()
+{
+    if (!secil_state.clock_callback)
+    {
+        return SECIL_OK;
+    }
+
+    secil_message message;
+    secil_lock();
+    uint32_t now = secil_now();
+    bool agreed = secil_state.connection.state == SECIL_CONNECTED && (secil_state.agreed_capabilities & SECIL_CAPABILITY_HEARTBEAT);
+    uint32_t silent = now - secil_state.heartbeat.rx_at;
+    bool down = agreed && !secil_state.heartbeat.down && secil_state.heartbeat.remote_interval > 0 && secil_state.heartbeat.missed_limit > 0
+             && silent >= (uint32_t)secil_state.heartbeat.missed_limit * secil_state.heartbeat.remote_interval;
+    if (down)
+    {
+        secil_state.heartbeat.down = true;
+        secil_state.heartbeat.stats.link_downs++;
+    }
+
+    bool quiet = secil_state.heartbeat.interval > 0 && now - secil_state.heartbeat.tx_at >= secil_state.heartbeat.interval;
+    bool sync = secil_state.clock.interval > 0 && now - secil_state.clock.asked_at >= secil_state.clock.interval;
+    bool send = agreed && (quiet || sync);
+    secil_error_t result = SECIL_OK;
+    if (send)
+    {
+        // Sent before letting go of the lock, so that no other frame goes out between the time in it and the heartbeat
+        secil_heartbeat_message(&message, true);
+        result = secil_send(&message);
+        // Counted as sent now, so that no more than one waits in a send queue that is held back
+        secil_state.heartbeat.tx_at = now;
+        secil_state.clock.asked_at = now;
+    }
+    secil_unlock();
+
+    if (down)
+    {
+        secil_log(secil_LOG_WARNING, "Nothing from the remote end for %u ms - link down.", (unsigned)silent);
+        if (secil_state.heartbeat.on_link_down)
+        {
+            secil_state.heartbeat.on_link_down(secil_state.user_data, silent);
+        }
+    }
+
+    if (!send)
+    {
+        return SECIL_OK;
+    }
+    secil_error_t flush_result = secil_tx_flush();
+    return result != SECIL_OK ? result : flush_result;
+}
+#endif
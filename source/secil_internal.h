@@ -0,0 +1,623 @@
+/// @file secil_internal.h
+/// @brief Private to the library: its state, and the functions that its source files share.
+///        secil.c holds the core of the library and its API. Each larger optional subsystem has a source file of its
+///        own, whose body is compiled out unless the build uses it.
+
+#if !defined(SECIL_INTERNAL_H)
+#define SECIL_INTERNAL_H
+
+#include "secil.h"
+
+#include <pb.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include <pb_common.h>
+#include "secil.pb.h"
+
+#define RETURN_IF_ERROR(operation, log) \
+    do                  \
+    {                   \
+        secil_error_t err = (operation); \
+        if (err != SECIL_OK) \
+        { \
+            if (log) secil_log(secil_LOG_DEBUG, log); \
+            return err; \
+        } \
+    } while (0)
+
+// Frames use the v1 layout "CA FE len_lo len_hi | message with a varint length prefix | crc_lo crc_hi FA DE",
+// or once both ends offer SECIL_CAPABILITY_COMPACT_FRAMES the v2 layout "CA F2 len | message | crc_lo crc_hi".
+// Once they also offer SECIL_CAPABILITY_COMPRESSION, a v2 frame "CA F3 len | compressed message | crc_lo crc_hi"
+// carries a message that is shorter once compressed.
+// The CRC covers the header and the message as sent. Both layouts are always accepted on receipt.
+#define HEADER_SIZE 4
+#define FOOTER_SIZE 4
+#define COMPACT_HEADER_SIZE 3
+#define COMPACT_FOOTER_SIZE 2
+#define COMPACT_MAX_BODY 255
+#define HEADROOM 8
+#define MAX_MESSAGE_SIZE (HEADER_SIZE + secil_message_size + FOOTER_SIZE + HEADROOM)
+#define TX_ENTRY_HEADER_SIZE 7 // Frame length, the clock when it was queued and flags, ahead of each frame in a send queue
+#define TX_ENTRY_HANDSHAKE 0x01 // Flag of a handshake, after which the bytes sent are counted afresh for flow control
+#define FRAGMENT_HEADER_SIZE 2 // Stream and index, ahead of the piece of the frame in each fragment
+#define FRAGMENT_INDEX_MASK 0x7F
+#define FRAGMENT_LAST 0x80     // Set in the index byte of the last fragment of a frame
+#define CREDIT_FRAME_SIZE 32   // Room for a frame that only carries credit and an acknowledgement
+#define CREDIT_RESERVE (2 * CREDIT_FRAME_SIZE) // Receive buffer kept back from the credit given, for those frames
+
+// NOTE: The configuration options used below are documented in secil_config.h
+
+#if SECIL_STREAMING_TX
+#if SECIL_TX_CHUNK_SIZE < HEADER_SIZE || SECIL_TX_CHUNK_SIZE < FOOTER_SIZE
+#error "SECIL_TX_CHUNK_SIZE must be large enough to hold a frame header or footer"
+#endif
+#define OUTGOING_BUFFER_SIZE SECIL_TX_CHUNK_SIZE
+#else
+#define OUTGOING_BUFFER_SIZE MAX_MESSAGE_SIZE
+#endif
+
+// Queries need both of their message types, either of which may be excluded from the build
+#if defined(secil_message_query_tag) && defined(secil_message_queryReply_tag)
+#define SECIL_QUERIES 1
+#else
+#define SECIL_QUERIES 0
+#endif
+
+// The state digest keeps the values that can be queried in step, so it needs queries and their shadow.
+// Values are hashed while they are encoded, which needs a stream callback.
+#if SECIL_STATE_DIGEST && SECIL_QUERIES && SECIL_QUERY_SHADOW && defined(secil_message_stateDigest_tag) && !defined(PB_BUFFER_ONLY)
+#define SECIL_RESYNC 1
+#else
+#define SECIL_RESYNC 0
+#endif
+
+// Switching the UART rate needs its message type, which may be excluded from the build
+#if defined(secil_message_baudSwitch_tag)
+#define SECIL_BAUD_SWITCH 1
+#else
+#define SECIL_BAUD_SWITCH 0
+#endif
+
+// Bulk transfers need their message type, which may be excluded from the build
+#if defined(secil_message_bulk_tag)
+#define SECIL_BULK 1
+#else
+#define SECIL_BULK 0
+#endif
+
+// Heartbeats need their message type, which may be excluded from the build
+#if defined(secil_message_heartbeat_tag)
+#define SECIL_HEARTBEAT 1
+#else
+#define SECIL_HEARTBEAT 0
+#endif
+
+// The string dictionary holds warning texts, so it needs the warning message type, which may be excluded from the build
+#if defined(secil_message_warning_tag)
+#define SECIL_DICTIONARY 1
+#else
+#define SECIL_DICTIONARY 0
+#endif
+
+// Compression needs the whole message encoded before it goes out, so it cannot be used while streaming
+#if SECIL_COMPRESSION && !SECIL_STREAMING_TX
+#define SECIL_LZ 1
+#else
+#define SECIL_LZ 0
+#endif
+
+// Likewise a frame has to be encoded in full before it can wait in a queue
+#if SECIL_TX_SCHEDULER && !SECIL_STREAMING_TX
+#define SECIL_TX_QUEUES 1
+#if SECIL_TX_QUEUE_SIZE < TX_ENTRY_HEADER_SIZE + MAX_MESSAGE_SIZE || SECIL_TX_QUEUE_SIZE > 65535
+#error "SECIL_TX_QUEUE_SIZE must hold the largest frame and its entry header, and be below 64 KB"
+#endif
+#else
+#define SECIL_TX_QUEUES 0
+#endif
+
+// Any build that offers fragments puts them back together, but only one with the send queues sends them
+#if SECIL_FRAGMENTATION
+#define SECIL_FRAGMENTS 1
+#if SECIL_FRAGMENT_SIZE < 1 || SECIL_FRAGMENT_SIZE > COMPACT_MAX_BODY - FRAGMENT_HEADER_SIZE
+#error "SECIL_FRAGMENT_SIZE must be between 1 and 253"
+#endif
+#if (MAX_MESSAGE_SIZE + SECIL_FRAGMENT_SIZE - 1) / SECIL_FRAGMENT_SIZE > FRAGMENT_INDEX_MASK + 1
+#error "SECIL_FRAGMENT_SIZE is too small to send the largest frame in 128 fragments"
+#endif
+#else
+#define SECIL_FRAGMENTS 0
+#endif
+
+// Likewise any build that offers flow control tells the remote end how much it can take, but only one with the send
+// queues can hold frames back when the remote end has no room for them
+#if SECIL_FLOW_CONTROL && SECIL_TX_QUEUES
+#define SECIL_TX_CREDITS 1
+#else
+#define SECIL_TX_CREDITS 0
+#endif
+
+// The capabilities that this build can offer
+#define SECIL_BUILD_CAPABILITIES (  SECIL_CAPABILITY_COMPACT_FRAMES \
+                                  | (SECIL_RESYNC ? SECIL_CAPABILITY_STATE_DIGEST : 0) \
+                                  | (SECIL_LZ ? SECIL_CAPABILITY_COMPRESSION : 0) \
+                                  | (SECIL_FRAGMENTS ? SECIL_CAPABILITY_FRAGMENTS : 0) \
+                                  | (SECIL_FLOW_CONTROL ? SECIL_CAPABILITY_FLOW_CONTROL : 0) \
+                                  | (SECIL_HEARTBEAT ? SECIL_CAPABILITY_HEARTBEAT : 0))
+
+#if SECIL_MAX_PENDING_REQUESTS < 1
+#error "SECIL_MAX_PENDING_REQUESTS must be at least 1"
+#endif
+
+#if SECIL_LOOPBACK_HOLD < 1 || SECIL_LOOPBACK_HOLD > 255
+#error "SECIL_LOOPBACK_HOLD must be between 1 and 255"
+#endif
+
+/// @brief A request that is waiting for its response.
+typedef struct
+{
+    uint16_t id;                    // request_id sent with the request, 0 when the entry is free
+    pb_size_t response_tag;         // Payload that the response must carry
+#if defined(secil_message_loopbackTest_tag)
+    char echo[sizeof(((secil_message *)0)->payload.loopbackTest.data)]; // Data that a loopback reply must echo back
+#endif
+    bool completed;                 // The result is waiting to be collected by secil_request_poll()
+    secil_error_t result;
+    uint32_t sent_at;               // Clock when the request was sent
+    secil_response_fn on_response;  // Null if the application polls for the result instead
+    void *context;
+} secil_pending_request_t;
+
+#if SECIL_TX_QUEUES
+/// @brief Frames of one priority class waiting to be written, each as a [length][queued at][frame] entry in a ring.
+typedef struct
+{
+    uint8_t buf[SECIL_TX_QUEUE_SIZE];
+    uint16_t head;  // Offset of the oldest entry
+    uint16_t used;  // Bytes taken by the entries
+    secil_tx_class_stats_t stats;
+} secil_tx_queue_t;
+#endif
+
+/// @brief Progress of a UART rate switch.
+typedef enum
+{
+    BAUD_IDLE,
+    BAUD_PROPOSED,  // We proposed a switch and wait for the remote end to accept it
+    BAUD_VERIFYING, // The remote end accepted and we have switched - our probe at the new rate waits for its answer
+    BAUD_ACCEPTED,  // We accepted the remote end's proposal and have switched - we wait for its probe
+} secil_baud_phase_t;
+
+/// @brief Everything the library knows, shared by its source files.
+typedef struct
+{
+    secil_read_fn read_callback;
+    secil_write_fn write_callback;
+    secil_available_fn available_callback;
+    secil_read_within_fn read_within_callback;
+    secil_clock_fn clock_callback;
+    secil_sleep_fn sleep_callback;
+    secil_lock_fn lock_callback;
+    secil_lock_fn unlock_callback;
+    secil_value_provider_fn value_provider;
+    secil_on_connect_fn on_connect;
+    secil_log_fn logger;
+    secil_operating_mode_t mode;
+    char remote_version[32]; // Version string of the remote end
+    uint32_t local_subscriptions;  // Bit n is set if we want the values with payload tag n (sent in our handshake)
+    uint32_t remote_subscriptions; // Bit n is set if the remote end wants the values with payload tag n
+    uint32_t local_capabilities;   // SECIL_CAPABILITY_* bits offered in our handshake
+    uint32_t agreed_capabilities;  // The ones the remote end offered too, 0 until its handshake arrives
+    uint16_t remote_max_frame_size; // Largest v1 frame the remote end can receive, 0 if it did not say
+    void *user_data; // User data pointer passed to callbacks
+
+    char log_buffer[128]; // Buffer for logging messages
+
+    // Deadline of secil_receive_until(), and the frame it cut short. Inter-byte timeout, and the frame it abandoned.
+    struct
+    {
+        bool has_deadline;   // Reads give up at the deadline (only while inside secil_receive_until())
+        uint32_t deadline;   // Clock at which to give up
+        bool expired;        // A read gave up at the deadline
+        uint16_t kept;       // Bytes of the frame cut short that are still at the start of the incoming message buffer
+        uint16_t gap_chars;  // Longest gap allowed within a frame in character times, 0 if gaps are not timed
+        uint16_t gap_min_ms; // Shortest gap allowed within a frame, whatever the rate
+        uint32_t gap_ms;     // The two together at the rate of the UART
+        bool abandoned;      // A read gave up on a frame that stopped arriving part way
+        uint16_t rescan_at;  // Bytes of the abandoned frame still to be read again, in the incoming message buffer
+        uint16_t rescan_end;
+    } receive;
+
+#if SECIL_HALF_DUPLEX
+    union
+    {
+#endif
+    uint8_t outgoingMessage[OUTGOING_BUFFER_SIZE]; // Buffer for encoding messages (one chunk when streaming)
+    uint8_t incomingMessage[MAX_MESSAGE_SIZE]; // Buffer for decoding messages
+#if SECIL_HALF_DUPLEX
+    }; // Sending and receiving share one buffer, the incoming frame is always decoded before anything is sent
+#endif
+
+#if SECIL_DICTIONARY
+    // Warning texts sent as their index, once the remote end has offered the same dictionary hash
+    struct
+    {
+        const char *const *entries;
+        uint16_t count;
+        bool expand;    // Expand the index of warnings received back into their text
+        uint32_t hash;  // 0 if there is no dictionary
+        bool in_use;
+    } dictionary;
+#endif
+
+#if SECIL_LZ
+    struct
+    {
+        uint32_t compressed_frames;
+        uint32_t bytes_before;
+        uint32_t bytes_after;
+#if SECIL_HALF_DUPLEX
+        union
+        {
+#endif
+        uint8_t inflated[secil_message_size];  // A compressed message received, once expanded
+        uint8_t deflated[COMPACT_MAX_BODY];    // A message being compressed before it is sent
+#if SECIL_HALF_DUPLEX
+        }; // Like the frame buffers, the incoming message is always decoded before anything is sent
+#endif
+    } lz;
+#endif
+
+#if SECIL_TX_QUEUES
+    // Frames waiting to be written, one queue per priority class
+    struct
+    {
+        secil_tx_queue_t queues[SECIL_TX_CLASSES];
+        bool writing;       // A thread is writing frames outside the lock, and will also write any that are queued meanwhile
+        uint8_t bulk_passed; // Frames that have gone out ahead of a waiting bulk frame
+#if SECIL_FRAGMENTS
+        secil_tx_class_t fragmenting; // Class whose oldest frame is part way out in fragments
+        uint16_t fragment_offset;     // Bytes of that frame sent so far, 0 if no frame is part way out
+        uint8_t stream;               // Stream of the last frame sent in fragments
+        uint8_t fragment[COMPACT_HEADER_SIZE + FRAGMENT_HEADER_SIZE + SECIL_FRAGMENT_SIZE + COMPACT_FOOTER_SIZE];
+#endif
+#if SECIL_TX_CREDITS
+        // A frame that only carries credit (or an acknowledgement) goes out ahead of the queues, and is never held back
+        // for lack of credit, or each end could wait for the other's forever. Each one supersedes the one before.
+        uint8_t credit_frame[CREDIT_FRAME_SIZE];
+        uint8_t credit_frame_size; // 0 if there is none waiting
+        bool draining;             // Frames go out whatever the credit, as the UART rate is about to change
+#endif
+    } tx;
+#endif
+
+#if SECIL_FLOW_CONTROL
+    // Credit based flow control: each end counts the bytes since the last handshake, and tells the other how many more
+    // its receive buffer can take
+    struct
+    {
+        uint16_t rx_buffer;     // Size of the transport's receive buffer, 0 if the remote end is not limited
+        uint32_t consumed;      // Bytes read from the transport since the remote end's last handshake
+        uint32_t granted;       // The credit last given: the remote end may send until it has sent this many bytes
+        uint32_t granted_at;    // Clock when it was given
+#if SECIL_TX_CREDITS
+        uint16_t remote_window; // Most the remote end lets us have in flight, 0 if it does not limit us
+        uint32_t sent;          // Bytes written since our last handshake
+        uint32_t limit;         // The credit given by the remote end, counted like sent
+        bool stalled;           // Frames are held back for lack of credit
+        uint32_t stalled_at;    // Clock when they started to be
+#endif
+        secil_flow_stats_t stats;
+    } flow;
+#endif
+
+#if SECIL_RATE_LIMITS
+    // Token bucket of the application messages of each priority class
+    struct
+    {
+        uint32_t rate;        // Bytes per second, 0 if the class is not limited
+        uint16_t burst;       // Bytes the bucket holds when full
+        secil_rate_overflow_t overflow;
+        uint32_t tokens;      // Thousandths of a byte, so that the bucket fills smoothly at any rate
+        uint32_t filled_at;   // Clock when the tokens were last topped up
+        uint32_t held;        // Bit per payload tag of the values held back to go out from secil_poll()
+        secil_rate_stats_t stats;
+    } rate[SECIL_TX_CLASSES];
+#endif
+
+#if SECIL_FRAGMENTS
+    // A frame received in fragments is put back together here, then read again as if it had just arrived
+    struct
+    {
+        uint8_t buf[MAX_MESSAGE_SIZE];
+        uint16_t size;        // Bytes put back together so far
+        uint16_t replayed;    // Bytes read again so far, once the frame is complete
+        bool replaying;       // secil_read() takes bytes from buf instead of the transport
+        bool active;          // A frame is part way through being put back together
+        uint8_t stream;
+        uint8_t next_index;
+    } fragments;
+#endif
+
+#if SECIL_RELIABLE
+    struct
+    {
+        uint8_t local_window;  // Window offered in our handshake
+        uint8_t window;        // Window agreed with the remote end, 0 when the reliable channel is not in use
+
+        // Sending side: frames tx_base up to (but not including) tx_next are waiting for an acknowledgement
+        uint16_t tx_base;
+        uint16_t tx_next;
+        uint32_t tx_acked;     // Bit i is set if frame tx_base + i has been selectively acknowledged
+        uint32_t tx_counter;   // Counts every transmission, to tell which frames went out before which
+        uint32_t tx_order[SECIL_RELIABLE_WINDOW];   // tx_counter at the last transmission of each frame
+        uint32_t tx_sent_at[SECIL_RELIABLE_WINDOW]; // Clock at the last transmission of each frame
+        secil_message tx_frames[SECIL_RELIABLE_WINDOW];
+
+        // Receiving side: rx_next is the next frame to deliver to the application
+        uint16_t rx_next;
+        uint32_t rx_held;      // Bit i is set if frame rx_next + i has arrived early and is held in rx_frames
+        bool ack_pending;      // True if the remote end has not been told about the latest frames received
+        secil_message rx_frames[SECIL_RELIABLE_WINDOW];
+
+        secil_reliable_stats_t stats;
+    } reliable;
+#endif
+
+    // Progress of the handshake, driven by secil_poll() and by the frames received
+    struct
+    {
+        secil_connection_state_t state;
+        bool fail_on_version_mismatch; // Set by secil_startup(), which gives up on a version mismatch
+        uint32_t started_at;           // Clock when connecting started
+        uint32_t retry_at;             // Clock at which the handshake is sent again if the remote end has not answered
+        uint32_t retry_interval;       // Doubles after every attempt, up to SECIL_HANDSHAKE_RETRY_MAX_MS
+        uint32_t session;              // Session of the connection, chosen by the client (0 until there is one)
+        uint32_t sessions_started;     // Mixed into new sessions so that they differ even without a clock
+        bool resuming;                 // Connected from a resumption ticket, and the remote end has not answered yet
+        secil_connection_stats_t stats;
+    } connection;
+
+    // Requests waiting for a response, matched to it by request_id
+    struct
+    {
+        uint16_t next_id;
+        secil_pending_request_t pending[SECIL_MAX_PENDING_REQUESTS];
+    } requests;
+
+#if defined(secil_message_loopbackTest_tag)
+    // Application messages that arrived while secil_loopback_test() waited for its reply, for the next receive. Only
+    // the thread that receives fills or empties it, so it is not locked.
+    struct
+    {
+        secil_message messages[SECIL_LOOPBACK_HOLD];
+        uint8_t head;
+        uint8_t count;
+    } held;
+#endif
+
+#if SECIL_QUERIES && SECIL_QUERY_SHADOW
+    secil_queryReply shadow; // The last value sent of each type that can be queried
+#endif
+
+#if SECIL_RESYNC
+    uint16_t received_hashes[32]; // Hash of the last value received with each payload tag, 0 if there is none
+#endif
+
+#if SECIL_BAUD_SWITCH
+    // UART rate switch, driven by the baudSwitch messages received and by secil_poll()
+    struct
+    {
+        secil_set_speed_fn set_speed;
+        uint32_t local_rates;   // SECIL_BAUD_* bits offered in our handshake
+        uint32_t remote_rates;  // SECIL_BAUD_* bits offered in the remote end's handshake
+        uint32_t boot_baud;     // Rate both ends start at
+        uint32_t previous_baud; // Rate to go back to if the switch fails
+        uint32_t target_baud;   // Rate of the switch under way
+        secil_baud_phase_t phase;
+        uint32_t deadline;      // Clock at which the switch under way is given up
+        uint32_t probe_at;      // Clock at which the probe is sent again
+        secil_baud_stats_t stats;
+    } baud;
+#endif
+
+#if SECIL_BULK
+    // Bulk transfers: at most one outgoing and one incoming at a time, their data streamed through the callbacks
+    struct
+    {
+        secil_bulk_open_fn on_open;
+        secil_bulk_write_fn on_write;
+        secil_bulk_read_fn on_read;
+        secil_bulk_done_fn on_done;
+        uint16_t last_transfer; // Number of the last transfer we opened
+
+        struct
+        {
+            bool active;
+            bool opened;           // The remote end has answered our BULK_OPEN
+            uint16_t transfer;
+            uint32_t kind;
+            uint32_t size;
+            uint32_t acked;        // Every byte below this has been acknowledged
+            uint32_t next;         // Offset of the next chunk to send
+            uint16_t chunk_size;   // Agreed with the remote end when it answers BULK_OPEN
+            uint32_t progress_at;  // Clock at the last acknowledgement, after which unacknowledged chunks are sent again
+            uint32_t started_at;
+            uint32_t finished_at;
+            uint32_t retransmitted;
+        } tx;
+
+        struct
+        {
+            bool active;
+            bool complete;         // Every byte arrived - kept to answer chunks resent after our last acknowledgement was lost
+            uint16_t transfer;
+            uint32_t size;
+            uint32_t received;     // Every byte below this has been stored
+            uint8_t unacked;       // Chunks stored since our last acknowledgement
+            bool nacked;           // The remote end has been told about the gap at received
+        } rx;
+    } bulk;
+#endif
+
+#if SECIL_HEARTBEAT
+    // Heartbeats, sent while the link is quiet and answered at once, and the health of the link measured with them
+    struct
+    {
+        uint16_t interval;        // Our heartbeat interval in ms, 0 if we send none
+        uint8_t missed_limit;     // Heartbeat intervals of the remote end without a frame, after which the link is down
+        secil_link_down_fn on_link_down;
+        uint16_t remote_interval; // The remote end's heartbeat interval, 0 if it sends none
+        uint16_t next_seq;        // Number of the next heartbeat we send
+        uint16_t rx_next_seq;     // Number of the next heartbeat expected from the remote end
+        bool rx_seq_valid;        // False until a heartbeat has arrived since the remote end's last handshake
+        bool echo_pending;        // The last heartbeat received has not been echoed yet
+        uint32_t echo_sent_at;    // Its sent_at, by the remote end's clock
+        uint32_t echo_received_at; // Clock when it arrived
+        uint32_t tx_at;           // Clock when a frame was last written
+        uint32_t rx_at;           // Clock when a frame last arrived
+        bool down;                // The link down callback is due or has been called, and nothing has arrived since
+        bool measured;            // A round trip time has been measured
+        uint32_t srtt;            // Smoothed round trip time, in eighths of a ms
+        uint32_t rttvar;          // Smoothed deviation of the round trip time, in quarters of a ms
+        uint16_t loss;            // Recent share of the remote end's heartbeats lost, in sixteenths of a thousandth
+        secil_link_stats_t stats;
+    } heartbeat;
+
+    // Offset and drift of the remote end's clock, measured from the timestamps that heartbeats echo
+    struct
+    {
+        uint16_t interval;        // Longest time in ms between heartbeats that ask for an answer, 0 to only use those sent
+        bool timestamps;          // Application messages are sent with sent_at
+        uint32_t asked_at;        // Clock when we last sent a heartbeat that asks for an answer
+        struct
+        {
+            int64_t offset_us;    // The remote end's clock less ours
+            uint32_t at;          // Our clock when it was measured
+            uint32_t delay;       // Round trip time it was measured over
+        } samples[SECIL_CLOCK_SAMPLES], best, reference;
+        uint8_t count;            // Samples measured, up to SECIL_CLOCK_SAMPLES
+        uint8_t next;             // Sample to replace next
+        bool referenced;          // The reference is set, from which the next drift is worked out
+        bool drift_measured;      // The drift has been worked out at least once
+        int32_t drift_ppb;        // Smoothed drift, in billionths
+        uint32_t measured;        // Samples since the remote end's last handshake
+    } clock;
+#endif
+
+} secil_state_t;
+
+extern secil_state_t secil_state;
+
+/// @brief Layout of one version of the frame.
+typedef struct
+{
+    uint8_t header_size;
+    uint8_t footer_size;
+    bool delimited;      // True if the message carries its own varint length prefix
+} secil_frame_format_t;
+
+extern const secil_frame_format_t secil_frame_v1;
+extern const secil_frame_format_t secil_frame_compact;
+#if SECIL_FRAGMENTS
+extern const secil_frame_format_t secil_frame_fragment;
+#endif
+#if SECIL_LZ
+extern const secil_frame_format_t secil_frame_compressed;
+#endif
+
+// secil.c - logging, locking, the clock, and sending and writing frames
+void secil_log(secil_log_severity_t severity, const char *format, ...);
+void secil_lock();
+void secil_unlock();
+uint32_t secil_now();
+void secil_update_gap(uint32_t baud);
+uint16_t crc16arc_bit(uint16_t crc, void const *mem, size_t len);
+bool secil_write(const pb_byte_t *buf, size_t count);
+const secil_frame_format_t *secil_tx_format(const secil_message *message);
+secil_error_t secil_send(const secil_message *message);
+secil_error_t secil_send_locked(const secil_message *message);
+secil_error_t secil_send_admitted(secil_message *message);
+secil_error_t secil_tx_flush();
+#if SECIL_TX_QUEUES || SECIL_RATE_LIMITS
+secil_tx_class_t secil_tx_class(const secil_message *message);
+#endif
+#if SECIL_QUERIES
+bool secil_find_query_field(pb_field_iter_t *field, const secil_queryReply *reply, pb_size_t tag);
+bool secil_current_value(pb_size_t tag, secil_message *value);
+#endif
+
+#if SECIL_RELIABLE
+// secil_reliable.c - the reliable channel
+int16_t secil_seq_distance(uint16_t from, uint16_t to);
+void secil_reliable_reset(uint8_t remote_window);
+void secil_reliable_add_ack(secil_message *message);
+secil_error_t secil_reliable_send(const secil_message *message);
+bool secil_reliable_receive(secil_message *message);
+bool secil_reliable_take_held(secil_message *message);
+secil_error_t secil_reliable_poll();
+#endif
+
+#if SECIL_FLOW_CONTROL
+// secil_flow.c - credit based flow control
+void secil_flow_add_credit(secil_message *message);
+secil_error_t secil_flow_update(bool refresh);
+void secil_flow_on_handshake(const secil_message *handshake_message);
+#if SECIL_TX_CREDITS
+void secil_flow_on_receipt(const secil_message *message);
+bool secil_flow_allows(size_t size);
+void secil_flow_wrote(size_t size, bool handshake);
+void secil_flow_stall(bool stalled);
+#endif
+#endif
+
+#if SECIL_BAUD_SWITCH
+// secil_baud.c - switching the UART rate
+#define SECIL_BAUD_ALL ((SECIL_BAUD_3000000 << 1) - 1) // Every SECIL_BAUD_* bit
+uint32_t secil_baud_bit(uint32_t baud);
+secil_error_t secil_send_baud_step(secil_baud_switch_step_t step, uint32_t baud);
+bool secil_apply_baud(uint32_t baud);
+secil_error_t secil_handle_baud_switch(const secil_baudSwitch *request);
+secil_error_t secil_baud_poll();
+#endif
+
+#if SECIL_BULK
+// secil_bulk.c - bulk transfers
+secil_error_t secil_send_bulk_close(uint16_t transfer, uint32_t offset, bool from_sender);
+void secil_bulk_finish(bool outgoing, secil_error_t result);
+secil_error_t secil_bulk_send_open();
+secil_error_t secil_handle_bulk(const secil_bulk *bulk);
+secil_error_t secil_bulk_poll();
+#endif
+
+#if SECIL_HEARTBEAT
+// secil_heartbeat.c - heartbeats, the health of the link, and the remote end's clock
+void secil_heartbeat_on_receipt(secil_message *message);
+int32_t secil_clock_thousandths(int64_t value);
+int64_t secil_clock_offset_at(uint32_t at);
+void secil_clock_stamp(secil_message *message);
+secil_error_t secil_handle_heartbeat(const secil_heartbeat *heartbeat);
+secil_error_t secil_heartbeat_poll();
+#endif
+
+#if SECIL_LZ
+// secil_lz.c - compression of large messages
+bool secil_lz_deflate(const uint8_t *in, size_t in_size, uint8_t *out, size_t out_capacity, size_t *out_size);
+bool secil_lz_inflate(const uint8_t *in, size_t in_size, uint8_t *out, size_t out_capacity, size_t *out_size);
+#endif
+
+#if SECIL_TX_QUEUES
+// secil_txq.c - the send queues of the scheduler
+secil_error_t secil_tx_enqueue(secil_tx_class_t tx_class, size_t frame_size, uint8_t flags);
+#if SECIL_BAUD_SWITCH
+void secil_tx_drain();
+#endif
+#endif
+
+#if SECIL_RATE_LIMITS
+// secil_rate.c - rate limits of the application messages
+secil_error_t secil_rate_admit(const secil_message *message, bool *send);
+secil_error_t secil_rate_poll();
+#endif
+
+#endif // SECIL_INTERNAL_H
@@ -0,0 +1,152 @@
+#include "secil_internal.h"
+
+#if SECIL_LZ
+
+// Compressed messages are a stream of bits, most significant first (in the style of heatshrink):
+//   1 | 8 bit literal
+//   0 | 8 bit distance - 1 | 4 bit length - LZ_MIN_MATCH  (copy from earlier in the message, which may overlap)
+// followed by up to 7 zero bits of padding.
+#define LZ_WINDOW_BITS 8
+#define LZ_LENGTH_BITS 4
+#define LZ_MIN_MATCH 2
+#define LZ_MAX_MATCH (LZ_MIN_MATCH + (1 << LZ_LENGTH_BITS) - 1)
+#define LZ_WINDOW (1 << LZ_WINDOW_BITS)
+#define LZ_LITERAL_BITS 9
+
+/// @brief Bits written so far to a compressed message.
+typedef struct
+{
+    uint8_t *buf;
+    size_t capacity;
+    size_t bits;
+} secil_lz_writer_t;
+
+/// @brief Append the low bits of a value to a compressed message.
+/// @return False if the message would no longer fit.
+static bool secil_lz_put(secil_lz_writer_t *writer, uint16_t value, uint8_t count)
+{
+    while (count-- > 0)
+    {
+        size_t byte = writer->bits >> 3;
+        if (byte >= writer->capacity)
+        {
+            return false;
+        }
+        if ((writer->bits & 7) == 0)
+        {
+            writer->buf[byte] = 0;
+        }
+        if ((value >> count) & 1)
+        {
+            writer->buf[byte] |= (uint8_t)(0x80 >> (writer->bits & 7));
+        }
+        writer->bits++;
+    }
+    return true;
+}
+
+/// @brief Compress a message, taking the longest earlier match at each position.
+/// @param out_size Set to the size of the compressed message.
+/// @return False if the compressed message does not fit in out_capacity bytes.
+bool secil_lz_deflate(const uint8_t *in, size_t in_size, uint8_t *out, size_t out_capacity, size_t *out_size)
+{
+    secil_lz_writer_t writer = { out, out_capacity, 0 };
+
+    size_t pos = 0;
+    while (pos < in_size)
+    {
+        size_t best_length = 0;
+        size_t best_distance = 0;
+        size_t longest = in_size - pos < LZ_MAX_MATCH ? in_size - pos : LZ_MAX_MATCH;
+        size_t furthest = pos < LZ_WINDOW ? pos : LZ_WINDOW;
+        for (size_t distance = 1; distance <= furthest && best_length < longest; distance++)
+        {
+            size_t length = 0;
+            while (length < longest && in[pos - distance + length] == in[pos + length])
+            {
+                length++;
+            }
+            if (length > best_length)
+            {
+                best_length = length;
+                best_distance = distance;
+            }
+        }
+
+        bool written;
+        if (best_length >= LZ_MIN_MATCH)
+        {
+            written = secil_lz_put(&writer, 0, 1)
+                   && secil_lz_put(&writer, (uint16_t)(best_distance - 1), LZ_WINDOW_BITS)
+                   && secil_lz_put(&writer, (uint16_t)(best_length - LZ_MIN_MATCH), LZ_LENGTH_BITS);
+            pos += best_length;
+        }
+        else
+        {
+            written = secil_lz_put(&writer, 1, 1) && secil_lz_put(&writer, in[pos], 8);
+            pos++;
+        }
+        if (!written)
+        {
+            return false;
+        }
+    }
+
+    *out_size = (writer.bits + 7) >> 3;
+    return true;
+}
+
+/// @brief Read the next bits of a compressed message.
+static uint16_t secil_lz_get(const uint8_t *buf, size_t *bit, uint8_t count)
+{
+    uint16_t value = 0;
+    while (count-- > 0)
+    {
+        value = (uint16_t)((value << 1) | ((buf[*bit >> 3] >> (7 - (*bit & 7))) & 1));
+        (*bit)++;
+    }
+    return value;
+}
+
+/// @brief Expand a compressed message.
+/// @param out_size Set to the size of the expanded message.
+/// @return False if the compressed message is malformed or expands to more than out_capacity bytes.
+bool secil_lz_inflate(const uint8_t *in, size_t in_size, uint8_t *out, size_t out_capacity, size_t *out_size)
+{
+    size_t total_bits = in_size * 8;
+    size_t bit = 0;
+    size_t produced = 0;
+
+    // Anything shorter than a literal is padding
+    while (total_bits - bit >= LZ_LITERAL_BITS)
+    {
+        if (secil_lz_get(in, &bit, 1))
+        {
+            if (produced >= out_capacity)
+            {
+                return false;
+            }
+            out[produced++] = (uint8_t)secil_lz_get(in, &bit, 8);
+            continue;
+        }
+
+        if (total_bits - bit < LZ_WINDOW_BITS + LZ_LENGTH_BITS)
+        {
+            return false;
+        }
+        size_t distance = secil_lz_get(in, &bit, LZ_WINDOW_BITS) + 1u;
+        size_t length = secil_lz_get(in, &bit, LZ_LENGTH_BITS) + (size_t)LZ_MIN_MATCH;
+        if (distance > produced || length > out_capacity - produced)
+        {
+            return false;
+        }
+        for (size_t i = 0; i < length; i++, produced++)
+        {
+            out[produced] = out[produced - distance];
+        }
+    }
+
+    *out_size = produced;
+    return true;
+}
+#endif // SECIL_LZ
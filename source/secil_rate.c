@@ -0,0 +1,169 @@
+#include "secil_internal.h"
+
+#if SECIL_RATE_LIMITS
+
+/// @brief Work out the bytes a message takes on the link, before any compression.
+static uint32_t secil_rate_cost(const secil_message *message)
+{
+    size_t message_size = 0;
+    pb_get_encoded_size(&message_size, secil_message_fields, message);
+
+    const secil_frame_format_t *format = secil_tx_format(message);
+    if (message_size > COMPACT_MAX_BODY)
+    {
+        format = &secil_frame_v1;
+    }
+
+    // A v1 frame also carries the length of the message, in 2 bytes for any message longer than 127 bytes
+    uint32_t prefix = format->delimited ? (message_size > 127 ? 2 : 1) : 0;
+    return (uint32_t)(format->header_size + prefix + message_size + format->footer_size);
+}
+
+/// @brief Take the tokens for a frame from the bucket of its class, if it holds enough.
+/// @param tx_class The class.
+/// @param cost The size of the frame. One larger than the bucket goes once the bucket is full, and empties it.
+/// @return 0 if the tokens were taken, otherwise the time in milliseconds until the bucket holds enough.
+/// @note The caller must hold the lock.
+static uint32_t secil_rate_take(secil_tx_class_t tx_class, uint32_t cost)
+{
+    if (secil_state.rate[tx_class].rate == 0)
+    {
+        return 0;
+    }
+
+    // The bucket fills by rate thousandths of a byte every millisecond
+    uint32_t now = secil_now();
+    uint64_t tokens = secil_state.rate[tx_class].tokens + (uint64_t)(now - secil_state.rate[tx_class].filled_at) * secil_state.rate[tx_class].rate;
+    uint64_t full = (uint64_t)secil_state.rate[tx_class].burst * 1000;
+    secil_state.rate[tx_class].tokens = (uint32_t)(tokens < full ? tokens : full);
+    secil_state.rate[tx_class].filled_at = now;
+
+    uint32_t needed = (cost < secil_state.rate[tx_class].burst ? cost : secil_state.rate[tx_class].burst) * 1000;
+    if (secil_state.rate[tx_class].tokens < needed)
+    {
+        return (needed - secil_state.rate[tx_class].tokens + secil_state.rate[tx_class].rate - 1) / secil_state.rate[tx_class].rate;
+    }
+
+    secil_state.rate[tx_class].tokens -= needed;
+    secil_state.rate[tx_class].stats.bytes += cost;
+    return 0;
+}
+
+/// @brief Check if a message is a value that can be held back, as its latest value can be fetched again later.
+static bool secil_rate_can_hold(const secil_message *message)
+{
+#if SECIL_QUERIES && SECIL_QUERY_SHADOW
+    pb_field_iter_t field;
+    return message->which_payload < 32 && secil_find_query_field(&field, &secil_state.shadow, message->which_payload);
+#else
+    return false;
+#endif
+}
+
+/// @brief Apply the rate limit of its class to an application message that is about to be sent.
+/// @param message The message.
+/// @param send Set to false if the message is held back, to go out from secil_poll() once there is room.
+/// @return SECIL_OK if the message may be sent (or was held back), or SECIL_ERROR_RATE_LIMITED if it was dropped.
+secil_error_t secil_rate_admit(const secil_message *message, bool *send)
+{
+    *send = true;
+    secil_tx_class_t tx_class = secil_tx_class(message);
+
+    secil_lock();
+    bool limited = secil_state.rate[tx_class].rate > 0 && secil_state.clock_callback;
+    uint32_t cost = limited ? secil_rate_cost(message) : 0;
+    uint32_t started = limited ? secil_now() : 0;
+    bool waited = false;
+    uint32_t wait_ms;
+    while (limited && (wait_ms = secil_rate_take(tx_class, cost)) > 0)
+    {
+        // Other senders of the class may take the room first, so the wait as a whole is bounded too
+        if (secil_state.rate[tx_class].overflow == SECIL_RATE_BLOCK && secil_state.sleep_callback
+            && secil_now() - started + wait_ms <= SECIL_RATE_BLOCK_MAX_MS)
+        {
+            secil_unlock();
+            secil_state.sleep_callback(secil_state.user_data, wait_ms);
+            waited = true;
+            secil_lock();
+            continue;
+        }
+
+        if (secil_state.rate[tx_class].overflow == SECIL_RATE_CONFLATE && secil_rate_can_hold(message))
+        {
+            // The value has already been put in the shadow, where secil_rate_poll() finds the latest one
+            secil_state.rate[tx_class].held |= SECIL_TAG_BIT(message->which_payload);
+            secil_state.rate[tx_class].stats.conflated++;
+            secil_unlock();
+            *send = false;
+            return SECIL_OK;
+        }
+
+        secil_state.rate[tx_class].stats.dropped++;
+        secil_unlock();
+        return SECIL_ERROR_RATE_LIMITED;
+    }
+
+    if (waited)
+    {
+        secil_state.rate[tx_class].stats.blocked++;
+        secil_state.rate[tx_class].stats.blocked_ms += secil_now() - started;
+    }
+    if (message->which_payload < 32)
+    {
+        // This is now the latest value of its type, so any held back is no longer needed
+        secil_state.rate[tx_class].held &= ~SECIL_TAG_BIT(message->which_payload);
+    }
+    secil_state.rate[tx_class].stats.passed++;
+    secil_unlock();
+    return SECIL_OK;
+}
+
+/// @brief Send the latest of each value held back by a rate limit, as far as the limit of its class allows.
+secil_error_t secil_rate_poll()
+{
+    secil_error_t result = SECIL_OK;
+
+#if SECIL_QUERIES && SECIL_QUERY_SHADOW
+    for (int i = 0; i < SECIL_TX_CLASSES; i++)
+    {
+        for (pb_size_t tag = 1; tag < 32; tag++)
+        {
+            // Claim the value before fetching it, so that one held back meanwhile is not lost
+            secil_lock();
+            bool held = (secil_state.rate[i].held & SECIL_TAG_BIT(tag)) != 0;
+            secil_state.rate[i].held &= ~SECIL_TAG_BIT(tag);
+            secil_unlock();
+
+            secil_message message = { .which_payload = 0 };
+            if (!held || !secil_remote_wants(tag) || !secil_current_value(tag, &message))
+            {
+                continue;
+            }
+
+            uint32_t cost = secil_rate_cost(&message);
+            secil_lock();
+            bool send = secil_rate_take((secil_tx_class_t)i, cost) == 0;
+            if (send)
+            {
+                secil_state.rate[i].stats.passed++;
+            }
+            else
+            {
+                secil_state.rate[i].held |= SECIL_TAG_BIT(tag);
+            }
+            secil_unlock();
+
+            if (!send)
+            {
+                break; // No room left in this class
+            }
+            secil_error_t send_result = secil_send_admitted(&message);
+            result = result != SECIL_OK ? result : send_result;
+        }
+    }
+#endif
+
+    return result;
+}
+
+#endif // SECIL_RATE_LIMITS
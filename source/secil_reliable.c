@@ -0,0 +1,271 @@
+#include "secil_internal.h"
+
+#if SECIL_RELIABLE
+
+#if SECIL_RELIABLE_WINDOW < 1 || SECIL_RELIABLE_WINDOW > 32 || (SECIL_RELIABLE_WINDOW & (SECIL_RELIABLE_WINDOW - 1)) != 0
+#error "SECIL_RELIABLE_WINDOW must be a power of two between 1 and 32"
+#endif
+
+// Sequence numbers wrap at 65536, which is a multiple of the window, so each frame in flight has its own slot
+#define RELIABLE_SLOT(seq) ((uint16_t)(seq) % SECIL_RELIABLE_WINDOW)
+
+/// @brief Check if the transport has received bytes that can be read without blocking.
+/// @return true if the optional available callback reports pending bytes, false otherwise.
+static bool secil_rx_pending()
+{
+    return secil_state.available_callback && secil_state.available_callback(secil_state.user_data) > 0;
+}
+
+/// @brief Number of frames from sequence number from to sequence number to, allowing for wrap around.
+int16_t secil_seq_distance(uint16_t from, uint16_t to)
+{
+    return (int16_t)(uint16_t)(to - from);
+}
+
+/// @brief Start the reliable channel afresh after a handshake.
+/// @param remote_window The window offered by the remote end (0 if it does not support the reliable channel).
+void secil_reliable_reset(uint8_t remote_window)
+{
+    secil_lock();
+    uint8_t local_window = secil_state.reliable.local_window;
+    memset(&secil_state.reliable, 0, sizeof(secil_state.reliable));
+    secil_state.reliable.local_window = local_window;
+    secil_state.reliable.window = remote_window < local_window ? remote_window : local_window;
+    secil_unlock();
+
+    if (secil_state.reliable.window > 0)
+    {
+        secil_log(secil_LOG_INFO, "Reliable channel in use with a window of %u frames.", (unsigned)secil_state.reliable.window);
+    }
+}
+
+/// @brief Piggyback our acknowledgement of the frames received so far on an outgoing message.
+void secil_reliable_add_ack(secil_message *message)
+{
+    message->has_ack = true;
+    message->ack = secil_state.reliable.rx_next;
+    message->has_sack = secil_state.reliable.rx_held != 0;
+    message->sack = secil_state.reliable.rx_held >> 1;
+    secil_state.reliable.ack_pending = false;
+}
+
+/// @brief Send, or send again, the frame with the given sequence number from the retransmit buffers.
+static secil_error_t secil_reliable_transmit(uint16_t seq)
+{
+    uint16_t slot = RELIABLE_SLOT(seq);
+    secil_message *frame = &secil_state.reliable.tx_frames[slot];
+
+    secil_reliable_add_ack(frame);
+    secil_state.reliable.tx_order[slot] = ++secil_state.reliable.tx_counter;
+    secil_state.reliable.tx_sent_at[slot] = secil_now();
+
+    return secil_send(frame);
+}
+
+/// @brief Give the message the next sequence number, keep a copy for retransmission and send it.
+/// @note The caller must hold the lock.
+secil_error_t secil_reliable_send(const secil_message *message)
+{
+    int16_t in_flight = secil_seq_distance(secil_state.reliable.tx_base, secil_state.reliable.tx_next);
+    if (in_flight >= secil_state.reliable.window)
+    {
+        return SECIL_ERROR_WINDOW_FULL;
+    }
+
+    uint16_t seq = secil_state.reliable.tx_next++;
+    secil_message *frame = &secil_state.reliable.tx_frames[RELIABLE_SLOT(seq)];
+    *frame = *message;
+    frame->has_seq = true;
+    frame->seq = seq;
+    secil_state.reliable.tx_acked &= ~((uint32_t)1 << in_flight);
+    secil_state.reliable.stats.frames_sent++;
+
+    // The frame is in the window now, so if its send queue is full it simply goes out with the retransmissions
+    secil_error_t result = secil_reliable_transmit(seq);
+    return result == SECIL_ERROR_QUEUE_FULL ? SECIL_OK : result;
+}
+
+/// @brief Send a frame that only carries our acknowledgement, if the remote end is waiting for one.
+/// @note The caller must hold the lock.
+static secil_error_t secil_reliable_flush_ack()
+{
+    if (!secil_state.reliable.ack_pending)
+    {
+        return SECIL_OK;
+    }
+
+    secil_message message = { .which_payload = 0 };
+    secil_reliable_add_ack(&message);
+#if SECIL_FLOW_CONTROL
+    secil_flow_add_credit(&message);
+#endif
+    secil_state.reliable.stats.acks_sent++;
+
+    return secil_send(&message);
+}
+
+/// @brief Release the frames acknowledged by the remote end and retransmit the gaps its selective acks reveal.
+/// @param ack The next sequence number the remote end expects.
+/// @param sack Bit i is set if the remote end also holds frame ack + 1 + i.
+/// @note The caller must hold the lock.
+static secil_error_t secil_reliable_on_ack(uint16_t ack, uint32_t sack)
+{
+    int16_t released = secil_seq_distance(secil_state.reliable.tx_base, ack);
+    int16_t in_flight = secil_seq_distance(ack, secil_state.reliable.tx_next);
+    if (released < 0 || in_flight < 0)
+    {
+        // An old acknowledgement that arrived late, or one for frames we never sent
+        return SECIL_OK;
+    }
+
+    secil_state.reliable.tx_base = ack;
+    secil_state.reliable.tx_acked = released >= 32 ? 0 : secil_state.reliable.tx_acked >> released;
+
+    int16_t highest = 0;
+    for (int16_t i = 1; i < in_flight; i++)
+    {
+        if (sack & ((uint32_t)1 << (i - 1)))
+        {
+            secil_state.reliable.tx_acked |= (uint32_t)1 << i;
+            highest = i;
+        }
+    }
+
+    // A frame that went out before one the remote end already holds has been lost - send it again now
+    // rather than waiting for its timer. Once resent it is newer than that frame, so it is only resent once.
+    uint32_t highest_order = secil_state.reliable.tx_order[RELIABLE_SLOT(ack + highest)];
+    for (int16_t i = 0; i < highest; i++)
+    {
+        uint16_t seq = (uint16_t)(ack + i);
+        if (   !(secil_state.reliable.tx_acked & ((uint32_t)1 << i))
+            && (int32_t)(secil_state.reliable.tx_order[RELIABLE_SLOT(seq)] - highest_order) < 0)
+        {
+            secil_state.reliable.stats.retransmissions++;
+            RETURN_IF_ERROR(secil_reliable_transmit(seq), "Failed to retransmit frame.");
+        }
+    }
+
+    return SECIL_OK;
+}
+
+/// @brief Handle the reliable channel fields of a received frame.
+/// @param message The received message.
+/// @return true if the message should be handed on now, false if it was consumed here
+///         (an acknowledgement only, a duplicate, or a frame that arrived early and is held back).
+bool secil_reliable_receive(secil_message *message)
+{
+    bool deliver = message->which_payload != 0;
+
+    secil_lock();
+
+    if (message->has_ack)
+    {
+        secil_reliable_on_ack((uint16_t)message->ack, message->has_sack ? message->sack : 0);
+    }
+
+    if (message->has_seq && secil_state.reliable.window > 0)
+    {
+        int16_t offset = secil_seq_distance(secil_state.reliable.rx_next, (uint16_t)message->seq);
+        secil_state.reliable.ack_pending = true;
+
+        if (offset < 0 || (offset < 32 && (secil_state.reliable.rx_held & ((uint32_t)1 << offset))))
+        {
+            // We already have this frame, the remote end must have missed our acknowledgement
+            secil_state.reliable.stats.duplicates_dropped++;
+            deliver = false;
+        }
+        else if (offset >= secil_state.reliable.window)
+        {
+            secil_log(secil_LOG_WARNING, "Dropping frame %u - outside the receive window.", (unsigned)message->seq);
+            deliver = false;
+        }
+        else if (offset > 0)
+        {
+            // Hold it back until the frames before it have arrived
+            secil_state.reliable.rx_frames[RELIABLE_SLOT(message->seq)] = *message;
+            secil_state.reliable.rx_held |= (uint32_t)1 << offset;
+            secil_state.reliable.stats.out_of_order++;
+            deliver = false;
+        }
+        else
+        {
+            secil_state.reliable.rx_next++;
+            secil_state.reliable.rx_held >>= 1;
+        }
+    }
+
+    // Acknowledge once the transport has no more frames waiting, so that a burst is acknowledged by one frame
+    if (!secil_rx_pending() && !(secil_state.reliable.rx_held & 1))
+    {
+        secil_reliable_flush_ack();
+    }
+
+    secil_unlock();
+
+    return deliver;
+}
+
+/// @brief Take the next frame to deliver from the frames that arrived early, if it is there.
+/// @param message Receives the frame.
+/// @return true if a frame was taken.
+bool secil_reliable_take_held(secil_message *message)
+{
+    secil_lock();
+
+    bool taken = (secil_state.reliable.rx_held & 1) != 0;
+    if (taken)
+    {
+        *message = secil_state.reliable.rx_frames[RELIABLE_SLOT(secil_state.reliable.rx_next)];
+        secil_state.reliable.rx_next++;
+        secil_state.reliable.rx_held >>= 1;
+        secil_state.reliable.ack_pending = true;
+
+        if (!secil_rx_pending() && !(secil_state.reliable.rx_held & 1))
+        {
+            secil_reliable_flush_ack();
+        }
+    }
+
+    secil_unlock();
+
+    return taken;
+}
+
+/// @brief Retransmit the frames whose acknowledgement is overdue.
+/// @note The caller must hold the lock.
+secil_error_t secil_reliable_poll()
+{
+    if (secil_state.reliable.window == 0)
+    {
+        return SECIL_OK;
+    }
+
+    if (secil_state.clock_callback)
+    {
+        // When acknowledgements stop arriving it is usually the acknowledgement that was lost, not the frames.
+        // So only the oldest overdue frame is sent again; the remote end's reply to it tells us what else is missing.
+        uint32_t now = secil_now();
+        int16_t in_flight = secil_seq_distance(secil_state.reliable.tx_base, secil_state.reliable.tx_next);
+        bool resent = false;
+        for (int16_t i = 0; i < in_flight; i++)
+        {
+            uint16_t slot = RELIABLE_SLOT(secil_state.reliable.tx_base + i);
+            if (   !(secil_state.reliable.tx_acked & ((uint32_t)1 << i))
+                && now - secil_state.reliable.tx_sent_at[slot] >= SECIL_RELIABLE_RETRANSMIT_MS)
+            {
+                if (resent)
+                {
+                    secil_state.reliable.tx_sent_at[slot] = now;
+                    continue;
+                }
+                secil_state.reliable.stats.retransmissions++;
+                RETURN_IF_ERROR(secil_reliable_transmit((uint16_t)(secil_state.reliable.tx_base + i)), "Failed to retransmit frame.");
+                resent = true;
+            }
+        }
+    }
+
+    return secil_reliable_flush_ack();
+}
+
+#endif // SECIL_RELIABLE
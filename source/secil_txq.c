@@ -0,0 +1,368 @@
+#include "secil_internal.h"
+
+#if SECIL_TX_QUEUES
+
+/// @brief Copy bytes into a send queue at the given offset, wrapping round its end.
+static void secil_tx_ring_put(uint8_t *ring, size_t offset, const uint8_t *data, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        ring[(offset + i) % SECIL_TX_QUEUE_SIZE] = data[i];
+    }
+}
+
+/// @brief Copy bytes out of a send queue from the given offset, wrapping round its end.
+static void secil_tx_ring_get(const uint8_t *ring, size_t offset, uint8_t *data, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        data[i] = ring[(offset + i) % SECIL_TX_QUEUE_SIZE];
+    }
+}
+
+/// @brief Queue the frame held in the outgoing message buffer behind the others of its class.
+/// @param tx_class The priority class of the frame.
+/// @param frame_size The size of the whole frame.
+/// @param flags TX_ENTRY_* flags of the frame.
+/// @note The caller must hold the lock.
+/// @return SECIL_OK if the frame was queued, or SECIL_ERROR_QUEUE_FULL if its class has no room for it.
+secil_error_t secil_tx_enqueue(secil_tx_class_t tx_class, size_t frame_size, uint8_t flags)
+{
+    secil_tx_queue_t *queue = &secil_state.tx.queues[tx_class];
+    if (queue->used + TX_ENTRY_HEADER_SIZE + frame_size > SECIL_TX_QUEUE_SIZE)
+    {
+        queue->stats.rejected++;
+        return SECIL_ERROR_QUEUE_FULL;
+    }
+
+    uint32_t now = secil_now();
+    uint8_t entry[TX_ENTRY_HEADER_SIZE] = { (uint8_t)(frame_size & 0xFF), (uint8_t)((frame_size >> 8) & 0xFF),
+                                            (uint8_t)(now & 0xFF), (uint8_t)((now >> 8) & 0xFF),
+                                            (uint8_t)((now >> 16) & 0xFF), (uint8_t)((now >> 24) & 0xFF), flags };
+    size_t tail = queue->head + queue->used;
+    secil_tx_ring_put(queue->buf, tail, entry, sizeof(entry));
+    secil_tx_ring_put(queue->buf, tail + sizeof(entry), secil_state.outgoingMessage, frame_size);
+    queue->used += (uint16_t)(TX_ENTRY_HEADER_SIZE + frame_size);
+
+    queue->stats.queued++;
+    queue->stats.depth++;
+    if (queue->stats.depth > queue->stats.peak_depth)
+    {
+        queue->stats.peak_depth = queue->stats.depth;
+    }
+    return SECIL_OK;
+}
+
+/// @brief Pick the class whose oldest frame goes out next.
+/// @note Control frames always go first, so they never wait for more than the frame already being written.
+///       State frames go before bulk ones, except that one bulk frame goes out after every SECIL_TX_BULK_SHARE of them.
+/// @note The caller must hold the lock.
+/// @return The class, or SECIL_TX_CLASSES if every queue is empty.
+static secil_tx_class_t secil_tx_pick()
+{
+    bool bulk_waiting = secil_state.tx.queues[SECIL_TX_BULK].used > 0;
+    if (secil_state.tx.queues[SECIL_TX_CONTROL].used > 0)
+    {
+        return SECIL_TX_CONTROL;
+    }
+
+#if SECIL_FRAGMENTS
+    // Only control frames go between the fragments of a frame
+    if (secil_state.tx.fragment_offset > 0)
+    {
+        return secil_state.tx.fragmenting;
+    }
+#endif
+
+    if (secil_state.tx.queues[SECIL_TX_STATE].used > 0 && (!bulk_waiting || secil_state.tx.bulk_passed < SECIL_TX_BULK_SHARE))
+    {
+        secil_state.tx.bulk_passed += bulk_waiting ? 1 : 0;
+        return SECIL_TX_STATE;
+    }
+
+    secil_state.tx.bulk_passed = 0;
+    return bulk_waiting ? SECIL_TX_BULK : SECIL_TX_CLASSES;
+}
+
+/// @brief Write the oldest frame of a queue whole.
+/// @note The caller must hold the lock, which is released while writing.
+/// @return True if the frame was written.
+static bool secil_tx_write_frame(const secil_tx_queue_t *queue, size_t frame_size)
+{
+    // Nobody else touches the oldest entry, so it can be written straight from the queue (in two parts if it wraps)
+    size_t start = (queue->head + TX_ENTRY_HEADER_SIZE) % SECIL_TX_QUEUE_SIZE;
+    size_t first = frame_size < SECIL_TX_QUEUE_SIZE - start ? frame_size : SECIL_TX_QUEUE_SIZE - start;
+    secil_unlock();
+    bool written = secil_write(queue->buf + start, first)
+                && (first == frame_size || secil_write(queue->buf, frame_size - first));
+    secil_lock();
+    return written;
+}
+
+#if SECIL_FRAGMENTS
+/// @brief Check whether a frame goes out in fragments.
+/// @note Control frames always go out whole, as they are the ones sent between the fragments.
+static bool secil_tx_fragmented(secil_tx_class_t tx_class, size_t frame_size)
+{
+    const uint32_t both = SECIL_CAPABILITY_COMPACT_FRAMES | SECIL_CAPABILITY_FRAGMENTS;
+    return (secil_state.tx.fragment_offset > 0 && secil_state.tx.fragmenting == tx_class)
+        || (   tx_class != SECIL_TX_CONTROL && frame_size > SECIL_FRAGMENT_SIZE
+            && (secil_state.agreed_capabilities & both) == both);
+}
+
+/// @brief Write the next fragment of the oldest frame of a queue: `CA F4 len | stream index | piece of frame | crc`.
+/// @param finished Set to true if that was the last fragment of the frame.
+/// @note The caller must hold the lock, which is released while writing.
+/// @return True if the fragment was written.
+static bool secil_tx_write_fragment(secil_tx_queue_t *queue, secil_tx_class_t tx_class, size_t frame_size, bool *finished)
+{
+    uint16_t offset = secil_state.tx.fragment_offset;
+    if (offset == 0)
+    {
+        secil_state.tx.stream++;
+    }
+    size_t count = frame_size - offset < SECIL_FRAGMENT_SIZE ? frame_size - offset : SECIL_FRAGMENT_SIZE;
+    *finished = offset + count == frame_size;
+
+    uint8_t *fragment = secil_state.tx.fragment;
+    fragment[0] = 0xCA;
+    fragment[1] = 0xF4;
+    fragment[2] = (uint8_t)(FRAGMENT_HEADER_SIZE + count);
+    fragment[3] = secil_state.tx.stream;
+    fragment[4] = (uint8_t)(offset / SECIL_FRAGMENT_SIZE) | (*finished ? FRAGMENT_LAST : 0);
+    secil_tx_ring_get(queue->buf, queue->head + TX_ENTRY_HEADER_SIZE + offset, fragment + COMPACT_HEADER_SIZE + FRAGMENT_HEADER_SIZE, count);
+
+    size_t size = COMPACT_HEADER_SIZE + FRAGMENT_HEADER_SIZE + count;
+    uint16_t crc = crc16arc_bit(0, fragment, size);
+    fragment[size++] = (uint8_t)(crc & 0xFF);
+    fragment[size++] = (uint8_t)((crc >> 8) & 0xFF);
+
+    secil_state.tx.fragmenting = tx_class;
+    secil_state.tx.fragment_offset = *finished ? 0 : (uint16_t)(offset + count);
+    queue->stats.fragments++;
+
+    // Only the writer uses the fragment buffer
+    secil_unlock();
+    bool written = secil_write(fragment, size);
+    secil_lock();
+
+    if (!written)
+    {
+        // The rest of the frame is dropped, and the remote end drops what it has of it when the next frame starts
+        secil_state.tx.fragment_offset = 0;
+    }
+    return written;
+}
+#endif
+
+#if SECIL_TX_CREDITS
+/// @brief Size of the next write of the oldest frame of a class: the whole frame, or its next fragment.
+/// @note The caller must hold the lock.
+static size_t secil_tx_write_size(secil_tx_class_t tx_class, size_t frame_size)
+{
+#if SECIL_FRAGMENTS
+    if (secil_tx_fragmented(tx_class, frame_size))
+    {
+        size_t rest = frame_size - secil_state.tx.fragment_offset;
+        return COMPACT_HEADER_SIZE + FRAGMENT_HEADER_SIZE + (rest < SECIL_FRAGMENT_SIZE ? rest : SECIL_FRAGMENT_SIZE) + COMPACT_FOOTER_SIZE;
+    }
+#endif
+    return frame_size;
+}
+
+/// @brief Write the frame that only carries credit, which goes out ahead of the queues.
+/// @note The caller must hold the lock, which is released while writing.
+/// @return True if the frame was written.
+static bool secil_tx_write_credit_frame()
+{
+    // Another thread may put a newer one in its place meanwhile
+    uint8_t frame[CREDIT_FRAME_SIZE];
+    size_t size = secil_state.tx.credit_frame_size;
+    memcpy(frame, secil_state.tx.credit_frame, size);
+    secil_state.tx.credit_frame_size = 0;
+
+    secil_unlock();
+    bool written = secil_write(frame, size);
+    secil_lock();
+
+    if (written)
+    {
+        secil_flow_wrote(size, false);
+    }
+    return written;
+}
+#endif
+
+/// @brief Check whether a writer has more to do: any control frame, and every frame that was queued when it started.
+/// @param queued The number of frames queued in each class when the writer started.
+/// @note The caller must hold the lock.
+static bool secil_tx_owes(const uint32_t *queued)
+{
+    bool owes = secil_state.tx.queues[SECIL_TX_CONTROL].used > 0;
+    for (int i = 0; i < SECIL_TX_CLASSES; i++)
+    {
+        const secil_tx_class_stats_t *stats = &secil_state.tx.queues[i].stats;
+        owes = owes || stats->sent + stats->failed < queued[i];
+    }
+    return owes;
+}
+
+/// @brief Write the queued frames, most urgent first.
+/// @note The frames are written outside the lock, so that other threads can queue more meanwhile. If another thread is
+///       already writing, this returns at once and leaves the frames to it. A writer goes on until every frame that was
+///       queued when it started has gone out, along with any control frames queued meanwhile, so a thread is never held
+///       up for long by others that keep the link busy. Frames they queue after that go out with their next send, or
+///       the next secil_poll() or frame received.
+/// @return SECIL_OK if every frame was written, otherwise SECIL_ERROR_WRITE_FAILED.
+secil_error_t secil_tx_flush()
+{
+    secil_error_t result = SECIL_OK;
+
+    secil_lock();
+    if (secil_state.tx.writing)
+    {
+        secil_unlock();
+        return SECIL_OK;
+    }
+    secil_state.tx.writing = true;
+
+    uint32_t queued[SECIL_TX_CLASSES];
+    for (int i = 0; i < SECIL_TX_CLASSES; i++)
+    {
+        queued[i] = secil_state.tx.queues[i].stats.queued;
+    }
+
+    while (true)
+    {
+#if SECIL_TX_CREDITS
+        if (secil_state.tx.credit_frame_size > 0)
+        {
+            if (!secil_tx_write_credit_frame())
+            {
+                result = SECIL_ERROR_WRITE_FAILED;
+            }
+            continue;
+        }
+#endif
+
+        secil_tx_class_t tx_class;
+        if (!secil_tx_owes(queued) || (tx_class = secil_tx_pick()) == SECIL_TX_CLASSES)
+        {
+            break;
+        }
+
+        secil_tx_queue_t *queue = &secil_state.tx.queues[tx_class];
+        uint8_t entry[TX_ENTRY_HEADER_SIZE];
+        secil_tx_ring_get(queue->buf, queue->head, entry, sizeof(entry));
+        size_t frame_size = entry[0] | ((size_t)entry[1] << 8);
+#if SECIL_TX_CREDITS
+        size_t write_size = secil_tx_write_size(tx_class, frame_size);
+        if (!secil_flow_allows(write_size))
+        {
+            // The frames wait until the remote end gives more credit, and the next frame received writes them
+            secil_flow_stall(true);
+            break;
+        }
+        secil_flow_stall(false);
+#endif
+
+        uint32_t queued_at = entry[2] | ((uint32_t)entry[3] << 8) | ((uint32_t)entry[4] << 16) | ((uint32_t)entry[5] << 24);
+        uint32_t waited = secil_now() - queued_at;
+        bool continued = false;
+#if SECIL_FRAGMENTS
+        continued = secil_state.tx.fragment_offset > 0 && secil_state.tx.fragmenting == tx_class;
+#endif
+        if (!continued && waited > queue->stats.max_wait_ms)
+        {
+            queue->stats.max_wait_ms = waited;
+        }
+
+        bool written;
+#if SECIL_FRAGMENTS
+        if (secil_tx_fragmented(tx_class, frame_size))
+        {
+            bool finished;
+            written = secil_tx_write_fragment(queue, tx_class, frame_size, &finished);
+#if SECIL_TX_CREDITS
+            if (written)
+            {
+                secil_flow_wrote(write_size, false);
+            }
+#endif
+            if (written && !finished)
+            {
+                continue; // The frame stays at the head of its queue until its last fragment is out
+            }
+        }
+        else
+#endif
+        {
+            written = secil_tx_write_frame(queue, frame_size);
+#if SECIL_TX_CREDITS
+            if (written)
+            {
+                secil_flow_wrote(write_size, (entry[6] & TX_ENTRY_HANDSHAKE) != 0);
+            }
+#endif
+        }
+
+        queue->head = (uint16_t)((queue->head + TX_ENTRY_HEADER_SIZE + frame_size) % SECIL_TX_QUEUE_SIZE);
+        queue->used -= (uint16_t)(TX_ENTRY_HEADER_SIZE + frame_size);
+        queue->stats.depth--;
+        if (written)
+        {
+            queue->stats.sent++;
+        }
+        else
+        {
+            queue->stats.failed++;
+            result = SECIL_ERROR_WRITE_FAILED;
+        }
+    }
+
+    secil_state.tx.writing = false;
+    secil_unlock();
+
+    if (result != SECIL_OK)
+    {
+        secil_log(secil_LOG_ERROR, "Failed to write message.");
+    }
+    return result;
+}
+
+#if SECIL_BAUD_SWITCH
+/// @brief Wait until every queued frame has been written, whichever thread writes it.
+void secil_tx_drain()
+{
+#if SECIL_TX_CREDITS
+    // The remote end is waiting for the last frame at the old rate, so nothing is held back for lack of credit
+    secil_lock();
+    secil_state.tx.draining = true;
+    secil_unlock();
+#endif
+
+    while (true)
+    {
+        secil_tx_flush();
+
+        secil_lock();
+        bool idle = !secil_state.tx.writing;
+        for (int i = 0; i < SECIL_TX_CLASSES; i++)
+        {
+            idle = idle && secil_state.tx.queues[i].used == 0;
+        }
+#if SECIL_TX_CREDITS
+        secil_state.tx.draining = !idle;
+#endif
+        secil_unlock();
+
+        if (idle)
+        {
+            return;
+        }
+    }
+}
+
+#endif
+
+#endif // SECIL_TX_QUEUES
@@ -0,0 +1,260 @@
+#include <secil.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "sim_link.h"
+
+// The simulated UART: both directions run at this rate and every bit may be flipped with probability sim.ber
+#define LINK_BAUD 460800
+#define BLOB_SIZE (32 * 1024)
+#define BLOB_KIND 7
+#define CONTROL_INTERVAL_MS 10
+
+typedef struct
+{
+    bool completed;
+    double seconds;
+    uint32_t controls_sent;
+    secil_bulk_stats_t stats;
+} result_t;
+
+typedef struct
+{
+    bool verified;
+    uint32_t controls_received;
+    uint32_t opens;
+} receiver_result_t;
+
+// Transfer state shared with the callbacks
+static uint8_t blob[BLOB_SIZE];
+static uint32_t stored;
+static uint32_t opens;
+static volatile bool done;
+static volatile secil_error_t done_result;
+
+static uint8_t blob_byte(uint32_t offset)
+{
+    return (uint8_t)(offset * 31 + (offset >> 8));
+}
+
+static bool open_fn(void *user_data, uint32_t kind, uint32_t size, uint32_t *resume_offset)
+{
+    if (kind != BLOB_KIND || size != BLOB_SIZE)
+    {
+        return false;
+    }
+    opens++;
+    *resume_offset = stored; // Keep what arrived before a restart
+    return true;
+}
+
+static bool write_chunk_fn(void *user_data, uint32_t offset, const uint8_t *data, size_t count)
+{
+    memcpy(blob + offset, data, count);
+    stored = offset + (uint32_t)count;
+    return true;
+}
+
+static bool read_chunk_fn(void *user_data, uint32_t offset, uint8_t *data, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        data[i] = blob_byte(offset + (uint32_t)i);
+    }
+    return true;
+}
+
+static void done_fn(void *user_data, bool outgoing, secil_error_t result)
+{
+    done_result = result;
+    done = true;
+}
+
+static void start_link()
+{
+    secil_init(sim_read_fn, sim_write_fn, NULL, NULL, NULL);
+    secil_set_available_callback(sim_available_fn);
+    secil_set_clock_callback(sim_clock_fn);
+    secil_set_lock_callbacks(sim_lock_fn, sim_unlock_fn);
+    secil_set_bulk_callbacks(open_fn, write_chunk_fn, read_chunk_fn, done_fn);
+}
+
+/// @brief Receiving end: store the blob, count the control messages that arrive alongside it and check the blob at the end.
+///        With restart set it starts again half way through, keeping only what it has stored.
+static int run_receiver(bool restart, int result_fd)
+{
+    receiver_result_t result = { 0 };
+
+    start_link();
+    if (secil_startup(secil_operating_mode_t_SERVER) != SECIL_OK)
+    {
+        return 1;
+    }
+    sim.errors_enabled = true;
+
+    bool restarted = false;
+    while (true)
+    {
+        secil_message message;
+        secil_error_t receive_result = secil_receive(&message);
+        if (receive_result == SECIL_ERROR_READ_TIMEOUT)
+        {
+            break; // The sender has finished and closed the link
+        }
+        if (receive_result != SECIL_OK || message.which_payload != secil_message_dateAndTime_tag)
+        {
+            continue; // Corrupt frames are expected on this link
+        }
+        result.controls_received++;
+
+        if (restart && !restarted && stored > BLOB_SIZE / 2)
+        {
+            restarted = true;
+            secil_deinit();
+            start_link();
+            secil_connect(secil_operating_mode_t_SERVER);
+        }
+    }
+
+    result.opens = opens;
+    result.verified = done && done_result == SECIL_OK && stored == BLOB_SIZE;
+    for (uint32_t i = 0; result.verified && i < BLOB_SIZE; i++)
+    {
+        result.verified = blob[i] == blob_byte(i);
+    }
+
+    return write(result_fd, &result, sizeof(result)) == sizeof(result) ? 0 : 1;
+}
+
+/// @brief Process acknowledgements (and send the chunks they free up) while the main thread sends control messages.
+static void *sender_receive_thread(void *arg)
+{
+    secil_message message;
+    while (secil_receive(&message) != SECIL_ERROR_READ_TIMEOUT)
+    {
+    }
+    return NULL;
+}
+
+/// @brief Sending end: send the blob and a control message every CONTROL_INTERVAL_MS until it is acknowledged.
+static int run_sender(int result_fd)
+{
+    result_t result = { 0 };
+
+    start_link();
+    if (secil_startup(secil_operating_mode_t_CLIENT) == SECIL_OK)
+    {
+        sim.errors_enabled = true;
+
+        pthread_t thread;
+        pthread_create(&thread, NULL, sender_receive_thread, NULL);
+
+        double start = sim_now_s();
+        double next_control = start;
+        if (secil_bulk_send(BLOB_KIND, BLOB_SIZE) == SECIL_OK)
+        {
+            while (!done)
+            {
+                if (sim_now_s() >= next_control)
+                {
+                    secil_send_dateTime(result.controls_sent++);
+                    next_control += CONTROL_INTERVAL_MS / 1000.0;
+                }
+                secil_poll();
+                usleep(1000);
+            }
+        }
+
+        result.seconds = sim_now_s() - start;
+        result.completed = done && done_result == SECIL_OK;
+        secil_get_bulk_stats(&result.stats);
+
+        shutdown(sim.fd, SHUT_RDWR);
+        pthread_join(thread, NULL);
+    }
+
+    return write(result_fd, &result, sizeof(result)) == sizeof(result) ? 0 : 1;
+}
+
+static bool run_case(double ber, bool restart)
+{
+    int link_fds[2];
+    int result_fds[2];
+    int receiver_fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, link_fds) != 0 || pipe(result_fds) != 0 || pipe(receiver_fds) != 0)
+    {
+        return false;
+    }
+
+    sim.ber = ber;
+    pid_t receiver = sim_fork_end(link_fds[1], link_fds[0], 60);
+    if (receiver == 0)
+    {
+        exit(run_receiver(restart, receiver_fds[1]));
+    }
+
+    pid_t sender = sim_fork_end(link_fds[0], link_fds[1], 60);
+    if (sender == 0)
+    {
+        exit(run_sender(result_fds[1]));
+    }
+
+    close(link_fds[0]);
+    close(link_fds[1]);
+    close(result_fds[1]);
+    close(receiver_fds[1]);
+
+    bool ended = sim_wait_ends(receiver, sender);
+    result_t result = { 0 };
+    receiver_result_t received = { 0 };
+    bool ok = read(result_fds[0], &result, sizeof(result)) == sizeof(result)
+           && read(receiver_fds[0], &received, sizeof(received)) == sizeof(received)
+           && result.completed && received.verified && received.opens == (restart ? 2 : 1) && ended;
+    close(result_fds[0]);
+    close(receiver_fds[0]);
+
+    const char *name = restart ? "restart" : "-";
+    if (!ok)
+    {
+        printf("%-8.0e %-9s did not deliver the blob intact\n", ber, name);
+        return false;
+    }
+
+    double bytes_per_second = BLOB_SIZE / result.seconds;
+    printf("%-8.0e %-9s %10.0f %14.1f %12u %10u/%u\n",
+           ber, name,
+           bytes_per_second,
+           100.0 * bytes_per_second / ((double)LINK_BAUD / 10.0),
+           (unsigned)result.stats.retransmitted,
+           (unsigned)received.controls_received, (unsigned)result.controls_sent);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    const double bit_error_rates[] = { 0, 1e-5, 1e-4 };
+    bool ok = true;
+    sim.baud = LINK_BAUD;
+
+    printf("Bulk transfer: a %d byte blob over a simulated %d baud link, with a control message every %d ms\n",
+           BLOB_SIZE, LINK_BAUD, CONTROL_INTERVAL_MS);
+    printf("Line rate is the share of the raw %d bytes/s that arrives as blob data.\n\n", LINK_BAUD / 10);
+    printf("BER      Receiver  Blob B/s   Line rate %%   Resent bytes Controls\n");
+
+    for (size_t b = 0; b < sizeof(bit_error_rates) / sizeof(bit_error_rates[0]); b++)
+    {
+        ok &= run_case(bit_error_rates[b], false);
+    }
+    ok &= run_case(0, true);
+
+    if (!ok)
+    {
+        printf("Bulk benchmark failed.\n");
+        return 1;
+    }
+
+    return 0;
+}
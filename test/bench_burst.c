@@ -0,0 +1,214 @@
+#include <secil.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define MESSAGES_PER_BURST 14
+
+typedef struct
+{
+    char buffer[2*1024*1024]; // 2 MB buffer for the memory stream
+    size_t read_index;
+    size_t write_index;
+} memory_buffer_t;
+
+static memory_buffer_t memory_buffer;
+
+static void log_fn(void *user_data, secil_log_severity_t severity, const char *message)
+{
+    if (severity >= secil_LOG_WARNING)
+    {
+        printf("%s\n", message);
+    }
+}
+
+static bool read_fn(void *user_data, unsigned char *buf, size_t required_count)
+{
+    memory_buffer_t *memory_buffer = (memory_buffer_t *)user_data;
+
+    if (memory_buffer->read_index + required_count > memory_buffer->write_index)
+    {
+        return false;
+    }
+
+    memcpy(buf, memory_buffer->buffer + memory_buffer->read_index, required_count);
+    memory_buffer->read_index += required_count;
+
+    return true;
+}
+
+static bool write_fn(void *user_data, const unsigned char *buf, size_t count)
+{
+    memory_buffer_t *memory_buffer = (memory_buffer_t *)user_data;
+
+    if (memory_buffer->write_index + count > sizeof(memory_buffer->buffer))
+    {
+        return false;
+    }
+
+    memcpy(memory_buffer->buffer + memory_buffer->write_index, buf, count);
+    memory_buffer->write_index += count;
+
+    return true;
+}
+
+/// @brief Report how many bytes are buffered, so that secil_receive_many() knows when a burst has been drained.
+static size_t available_fn(void *user_data)
+{
+    memory_buffer_t *memory_buffer = (memory_buffer_t *)user_data;
+    return memory_buffer->write_index - memory_buffer->read_index;
+}
+
+/// @brief Queue the same 14 messages as each iteration of test_loopback.c
+static void send_burst()
+{
+    secil_send_currentTemperature(100);
+    secil_send_heatingSetpoint(89);
+    secil_send_awayHeatingSetpoint(75);
+    secil_send_coolingSetpoint(22);
+    secil_send_awayCoolingSetpoint(18);
+    secil_send_hvacMode(2);
+    secil_send_relativeHumidity(true);
+    secil_send_accessoryState(false);
+    secil_send_supportPackageData("Support Package Data Example");
+    secil_send_demandResponse(true);
+    secil_send_awayMode(true);
+    secil_send_autoWake(false);
+    secil_send_localUiState(1);
+    secil_send_dateTime(1633036800);
+}
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void view_fn(void *context, const secil_message *message)
+{
+    int *received = (int *)context;
+    (*received)++;
+}
+
+/// @brief Drain the whole buffer using the chosen API and report the cost per message.
+/// @param name Label printed in the results table.
+/// @param batch_size Number of messages per call (0 means one secil_receive() per message).
+/// @param use_view True to use secil_receive_many_view() instead of secil_receive_many().
+/// @param expected Number of messages that should be received.
+/// @param best_ns Updated with the lowest cost per message seen so far.
+/// @return true if every message was received.
+static bool run_benchmark(const char *name, size_t batch_size, bool use_view, int expected, double *best_ns)
+{
+    static secil_message messages[64];
+    int received = 0;
+    int calls = 0;
+
+    memory_buffer.read_index = 0;
+    double start = now_ns();
+
+    while (memory_buffer.read_index < memory_buffer.write_index)
+    {
+        size_t count = 0;
+        secil_error_t result;
+
+        calls++;
+        if (batch_size == 0)
+        {
+            result = secil_receive(&messages[0]);
+            count = (result == SECIL_OK) ? 1 : 0;
+        }
+        else if (use_view)
+        {
+            int viewed = 0;
+            result = secil_receive_many_view(view_fn, &viewed, batch_size, &count);
+            if (result == SECIL_OK && viewed != (int)count)
+            {
+                printf("%s: callback saw %d messages but count is %zu\n", name, viewed, count);
+                return false;
+            }
+        }
+        else
+        {
+            result = secil_receive_many(messages, batch_size, &count);
+        }
+
+        if (result != SECIL_OK)
+        {
+            printf("%s: receive failed: %s\n", name, secil_error_string(result));
+            return false;
+        }
+        received += (int)count;
+    }
+
+    double per_message = (now_ns() - start) / received;
+    if (*best_ns == 0 || per_message < *best_ns)
+    {
+        *best_ns = per_message;
+    }
+
+    if (received != expected)
+    {
+        printf("%s: received %d of %d messages in %d calls\n", name, received, expected, calls);
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    const int bursts = 5000;
+    const int rounds = 5;
+    bool ok = true;
+
+    secil_init(read_fn, write_fn, NULL, log_fn, &memory_buffer);
+    secil_set_available_callback(available_fn);
+
+    for (int i = 0; i < bursts; i++)
+    {
+        send_burst();
+    }
+
+    int expected = bursts * MESSAGES_PER_BURST;
+    printf("Burst benchmark: %d bursts of %d messages (%zu bytes)\n", bursts, MESSAGES_PER_BURST, memory_buffer.write_index);
+
+    const struct
+    {
+        const char *name;
+        size_t batch_size;
+        bool use_view;
+    } variants[] = {
+        { "secil_receive",          0,                  false },
+        { "secil_receive_many(14)", MESSAGES_PER_BURST, false },
+        { "secil_receive_many(64)", 64,                 false },
+        { "receive_many_view(64)",  64,                 true  },
+    };
+    const size_t variant_count = sizeof(variants) / sizeof(variants[0]);
+    double best_ns[sizeof(variants) / sizeof(variants[0])] = {0};
+
+    // Interleave the variants over several rounds and keep the best result of each to reduce noise
+    for (int round = 0; round < rounds; round++)
+    {
+        for (size_t v = 0; v < variant_count; v++)
+        {
+            ok &= run_benchmark(variants[v].name, variants[v].batch_size, variants[v].use_view, expected, &best_ns[v]);
+        }
+    }
+
+    for (size_t v = 0; v < variant_count; v++)
+    {
+        printf("%-24s %8.1f ns/message (%.1f%% of secil_receive)\n", variants[v].name, best_ns[v], 100.0 * best_ns[v] / best_ns[0]);
+    }
+
+    secil_deinit();
+
+    if (!ok)
+    {
+        printf("Burst benchmark did not receive every message.\n");
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,249 @@
+#include <secil.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "sim_link.h"
+
+// The simulated UART runs at this rate in both directions, and each frame takes LATENCY_MS on top to get through
+#define LINK_BAUD 115200
+#define LATENCY_MS 5
+// Long enough for the drift to be worked out once, from offsets SECIL_CLOCK_DRIFT_MS apart, and to be used for a while
+#define DURATION_MS (SECIL_CLOCK_DRIFT_MS + 3000)
+#define HEARTBEAT_INTERVAL_MS 100
+#define SYNC_INTERVAL_MS 100
+// The client sends a timestamped warning this often, which keeps its heartbeats from going out
+#define WARNING_INTERVAL_MS 20
+// The server's clock runs this much fast, as a cheap RC oscillator might, and starts close enough to wrapping that
+// it wraps during the run
+#define SKEW_PPM 5000
+#define CLIENT_CLOCK_START 1000000u
+#define SERVER_CLOCK_START 0xFFFFF000u
+// The clocks count whole ms, which bounds everything measured with them
+#define OFFSET_BOUND_MS 2
+#define DRIFT_BOUND_PPM 300
+#define MAP_BOUND_MS 3
+
+/// @brief Times of the warnings received, split by whether the drift was known when they arrived.
+typedef struct
+{
+    uint32_t messages;
+    double latency_total_ms;      // As reported by secil_get_message_time()
+    double true_latency_total_ms; // By the shared monotonic clock
+    int32_t map_error_max_ms;     // Largest error of the sent_at mapped onto the receiver's clock, either way
+} phase_result_t;
+
+typedef struct
+{
+    bool completed;
+    secil_clock_stats_t stats;
+    int32_t true_offset_ms;       // The remote end's clock less ours when the stats were read
+    int32_t true_drift_ppm;
+    phase_result_t before_drift;
+    phase_result_t after_drift;
+} end_result_t;
+
+static double epoch;
+static bool is_server;
+
+static uint32_t client_clock(double at)
+{
+    return CLIENT_CLOCK_START + (uint32_t)((at - epoch) * 1000.0);
+}
+
+static uint32_t server_clock(double at)
+{
+    return SERVER_CLOCK_START + (uint32_t)((at - epoch) * 1000.0 * (1.0 + SKEW_PPM / 1e6));
+}
+
+static uint32_t clock_fn(void *user_data)
+{
+    return is_server ? server_clock(sim_now_s()) : client_clock(sim_now_s());
+}
+
+/// @brief Work out when the client read its clock, from what it read (to within the ms it counts).
+static double client_time(uint32_t clock)
+{
+    return epoch + ((uint32_t)(clock - CLIENT_CLOCK_START) + 0.5) / 1000.0;
+}
+
+/// @brief Time the warnings that arrive, carrying on until the link is closed.
+static void *receive_thread(void *arg)
+{
+    end_result_t *result = arg;
+    secil_message message;
+    while (!sim.closed)
+    {
+        secil_message_time_t time;
+        secil_clock_stats_t stats;
+        if (secil_receive(&message) != SECIL_OK || message.which_payload != secil_message_warning_tag
+            || secil_get_message_time(&message, &time) != SECIL_OK || secil_get_clock_stats(&stats) != SECIL_OK)
+        {
+            continue;
+        }
+
+        // The client's timestamp is read from its clock, which is known here, so when it was sent is known too
+        double sent = client_time(message.sent_at);
+        int32_t map_error = (int32_t)(time.sent_at - server_clock(sent));
+        map_error = map_error < 0 ? -map_error : map_error;
+
+        phase_result_t *phase = stats.drift_ppm != 0 ? &result->after_drift : &result->before_drift;
+        phase->messages++;
+        phase->latency_total_ms += time.latency_ms;
+        phase->true_latency_total_ms += (sim_now_s() - sent) * 1000.0;
+        if (map_error > phase->map_error_max_ms)
+        {
+            phase->map_error_max_ms = map_error;
+        }
+    }
+    return NULL;
+}
+
+/// @brief One end of the link: the client sends timestamped warnings and the server times them, until end_at.
+static int run_end(secil_operating_mode_t mode, double end_at, int result_fd)
+{
+    end_result_t result = { 0 };
+    is_server = mode == secil_operating_mode_t_SERVER;
+
+    secil_init(sim_read_fn, sim_write_fn, NULL, NULL, NULL);
+    secil_set_clock_callback(clock_fn);
+    secil_set_lock_callbacks(sim_lock_fn, sim_unlock_fn);
+    secil_set_heartbeat(HEARTBEAT_INTERVAL_MS, 0, NULL);
+    secil_set_clock_sync(SYNC_INTERVAL_MS, !is_server);
+    if (secil_startup(mode) == SECIL_OK)
+    {
+        pthread_t receiver;
+        pthread_create(&receiver, NULL, receive_thread, &result);
+
+        result.completed = true;
+        double next_warning = sim_now_s();
+        while (sim_now_s() < end_at && result.completed)
+        {
+            if (!is_server && sim_now_s() >= next_warning)
+            {
+                result.completed = secil_send_warning(secil_warning_type_t_WARNING_SYSTEM, "Timed") == SECIL_OK;
+                next_warning += WARNING_INTERVAL_MS / 1000.0;
+            }
+            secil_poll();
+            usleep(1000);
+        }
+
+        secil_get_clock_stats(&result.stats);
+        double now = sim_now_s();
+        result.true_offset_ms = is_server ? (int32_t)(client_clock(now) - server_clock(now))
+                                          : (int32_t)(server_clock(now) - client_clock(now));
+        result.true_drift_ppm = is_server ? (int32_t)(-SKEW_PPM / (1.0 + SKEW_PPM / 1e6)) : SKEW_PPM;
+
+        // Keep the link open until the remote end has written its last frame too
+        sim_sleep_until(end_at + 0.1);
+    }
+
+    return write(result_fd, &result, sizeof(result)) == sizeof(result) ? 0 : 1;
+}
+
+static void print_end(const char *end, const end_result_t *result)
+{
+    const secil_clock_stats_t *stats = &result->stats;
+    printf("%-6s %7u %8u %11d %9d %9d %9d\n", end, (unsigned)stats->samples, (unsigned)stats->delay_ms,
+           (int)stats->offset_ms, (int)(stats->offset_ms - result->true_offset_ms), (int)stats->drift_ppm,
+           (int)result->true_drift_ppm);
+}
+
+static void print_phase(const char *name, const phase_result_t *phase)
+{
+    printf("%-13s %8u %12.1f %12.1f %12d\n", name, (unsigned)phase->messages,
+           phase->messages ? phase->latency_total_ms / phase->messages : 0.0,
+           phase->messages ? phase->true_latency_total_ms / phase->messages : 0.0, (int)phase->map_error_max_ms);
+}
+
+/// @brief Check what an end measured of the remote end's clock.
+static bool check_clock(const end_result_t *result)
+{
+    const secil_clock_stats_t *stats = &result->stats;
+    int32_t offset_error = stats->offset_ms - result->true_offset_ms;
+    int32_t drift_error = stats->drift_ppm - result->true_drift_ppm;
+    return stats->synced && stats->samples > DURATION_MS / SYNC_INTERVAL_MS / 2
+        && offset_error >= -OFFSET_BOUND_MS && offset_error <= OFFSET_BOUND_MS
+        && drift_error >= -DRIFT_BOUND_PPM && drift_error <= DRIFT_BOUND_PPM;
+}
+
+int main(int argc, char **argv)
+{
+    sim.baud = LINK_BAUD;
+    sim.latency_ms = LATENCY_MS;
+
+    printf("Clock sync: the server's clock runs %d ppm fast and wraps during the run, over a simulated %d baud link\n",
+           SKEW_PPM, LINK_BAUD);
+    printf("with %d ms of latency each way. Both ends ask for a timed heartbeat every %d ms, and the client sends a\n",
+           LATENCY_MS, SYNC_INTERVAL_MS);
+    printf("timestamped warning every %d ms for %d ms, which the server maps onto its own clock.\n\n",
+           WARNING_INTERVAL_MS, DURATION_MS);
+
+    int link_fds[2];
+    int client_fds[2];
+    int server_fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, link_fds) != 0 || pipe(client_fds) != 0 || pipe(server_fds) != 0)
+    {
+        return 1;
+    }
+
+    // Both ends read the same monotonic clock, from which each works out its own, and connecting takes well under the
+    // 200 ms allowed for it
+    epoch = sim_now_s();
+    double end_at = epoch + 0.2 + DURATION_MS / 1000.0;
+
+    pid_t server = sim_fork_end(link_fds[1], link_fds[0], 60);
+    if (server == 0)
+    {
+        exit(run_end(secil_operating_mode_t_SERVER, end_at, server_fds[1]));
+    }
+
+    pid_t client = sim_fork_end(link_fds[0], link_fds[1], 60);
+    if (client == 0)
+    {
+        exit(run_end(secil_operating_mode_t_CLIENT, end_at, client_fds[1]));
+    }
+
+    close(link_fds[0]);
+    close(link_fds[1]);
+    close(client_fds[1]);
+    close(server_fds[1]);
+
+    bool ended = sim_wait_ends(client, server);
+    end_result_t client_result = { 0 };
+    end_result_t server_result = { 0 };
+    bool ok = read(client_fds[0], &client_result, sizeof(client_result)) == sizeof(client_result)
+           && read(server_fds[0], &server_result, sizeof(server_result)) == sizeof(server_result)
+           && client_result.completed && server_result.completed && ended;
+    close(client_fds[0]);
+    close(server_fds[0]);
+
+    if (!ok)
+    {
+        printf("The link did not complete.\n");
+        printf("Clock sync benchmark failed.\n");
+        return 1;
+    }
+
+    printf("End    Samples Delay ms   Offset ms Error ms Drift ppm True ppm\n");
+    print_end("client", &client_result);
+    print_end("server", &server_result);
+    printf("\nWarnings      Received   Latency ms  True lat. ms  Map err. ms\n");
+    print_phase("before drift", &server_result.before_drift);
+    print_phase("after drift", &server_result.after_drift);
+
+    // Once the drift is known, every warning is mapped to within the clock resolution either way
+    const phase_result_t *after = &server_result.after_drift;
+    ok = check_clock(&client_result) && check_clock(&server_result)
+      && after->messages > 0 && after->map_error_max_ms <= MAP_BOUND_MS;
+    if (!ok)
+    {
+        printf("The clocks were not measured as expected.\n");
+        printf("Clock sync benchmark failed.\n");
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,318 @@
+#include <secil.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+// How many times the corpus is sent in each run, so that the CPU time is long enough to measure
+#define REPEATS 50
+#define MAX_TEXT (sizeof(((secil_supportPackageData *)0)->supportPackageData) - 1)
+
+typedef enum
+{
+    WORKLOAD_SUPPORT_PACKAGE, // The corpus in chunks as large as a support package message takes
+    WORKLOAD_WARNINGS,        // One warning per line of the corpus
+} workload_t;
+
+typedef struct
+{
+    bool completed;
+    double cpu_seconds;
+    size_t messages;
+    size_t text_bytes;
+    size_t wire_bytes;
+    secil_compression_stats_t stats;
+} sender_result_t;
+
+typedef struct
+{
+    bool verified;
+    double cpu_seconds;
+} receiver_result_t;
+
+static int link_fd;
+static size_t wire_bytes;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static char corpus[16 * 1024];
+static size_t corpus_size;
+
+static double cpu_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void lock_fn(void *user_data)
+{
+    pthread_mutex_lock(&lock);
+}
+
+static void unlock_fn(void *user_data)
+{
+    pthread_mutex_unlock(&lock);
+}
+
+static bool read_fn(void *user_data, unsigned char *buf, size_t required_count)
+{
+    while (required_count > 0)
+    {
+        ssize_t count = read(link_fd, buf, required_count);
+        if (count <= 0)
+        {
+            return false;
+        }
+        buf += count;
+        required_count -= (size_t)count;
+    }
+    return true;
+}
+
+static bool write_fn(void *user_data, const unsigned char *buf, size_t count)
+{
+    wire_bytes += count;
+    return write(link_fd, buf, count) == (ssize_t)count;
+}
+
+/// @brief Cut the next piece of text from the corpus for the workload.
+/// @param offset Where to start, moved on past the piece.
+/// @param text Receives the piece, null terminated.
+static void next_text(workload_t workload, size_t *offset, char *text)
+{
+    size_t length = corpus_size - *offset < MAX_TEXT ? corpus_size - *offset : MAX_TEXT;
+    if (workload == WORKLOAD_WARNINGS)
+    {
+        const char *end = memchr(corpus + *offset, '\n', length);
+        length = end ? (size_t)(end - (corpus + *offset)) + 1 : length;
+    }
+    memcpy(text, corpus + *offset, length);
+    text[length] = '\0';
+    *offset += length;
+}
+
+static bool start_link(int fd, secil_operating_mode_t mode, bool compression)
+{
+    link_fd = fd;
+    signal(SIGPIPE, SIG_IGN); // The reliable channel may still acknowledge once the other end has closed
+    secil_init(read_fn, write_fn, NULL, NULL, NULL);
+    secil_set_lock_callbacks(lock_fn, unlock_fn);
+    uint32_t capabilities = SECIL_CAPABILITIES_SUPPORTED;
+    if (!compression)
+    {
+        capabilities &= ~SECIL_CAPABILITY_COMPRESSION;
+    }
+    secil_set_capabilities(capabilities);
+    return secil_startup(mode) == SECIL_OK;
+}
+
+/// @brief Receiving end: check every piece of text against the corpus, and time the CPU spent receiving them.
+static int run_receiver(int fd, workload_t workload, int result_fd)
+{
+    receiver_result_t result = { 0 };
+
+    if (start_link(fd, secil_operating_mode_t_SERVER, true))
+    {
+        result.verified = true;
+        double start = cpu_s();
+        for (int repeat = 0; repeat < REPEATS && result.verified; repeat++)
+        {
+            size_t offset = 0;
+            while (offset < corpus_size && result.verified)
+            {
+                char expected[MAX_TEXT + 1];
+                next_text(workload, &offset, expected);
+
+                secil_message message;
+                if (secil_receive(&message) != SECIL_OK)
+                {
+                    result.verified = false;
+                }
+                else if (workload == WORKLOAD_WARNINGS)
+                {
+                    result.verified = message.which_payload == secil_message_warning_tag
+                                   && strcmp(message.payload.warning.message, expected) == 0;
+                }
+                else
+                {
+                    result.verified = message.which_payload == secil_message_supportPackageData_tag
+                                   && strcmp(message.payload.supportPackageData.supportPackageData, expected) == 0;
+                }
+            }
+        }
+        result.cpu_seconds = cpu_s() - start;
+    }
+
+    return write(result_fd, &result, sizeof(result)) == sizeof(result) ? 0 : 1;
+}
+
+/// @brief Send a piece of text in the message of the workload.
+static secil_error_t send_text(workload_t workload, const char *text)
+{
+    return workload == WORKLOAD_WARNINGS ? secil_send_warning(secil_warning_type_t_WARNING_SYSTEM, text)
+                                         : secil_send_supportPackageData(text);
+}
+
+/// @brief Take the acknowledgements of the reliable channel (when it is in use), until the link closes.
+static void *receive_thread(void *arg)
+{
+    secil_message message;
+    while (secil_receive(&message) == SECIL_OK)
+    {
+    }
+    return NULL;
+}
+
+/// @brief Sending end: send the corpus REPEATS times and time the CPU spent sending it.
+static int run_sender(int fd, workload_t workload, bool compression, int result_fd)
+{
+    sender_result_t result = { 0 };
+
+    if (start_link(fd, secil_operating_mode_t_CLIENT, compression))
+    {
+        pthread_t receiver;
+        pthread_create(&receiver, NULL, receive_thread, NULL);
+
+        result.completed = true;
+        size_t wire_bytes_at_start = wire_bytes;
+        double start = cpu_s();
+        for (int repeat = 0; repeat < REPEATS && result.completed; repeat++)
+        {
+            size_t offset = 0;
+            while (offset < corpus_size && result.completed)
+            {
+                char text[MAX_TEXT + 1];
+                next_text(workload, &offset, text);
+                result.messages++;
+                result.text_bytes += strlen(text);
+
+                // On the reliable channel the text waits for room in the window
+                secil_error_t sent;
+                while ((sent = send_text(workload, text)) == SECIL_ERROR_WINDOW_FULL)
+                {
+                    usleep(100);
+                }
+                result.completed = sent == SECIL_OK;
+            }
+        }
+
+        // Keep the link open until the last frames have been acknowledged
+        secil_reliable_stats_t reliable = { 0 };
+        for (int i = 0; i < 1000 && secil_get_reliable_stats(&reliable) == SECIL_OK && reliable.in_flight > 0; i++)
+        {
+            usleep(1000);
+        }
+        result.cpu_seconds = cpu_s() - start;
+        result.wire_bytes = wire_bytes - wire_bytes_at_start;
+        secil_get_compression_stats(&result.stats);
+    }
+
+    return write(result_fd, &result, sizeof(result)) == sizeof(result) ? 0 : 1;
+}
+
+static bool run_case(workload_t workload, bool compression, size_t *uncompressed_wire_bytes)
+{
+    int link_fds[2];
+    int sender_fds[2];
+    int receiver_fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, link_fds) != 0 || pipe(sender_fds) != 0 || pipe(receiver_fds) != 0)
+    {
+        return false;
+    }
+
+    fflush(stdout);
+    pid_t receiver = fork();
+    if (receiver == 0)
+    {
+        alarm(60);
+        close(link_fds[0]);
+        exit(run_receiver(link_fds[1], workload, receiver_fds[1]));
+    }
+
+    pid_t sender = fork();
+    if (sender == 0)
+    {
+        alarm(60);
+        close(link_fds[1]);
+        exit(run_sender(link_fds[0], workload, compression, sender_fds[1]));
+    }
+
+    close(link_fds[0]);
+    close(link_fds[1]);
+    close(sender_fds[1]);
+    close(receiver_fds[1]);
+
+    int receiver_status = 0;
+    int sender_status = 0;
+    waitpid(receiver, &receiver_status, 0);
+    waitpid(sender, &sender_status, 0);
+
+    sender_result_t sent = { 0 };
+    receiver_result_t received = { 0 };
+    bool ok = read(sender_fds[0], &sent, sizeof(sent)) == sizeof(sent)
+           && read(receiver_fds[0], &received, sizeof(received)) == sizeof(received)
+           && sent.completed && received.verified
+           && WIFEXITED(receiver_status) && WEXITSTATUS(receiver_status) == 0
+           && WIFEXITED(sender_status) && WEXITSTATUS(sender_status) == 0;
+    close(sender_fds[0]);
+    close(receiver_fds[0]);
+
+    const char *name = workload == WORKLOAD_WARNINGS ? "warnings" : "support package";
+    if (!ok)
+    {
+        printf("%-16s %-4s did not deliver the corpus intact\n", name, compression ? "on" : "off");
+        return false;
+    }
+
+    if (!compression)
+    {
+        *uncompressed_wire_bytes = sent.wire_bytes;
+    }
+    printf("%-16s %-4s %10zu %10.2f %13.2f %12.1f %12.1f %15.1f\n",
+           name, compression ? "on" : "off",
+           sent.wire_bytes,
+           (double)*uncompressed_wire_bytes / (double)sent.wire_bytes,
+           sent.stats.bytes_after ? (double)sent.stats.bytes_before / sent.stats.bytes_after : 1.0,
+           100.0 * sent.stats.compressed_frames / sent.messages,
+           1e9 * sent.cpu_seconds / sent.text_bytes,
+           1e9 * received.cpu_seconds / sent.text_bytes);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    FILE *file = fopen(SECIL_CORPUS, "rb");
+    if (!file)
+    {
+        printf("Cannot open the corpus %s\n", SECIL_CORPUS);
+        return 1;
+    }
+    corpus_size = fread(corpus, 1, sizeof(corpus), file);
+    fclose(file);
+
+    printf("Compression: %s (%zu bytes), sent %d times\n", SECIL_CORPUS, corpus_size, REPEATS);
+    printf("Wire ratio compares the bytes sent with compression off and on, message ratio covers the compressed frames only.\n");
+    printf("CPU time is per byte of text, for encoding and framing (send) or decoding (receive).\n\n");
+    printf("Workload         LZ   Wire bytes Wire ratio Message ratio Compressed %% Send ns/byte Receive ns/byte\n");
+
+    bool ok = true;
+    const workload_t workloads[] = { WORKLOAD_SUPPORT_PACKAGE, WORKLOAD_WARNINGS };
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++)
+    {
+        size_t uncompressed_wire_bytes = 0;
+        ok &= run_case(workloads[w], false, &uncompressed_wire_bytes);
+        ok &= run_case(workloads[w], true, &uncompressed_wire_bytes);
+    }
+
+    if (!ok)
+    {
+        printf("Compression benchmark failed.\n");
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,342 @@
+#include <secil.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "sim_link.h"
+
+// The simulated UART runs at this rate in both directions
+#define LINK_BAUD 115200
+#define DURATION_MS 2000
+// The slow end's UART receive buffer, and the time its application spends on each message
+#define RX_RING_SIZE 256
+#define RECEIVER_WORK_US 2000
+// Longest the sending end waits for its queues to drain once it stops sending
+#define DRAIN_MS 3000
+#define MAX_TEXT (sizeof(((secil_supportPackageData *)0)->supportPackageData) - 1)
+
+static volatile bool stop;
+static uint32_t accepted[SECIL_TX_CLASSES]; // Messages the library took to send, each counted by the thread of its class
+
+// The slow end's UART: a thread plays the receive interrupt, and drops the bytes that find the ring full
+static struct
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint8_t buf[RX_RING_SIZE];
+    size_t head;
+    size_t used;
+    bool closed;
+    uint32_t overrun_bytes;
+} ring = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+typedef struct
+{
+    bool completed;
+    uint32_t sent[SECIL_TX_CLASSES]; // Messages sent once, as a retransmission on the reliable channel is one frame more
+    secil_flow_stats_t flow;
+} sender_result_t;
+
+typedef struct
+{
+    uint32_t received[SECIL_TX_CLASSES];
+    uint32_t errors;
+    uint32_t overrun_bytes;
+    secil_flow_stats_t flow;
+} receiver_result_t;
+
+/// @brief The receive interrupt of the slow end: move each byte that arrives into the ring, if it has room.
+static void *uart_thread(void *arg)
+{
+    uint8_t buf[64];
+    ssize_t count;
+    while ((count = read(sim.fd, buf, sizeof(buf))) > 0)
+    {
+        pthread_mutex_lock(&ring.mutex);
+        for (ssize_t i = 0; i < count; i++)
+        {
+            if (ring.used == RX_RING_SIZE)
+            {
+                ring.overrun_bytes++;
+                continue;
+            }
+            ring.buf[(ring.head + ring.used++) % RX_RING_SIZE] = buf[i];
+        }
+        pthread_cond_signal(&ring.cond);
+        pthread_mutex_unlock(&ring.mutex);
+    }
+
+    pthread_mutex_lock(&ring.mutex);
+    ring.closed = true;
+    pthread_cond_signal(&ring.cond);
+    pthread_mutex_unlock(&ring.mutex);
+    return NULL;
+}
+
+/// @brief Read from the ring of the slow end, waiting for the bytes to arrive.
+static bool ring_read_fn(void *user_data, unsigned char *buf, size_t required_count)
+{
+    pthread_mutex_lock(&ring.mutex);
+    while (required_count > 0)
+    {
+        while (ring.used == 0 && !ring.closed)
+        {
+            pthread_cond_wait(&ring.cond, &ring.mutex);
+        }
+        if (ring.used == 0)
+        {
+            break;
+        }
+        *buf++ = ring.buf[ring.head];
+        ring.head = (ring.head + 1) % RX_RING_SIZE;
+        ring.used--;
+        required_count--;
+    }
+    pthread_mutex_unlock(&ring.mutex);
+    return required_count == 0;
+}
+
+static size_t ring_available_fn(void *user_data)
+{
+    pthread_mutex_lock(&ring.mutex);
+    size_t used = ring.used;
+    pthread_mutex_unlock(&ring.mutex);
+    return used;
+}
+
+static bool start_link(secil_read_fn read_callback, secil_operating_mode_t mode, uint16_t rx_buffer)
+{
+    secil_init(read_callback, sim_write_fn, NULL, NULL, NULL);
+    secil_set_clock_callback(sim_clock_fn);
+    secil_set_lock_callbacks(sim_lock_fn, sim_unlock_fn);
+    return secil_set_rx_buffer(rx_buffer) == SECIL_OK && secil_startup(mode) == SECIL_OK;
+}
+
+static void *poll_thread(void *arg)
+{
+    while (!stop)
+    {
+        secil_poll();
+        usleep(10000);
+    }
+    return NULL;
+}
+
+/// @brief Receiving end: a slow application that counts the messages of each class.
+static int run_receiver(bool flow_control, int result_fd)
+{
+    receiver_result_t result = { 0 };
+
+    pthread_t uart;
+    pthread_create(&uart, NULL, uart_thread, NULL);
+
+    if (!start_link(ring_read_fn, secil_operating_mode_t_SERVER, flow_control ? RX_RING_SIZE : 0))
+    {
+        return 1;
+    }
+    secil_set_available_callback(ring_available_fn);
+
+    pthread_t poller;
+    pthread_create(&poller, NULL, poll_thread, NULL);
+
+    secil_message message;
+    while (true)
+    {
+        if (secil_receive(&message) != SECIL_OK)
+        {
+            // Lost bytes show up as frames that fail their CRC, until the link closes
+            if (ring_available_fn(NULL) == 0 && ring.closed)
+            {
+                break;
+            }
+            result.errors++;
+            continue;
+        }
+
+        result.received[message.which_payload == secil_message_supportPackageData_tag ? SECIL_TX_BULK : SECIL_TX_STATE]++;
+        usleep(RECEIVER_WORK_US);
+    }
+
+    stop = true;
+    pthread_join(poller, NULL);
+    pthread_join(uart, NULL);
+
+    result.overrun_bytes = ring.overrun_bytes;
+    secil_get_flow_stats(&result.flow);
+    return write(result_fd, &result, sizeof(result)) == sizeof(result) ? 0 : 1;
+}
+
+/// @brief Keep the bulk queue full of support package text.
+static void *bulk_thread(void *arg)
+{
+    char text[MAX_TEXT + 1];
+    memset(text, 'x', MAX_TEXT);
+    text[MAX_TEXT] = '\0';
+
+    while (!stop)
+    {
+        secil_error_t sent = secil_send_supportPackageData(text);
+        if (sent == SECIL_ERROR_QUEUE_FULL || sent == SECIL_ERROR_WINDOW_FULL)
+        {
+            usleep(500);
+        }
+        accepted[SECIL_TX_BULK] += sent == SECIL_OK;
+    }
+    return NULL;
+}
+
+/// @brief Keep the state queue full of temperature values.
+static void *state_thread(void *arg)
+{
+    int8_t temperature = 0;
+    while (!stop)
+    {
+        secil_error_t sent = secil_send_currentTemperature(temperature++);
+        if (sent == SECIL_ERROR_QUEUE_FULL || sent == SECIL_ERROR_WINDOW_FULL)
+        {
+            usleep(500);
+        }
+        accepted[SECIL_TX_STATE] += sent == SECIL_OK;
+    }
+    return NULL;
+}
+
+/// @brief Take the credit (and, on the reliable channel, the acknowledgements) sent back by the slow end, until the
+///        link closes.
+static void *receive_thread(void *arg)
+{
+    secil_message message;
+    while (secil_receive(&message) == SECIL_OK)
+    {
+    }
+    return NULL;
+}
+
+/// @brief Sending end: flood the state and bulk classes for DURATION_MS, then let the queues drain.
+static int run_sender(int result_fd)
+{
+    sender_result_t result = { 0 };
+
+    if (start_link(sim_read_fn, secil_operating_mode_t_CLIENT, 0))
+    {
+        pthread_t threads[3];
+        pthread_create(&threads[0], NULL, receive_thread, NULL);
+        pthread_create(&threads[1], NULL, bulk_thread, NULL);
+        pthread_create(&threads[2], NULL, state_thread, NULL);
+
+        usleep(DURATION_MS * 1000);
+        stop = true;
+        pthread_join(threads[1], NULL);
+        pthread_join(threads[2], NULL);
+
+        // Whatever is still queued goes out as the slow end gives credit, and is acknowledged on the reliable channel
+        secil_tx_class_stats_t stats[SECIL_TX_CLASSES];
+        double end = sim_now_s() + DRAIN_MS / 1000.0;
+        bool drained = false;
+        while (!drained && sim_now_s() < end)
+        {
+            secil_poll();
+            usleep(10000);
+            secil_reliable_stats_t reliable = { 0 };
+            secil_get_reliable_stats(&reliable);
+            drained = reliable.in_flight == 0;
+            for (int i = 0; i < SECIL_TX_CLASSES; i++)
+            {
+                secil_get_tx_stats((secil_tx_class_t)i, &stats[i]);
+                drained = drained && stats[i].depth == 0;
+            }
+        }
+
+        result.completed = drained;
+        for (int i = 0; i < SECIL_TX_CLASSES; i++)
+        {
+            result.sent[i] = accepted[i];
+        }
+        secil_get_flow_stats(&result.flow);
+        shutdown(sim.fd, SHUT_RDWR);
+        pthread_join(threads[0], NULL);
+    }
+
+    return write(result_fd, &result, sizeof(result)) == sizeof(result) ? 0 : 1;
+}
+
+static bool run_case(bool flow_control)
+{
+    int link_fds[2];
+    int sender_fds[2];
+    int receiver_fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, link_fds) != 0 || pipe(sender_fds) != 0 || pipe(receiver_fds) != 0)
+    {
+        return false;
+    }
+
+    pid_t receiver = sim_fork_end(link_fds[1], link_fds[0], 60);
+    if (receiver == 0)
+    {
+        exit(run_receiver(flow_control, receiver_fds[1]));
+    }
+
+    pid_t sender = sim_fork_end(link_fds[0], link_fds[1], 60);
+    if (sender == 0)
+    {
+        exit(run_sender(sender_fds[1]));
+    }
+
+    close(link_fds[0]);
+    close(link_fds[1]);
+    close(sender_fds[1]);
+    close(receiver_fds[1]);
+
+    bool ended = sim_wait_ends(receiver, sender);
+    sender_result_t sent = { 0 };
+    receiver_result_t received = { 0 };
+    bool ok = read(sender_fds[0], &sent, sizeof(sent)) == sizeof(sent)
+           && read(receiver_fds[0], &received, sizeof(received)) == sizeof(received)
+           && sent.completed && ended;
+    close(sender_fds[0]);
+    close(receiver_fds[0]);
+
+    const char *name = flow_control ? "on" : "off";
+    if (!ok)
+    {
+        printf("%-4s the link did not complete\n", name);
+        return false;
+    }
+
+    uint32_t frames_sent = sent.sent[SECIL_TX_STATE] + sent.sent[SECIL_TX_BULK];
+    uint32_t frames_received = received.received[SECIL_TX_STATE] + received.received[SECIL_TX_BULK];
+    printf("%-4s %13u %7u %9u %6u %6u %7u %11u %10u %8u %10u\n",
+           name, (unsigned)received.overrun_bytes, (unsigned)frames_sent, (unsigned)frames_received,
+           (unsigned)(frames_sent - frames_received), (unsigned)received.errors,
+           (unsigned)sent.flow.stalls, (unsigned)sent.flow.stalled_ms, (unsigned)received.flow.stalled_ms,
+           (unsigned)received.flow.credits_sent, (unsigned)received.flow.rx_peak);
+
+    // With flow control the ring never overruns, so every frame written arrives
+    return !flow_control
+        || (   received.overrun_bytes == 0 && received.errors == 0 && frames_sent > 0
+            && received.received[SECIL_TX_STATE] == sent.sent[SECIL_TX_STATE]
+            && received.received[SECIL_TX_BULK] == sent.sent[SECIL_TX_BULK]);
+}
+
+int main(int argc, char **argv)
+{
+    sim.baud = LINK_BAUD;
+
+    printf("Flow control: state and bulk queues kept full for %d ms over a simulated %d baud link, to a receiver with\n", DURATION_MS, LINK_BAUD);
+    printf("a %d byte UART ring that spends %d us on each message. Stalls are counted at the sending end, and the\n", RX_RING_SIZE, RECEIVER_WORK_US);
+    printf("stalled time at both ends.\n\n");
+    printf("Flow Overrun bytes    Sent  Received   Lost Errors  Stalls  Stalled ms Rx stalled  Credits  Peak ring\n");
+
+    bool ok = run_case(false);
+    ok &= run_case(true);
+
+    if (!ok)
+    {
+        printf("Flow control benchmark failed.\n");
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,268 @@
+#include <secil.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "sim_link.h"
+
+// The simulated UART runs at this rate in both directions, and each frame takes LATENCY_MS on top to get through
+#define LINK_BAUD 115200
+#define LATENCY_MS 5
+#define DURATION_MS 2000
+#define INTERVAL_MS 50
+#define MISSED_LIMIT 3
+// Busy ends send a value this often, which is plenty to keep the link alive without heartbeats
+#define BUSY_INTERVAL_MS 10
+// Share of the frames lost in the lossy case, once connected
+#define LOSS_PERCENT 20
+// The server goes silent this long after the start in the dead case
+#define DEATH_MS 1000
+// Each round trip takes two latencies, plus the frames on the wire and a ms of clock resolution either way
+#define RTT_MIN_MS (2 * LATENCY_MS)
+#define RTT_MAX_MS (2 * LATENCY_MS + 10)
+// The link is down MISSED_LIMIT intervals after the last frame, and the poll loop runs every ms
+#define DOWN_BOUND_MS (MISSED_LIMIT * INTERVAL_MS + 20)
+
+typedef enum
+{
+    CASE_IDLE,
+    CASE_BUSY,
+    CASE_LOSSY,
+    CASE_DEAD,
+} bench_case_t;
+
+static double link_down_at;
+static uint32_t link_down_silent_ms;
+
+typedef struct
+{
+    bool completed;
+    uint32_t messages;     // Values received from the remote end
+    double down_after_ms;  // From the remote end going silent to the link down callback, negative if it never came
+    uint32_t silent_ms;    // Silence given to the callback
+    secil_link_stats_t stats;
+} end_result_t;
+
+static void on_link_down(void *user_data, uint32_t silent_ms)
+{
+    link_down_at = sim_now_s();
+    link_down_silent_ms = silent_ms;
+}
+
+/// @brief Count the values that arrive, carrying on past corrupt frames until the link is closed.
+static void *receive_thread(void *arg)
+{
+    uint32_t *messages = arg;
+    secil_message message;
+    while (!sim.closed)
+    {
+        if (secil_receive(&message) == SECIL_OK)
+        {
+            (*messages)++;
+        }
+    }
+    return NULL;
+}
+
+/// @brief One end of the link: keep polling (and sending values if busy) until end_at.
+///        In the dead case the server goes silent at death_at, and the client times how long it takes to notice.
+static int run_end(secil_operating_mode_t mode, bench_case_t bench_case, double death_at, double end_at, int result_fd)
+{
+    bool dies = bench_case == CASE_DEAD && mode == secil_operating_mode_t_SERVER;
+    end_result_t result = { 0 };
+    result.down_after_ms = -1.0;
+    sim.seed = mode == secil_operating_mode_t_CLIENT ? 1 : 2;
+
+    secil_init(sim_read_fn, sim_write_fn, NULL, NULL, NULL);
+    secil_set_clock_callback(sim_clock_fn);
+    secil_set_lock_callbacks(sim_lock_fn, sim_unlock_fn);
+    secil_set_heartbeat(INTERVAL_MS, MISSED_LIMIT, on_link_down);
+    if (secil_startup(mode) == SECIL_OK)
+    {
+        pthread_t receiver;
+        pthread_create(&receiver, NULL, receive_thread, &result.messages);
+        sim.errors_enabled = bench_case == CASE_LOSSY;
+
+        result.completed = true;
+        double next_value = sim_now_s();
+        int8_t value = 0;
+        while (sim_now_s() < end_at && result.completed)
+        {
+            if (dies && sim_now_s() >= death_at)
+            {
+                sim.frozen = true;
+                break;
+            }
+            if (bench_case == CASE_BUSY && sim_now_s() >= next_value)
+            {
+                result.completed = secil_send_heatingSetpoint(value++ % 30) == SECIL_OK;
+                next_value += BUSY_INTERVAL_MS / 1000.0;
+            }
+            secil_poll();
+            usleep(1000);
+        }
+
+        if (sim.frozen)
+        {
+            // Stay silent with the link still open until the other end has finished watching it
+            sim_sleep_until(end_at + 0.5);
+            _exit(0);
+        }
+        secil_get_link_stats(&result.stats);
+
+        // Keep the link open until the remote end has written its last frame too
+        sim_sleep_until(end_at + 0.1);
+    }
+
+    if (link_down_at > 0 && bench_case == CASE_DEAD)
+    {
+        result.down_after_ms = (link_down_at - death_at) * 1000.0;
+        result.silent_ms = link_down_silent_ms;
+    }
+    return write(result_fd, &result, sizeof(result)) == sizeof(result) ? 0 : 1;
+}
+
+static void print_end(const char *name, const char *end, const end_result_t *result)
+{
+    const secil_link_stats_t *stats = &result->stats;
+    printf("%-6s %-6s %5u %5u %5u %6u %6u %6u %6u %7u %5s %5u %5u",
+           name, end,
+           (unsigned)stats->heartbeats_sent, (unsigned)stats->heartbeats_received, (unsigned)stats->heartbeats_lost,
+           (unsigned)result->messages, (unsigned)stats->rtt_ms, (unsigned)stats->rtt_min_ms, (unsigned)stats->jitter_ms,
+           (unsigned)stats->loss_permille, stats->up ? "up" : "down", (unsigned)stats->link_downs, (unsigned)stats->quality);
+    if (result->down_after_ms >= 0)
+    {
+        printf(" %8.1f", result->down_after_ms);
+    }
+    printf("\n");
+}
+
+/// @brief Check the measurements of an end that heard its remote end.
+/// @param steady The remote end was heard throughout, so the link never went down.
+static bool check_measured(const end_result_t *result, bool steady, uint16_t loss_min, uint16_t loss_max, uint8_t quality_min)
+{
+    const secil_link_stats_t *stats = &result->stats;
+    return (!steady || (stats->up && stats->link_downs == 0)) && stats->heartbeats_received > 0
+        && stats->rtt_ms >= RTT_MIN_MS && stats->rtt_ms <= RTT_MAX_MS && stats->rtt_min_ms >= RTT_MIN_MS
+        && stats->loss_permille >= loss_min && stats->loss_permille <= loss_max && stats->quality >= quality_min;
+}
+
+static bool run_case(const char *name, bench_case_t bench_case)
+{
+    int link_fds[2];
+    int client_fds[2];
+    int server_fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, link_fds) != 0 || pipe(client_fds) != 0 || pipe(server_fds) != 0)
+    {
+        return false;
+    }
+
+    // Both ends read the same monotonic clock, and connecting takes well under the 200 ms allowed for it
+    double start = sim_now_s() + 0.2;
+    double end_at = start + DURATION_MS / 1000.0;
+    double death_at = start + DEATH_MS / 1000.0;
+
+    pid_t server = sim_fork_end(link_fds[1], link_fds[0], 60);
+    if (server == 0)
+    {
+        exit(run_end(secil_operating_mode_t_SERVER, bench_case, death_at, end_at, server_fds[1]));
+    }
+
+    pid_t client = sim_fork_end(link_fds[0], link_fds[1], 60);
+    if (client == 0)
+    {
+        exit(run_end(secil_operating_mode_t_CLIENT, bench_case, death_at, end_at, client_fds[1]));
+    }
+
+    close(link_fds[0]);
+    close(link_fds[1]);
+    close(client_fds[1]);
+    close(server_fds[1]);
+
+    bool ended = sim_wait_ends(client, server);
+    end_result_t client_result = { 0 };
+    end_result_t server_result = { 0 };
+    bool ok = read(client_fds[0], &client_result, sizeof(client_result)) == sizeof(client_result)
+           && client_result.completed && ended;
+    bool server_reported = read(server_fds[0], &server_result, sizeof(server_result)) == sizeof(server_result);
+    close(client_fds[0]);
+    close(server_fds[0]);
+
+    if (!ok || (bench_case != CASE_DEAD && !(server_reported && server_result.completed)))
+    {
+        printf("%-6s the link did not complete\n", name);
+        return false;
+    }
+
+    print_end(name, "client", &client_result);
+    if (bench_case != CASE_DEAD)
+    {
+        print_end(name, "server", &server_result);
+    }
+
+    const uint32_t intervals = DURATION_MS / INTERVAL_MS;
+    switch (bench_case)
+    {
+    case CASE_IDLE:
+        // Each end sends a heartbeat or an answer about once an interval, and none go missing
+        ok = check_measured(&client_result, true, 0, 0, 80) && check_measured(&server_result, true, 0, 0, 80)
+          && client_result.stats.heartbeats_sent >= intervals / 2 && client_result.stats.heartbeats_sent <= 2 * intervals + 2;
+        break;
+
+    case CASE_BUSY:
+        // The values keep the link alive, so no heartbeat goes out at all
+        ok = client_result.stats.heartbeats_sent == 0 && server_result.stats.heartbeats_sent == 0
+          && client_result.stats.up && server_result.stats.up
+          && client_result.stats.link_downs == 0 && server_result.stats.link_downs == 0;
+        break;
+
+    case CASE_LOSSY:
+        // The loss rate is an average over the last 16 or so heartbeats, so it is only roughly LOSS_PERCENT.
+        // At this loss every frame of MISSED_LIMIT intervals goes missing now and then, which takes the link down.
+        ok = check_measured(&client_result, false, 50, 400, 40) && check_measured(&server_result, false, 50, 400, 40);
+        break;
+
+    case CASE_DEAD:
+        ok = client_result.stats.link_downs == 1 && !client_result.stats.up && client_result.stats.quality == 0
+          && client_result.down_after_ms >= 0 && client_result.down_after_ms <= DOWN_BOUND_MS
+          && client_result.silent_ms >= MISSED_LIMIT * INTERVAL_MS;
+        break;
+    }
+
+    if (!ok)
+    {
+        printf("The link was not measured as expected.\n");
+    }
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    sim.baud = LINK_BAUD;
+    sim.latency_ms = LATENCY_MS;
+    sim.loss_percent = LOSS_PERCENT;
+
+    printf("Heartbeats: every %d ms while the link is quiet, over a simulated %d baud link with %d ms of latency each way,\n",
+           INTERVAL_MS, LINK_BAUD, LATENCY_MS);
+    printf("for %d ms. The busy case sends a value every %d ms from each end, the lossy case loses %d%% of the frames,\n",
+           DURATION_MS, BUSY_INTERVAL_MS, LOSS_PERCENT);
+    printf("and in the dead case the server goes silent after %d ms: the link is down after %d missed heartbeats,\n",
+           DEATH_MS, MISSED_LIMIT);
+    printf("where a reader relying on a 5 s read timeout would still be waiting.\n\n");
+
+    printf("Case   End     Sent  Rcvd  Lost Values RTT ms Min ms Jitter Loss %%o  Link Downs Qual. Down ms\n");
+    bool ok = run_case("idle", CASE_IDLE);
+    ok &= run_case("busy", CASE_BUSY);
+    ok &= run_case("lossy", CASE_LOSSY);
+    ok &= run_case("dead", CASE_DEAD);
+
+    if (!ok)
+    {
+        printf("Heartbeat benchmark failed.\n");
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,273 @@
+#include <secil.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "sim_link.h"
+
+// The simulated UART runs at this rate in both directions
+#define LINK_BAUD 115200
+#define DURATION_MS 2000
+#define WARNING_INTERVAL_MS 20
+// Allowance for thread scheduling and the millisecond clock on top of the frame time
+#define SLACK_MS 10
+#define MAX_TEXT (sizeof(((secil_supportPackageData *)0)->supportPackageData) - 1)
+
+static volatile bool stop;
+
+typedef struct
+{
+    bool completed;
+    double largest_frame_ms;
+    secil_tx_class_stats_t stats[SECIL_TX_CLASSES];
+} sender_result_t;
+
+typedef struct
+{
+    uint32_t received[SECIL_TX_CLASSES];
+    double warning_latency_max_ms;
+    double warning_latency_total_ms;
+} receiver_result_t;
+
+static bool start_link(secil_operating_mode_t mode, bool fragments)
+{
+    secil_init(sim_read_fn, sim_write_fn, NULL, NULL, NULL);
+    secil_set_clock_callback(sim_clock_fn);
+    secil_set_lock_callbacks(sim_lock_fn, sim_unlock_fn);
+    uint32_t capabilities = SECIL_CAPABILITIES_SUPPORTED;
+    if (!fragments)
+    {
+        capabilities &= ~SECIL_CAPABILITY_FRAGMENTS;
+    }
+    secil_set_capabilities(capabilities);
+    bool connected = secil_startup(mode) == SECIL_OK;
+    sim.largest_write = 0; // Only the frames (or fragments) once connected, to work out the longest one can take
+    return connected;
+}
+
+/// @brief Receiving end: count the messages of each class, and time how long each warning took to arrive.
+///        The warning carries the time it was sent, which both processes read from the same monotonic clock.
+static int run_receiver(int result_fd)
+{
+    receiver_result_t result = { 0 };
+
+    if (!start_link(secil_operating_mode_t_SERVER, true))
+    {
+        return 1;
+    }
+
+    secil_message message;
+    while (secil_receive(&message) == SECIL_OK)
+    {
+        switch (message.which_payload)
+        {
+        case secil_message_warning_tag:
+        {
+            double latency_ms = (sim_now_s() - atof(message.payload.warning.message)) * 1000.0;
+            result.warning_latency_total_ms += latency_ms;
+            if (latency_ms > result.warning_latency_max_ms)
+            {
+                result.warning_latency_max_ms = latency_ms;
+            }
+            result.received[SECIL_TX_CONTROL]++;
+            break;
+        }
+        case secil_message_supportPackageData_tag:
+            result.received[SECIL_TX_BULK]++;
+            break;
+        default:
+            result.received[SECIL_TX_STATE]++;
+            break;
+        }
+    }
+
+    return write(result_fd, &result, sizeof(result)) == sizeof(result) ? 0 : 1;
+}
+
+/// @brief Keep the bulk queue full of support package text.
+static void *bulk_thread(void *arg)
+{
+    char text[MAX_TEXT + 1];
+    memset(text, 'x', MAX_TEXT);
+    text[MAX_TEXT] = '\0';
+
+    while (!stop)
+    {
+        secil_error_t sent = secil_send_supportPackageData(text);
+        if (sent == SECIL_ERROR_QUEUE_FULL || sent == SECIL_ERROR_WINDOW_FULL)
+        {
+            usleep(500);
+        }
+    }
+    return NULL;
+}
+
+/// @brief Keep the state queue full of temperature values.
+static void *state_thread(void *arg)
+{
+    int8_t temperature = 0;
+    while (!stop)
+    {
+        secil_error_t sent = secil_send_currentTemperature(temperature++);
+        if (sent == SECIL_ERROR_QUEUE_FULL || sent == SECIL_ERROR_WINDOW_FULL)
+        {
+            usleep(500);
+        }
+    }
+    return NULL;
+}
+
+/// @brief Take the acknowledgements of the reliable channel (when it is in use), until the link closes.
+static void *receive_thread(void *arg)
+{
+    secil_message message;
+    while (secil_receive(&message) == SECIL_OK)
+    {
+    }
+    return NULL;
+}
+
+/// @brief Sending end: flood the state and bulk classes while a warning goes out every WARNING_INTERVAL_MS.
+static int run_sender(bool fragments, int result_fd)
+{
+    sender_result_t result = { 0 };
+
+    if (start_link(secil_operating_mode_t_CLIENT, fragments))
+    {
+        pthread_t threads[3];
+        pthread_create(&threads[0], NULL, bulk_thread, NULL);
+        pthread_create(&threads[1], NULL, state_thread, NULL);
+        pthread_create(&threads[2], NULL, receive_thread, NULL);
+
+        result.completed = true;
+        double end = sim_now_s() + DURATION_MS / 1000.0;
+        while (sim_now_s() < end && result.completed)
+        {
+            char text[32];
+            snprintf(text, sizeof(text), "%.6f", sim_now_s());
+
+            // On the reliable channel the warning waits for room in the window, which counts towards its latency
+            secil_error_t sent;
+            while ((sent = secil_send_warning(secil_warning_type_t_WARNING_SYSTEM, text)) == SECIL_ERROR_WINDOW_FULL)
+            {
+                secil_poll();
+                usleep(100);
+            }
+            result.completed = sent == SECIL_OK;
+            usleep(WARNING_INTERVAL_MS * 1000);
+        }
+
+        stop = true;
+        pthread_join(threads[0], NULL);
+        pthread_join(threads[1], NULL);
+
+        // Frames on the reliable channel are only done once they have been acknowledged
+        secil_reliable_stats_t reliable = { 0 };
+        double drain_end = sim_now_s() + 1.0;
+        do
+        {
+            secil_poll();
+            usleep(1000);
+            secil_get_reliable_stats(&reliable);
+        } while (reliable.in_flight > 0 && sim_now_s() < drain_end);
+
+        result.largest_frame_ms = 1000.0 * (double)sim.largest_write * 10.0 / LINK_BAUD;
+        for (int i = 0; i < SECIL_TX_CLASSES; i++)
+        {
+            secil_get_tx_stats((secil_tx_class_t)i, &result.stats[i]);
+        }
+        shutdown(sim.fd, SHUT_RDWR);
+    }
+
+    return write(result_fd, &result, sizeof(result)) == sizeof(result) ? 0 : 1;
+}
+
+static bool run_case(bool fragments)
+{
+    int link_fds[2];
+    int sender_fds[2];
+    int receiver_fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, link_fds) != 0 || pipe(sender_fds) != 0 || pipe(receiver_fds) != 0)
+    {
+        return false;
+    }
+
+    pid_t receiver = sim_fork_end(link_fds[1], link_fds[0], 60);
+    if (receiver == 0)
+    {
+        exit(run_receiver(receiver_fds[1]));
+    }
+
+    pid_t sender = sim_fork_end(link_fds[0], link_fds[1], 60);
+    if (sender == 0)
+    {
+        exit(run_sender(fragments, sender_fds[1]));
+    }
+
+    close(link_fds[0]);
+    close(link_fds[1]);
+    close(sender_fds[1]);
+    close(receiver_fds[1]);
+
+    bool ended = sim_wait_ends(receiver, sender);
+    sender_result_t sent = { 0 };
+    receiver_result_t received = { 0 };
+    bool ok = read(sender_fds[0], &sent, sizeof(sent)) == sizeof(sent)
+           && read(receiver_fds[0], &received, sizeof(received)) == sizeof(received)
+           && sent.completed && ended;
+    close(sender_fds[0]);
+    close(receiver_fds[0]);
+
+    printf("\nFragments %s: the largest frame or fragment takes %.1f ms to write.\n", fragments ? "on" : "off", sent.largest_frame_ms);
+    if (!ok)
+    {
+        printf("The link did not complete.\n");
+        return false;
+    }
+
+    printf("Class    Queued     Sent   Received Rejected Peak depth Max wait ms Fragments\n");
+    const char *names[SECIL_TX_CLASSES] = { "control", "state", "bulk" };
+    for (int i = 0; i < SECIL_TX_CLASSES; i++)
+    {
+        printf("%-8s %6u %8u %10u %8u %10u %11u %9u\n",
+               names[i],
+               (unsigned)sent.stats[i].queued, (unsigned)sent.stats[i].sent, (unsigned)received.received[i],
+               (unsigned)sent.stats[i].rejected, (unsigned)sent.stats[i].peak_depth, (unsigned)sent.stats[i].max_wait_ms,
+               (unsigned)sent.stats[i].fragments);
+    }
+
+    uint32_t warnings = received.received[SECIL_TX_CONTROL];
+    printf("Warning latency, sent to received: %.1f ms average, %.1f ms worst\n",
+           warnings ? received.warning_latency_total_ms / warnings : 0.0, received.warning_latency_max_ms);
+
+    // A warning waits at most for the frame (or fragment) already on the wire, and bulk still gets its share of the link
+    double bound_ms = sent.largest_frame_ms + SLACK_MS;
+    if (sent.stats[SECIL_TX_CONTROL].max_wait_ms > bound_ms || sent.stats[SECIL_TX_BULK].sent == 0
+        || received.received[SECIL_TX_BULK] != sent.stats[SECIL_TX_BULK].sent)
+    {
+        printf("Warnings waited over %.1f ms, or bulk frames were starved or lost.\n", bound_ms);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    sim.baud = LINK_BAUD;
+
+    printf("Priority classes: state and bulk queues kept full over a simulated %d baud link for %d ms,\n", LINK_BAUD, DURATION_MS);
+    printf("with a warning every %d ms.\n", WARNING_INTERVAL_MS);
+
+    bool ok = run_case(false);
+    ok &= run_case(true);
+
+    if (!ok)
+    {
+        printf("Priority benchmark failed.\n");
+        return 1;
+    }
+
+    return 0;
+}
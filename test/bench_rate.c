@@ -0,0 +1,340 @@
+#include <secil.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "sim_link.h"
+
+// The simulated UART runs at this rate in both directions
+#define LINK_BAUD 115200
+#define DURATION_MS 2000
+#define WARNING_INTERVAL_MS 20
+#define PACKAGE_INTERVAL_MS 50
+#define PACKAGE_LENGTH 200
+// Limit of the state class, where the runaway heatingSetpoint calls land
+#define STATE_RATE 1000
+#define STATE_BURST 32
+// A warning waits at most for the support package already on the wire, and for scheduling on top of that
+#define WARNING_BOUND_MS 40
+// The value sent last, once the runaway loop has stopped
+#define FINAL_SETPOINT (-1)
+
+static volatile bool stop;
+
+typedef struct
+{
+    bool completed;
+    uint32_t runaway_calls;
+    uint32_t packages_sent;
+    uint32_t warnings_sent;
+    double seconds;
+    double limited_seconds; // From setting the limit until the stats were read, over which the bytes are counted
+    secil_rate_stats_t stats[SECIL_TX_CLASSES];
+} sender_result_t;
+
+typedef struct
+{
+    uint32_t bytes;
+    double seconds;
+    uint32_t setpoints;
+    int8_t last_setpoint;
+    uint32_t packages;
+    uint32_t warnings;
+    double warning_latency_max_ms;
+    double warning_latency_total_ms;
+} receiver_result_t;
+
+static void sleep_fn(void *user_data, uint32_t ms)
+{
+    usleep(ms * 1000);
+}
+
+static bool start_link(secil_operating_mode_t mode)
+{
+    secil_init(sim_read_fn, sim_write_fn, NULL, NULL, NULL);
+    secil_set_clock_callback(sim_clock_fn);
+    secil_set_sleep_callback(sleep_fn);
+    secil_set_lock_callbacks(sim_lock_fn, sim_unlock_fn);
+    return secil_startup(mode) == SECIL_OK;
+}
+
+/// @brief Receiving end: count what arrives, and time how long each warning took.
+///        The warning carries the time it was sent, which both processes read from the same monotonic clock.
+static int run_receiver(int result_fd)
+{
+    receiver_result_t result = { 0 };
+
+    if (!start_link(secil_operating_mode_t_SERVER))
+    {
+        return 1;
+    }
+
+    sim.bytes_read = 0; // Only what arrives once connected, to work out how busy the link was
+    double start = sim_now_s();
+    double last = start;
+    secil_message message;
+    while (secil_receive(&message) == SECIL_OK)
+    {
+        last = sim_now_s();
+        switch (message.which_payload)
+        {
+        case secil_message_warning_tag:
+        {
+            double latency_ms = (sim_now_s() - atof(message.payload.warning.message)) * 1000.0;
+            result.warning_latency_total_ms += latency_ms;
+            if (latency_ms > result.warning_latency_max_ms)
+            {
+                result.warning_latency_max_ms = latency_ms;
+            }
+            result.warnings++;
+            break;
+        }
+        case secil_message_heatingSetpoint_tag:
+            result.setpoints++;
+            result.last_setpoint = message.payload.heatingSetpoint.heatingSetpoint;
+            break;
+        case secil_message_supportPackageData_tag:
+            result.packages++;
+            break;
+        default:
+            break;
+        }
+    }
+
+    result.bytes = (uint32_t)sim.bytes_read;
+    result.seconds = last - start;
+    return write(result_fd, &result, sizeof(result)) == sizeof(result) ? 0 : 1;
+}
+
+/// @brief A buggy UI loop that sends the heating setpoint as fast as it can.
+static void *runaway_thread(void *arg)
+{
+    uint32_t *calls = arg;
+    int8_t setpoint = 0;
+    while (!stop)
+    {
+        secil_send_heatingSetpoint(setpoint);
+        setpoint = (int8_t)((setpoint + 1) % 100);
+        (*calls)++;
+    }
+    return NULL;
+}
+
+/// @brief Send a support package every PACKAGE_INTERVAL_MS.
+static void *package_thread(void *arg)
+{
+    uint32_t *sent = arg;
+    char text[PACKAGE_LENGTH + 1];
+    memset(text, 'x', PACKAGE_LENGTH);
+    text[PACKAGE_LENGTH] = '\0';
+
+    while (!stop)
+    {
+        // On the reliable channel a package waits for room in the window
+        secil_error_t result;
+        while ((result = secil_send_supportPackageData(text)) == SECIL_ERROR_WINDOW_FULL && !stop)
+        {
+            usleep(100);
+        }
+        if (result == SECIL_OK)
+        {
+            (*sent)++;
+        }
+        usleep(PACKAGE_INTERVAL_MS * 1000);
+    }
+    return NULL;
+}
+
+/// @brief Take the acknowledgements of the reliable channel (when it is in use), until the link closes.
+static void *receive_thread(void *arg)
+{
+    secil_message message;
+    while (secil_receive(&message) == SECIL_OK)
+    {
+    }
+    return NULL;
+}
+
+/// @brief Sending end: run the runaway loop and the support packages while a warning goes out every WARNING_INTERVAL_MS.
+static int run_sender(bool limited, secil_rate_overflow_t overflow, int result_fd)
+{
+    sender_result_t result = { 0 };
+
+    if (start_link(secil_operating_mode_t_CLIENT))
+    {
+        double limited_at = sim_now_s();
+        if (limited)
+        {
+            secil_set_rate_limit(SECIL_TX_STATE, STATE_RATE, STATE_BURST, overflow);
+        }
+
+        pthread_t threads[3];
+        pthread_create(&threads[0], NULL, runaway_thread, &result.runaway_calls);
+        pthread_create(&threads[1], NULL, package_thread, &result.packages_sent);
+        pthread_create(&threads[2], NULL, receive_thread, NULL);
+
+        result.completed = true;
+        double start = sim_now_s();
+        double end = start + DURATION_MS / 1000.0;
+        double next_warning = start;
+        while (sim_now_s() < end && result.completed)
+        {
+            if (sim_now_s() >= next_warning)
+            {
+                char text[32];
+                snprintf(text, sizeof(text), "%.6f", sim_now_s());
+                secil_error_t sent;
+                while ((sent = secil_send_warning(secil_warning_type_t_WARNING_SYSTEM, text)) == SECIL_ERROR_WINDOW_FULL)
+                {
+                    usleep(100);
+                }
+                result.completed = sent == SECIL_OK;
+                result.warnings_sent++;
+                next_warning += WARNING_INTERVAL_MS / 1000.0;
+            }
+            secil_poll();
+            usleep(1000);
+        }
+
+        stop = true;
+        pthread_join(threads[0], NULL);
+        pthread_join(threads[1], NULL);
+        result.seconds = sim_now_s() - start;
+
+        // The last value must get through, even if it is held back for a while
+        secil_error_t final_result;
+        while ((final_result = secil_send_heatingSetpoint(FINAL_SETPOINT)) == SECIL_ERROR_RATE_LIMITED
+               || final_result == SECIL_ERROR_WINDOW_FULL)
+        {
+            usleep(1000);
+        }
+        result.completed = result.completed && final_result == SECIL_OK;
+
+        // Let anything held back go out, and on the reliable channel be acknowledged
+        secil_reliable_stats_t reliable = { 0 };
+        double drain_end = sim_now_s() + 1.0;
+        for (int i = 0; i < 100 || (reliable.in_flight > 0 && sim_now_s() < drain_end); i++)
+        {
+            secil_poll();
+            usleep(1000);
+            secil_get_reliable_stats(&reliable);
+        }
+
+        for (int i = 0; i < SECIL_TX_CLASSES; i++)
+        {
+            secil_get_rate_stats((secil_tx_class_t)i, &result.stats[i]);
+        }
+        result.limited_seconds = sim_now_s() - limited_at;
+        shutdown(sim.fd, SHUT_RDWR);
+    }
+
+    return write(result_fd, &result, sizeof(result)) == sizeof(result) ? 0 : 1;
+}
+
+static bool run_case(const char *name, bool limited, secil_rate_overflow_t overflow)
+{
+    int link_fds[2];
+    int sender_fds[2];
+    int receiver_fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, link_fds) != 0 || pipe(sender_fds) != 0 || pipe(receiver_fds) != 0)
+    {
+        return false;
+    }
+
+    pid_t receiver = sim_fork_end(link_fds[1], link_fds[0], 60);
+    if (receiver == 0)
+    {
+        exit(run_receiver(receiver_fds[1]));
+    }
+
+    pid_t sender = sim_fork_end(link_fds[0], link_fds[1], 60);
+    if (sender == 0)
+    {
+        exit(run_sender(limited, overflow, sender_fds[1]));
+    }
+
+    close(link_fds[0]);
+    close(link_fds[1]);
+    close(sender_fds[1]);
+    close(receiver_fds[1]);
+
+    bool ended = sim_wait_ends(receiver, sender);
+    sender_result_t sent = { 0 };
+    receiver_result_t received = { 0 };
+    bool ok = read(sender_fds[0], &sent, sizeof(sent)) == sizeof(sent)
+           && read(receiver_fds[0], &received, sizeof(received)) == sizeof(received)
+           && sent.completed && ended;
+    close(sender_fds[0]);
+    close(receiver_fds[0]);
+
+    if (!ok)
+    {
+        printf("%-9s the link did not complete\n", name);
+        return false;
+    }
+
+    const secil_rate_stats_t *state = &sent.stats[SECIL_TX_STATE];
+    printf("%-9s %8u %9u %8u %9u %7u %9u %8u %9u/%-3u %8u/%-3u %7.1f %7.1f\n",
+           name,
+           (unsigned)sent.runaway_calls, (unsigned)received.setpoints,
+           (unsigned)state->dropped, (unsigned)state->conflated, (unsigned)state->blocked,
+           limited ? (unsigned)(state->bytes / sent.seconds) : 0u,
+           received.seconds > 0 ? (unsigned)(received.bytes / received.seconds) : 0u,
+           (unsigned)received.packages, (unsigned)sent.packages_sent,
+           (unsigned)received.warnings, (unsigned)sent.warnings_sent,
+           received.warnings ? received.warning_latency_total_ms / received.warnings : 0.0,
+           received.warning_latency_max_ms);
+
+    if (received.last_setpoint != FINAL_SETPOINT)
+    {
+        printf("The last setpoint received was %d, not the last one sent.\n", received.last_setpoint);
+        return false;
+    }
+    if (!limited)
+    {
+        return true;
+    }
+
+    // The state class keeps to its limit, and the support packages and warnings all get through promptly
+    bool within = state->bytes <= STATE_RATE * sent.limited_seconds + STATE_BURST
+               && received.packages == sent.packages_sent && received.warnings == sent.warnings_sent
+               && received.warning_latency_max_ms <= WARNING_BOUND_MS;
+    bool applied = overflow == SECIL_RATE_DROP     ? state->dropped > 0 && state->conflated == 0
+                 : overflow == SECIL_RATE_CONFLATE ? state->conflated > 0 && state->dropped == 0
+                                                   : state->blocked > 0 && state->dropped == 0;
+    if (!within || !applied)
+    {
+        printf("The state class went over its limit, other traffic was held up, or the overflow was not applied.\n");
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    sim.baud = LINK_BAUD;
+
+    printf("Rate limits: a runaway loop sends heatingSetpoint as fast as it can over a simulated %d baud link for %d ms,\n",
+           LINK_BAUD, DURATION_MS);
+    printf("alongside a %d byte support package every %d ms and a warning every %d ms. The limited cases cap the state\n",
+           PACKAGE_LENGTH, PACKAGE_INTERVAL_MS, WARNING_INTERVAL_MS);
+    printf("class at %d bytes/s with a burst of %d bytes.\n", STATE_RATE, STATE_BURST);
+
+    printf("State B/s is counted by the limit, and Link B/s is everything that arrived, out of %d bytes/s.\n\n", LINK_BAUD / 10);
+
+    printf("Limit       Calls Setpoints  Dropped Conflated Blocked State B/s Link B/s  Packages     Warnings    Avg ms  Max ms\n");
+    bool ok = run_case("none", false, SECIL_RATE_DROP);
+    ok &= run_case("drop", true, SECIL_RATE_DROP);
+    ok &= run_case("conflate", true, SECIL_RATE_CONFLATE);
+    ok &= run_case("block", true, SECIL_RATE_BLOCK);
+
+    if (!ok)
+    {
+        printf("Rate limit benchmark failed.\n");
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,193 @@
+#include <secil.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "sim_link.h"
+
+// The simulated UART: both directions run at this rate and every bit may be flipped with probability sim.ber
+#define LINK_BAUD 460800
+#define MESSAGES 200
+
+typedef struct
+{
+    bool completed;
+    double seconds;
+    size_t bytes_written;
+    secil_reliable_stats_t stats;
+} result_t;
+
+static void start_link(uint8_t window)
+{
+    secil_init(sim_read_fn, sim_write_fn, NULL, NULL, NULL);
+    secil_set_available_callback(sim_available_fn);
+    secil_set_clock_callback(sim_clock_fn);
+    secil_set_lock_callbacks(sim_lock_fn, sim_unlock_fn);
+    secil_set_reliable_window(window);
+}
+
+/// @brief Receiving end: check that every message arrives exactly once and in order.
+static int run_receiver(uint8_t window)
+{
+    start_link(window);
+    if (secil_startup(secil_operating_mode_t_SERVER) != SECIL_OK)
+    {
+        return 1;
+    }
+    sim.errors_enabled = true;
+
+    uint64_t expected = 0;
+    while (true)
+    {
+        secil_message message;
+        secil_error_t result = secil_receive(&message);
+        if (result == SECIL_ERROR_READ_TIMEOUT)
+        {
+            break; // The sender has finished and closed the link
+        }
+        if (result != SECIL_OK || message.which_payload != secil_message_dateAndTime_tag)
+        {
+            continue; // Corrupt frames are expected on this link
+        }
+        if (message.payload.dateAndTime.dateAndTime != expected)
+        {
+            printf("Receiver: expected message %llu but got %llu\n",
+                   (unsigned long long)expected, (unsigned long long)message.payload.dateAndTime.dateAndTime);
+            return 1;
+        }
+        expected++;
+    }
+
+    if (expected != MESSAGES)
+    {
+        printf("Receiver: only %llu of %d messages arrived\n", (unsigned long long)expected, MESSAGES);
+        return 1;
+    }
+    return 0;
+}
+
+/// @brief Process acknowledgements (and retransmit gaps) while the main thread sends.
+static void *sender_receive_thread(void *arg)
+{
+    secil_message message;
+    while (secil_receive(&message) != SECIL_ERROR_READ_TIMEOUT)
+    {
+    }
+    return NULL;
+}
+
+/// @brief Sending end: send every message as fast as the window allows and wait until all are acknowledged.
+static int run_sender(uint8_t window, int result_fd)
+{
+    result_t result = { 0 };
+
+    start_link(window);
+    if (secil_startup(secil_operating_mode_t_CLIENT) == SECIL_OK)
+    {
+        sim.errors_enabled = true;
+
+        pthread_t thread;
+        pthread_create(&thread, NULL, sender_receive_thread, NULL);
+
+        double start = sim_now_s();
+        for (uint64_t i = 0; i < MESSAGES; i++)
+        {
+            while (secil_send_dateTime(i) == SECIL_ERROR_WINDOW_FULL)
+            {
+                secil_poll();
+                usleep(100);
+            }
+        }
+
+        do
+        {
+            secil_poll();
+            usleep(100);
+            secil_get_reliable_stats(&result.stats);
+        } while (result.stats.in_flight > 0);
+
+        result.seconds = sim_now_s() - start;
+        result.bytes_written = sim.bytes_written;
+        result.completed = true;
+
+        shutdown(sim.fd, SHUT_RDWR);
+        pthread_join(thread, NULL);
+    }
+
+    return write(result_fd, &result, sizeof(result)) == sizeof(result) ? 0 : 1;
+}
+
+static bool run_case(double ber, uint8_t window)
+{
+    int link_fds[2];
+    int result_fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, link_fds) != 0 || pipe(result_fds) != 0)
+    {
+        return false;
+    }
+
+    sim.ber = ber;
+    pid_t receiver = sim_fork_end(link_fds[1], link_fds[0], 60);
+    if (receiver == 0)
+    {
+        exit(run_receiver(window));
+    }
+
+    pid_t sender = sim_fork_end(link_fds[0], link_fds[1], 60);
+    if (sender == 0)
+    {
+        exit(run_sender(window, result_fds[1]));
+    }
+
+    close(link_fds[0]);
+    close(link_fds[1]);
+    close(result_fds[1]);
+
+    bool ended = sim_wait_ends(receiver, sender);
+    result_t result = { 0 };
+    bool ok = read(result_fds[0], &result, sizeof(result)) == sizeof(result) && result.completed && ended;
+    close(result_fds[0]);
+
+    if (!ok)
+    {
+        printf("%-8u %-8.0e did not deliver every message\n", (unsigned)window, ber);
+        return false;
+    }
+
+    printf("%-8u %-8.0e %10.0f %12.1f %10u %14.1f\n",
+           (unsigned)window, ber,
+           MESSAGES / result.seconds,
+           100.0 * (MESSAGES / result.seconds) / ((double)LINK_BAUD / 10.0 / ((double)result.bytes_written / MESSAGES)),
+           (unsigned)result.stats.retransmissions,
+           (double)result.bytes_written / MESSAGES);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    const double bit_error_rates[] = { 0, 1e-5, 1e-4, 1e-3 };
+    const uint8_t windows[] = { 1, SECIL_RELIABLE_WINDOW };
+    bool ok = true;
+    sim.baud = LINK_BAUD;
+
+    printf("Reliable channel: %d messages per run over a simulated %d baud link\n", MESSAGES, LINK_BAUD);
+    printf("Window 1 is stop-and-wait. Link use is the share of the sender's time spent clocking out bytes.\n\n");
+    printf("Window   BER      Messages/s   Link use %%   Resent     Wire bytes/msg\n");
+
+    for (size_t w = 0; w < sizeof(windows) / sizeof(windows[0]); w++)
+    {
+        for (size_t b = 0; b < sizeof(bit_error_rates) / sizeof(bit_error_rates[0]); b++)
+        {
+            ok &= run_case(bit_error_rates[b], windows[w]);
+        }
+    }
+
+    if (!ok)
+    {
+        printf("Reliable benchmark failed.\n");
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,193 @@
+#include "sim_link.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+sim_link_t sim = { .fd = -1 };
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+double sim_now_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+void sim_sleep_until(double at)
+{
+    struct timespec until = { (time_t)at, (long)((at - (time_t)at) * 1e9) };
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL);
+}
+
+uint32_t sim_clock_fn(void *user_data)
+{
+    return (uint32_t)(sim_now_s() * 1000.0);
+}
+
+void sim_lock_fn(void *user_data)
+{
+    pthread_mutex_lock(&lock);
+}
+
+void sim_unlock_fn(void *user_data)
+{
+    pthread_mutex_unlock(&lock);
+}
+
+/// @brief Read from the link, waiting while this end is frozen, and note when the remote end has closed it.
+bool sim_read_fn(void *user_data, unsigned char *buf, size_t required_count)
+{
+    while (required_count > 0)
+    {
+        while (sim.frozen)
+        {
+            usleep(10000);
+        }
+        ssize_t count = read(sim.fd, buf, required_count);
+        if (count <= 0)
+        {
+            sim.closed = true;
+            return false;
+        }
+        buf += count;
+        required_count -= (size_t)count;
+        sim.bytes_read += (size_t)count;
+    }
+    return true;
+}
+
+size_t sim_available_fn(void *user_data)
+{
+    int available = 0;
+    ioctl(sim.fd, FIONREAD, &available);
+    return available > 0 ? (size_t)available : 0;
+}
+
+/// @brief Write to the simulated UART: wait until the bytes would have been clocked out and got through, then corrupt
+///        some bits or lose the write.
+/// @note The library writes most frames in one go, so a frame is lost by leaving out one write. A frame that wraps round
+///       a send queue goes out in two writes, and losing one of them leaves a corrupt frame for the receiver to drop.
+///       Only one thread writes at a time (the library makes sure of that), so the link state needs no lock.
+bool sim_write_fn(void *user_data, const unsigned char *buf, size_t count)
+{
+    if (count > sim.largest_write)
+    {
+        sim.largest_write = count;
+    }
+    sim.bytes_written += count;
+
+    if (sim.baud > 0)
+    {
+        double now = sim_now_s();
+        if (sim.free_at < now)
+        {
+            sim.free_at = now;
+        }
+        sim.free_at += (double)count * 10.0 / sim.baud; // 8N1: 10 bit times per byte
+        sim_sleep_until(sim.free_at + sim.latency_ms / 1000.0);
+    }
+
+    if (sim.frozen || (sim.errors_enabled && sim.loss_percent > 0 && rand_r(&sim.seed) % 100 < sim.loss_percent))
+    {
+        return true;
+    }
+
+    unsigned char frame[1024];
+    if (sim.errors_enabled && sim.ber > 0)
+    {
+        if (count > sizeof(frame))
+        {
+            return false;
+        }
+        memcpy(frame, buf, count);
+        for (size_t i = 0; i < count * 8; i++)
+        {
+            if ((double)rand_r(&sim.seed) / RAND_MAX < sim.ber)
+            {
+                frame[i / 8] ^= (unsigned char)(1 << (i % 8));
+            }
+        }
+        buf = frame;
+    }
+
+    return write(sim.fd, buf, count) == (ssize_t)count;
+}
+
+/// @brief Fork the process of one end of the link.
+/// @param fd The end's side of the link.
+/// @param other_fd The remote end's side, which is closed in the child.
+/// @param timeout_s The child is ended after this long, should it hang.
+/// @return 0 in the child, and the child's pid in the parent.
+pid_t sim_fork_end(int fd, int other_fd, unsigned int timeout_s)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        alarm(timeout_s);
+        signal(SIGPIPE, SIG_IGN); // An end that is done may close the link while the other still sends
+        close(other_fd);
+        sim.fd = fd;
+        sim.seed = (unsigned int)getpid();
+    }
+    return pid;
+}
+
+/// @brief Wait for the processes of both ends.
+/// @return true if both exited with status 0.
+bool sim_wait_ends(pid_t first, pid_t second)
+{
+    int first_status = 0;
+    int second_status = 0;
+    waitpid(first, &first_status, 0);
+    waitpid(second, &second_status, 0);
+    return WIFEXITED(first_status) && WEXITSTATUS(first_status) == 0 &&
+           WIFEXITED(second_status) && WEXITSTATUS(second_status) == 0;
+}
+
+/// @brief Run a test with each end in a process of its own, and report whether both passed.
+/// @param fds The client's side of the link, then the server's.
+/// @param setup Initialises the library in each process before its end runs.
+bool sim_run_test(const char *name, const int fds[2], unsigned int timeout_s, sim_setup_fn setup,
+                  sim_end_fn client, sim_end_fn server)
+{
+    const sim_end_fn ends[2] = { client, server };
+    pid_t pids[2];
+
+    // The server starts first, so that it is listening when the client connects
+    for (int index = 1; index >= 0; index--)
+    {
+        pids[index] = sim_fork_end(fds[index], fds[1 - index], timeout_s);
+        if (pids[index] == 0)
+        {
+            setup(index);
+            exit(ends[index]());
+        }
+    }
+    close(fds[0]);
+    close(fds[1]);
+
+    bool passed = sim_wait_ends(pids[1], pids[0]);
+    printf("%s: %s\n", name, passed ? "passed" : "FAILED");
+    return passed;
+}
+
+/// @brief Run a test over a socket pair, with each end in a process of its own.
+bool sim_run_pair(const char *name, unsigned int timeout_s, sim_setup_fn setup, sim_end_fn client, sim_end_fn server)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    {
+        return false;
+    }
+    return sim_run_test(name, fds, timeout_s, setup, client, server);
+}
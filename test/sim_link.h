@@ -0,0 +1,57 @@
+#ifndef SIM_LINK_H
+#define SIM_LINK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// A simulated UART between two processes joined by a socket pair (or a pty), and the harness that runs one end of a
+// test in each process. The tests and benchmarks keep only their scenarios, and set up the link before they fork, so
+// that both ends inherit it.
+
+typedef struct
+{
+    int fd;                        // Our end of the socket pair that joins the two processes
+    uint32_t baud;                 // Both directions run at this rate, or 0 to write without waiting
+    uint32_t latency_ms;           // Each write takes this long on top to get through
+    double ber;                    // Bit error rate, only applied while errors_enabled
+    uint8_t loss_percent;          // Share of the writes lost, only applied while errors_enabled
+    volatile bool errors_enabled;  // Set once the handshake is over, so that the ends connect first
+    volatile bool frozen;          // This end has gone silent: it neither reads nor writes any more
+    volatile bool closed;          // The remote end has closed the link
+    double free_at;                // Time at which the last byte written has left the simulated UART
+    size_t bytes_written;
+    size_t bytes_read;
+    size_t largest_write;
+    unsigned int seed;             // For the bit errors and losses, set to the pid of each end when it starts
+} sim_link_t;
+
+/// @brief One end of a test, run in a process of its own.
+/// @return The exit status of the process: 0 if the end passed.
+typedef int (*sim_end_fn)(void);
+
+/// @brief Set up the library in the process of an end, before the end runs.
+/// @param index 0 for the client (or sender), 1 for the server (or receiver).
+typedef void (*sim_setup_fn)(int index);
+
+extern sim_link_t sim;
+
+extern double sim_now_s();
+extern void sim_sleep_until(double at);
+
+// Callbacks for secil_init() and the setters, on the link in sim
+extern bool sim_read_fn(void *user_data, unsigned char *buf, size_t required_count);
+extern bool sim_write_fn(void *user_data, const unsigned char *buf, size_t count);
+extern size_t sim_available_fn(void *user_data);
+extern uint32_t sim_clock_fn(void *user_data);
+extern void sim_lock_fn(void *user_data);
+extern void sim_unlock_fn(void *user_data);
+
+extern pid_t sim_fork_end(int fd, int other_fd, unsigned int timeout_s);
+extern bool sim_wait_ends(pid_t first, pid_t second);
+extern bool sim_run_test(const char *name, const int fds[2], unsigned int timeout_s, sim_setup_fn setup,
+                         sim_end_fn client, sim_end_fn server);
+extern bool sim_run_pair(const char *name, unsigned int timeout_s, sim_setup_fn setup, sim_end_fn client, sim_end_fn server);
+
+#endif // SIM_LINK_H
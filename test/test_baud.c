@@ -0,0 +1,443 @@
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+#include <secil.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "sim_link.h"
+
+// Tests of switching the UART rate, over a pseudo terminal that stands in for the UART.
+// A pty carries bytes at any rate, so each end also keeps its rate in shared memory: bytes written while the two rates
+// differ are garbled, as on a real UART, and writes take as long as they would on the wire.
+
+#define BOOT_BAUD 115200
+#define OFFERED_RATES (SECIL_BAUD_115200 | SECIL_BAUD_230400 | SECIL_BAUD_460800 | SECIL_BAUD_921600)
+#define GOODPUT_MESSAGES 500
+#define PING_BIT (1ull << 63)   // Set in a dateTime that the server echoes back, with the number of values received
+#define FINISHED UINT64_MAX     // dateTime that ends the server
+
+static struct
+{
+    volatile uint32_t baud[2]; // Rate of each end: 0 is the client, 1 the server
+} *shared;
+
+static int end_index;
+static bool lying_speed;        // set_speed reports success but leaves the rate alone, so the switch cannot verify
+static volatile uint64_t values_received;
+static volatile uint64_t last_echo;
+static volatile bool finished;
+
+static bool read_fn(void *user_data, unsigned char *buf, size_t required_count)
+{
+    while (required_count > 0)
+    {
+        struct pollfd pfd = { .fd = sim.fd, .events = POLLIN };
+        if (poll(&pfd, 1, 100) <= 0)
+        {
+            return false; // Give up on a frame garbled by a rate mismatch, rather than wait for bytes that never come
+        }
+        ssize_t count = read(sim.fd, buf, required_count);
+        if (count <= 0)
+        {
+            return false;
+        }
+        buf += count;
+        required_count -= (size_t)count;
+    }
+    return true;
+}
+
+/// @brief Write to the simulated UART: garble the bytes if the remote end runs at another rate, and take as long as the wire would.
+static bool write_fn(void *user_data, const unsigned char *buf, size_t count)
+{
+    unsigned char frame[1024];
+    if (count > sizeof(frame))
+    {
+        return false;
+    }
+    memcpy(frame, buf, count);
+
+    uint32_t baud = shared->baud[end_index];
+    if (baud != shared->baud[1 - end_index])
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            frame[i] ^= 0x55;
+        }
+    }
+
+    sim_sleep_until(sim_now_s() + (double)count * 10.0 / baud); // 8N1: 10 bit times per byte
+
+    sim.bytes_written += count;
+    return write(sim.fd, frame, count) == (ssize_t)count;
+}
+
+static speed_t termios_speed(uint32_t baud)
+{
+    switch (baud)
+    {
+    case 115200: return B115200;
+    case 230400: return B230400;
+    case 460800: return B460800;
+    case 921600: return B921600;
+    default:     return B0;
+    }
+}
+
+/// @brief Set the rate through termios, as a Linux transport does, and check that the pty took it.
+static bool set_speed_fn(void *user_data, uint32_t baud)
+{
+    struct termios options;
+    speed_t speed = termios_speed(baud);
+    if (speed == B0 || tcgetattr(sim.fd, &options) != 0)
+    {
+        return false;
+    }
+
+    cfsetispeed(&options, speed);
+    cfsetospeed(&options, speed);
+    if (tcsetattr(sim.fd, TCSADRAIN, &options) != 0 || tcgetattr(sim.fd, &options) != 0 || cfgetospeed(&options) != speed)
+    {
+        return false;
+    }
+
+    if (!lying_speed)
+    {
+        shared->baud[end_index] = baud;
+    }
+    return true;
+}
+
+static void log_fn(void *user_data, secil_log_severity_t severity, const char *message)
+{
+    if (severity >= secil_LOG_ERROR)
+    {
+        printf("  [%d] %s\n", (int)getpid(), message);
+    }
+}
+
+/// @brief Receive thread: count the values, answer pings as the server and note the echoes as the client.
+static void *receive_thread(void *arg)
+{
+    while (!finished)
+    {
+        secil_message message;
+        if (secil_receive(&message) != SECIL_OK || message.which_payload != secil_message_dateAndTime_tag)
+        {
+            continue;
+        }
+
+        uint64_t value = message.payload.dateAndTime.dateAndTime;
+        if (value == FINISHED)
+        {
+            finished = true;
+        }
+        else if (!(value & PING_BIT))
+        {
+            values_received++;
+        }
+        else if (end_index == 1)
+        {
+            secil_send_dateTime(value | values_received);
+            values_received = 0;
+        }
+        else
+        {
+            last_echo = value;
+        }
+    }
+    return NULL;
+}
+
+/// @brief The time based work, as the poll thread of an application would do it.
+static void service()
+{
+    secil_poll();
+    usleep(500);
+}
+
+/// @brief Send a value, waiting for room in the window of the reliable channel when it is in use.
+static bool send_value(uint64_t value)
+{
+    secil_error_t result;
+    double give_up = sim_now_s() + 2.0;
+    while ((result = secil_send_dateTime(value)) == SECIL_ERROR_WINDOW_FULL && sim_now_s() < give_up)
+    {
+        service();
+    }
+    return result == SECIL_OK;
+}
+
+/// @brief Keep servicing the link while a switch is under way.
+static secil_baud_stats_t wait_for_switch()
+{
+    secil_baud_stats_t stats;
+    double give_up = sim_now_s() + 2.0;
+    do
+    {
+        service();
+        secil_get_baud_stats(&stats);
+    } while (stats.switching && sim_now_s() < give_up);
+    return stats;
+}
+
+/// @brief Ask the server how many values it has received since the last ping, and wait for its answer.
+static bool ping(uint64_t *count)
+{
+    static uint64_t sequence;
+    uint64_t ping_value = PING_BIT | (++sequence << 32);
+    if (!send_value(ping_value))
+    {
+        return false;
+    }
+
+    double give_up = sim_now_s() + 2.0;
+    while ((last_echo & ~0xFFFFFFFFull) != ping_value && sim_now_s() < give_up)
+    {
+        service();
+    }
+    *count = last_echo & 0xFFFFFFFFull;
+    return (last_echo & ~0xFFFFFFFFull) == ping_value;
+}
+
+/// @brief Connect, then start receiving in the background.
+static bool start_link(secil_operating_mode_t mode)
+{
+    pthread_t thread;
+    if (secil_startup(mode) != SECIL_OK || pthread_create(&thread, NULL, receive_thread, NULL) != 0)
+    {
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+/// @brief Server end: follow the client's switches and answer its pings until it has finished.
+static int serve()
+{
+    if (!start_link(secil_operating_mode_t_SERVER))
+    {
+        return 1;
+    }
+
+    while (!finished)
+    {
+        service();
+    }
+    return 0;
+}
+
+/// @brief Tell the server that we have finished, and stop receiving.
+static int finish()
+{
+    finished = true;
+    secil_send_dateTime(FINISHED);
+    return 0;
+}
+
+/// @brief Set up the library in the process of each end, on its side of the pty.
+static void setup_end(int index)
+{
+    end_index = index;
+    secil_init(read_fn, write_fn, NULL, log_fn, NULL);
+    secil_set_lock_callbacks(sim_lock_fn, sim_unlock_fn);
+    secil_set_clock_callback(sim_clock_fn);
+    secil_set_speed_callback(set_speed_fn, OFFERED_RATES, BOOT_BAUD);
+}
+
+static bool run_test(const char *name, sim_end_fn client, sim_end_fn server)
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0)
+    {
+        printf("%s: FAILED to open a pty\n", name);
+        return false;
+    }
+    int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+
+    // Raw bytes both ways, starting at the boot rate
+    struct termios options;
+    tcgetattr(slave, &options);
+    cfmakeraw(&options);
+    cfsetispeed(&options, termios_speed(BOOT_BAUD));
+    cfsetospeed(&options, termios_speed(BOOT_BAUD));
+    tcsetattr(slave, TCSANOW, &options);
+    shared->baud[0] = BOOT_BAUD;
+    shared->baud[1] = BOOT_BAUD;
+
+    const int fds[2] = { slave, master };
+    return sim_run_test(name, fds, 20, setup_end, client, server);
+}
+
+// --- Switch-over ---
+
+static int switch_client()
+{
+    uint64_t count;
+
+    if (!start_link(secil_operating_mode_t_CLIENT))
+    {
+        return 1;
+    }
+
+    if (secil_switch_baud(3000000) != SECIL_ERROR_INVALID_PARAMETER)
+    {
+        printf("  Switch to a rate neither end offered was not refused\n");
+        return 1;
+    }
+
+    if (secil_switch_baud(921600) != SECIL_OK)
+    {
+        return 1;
+    }
+    secil_baud_stats_t stats = wait_for_switch();
+    if (stats.baud != 921600 || stats.switches != 1 || stats.rollbacks != 0 || shared->baud[1] != 921600)
+    {
+        printf("  At %u baud (server at %u) after %u switches and %u rollbacks\n", (unsigned)stats.baud,
+               (unsigned)shared->baud[1], (unsigned)stats.switches, (unsigned)stats.rollbacks);
+        return 1;
+    }
+
+    // Values flow at the new rate
+    secil_send_dateTime(1);
+    secil_send_dateTime(2);
+    if (!ping(&count) || count != 2)
+    {
+        printf("  The server received %u values at the new rate, expected 2\n", (unsigned)count);
+        return 1;
+    }
+
+    return finish();
+}
+
+static int switch_server()
+{
+    return serve();
+}
+
+// --- Rollback ---
+
+static int rollback_client()
+{
+    uint64_t count;
+
+    if (!start_link(secil_operating_mode_t_CLIENT) || secil_switch_baud(460800) != SECIL_OK)
+    {
+        return 1;
+    }
+
+    // The server accepts but stays at the old rate, so our probe at the new rate is garbled
+    secil_baud_stats_t stats = wait_for_switch();
+    if (stats.baud != BOOT_BAUD || stats.switches != 0 || stats.rollbacks != 1)
+    {
+        printf("  At %u baud after %u switches and %u rollbacks\n", (unsigned)stats.baud, (unsigned)stats.switches,
+               (unsigned)stats.rollbacks);
+        return 1;
+    }
+
+    secil_send_dateTime(1);
+    if (!ping(&count) || count != 1)
+    {
+        printf("  The server received %u values after the rollback, expected 1\n", (unsigned)count);
+        return 1;
+    }
+
+    return finish();
+}
+
+static int rollback_server()
+{
+    lying_speed = true;
+    if (serve() != 0)
+    {
+        return 1;
+    }
+
+    secil_baud_stats_t stats = wait_for_switch();
+    if (stats.baud != BOOT_BAUD || stats.rollbacks != 1)
+    {
+        printf("  Server at %u baud after %u rollbacks\n", (unsigned)stats.baud, (unsigned)stats.rollbacks);
+        return 1;
+    }
+    return 0;
+}
+
+// --- Goodput ---
+
+static int goodput_client()
+{
+    const uint32_t rates[] = { 115200, 230400, 460800, 921600 };
+    uint64_t count;
+
+    if (!start_link(secil_operating_mode_t_CLIENT))
+    {
+        return 1;
+    }
+
+    for (size_t r = 0; r < sizeof(rates) / sizeof(rates[0]); r++)
+    {
+        if (rates[r] != BOOT_BAUD)
+        {
+            if (secil_switch_baud(rates[r]) != SECIL_OK || wait_for_switch().baud != rates[r])
+            {
+                printf("  Could not switch to %u baud\n", (unsigned)rates[r]);
+                return 1;
+            }
+        }
+
+        size_t bytes_before = sim.bytes_written;
+        double start = sim_now_s();
+        for (uint64_t i = 0; i < GOODPUT_MESSAGES; i++)
+        {
+            if (!send_value(i))
+            {
+                printf("  Could not send value %u at %u baud\n", (unsigned)i, (unsigned)rates[r]);
+                return 1;
+            }
+        }
+        if (!ping(&count) || count != GOODPUT_MESSAGES)
+        {
+            printf("  The server received %u of %d values at %u baud\n", (unsigned)count, GOODPUT_MESSAGES, (unsigned)rates[r]);
+            return 1;
+        }
+        double seconds = sim_now_s() - start;
+
+        // The dateTime value is 8 bytes of application data
+        double wire_bytes = (double)(sim.bytes_written - bytes_before) / (GOODPUT_MESSAGES + 1);
+        printf("  %-8u %12.0f %14.0f %10.1f %16.1f\n", (unsigned)rates[r], GOODPUT_MESSAGES / seconds,
+               GOODPUT_MESSAGES * 8.0 / seconds, 100.0 * (GOODPUT_MESSAGES * wire_bytes * 10.0 / seconds) / rates[r], wire_bytes);
+    }
+
+    return finish();
+}
+
+static int goodput_server()
+{
+    return serve();
+}
+
+int main(int argc, char **argv)
+{
+    bool passed = true;
+
+    shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+    {
+        return 1;
+    }
+
+    passed &= run_test("Switch-over", switch_client, switch_server);
+    passed &= run_test("Rollback", rollback_client, rollback_server);
+
+    printf("Goodput of %d dateTime values per rate, with the rate switched over the link between runs:\n", GOODPUT_MESSAGES);
+    printf("  Baud     Messages/s   Goodput B/s   Link use %%   Wire bytes/msg\n");
+    passed &= run_test("Goodput", goodput_client, goodput_server);
+
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,731 @@
+#include <secil.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "sim_link.h"
+
+// Tests of the features that the two ends of a link agree on in the handshake.
+// Each test runs a client and a server in processes of their own, joined by a socket pair.
+
+static unsigned char last_frame_magic; // Second byte of the last frame written: 0xFE for v1, 0xF2 for compact frames
+static size_t last_frame_size;
+
+static bool write_fn(void *user_data, const unsigned char *buf, size_t count)
+{
+    if (count > 1 && buf[0] == 0xCA)
+    {
+        last_frame_magic = buf[1];
+        last_frame_size = count;
+    }
+    return sim_write_fn(user_data, buf, count);
+}
+
+static void log_fn(void *user_data, secil_log_severity_t severity, const char *message)
+{
+    if (severity >= secil_LOG_WARNING)
+    {
+        printf("  [%d] %s\n", (int)getpid(), message);
+    }
+}
+
+static bool bytes_waiting()
+{
+    return sim_available_fn(NULL) > 0;
+}
+
+/// @brief Receive the next application message, which must carry the given payload tag.
+static bool expect_message(pb_size_t tag, secil_message *message)
+{
+    secil_error_t result = secil_receive(message);
+    if (result != SECIL_OK)
+    {
+        printf("  Expected message %u but receiving failed: %s\n", (unsigned)tag, secil_error_string(result));
+        return false;
+    }
+    if (message->which_payload != tag)
+    {
+        printf("  Expected message %u but received %u\n", (unsigned)tag, (unsigned)message->which_payload);
+        return false;
+    }
+    return true;
+}
+
+/// @brief Receive application messages until one with the given payload tag arrives.
+static bool skip_to_message(pb_size_t tag)
+{
+    secil_message message;
+    do
+    {
+        if (secil_receive(&message) != SECIL_OK)
+        {
+            printf("  Receiving failed while waiting for message %u\n", (unsigned)tag);
+            return false;
+        }
+    } while (message.which_payload != tag);
+    return true;
+}
+
+/// @brief Set up the library in the process of each end.
+static void setup_end(int index)
+{
+    secil_init(sim_read_fn, write_fn, NULL, log_fn, NULL);
+}
+
+static bool run_test(const char *name, sim_end_fn client, sim_end_fn server)
+{
+    return sim_run_pair(name, 10, setup_end, client, server);
+}
+
+// --- Subscriptions ---
+
+static int subscriptions_server()
+{
+    secil_message message;
+
+    secil_set_subscriptions(SECIL_TAG_BIT(secil_message_currentTemperature_tag) | SECIL_TAG_BIT(secil_message_heatingSetpoint_tag));
+    if (secil_startup(secil_operating_mode_t_SERVER) != SECIL_OK)
+    {
+        return 1;
+    }
+
+    // The HVAC mode was not asked for, so it must not arrive in between these two
+    if (!expect_message(secil_message_currentTemperature_tag, &message) ||
+        !expect_message(secil_message_heatingSetpoint_tag, &message))
+    {
+        return 1;
+    }
+
+    // Now swap the temperature for the HVAC mode, and tell the client to carry on
+    secil_set_subscriptions(SECIL_TAG_BIT(secil_message_hvacMode_tag) | SECIL_TAG_BIT(secil_message_heatingSetpoint_tag));
+    secil_send_dateTime(1);
+
+    if (!expect_message(secil_message_hvacMode_tag, &message) ||
+        !expect_message(secil_message_heatingSetpoint_tag, &message))
+    {
+        return 1;
+    }
+    return 0;
+}
+
+static int subscriptions_client()
+{
+    secil_message message;
+
+    if (secil_startup(secil_operating_mode_t_CLIENT) != SECIL_OK)
+    {
+        return 1;
+    }
+
+    if (secil_remote_wants(secil_message_hvacMode_tag) || !secil_remote_wants(secil_message_currentTemperature_tag))
+    {
+        printf("  Subscriptions from the handshake were not applied\n");
+        return 1;
+    }
+
+    secil_send_currentTemperature(20);
+    secil_send_hvacMode(1);
+    secil_send_heatingSetpoint(21);
+
+    // The subscribe message is handled on the way to the date and time
+    if (!expect_message(secil_message_dateAndTime_tag, &message))
+    {
+        return 1;
+    }
+
+    secil_send_currentTemperature(20);
+    secil_send_hvacMode(2);
+    secil_send_heatingSetpoint(22);
+    return 0;
+}
+
+// --- Capabilities ---
+
+// What a build offers by default - compression, fragments and flow control only in builds with their options
+#define OFFERED_CAPABILITIES (SECIL_CAPABILITIES_SUPPORTED & ~(SECIL_COMPRESSION ? 0u : SECIL_CAPABILITY_COMPRESSION) \
+                                                      & ~(SECIL_FRAGMENTATION ? 0u : SECIL_CAPABILITY_FRAGMENTS) \
+                                                      & ~(SECIL_FLOW_CONTROL ? 0u : SECIL_CAPABILITY_FLOW_CONTROL))
+
+/// @brief Check the capabilities agreed in the handshake, then trade a value each way in frames of the expected version.
+static int exchange_values(uint32_t expected_capabilities, bool is_server)
+{
+    secil_message message;
+    uint32_t agreed;
+
+    if (secil_startup(is_server ? secil_operating_mode_t_SERVER : secil_operating_mode_t_CLIENT) != SECIL_OK ||
+        secil_get_agreed_capabilities(&agreed) != SECIL_OK)
+    {
+        return 1;
+    }
+
+    if (agreed != expected_capabilities)
+    {
+        printf("  Agreed capabilities 0x%08X, expected 0x%08X\n", (unsigned)agreed, (unsigned)expected_capabilities);
+        return 1;
+    }
+
+    if (is_server && !expect_message(secil_message_currentTemperature_tag, &message))
+    {
+        return 1;
+    }
+
+    secil_send_currentTemperature(20);
+    unsigned char expected_magic = (expected_capabilities & SECIL_CAPABILITY_COMPACT_FRAMES) ? 0xF2 : 0xFE;
+    if (last_frame_magic != expected_magic)
+    {
+        printf("  Sent a frame with magic 0x%02X, expected 0x%02X\n", last_frame_magic, expected_magic);
+        return 1;
+    }
+
+    if (!is_server && !expect_message(secil_message_currentTemperature_tag, &message))
+    {
+        return 1;
+    }
+    return 0;
+}
+
+static int compact_frames_server()
+{
+    return exchange_values(OFFERED_CAPABILITIES, true);
+}
+
+static int compact_frames_client()
+{
+    return exchange_values(OFFERED_CAPABILITIES, false);
+}
+
+static int mixed_versions_server()
+{
+    return exchange_values(0, true);
+}
+
+static int mixed_versions_client()
+{
+    // Stands in for a remote end that has not been upgraded yet, so only reads v1 frames
+    secil_set_capabilities(0);
+    return exchange_values(0, false);
+}
+
+// --- Non-blocking connect ---
+
+static int connect_server()
+{
+    secil_message message;
+
+    // Boot late: whatever the client sends before then is lost, as on a UART
+    uint32_t boot_at = sim_clock_fn(NULL) + 120;
+    while ((int32_t)(sim_clock_fn(NULL) - boot_at) < 0)
+    {
+        unsigned char discard[64];
+        if (bytes_waiting())
+        {
+            read(sim.fd, discard, sizeof(discard));
+        }
+        usleep(1000);
+    }
+
+    // Data goes out before our handshake, so the client gets it while it is still connecting
+    secil_send_heatingSetpoint(21);
+    if (secil_startup(secil_operating_mode_t_SERVER) != SECIL_OK)
+    {
+        return 1;
+    }
+
+    // The client is inside secil_receive() until a message comes after our handshake
+    secil_send_hvacMode(1);
+    return expect_message(secil_message_currentTemperature_tag, &message) ? 0 : 1;
+}
+
+static int connect_client()
+{
+    secil_message message;
+    bool got_setpoint = false;
+
+    secil_set_clock_callback(sim_clock_fn);
+    if (secil_connect(secil_operating_mode_t_CLIENT) != SECIL_OK)
+    {
+        return 1;
+    }
+
+    while (secil_get_connection_state() != SECIL_CONNECTED)
+    {
+        if (bytes_waiting())
+        {
+            secil_error_t result = secil_receive(&message);
+            if (result == SECIL_OK && message.which_payload == secil_message_heatingSetpoint_tag)
+            {
+                got_setpoint = true;
+            }
+        }
+        secil_poll();
+        usleep(1000);
+    }
+
+    secil_connection_stats_t stats;
+    secil_get_connection_stats(&stats);
+    if (!got_setpoint || stats.handshakes_sent < 2 || stats.connects != 1 || stats.last_connect_ms > 500)
+    {
+        printf("  Setpoint %s, %u handshakes sent, %u connects, connected after %u ms\n", got_setpoint ? "received" : "lost",
+               (unsigned)stats.handshakes_sent, (unsigned)stats.connects, (unsigned)stats.last_connect_ms);
+        return 1;
+    }
+
+    secil_send_currentTemperature(20);
+    return 0;
+}
+
+// --- State digest ---
+
+static int8_t client_hvac_mode = 1;
+
+static bool client_values(void *user_data, secil_message *value)
+{
+    if (value->which_payload != secil_message_hvacMode_tag)
+    {
+        return false; // The library falls back to the last value sent
+    }
+    value->payload.hvacMode.hvacMode = client_hvac_mode;
+    return true;
+}
+
+static int digest_server()
+{
+    secil_message message;
+
+    // The client's value provider knows the HVAC mode, which we do not have yet
+    if (secil_startup(secil_operating_mode_t_SERVER) != SECIL_OK ||
+        !expect_message(secil_message_hvacMode_tag, &message) ||
+        !expect_message(secil_message_heatingSetpoint_tag, &message) ||
+        !expect_message(secil_message_hvacMode_tag, &message) ||
+        !expect_message(secil_message_coolingSetpoint_tag, &message))
+    {
+        return 1;
+    }
+    secil_send_dateTime(1);
+
+    // Connect again, as after losing the link: our digest shows that only the HVAC mode has changed since
+    if (secil_startup(secil_operating_mode_t_SERVER) != SECIL_OK ||
+        !expect_message(secil_message_hvacMode_tag, &message))
+    {
+        return 1;
+    }
+    if (message.payload.hvacMode.hvacMode != 2)
+    {
+        printf("  Received HVAC mode %d, expected 2\n", message.payload.hvacMode.hvacMode);
+        return 1;
+    }
+    secil_send_dateTime(2);
+    return 0;
+}
+
+static int digest_client()
+{
+    secil_message message;
+
+    secil_set_value_provider(client_values);
+    if (secil_startup(secil_operating_mode_t_CLIENT) != SECIL_OK)
+    {
+        return 1;
+    }
+
+    secil_send_heatingSetpoint(21);
+    secil_send_hvacMode(client_hvac_mode);
+    secil_send_coolingSetpoint(25);
+    if (!expect_message(secil_message_dateAndTime_tag, &message))
+    {
+        return 1;
+    }
+
+    // Changes without being sent, so the server only finds out when it compares digests
+    client_hvac_mode = 2;
+    if (!expect_message(secil_message_dateAndTime_tag, &message))
+    {
+        return 1;
+    }
+
+    secil_connection_stats_t stats;
+    secil_get_connection_stats(&stats);
+    if (stats.remote_restarts != 1)
+    {
+        printf("  %u remote restarts, expected 1\n", (unsigned)stats.remote_restarts);
+        return 1;
+    }
+    return 0;
+}
+
+// --- Resumption ---
+
+static int resume_server()
+{
+    secil_message message;
+
+    if (secil_startup(secil_operating_mode_t_SERVER) != SECIL_OK ||
+        !expect_message(secil_message_heatingSetpoint_tag, &message))
+    {
+        return 1;
+    }
+    secil_send_dateTime(1);
+
+    // The client restarts and resumes: its handshake is followed straight away by data
+    if (!expect_message(secil_message_coolingSetpoint_tag, &message))
+    {
+        return 1;
+    }
+
+    secil_connection_stats_t stats;
+    secil_get_connection_stats(&stats);
+    if (stats.remote_restarts != 1)
+    {
+        printf("  %u remote restarts, expected 1\n", (unsigned)stats.remote_restarts);
+        return 1;
+    }
+    secil_send_dateTime(2);
+
+    // Values the client sent again after comparing digests may come first
+    return skip_to_message(secil_message_dateAndTime_tag) ? 0 : 1;
+}
+
+static int resume_client()
+{
+    secil_message message;
+    secil_resumption_ticket_t ticket;
+
+    if (secil_startup(secil_operating_mode_t_CLIENT) != SECIL_OK ||
+        secil_get_resumption_ticket(&ticket) != SECIL_OK)
+    {
+        return 1;
+    }
+    secil_send_heatingSetpoint(21);
+    if (!expect_message(secil_message_dateAndTime_tag, &message))
+    {
+        return 1;
+    }
+
+    // Restart, keeping only the ticket, and send without waiting for the server
+    secil_deinit();
+    secil_init(sim_read_fn, write_fn, NULL, log_fn, NULL);
+    if (secil_resume(secil_operating_mode_t_CLIENT, &ticket) != SECIL_OK)
+    {
+        return 1;
+    }
+    secil_send_coolingSetpoint(25);
+    if (last_frame_magic != 0xF2)
+    {
+        printf("  Sent a frame with magic 0x%02X after resuming, expected compact frames\n", last_frame_magic);
+        return 1;
+    }
+
+    if (!expect_message(secil_message_dateAndTime_tag, &message))
+    {
+        return 1;
+    }
+
+    secil_connection_stats_t stats;
+    secil_resumption_ticket_t resumed_ticket;
+    secil_get_connection_stats(&stats);
+    secil_get_resumption_ticket(&resumed_ticket);
+    if (stats.resumptions != 1 || stats.resumptions_rejected != 0 || resumed_ticket.session != ticket.session)
+    {
+        printf("  %u resumptions, %u rejected, session %s\n", (unsigned)stats.resumptions, (unsigned)stats.resumptions_rejected,
+               resumed_ticket.session == ticket.session ? "kept" : "changed");
+        return 1;
+    }
+    secil_send_dateTime(3);
+    return 0;
+}
+
+static int resume_rejected_server()
+{
+    secil_message message;
+
+    // A fresh start, so no ticket from before is known here
+    if (secil_startup(secil_operating_mode_t_SERVER) != SECIL_OK ||
+        !expect_message(secil_message_currentTemperature_tag, &message))
+    {
+        return 1;
+    }
+    secil_send_dateTime(1);
+    return skip_to_message(secil_message_dateAndTime_tag) ? 0 : 1;
+}
+
+static int resume_rejected_client()
+{
+    secil_message message;
+    secil_resumption_ticket_t ticket = {
+        .session = 0x1234,
+        .capabilities = SECIL_CAPABILITIES_SUPPORTED,
+        .subscriptions = SECIL_SUBSCRIBE_ALL,
+    };
+
+    if (secil_resume(secil_operating_mode_t_CLIENT, &ticket) != SECIL_OK)
+    {
+        return 1;
+    }
+
+    // Sent on the strength of the ticket - the server reads it all the same
+    secil_send_currentTemperature(20);
+    if (!expect_message(secil_message_dateAndTime_tag, &message))
+    {
+        return 1;
+    }
+
+    secil_connection_stats_t stats;
+    secil_get_connection_stats(&stats);
+    if (stats.resumptions != 0 || stats.resumptions_rejected != 1 || secil_get_resumption_ticket(&ticket) != SECIL_OK)
+    {
+        printf("  %u resumptions, %u rejected\n", (unsigned)stats.resumptions, (unsigned)stats.resumptions_rejected);
+        return 1;
+    }
+    secil_send_dateTime(2);
+    return 0;
+}
+
+// --- String dictionary ---
+
+static const char *const dictionary[] = {
+    "Filter needs replacing",
+    "Sensor %d reads %d, outside its range",
+};
+
+static const char *const other_dictionary[] = {
+    "Filter needs replacing",
+};
+
+/// @brief Receive a warning and check its text.
+static bool expect_warning(const char *text, bool with_id)
+{
+    secil_message message;
+    if (!expect_message(secil_message_warning_tag, &message))
+    {
+        return false;
+    }
+    if (strcmp(message.payload.warning.message, text) != 0 || message.payload.warning.has_message_id != with_id)
+    {
+        printf("  Received warning \"%s\" %s an index, expected \"%s\"\n", message.payload.warning.message,
+               message.payload.warning.has_message_id ? "with" : "without", text);
+        return false;
+    }
+    return true;
+}
+
+static int dictionary_server()
+{
+    secil_set_dictionary(dictionary, 2, true);
+    if (secil_startup(secil_operating_mode_t_SERVER) != SECIL_OK ||
+        !expect_warning("Filter needs replacing", true) ||
+        !expect_warning("Sensor 2 reads -40, outside its range", true) ||
+        !expect_warning("Not in the dictionary", false))
+    {
+        return 1;
+    }
+    secil_send_dateTime(1);
+    return skip_to_message(secil_message_dateAndTime_tag) ? 0 : 1;
+}
+
+static int dictionary_client()
+{
+    // Texts are printf formats, so ones that would read anything but the int32_t arguments of a warning are refused
+    static const char *const unsafe[] = { "Sensor %s failed", "%d %d %d %d %d", "Sensor %*d", "Sensor %ld", "Full to 100%" };
+    for (size_t i = 0; i < sizeof(unsafe) / sizeof(unsafe[0]); i++)
+    {
+        if (secil_set_dictionary(&unsafe[i], 1, true) != SECIL_ERROR_INVALID_PARAMETER)
+        {
+            printf("  Took \"%s\" as a dictionary text\n", unsafe[i]);
+            return 1;
+        }
+    }
+    static const char *const safe[] = { "Filter %d%% used, %+4x %.3u %c" };
+    if (secil_set_dictionary(safe, 1, true) != SECIL_OK)
+    {
+        printf("  Refused \"%s\" as a dictionary text\n", safe[0]);
+        return 1;
+    }
+
+    secil_set_dictionary(dictionary, 2, true);
+    if (secil_startup(secil_operating_mode_t_CLIENT) != SECIL_OK || !secil_dictionary_in_use())
+    {
+        printf("  The dictionary was not agreed\n");
+        return 1;
+    }
+
+    // A known text shrinks to its type and index (plus a sequence number and acknowledgement on the reliable channel)
+    secil_send_warning(secil_warning_type_t_WARNING_SYSTEM, dictionary[0]);
+    if (last_frame_size > (SECIL_RELIABLE ? 22 : 16))
+    {
+        printf("  Sent a warning from the dictionary in %zu bytes\n", last_frame_size);
+        return 1;
+    }
+
+    const int32_t args[] = { 2, -40 };
+    secil_send_warning_id(secil_warning_type_t_WARNING_SAFETY, 1, args, 2);
+    secil_send_warning(secil_warning_type_t_WARNING_SYSTEM, "Not in the dictionary");
+    if (!skip_to_message(secil_message_dateAndTime_tag))
+    {
+        return 1;
+    }
+    secil_send_dateTime(2);
+    return 0;
+}
+
+static int dictionary_mismatch_server()
+{
+    secil_set_dictionary(other_dictionary, 1, true);
+    if (secil_startup(secil_operating_mode_t_SERVER) != SECIL_OK ||
+        !expect_warning("Filter needs replacing", false) ||
+        !expect_warning("Sensor 2 reads -40, outside its range", false))
+    {
+        return 1;
+    }
+    secil_send_dateTime(1);
+    return skip_to_message(secil_message_dateAndTime_tag) ? 0 : 1;
+}
+
+static int dictionary_mismatch_client()
+{
+    secil_set_dictionary(dictionary, 2, true);
+    if (secil_startup(secil_operating_mode_t_CLIENT) != SECIL_OK || secil_dictionary_in_use())
+    {
+        printf("  Different dictionaries were agreed\n");
+        return 1;
+    }
+
+    // Without a common dictionary the texts go out in full, formatted here
+    const int32_t args[] = { 2, -40 };
+    secil_send_warning(secil_warning_type_t_WARNING_SYSTEM, dictionary[0]);
+    secil_send_warning_id(secil_warning_type_t_WARNING_SAFETY, 1, args, 2);
+    if (!skip_to_message(secil_message_dateAndTime_tag))
+    {
+        return 1;
+    }
+    secil_send_dateTime(2);
+    return 0;
+}
+
+// --- Bulk transfers both ways ---
+
+// Too large to finish while the test runs, so both transfers are still under way when one is cancelled
+#define BULK_SIZE (64u * 1024 * 1024)
+
+static bool bulk_opened;
+static secil_error_t bulk_done[2] = { SECIL_ERROR_REQUEST_PENDING, SECIL_ERROR_REQUEST_PENDING }; // Indexed by outgoing
+
+static bool bulk_open_fn(void *user_data, uint32_t kind, uint32_t size, uint32_t *resume_offset)
+{
+    bulk_opened = true;
+    return true;
+}
+
+static bool bulk_write_fn(void *user_data, uint32_t offset, const uint8_t *data, size_t count)
+{
+    return true;
+}
+
+static bool bulk_read_fn(void *user_data, uint32_t offset, uint8_t *data, size_t count)
+{
+    memset(data, (int)(offset & 0xFF), count);
+    return true;
+}
+
+static void bulk_done_fn(void *user_data, bool outgoing, secil_error_t result)
+{
+    bulk_done[outgoing] = result;
+}
+
+/// @brief Connect and start sending a transfer, which is the first at both ends, so both are numbered the same.
+static bool start_bulk(secil_operating_mode_t mode)
+{
+    secil_set_clock_callback(sim_clock_fn);
+    secil_set_available_callback(sim_available_fn);
+    secil_set_bulk_callbacks(bulk_open_fn, bulk_write_fn, bulk_read_fn, bulk_done_fn);
+    return secil_startup(mode) == SECIL_OK && secil_bulk_send(0, BULK_SIZE) == SECIL_OK;
+}
+
+/// @brief Handle what has arrived and poll, for the given time or until the condition holds.
+static void bulk_service(uint32_t ms, bool (*condition)(void))
+{
+    uint32_t until = sim_clock_fn(NULL) + ms;
+    while ((int32_t)(until - sim_clock_fn(NULL)) > 0 && !(condition && condition()))
+    {
+        // A deadline of now only reads what has already arrived
+        secil_message message;
+        while (bytes_waiting())
+        {
+            secil_receive_until(&message, sim_clock_fn(NULL));
+        }
+        secil_poll();
+        usleep(1000);
+    }
+}
+
+static bool bulk_both_flowing()
+{
+    secil_bulk_stats_t stats;
+    return bulk_opened && secil_get_bulk_stats(&stats) == SECIL_OK && stats.acked > 0;
+}
+
+static bool bulk_incoming_done()
+{
+    return bulk_done[false] != SECIL_ERROR_REQUEST_PENDING;
+}
+
+static int bulk_cancel_server()
+{
+    if (!start_bulk(secil_operating_mode_t_SERVER))
+    {
+        return 1;
+    }
+
+    // The client cancels the transfer it sends us, which has the same number as ours
+    bulk_service(5000, bulk_incoming_done);
+    secil_bulk_stats_t stats;
+    secil_get_bulk_stats(&stats);
+    if (bulk_done[false] != SECIL_ERROR_TRANSFER_CANCELLED || bulk_done[true] != SECIL_ERROR_REQUEST_PENDING || !stats.active)
+    {
+        printf("  Incoming transfer ended with \"%s\", outgoing with \"%s\"\n", secil_error_string(bulk_done[false]),
+               secil_error_string(bulk_done[true]));
+        return 1;
+    }
+    return 0;
+}
+
+static int bulk_cancel_client()
+{
+    if (!start_bulk(secil_operating_mode_t_CLIENT))
+    {
+        return 1;
+    }
+
+    bulk_service(5000, bulk_both_flowing);
+    if (!bulk_both_flowing() || secil_bulk_cancel(true) != SECIL_OK)
+    {
+        printf("  The transfers did not start\n");
+        return 1;
+    }
+
+    // The transfer coming the other way carries on
+    bulk_service(200, NULL);
+    if (bulk_done[false] != SECIL_ERROR_REQUEST_PENDING)
+    {
+        printf("  Incoming transfer ended with \"%s\"\n", secil_error_string(bulk_done[false]));
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    bool passed = true;
+
+    passed &= run_test("Subscriptions", subscriptions_client, subscriptions_server);
+    passed &= run_test("Compact frames", compact_frames_client, compact_frames_server);
+    passed &= run_test("Mixed versions", mixed_versions_client, mixed_versions_server);
+    passed &= run_test("Non-blocking connect", connect_client, connect_server);
+    passed &= run_test("State digest", digest_client, digest_server);
+    passed &= run_test("Resumption", resume_client, resume_server);
+    passed &= run_test("Resumption rejected", resume_rejected_client, resume_rejected_server);
+    passed &= run_test("String dictionary", dictionary_client, dictionary_server);
+    passed &= run_test("String dictionary mismatch", dictionary_mismatch_client, dictionary_mismatch_server);
+    passed &= run_test("Bulk cancel one way", bulk_cancel_client, bulk_cancel_server);
+
+    return passed ? 0 : 1;
+}
@@ -86,6 +86,187 @@ void inject_loopback_error(size_t bytes, memory_buffer_t *memory_buffer)
     }
 }
 
+static void on_loopback_response(void *context, secil_error_t result, const secil_message *response)
+{
+    secil_error_t *callback_result = (secil_error_t *)context;
+    *callback_result = result;
+}
+
+/// @brief Check that requests are matched to their responses without disturbing the normal stream of messages.
+/// @param memory_buffer - The memory buffer, which is emptied first.
+/// @return 0 if the test passed, 1 otherwise.
+static int test_requests(memory_buffer_t *memory_buffer)
+{
+    memory_buffer->read_index = 0;
+    memory_buffer->write_index = 0;
+
+    // Pipeline two requests with ordinary messages in between. Our own echo answers each request.
+    secil_error_t callback_result = SECIL_ERROR_REQUEST_PENDING;
+    secil_request_handle_t handle;
+    if (   secil_loopback_test_start("first", on_loopback_response, &callback_result, NULL) != SECIL_OK
+        || secil_send_currentTemperature(21) != SECIL_OK
+        || secil_loopback_test_start("second", NULL, NULL, &handle) != SECIL_OK
+        || secil_send_heatingSetpoint(22) != SECIL_OK)
+    {
+        printf("Request test: failed to send requests\n");
+        return 1;
+    }
+
+    if (secil_request_poll(handle) != SECIL_ERROR_REQUEST_PENDING)
+    {
+        printf("Request test: request completed before its response was received\n");
+        return 1;
+    }
+
+    int received = 0;
+    while (memory_buffer->read_index < memory_buffer->write_index)
+    {
+        secil_message message;
+        if (secil_receive(&message) != SECIL_OK)
+        {
+            continue;
+        }
+        if (   (received == 0 && message.which_payload != secil_message_currentTemperature_tag)
+            || (received == 1 && message.which_payload != secil_message_heatingSetpoint_tag)
+            || received > 1)
+        {
+            printf("Request test: unexpected message %u\n", (unsigned)message.which_payload);
+            return 1;
+        }
+        received++;
+    }
+
+    if (received != 2 || callback_result != SECIL_OK || secil_request_poll(handle) != SECIL_OK)
+    {
+        printf("Request test: requests did not complete (received %d messages)\n", received);
+        return 1;
+    }
+
+    if (secil_request_poll(handle) != SECIL_ERROR_INVALID_PARAMETER)
+    {
+        printf("Request test: handle was not released\n");
+        return 1;
+    }
+
+    // The blocking loopback test must not fail because an ordinary message arrives first, nor lose that message
+    secil_send_currentTemperature(23);
+    if (secil_loopback_test("third") != SECIL_OK)
+    {
+        printf("Request test: blocking loopback test failed\n");
+        return 1;
+    }
+
+    secil_message held;
+    if (   secil_receive(&held) != SECIL_OK || held.which_payload != secil_message_currentTemperature_tag
+        || held.payload.currentTemperature.currentTemperature != 23)
+    {
+        printf("Request test: message received during the blocking loopback test was lost\n");
+        return 1;
+    }
+
+    // The table of pending requests is limited
+    secil_request_handle_t handles[SECIL_MAX_PENDING_REQUESTS];
+    for (int i = 0; i < SECIL_MAX_PENDING_REQUESTS; i++)
+    {
+        if (secil_loopback_test_start("pending", NULL, NULL, &handles[i]) != SECIL_OK)
+        {
+            printf("Request test: could not fill the request table\n");
+            return 1;
+        }
+    }
+    if (secil_loopback_test_start("one too many", NULL, NULL, &handle) != SECIL_ERROR_TOO_MANY_REQUESTS)
+    {
+        printf("Request test: request table overflowed\n");
+        return 1;
+    }
+    for (int i = 0; i < SECIL_MAX_PENDING_REQUESTS; i++)
+    {
+        secil_request_cancel(handles[i]);
+    }
+
+    printf("Request test passed\n");
+    return 0;
+}
+
+static bool value_provider(void *user_data, secil_message *value)
+{
+    if (value->which_payload != secil_message_currentTemperature_tag)
+    {
+        return false;
+    }
+    value->payload.currentTemperature.currentTemperature = 19;
+    return true;
+}
+
+static void on_query_reply(void *context, secil_error_t result, const secil_message *reply)
+{
+    secil_message *values = (secil_message *)context;
+    if (result != SECIL_OK)
+    {
+        return;
+    }
+    secil_query_reply_get(reply, secil_message_currentTemperature_tag, &values[0]);
+    secil_query_reply_get(reply, secil_message_heatingSetpoint_tag, &values[1]);
+    secil_query_reply_get(reply, secil_message_matterStatus_tag, &values[2]);
+}
+
+/// @brief Check that queries are answered from the value provider and from the values sent so far, in one reply.
+/// @param memory_buffer - The memory buffer, which is emptied first.
+/// @return 0 if the test passed, 1 otherwise.
+static int test_queries(memory_buffer_t *memory_buffer)
+{
+    memory_buffer->read_index = 0;
+    memory_buffer->write_index = 0;
+
+    // The heating setpoint is answered from the last value sent, the temperature by the provider.
+    // Nothing has sent the matter status, so it is left out of the reply.
+    secil_set_value_provider(value_provider);
+    secil_send_heatingSetpoint(22);
+
+    secil_message values[3] = { 0 };
+    size_t query_start = memory_buffer->write_index;
+    if (secil_query_values(SECIL_TAG_BIT(secil_message_currentTemperature_tag) |
+                           SECIL_TAG_BIT(secil_message_heatingSetpoint_tag) |
+                           SECIL_TAG_BIT(secil_message_matterStatus_tag),
+                           on_query_reply, values, NULL) != SECIL_OK)
+    {
+        printf("Query test: failed to send query\n");
+        return 1;
+    }
+
+    int received = 0;
+    while (memory_buffer->read_index < memory_buffer->write_index)
+    {
+        secil_message message;
+        if (secil_receive(&message) == SECIL_OK)
+        {
+            received++;
+        }
+    }
+    secil_set_value_provider(NULL);
+
+    if (   received != 1
+        || values[0].which_payload != secil_message_currentTemperature_tag || values[0].payload.currentTemperature.currentTemperature != 19
+        || values[1].which_payload != secil_message_heatingSetpoint_tag || values[1].payload.heatingSetpoint.heatingSetpoint != 22
+        || values[2].which_payload != 0)
+    {
+        printf("Query test: reply did not hold the expected values\n");
+        return 1;
+    }
+
+    // Compare the query and its batched reply with pushing the same two values in frames of their own
+    size_t query_bytes = memory_buffer->write_index - query_start;
+    size_t push_start = memory_buffer->write_index;
+    secil_send_currentTemperature(19);
+    secil_send_heatingSetpoint(22);
+    size_t push_bytes = memory_buffer->write_index - push_start;
+    memory_buffer->read_index = memory_buffer->write_index;
+
+    printf("Query test passed (query and reply: %u bytes, one push of each value: %u bytes)\n",
+           (unsigned)query_bytes, (unsigned)push_bytes);
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     memory_buffer_t memory_buffer = {0}; // Initialize the memory buffer
@@ -188,5 +369,5 @@ int main(int argc, char **argv)
     printf("Longest sequence of errors: %d\n", longest_error_sequence);
     printf("Success rate: %d.%02d%%\n", (int)((messages / (float)attempts) * 100), (int)((messages / (float)attempts) * 10000) % 100);
 
-    return 0;
+    return test_requests(&memory_buffer) || test_queries(&memory_buffer);
 }
\ No newline at end of file
@@ -0,0 +1,395 @@
+#include <secil.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <unistd.h>
+#include "sim_link.h"
+
+// Tests of secil_receive_until(), whose deadline covers the whole receive however the bytes arrive, of the
+// inter-byte timeout, after which a frame that stopped arriving part way is abandoned, and of secil_receive_many(),
+// which only takes the frames that have already arrived in full.
+// Each test runs a sender and a receiver in processes of their own, joined by a socket pair.
+
+// A receive may end this long after its deadline, for the scheduler and the ms the clock counts in
+#define DEADLINE_SLACK_MS 15
+
+// Inter-byte timeout of the receivers that time gaps: a few character times at the nominal rate of the link, which
+// the shortest gap allowed outweighs, for the scheduler between the two processes
+#define GAP_CHAR_TIMES 16
+#define GAP_BAUD 115200
+#define GAP_MIN_MS 20
+
+static unsigned int trickle_ms; // The sender writes its frames one byte at a time, this far apart
+static size_t cut_after;        // The sender writes only this many more bytes, then drops the rest of the frame
+static bool cutting;
+
+/// @brief Read whatever arrives within the time limit, as a UART driver backed by poll() would.
+static int32_t read_within_fn(void *user_data, unsigned char *buf, size_t max_count, uint32_t timeout_ms)
+{
+    struct pollfd pfd = { .fd = sim.fd, .events = POLLIN };
+    int ready = poll(&pfd, 1, (int)timeout_ms);
+    if (ready < 0)
+    {
+        return -1;
+    }
+    if (ready == 0)
+    {
+        return 0;
+    }
+    ssize_t count = read(sim.fd, buf, max_count);
+    return count > 0 ? (int32_t)count : -1;
+}
+
+static bool write_fn(void *user_data, const unsigned char *buf, size_t count)
+{
+    if (cutting)
+    {
+        // As if the sender restarted part way through the frame
+        size_t written = cut_after < count ? cut_after : count;
+        cut_after -= written;
+        return write(sim.fd, buf, written) == (ssize_t)written;
+    }
+
+    if (trickle_ms == 0)
+    {
+        return sim_write_fn(user_data, buf, count);
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (write(sim.fd, &buf[i], 1) != 1)
+        {
+            return false;
+        }
+        usleep(trickle_ms * 1000);
+    }
+    return true;
+}
+
+static void log_fn(void *user_data, secil_log_severity_t severity, const char *message)
+{
+    if (severity >= secil_LOG_WARNING)
+    {
+        printf("  [%d] %s\n", (int)getpid(), message);
+    }
+}
+
+/// @brief Receive with a deadline wait_ms from now, and check both the result and when it came.
+static bool expect_result(uint32_t wait_ms, secil_error_t expected, secil_message *message)
+{
+    uint32_t start = sim_clock_fn(NULL);
+    secil_error_t result = secil_receive_until(message, start + wait_ms);
+    uint32_t took = sim_clock_fn(NULL) - start;
+    if (result != expected)
+    {
+        printf("  Expected \"%s\" but got \"%s\" after %u ms\n", secil_error_string(expected), secil_error_string(result),
+               (unsigned)took);
+        return false;
+    }
+    if (took > wait_ms + DEADLINE_SLACK_MS)
+    {
+        printf("  \"%s\" came %u ms after a deadline of %u ms\n", secil_error_string(result), (unsigned)took,
+               (unsigned)wait_ms);
+        return false;
+    }
+    return true;
+}
+
+/// @brief Set up the library in the process of each end.
+static void setup_end(int index)
+{
+    secil_init(sim_read_fn, write_fn, NULL, log_fn, NULL);
+    secil_set_clock_callback(sim_clock_fn);
+    secil_set_read_within_callback(read_within_fn);
+}
+
+static bool run_test(const char *name, sim_end_fn sender, sim_end_fn receiver)
+{
+    return sim_run_pair(name, 10, setup_end, sender, receiver);
+}
+
+// --- Nothing arrives ---
+
+static int silent_sender()
+{
+    usleep(300 * 1000);
+    return 0;
+}
+
+static int silent_receiver()
+{
+    secil_message message;
+    return expect_result(100, SECIL_ERROR_DEADLINE_EXPIRED, &message) ? 0 : 1;
+}
+
+// --- A trickle of bytes ---
+
+static int trickle_sender()
+{
+    // A frame of about 15 bytes takes 150 ms, so each one straddles several deadlines
+    trickle_ms = 10;
+    return secil_send_heatingSetpoint(21) == SECIL_OK && secil_send_hvacMode(1) == SECIL_OK ? 0 : 1;
+}
+
+/// @brief Receive with 30 ms deadlines until one does not expire, checking that none waits past its deadline.
+static secil_error_t receive_trickled(secil_message *message, unsigned int *expired)
+{
+    secil_error_t result;
+    do
+    {
+        uint32_t start = sim_clock_fn(NULL);
+        result = secil_receive_until(message, start + 30);
+        uint32_t took = sim_clock_fn(NULL) - start;
+        if (took > 30 + DEADLINE_SLACK_MS)
+        {
+            printf("  A receive took %u ms with a deadline of 30 ms\n", (unsigned)took);
+            return SECIL_ERROR_INVALID_STATE;
+        }
+        *expired += result == SECIL_ERROR_DEADLINE_EXPIRED;
+    } while (result == SECIL_ERROR_DEADLINE_EXPIRED);
+    return result;
+}
+
+static int trickle_receiver()
+{
+    secil_message message;
+    unsigned int expired = 0;
+
+#if SECIL_HALF_DUPLEX
+    // Sending shares the buffer, so each frame cut short is dropped, until the sender closes the link
+    secil_error_t result = receive_trickled(&message, &expired);
+    if (result != SECIL_ERROR_READ_TIMEOUT || expired < 4)
+    {
+        printf("  Got \"%s\" after %u deadlines\n", secil_error_string(result), expired);
+        return 1;
+    }
+    return 0;
+#else
+    // Every receive ends at its deadline, and the frames it cut short come through whole in the end
+    for (int i = 0; i < 2; i++)
+    {
+        secil_error_t result = receive_trickled(&message, &expired);
+        pb_size_t tag = i == 0 ? secil_message_heatingSetpoint_tag : secil_message_hvacMode_tag;
+        if (result != SECIL_OK || message.which_payload != tag)
+        {
+            printf("  Expected message %u but got \"%s\"\n", (unsigned)tag, secil_error_string(result));
+            return 1;
+        }
+    }
+
+    if (message.payload.hvacMode.hvacMode != 1 || expired < 4)
+    {
+        printf("  Frames cut short by %u deadlines\n", expired);
+        return 1;
+    }
+    return 0;
+#endif
+}
+
+// --- Only what has already arrived ---
+
+static int waiting_sender()
+{
+    secil_send_heatingSetpoint(21);
+    usleep(300 * 1000);
+    return 0;
+}
+
+static int waiting_receiver()
+{
+    // A deadline of now takes the message already waiting, then gives up at once
+    secil_message message;
+    usleep(100 * 1000);
+    bool passed = expect_result(0, SECIL_OK, &message) && message.which_payload == secil_message_heatingSetpoint_tag
+               && expect_result(0, SECIL_ERROR_DEADLINE_EXPIRED, &message);
+    return passed ? 0 : 1;
+}
+
+// --- A batch ends at a frame still arriving ---
+
+static int batch_sender()
+{
+    // One frame at once, then one that takes about 300 ms
+    if (secil_send_heatingSetpoint(21) != SECIL_OK)
+    {
+        return 1;
+    }
+    trickle_ms = 20;
+    if (secil_send_hvacMode(1) != SECIL_OK)
+    {
+        return 1;
+    }
+    usleep(300 * 1000);
+    return 0;
+}
+
+static int batch_receiver()
+{
+    // The batch takes the whole frame, and does not wait for the rest of the next although bytes of it are pending
+    secil_message messages[4];
+    size_t count = 0;
+    secil_set_available_callback(sim_available_fn);
+    usleep(100 * 1000);
+    uint32_t start = sim_clock_fn(NULL);
+    secil_error_t result = secil_receive_many(messages, 4, &count);
+    uint32_t took = sim_clock_fn(NULL) - start;
+    if (result != SECIL_OK || count != 1 || messages[0].which_payload != secil_message_heatingSetpoint_tag)
+    {
+        printf("  Got \"%s\" with %zu messages\n", secil_error_string(result), count);
+        return 1;
+    }
+    if (took > DEADLINE_SLACK_MS)
+    {
+        printf("  The batch waited %u ms for a frame still arriving\n", (unsigned)took);
+        return 1;
+    }
+
+#if SECIL_HALF_DUPLEX
+    // Sending shares the buffer, so the frame cut short is dropped, until the sender closes the link
+    result = secil_receive(&messages[0]);
+    return result == SECIL_ERROR_READ_TIMEOUT ? 0 : 1;
+#else
+    // The start of the frame is kept, and the next receive carries on with it
+    result = secil_receive(&messages[0]);
+    if (result != SECIL_OK || messages[0].which_payload != secil_message_hvacMode_tag || messages[0].payload.hvacMode.hvacMode != 1)
+    {
+        printf("  Expected the frame still arriving but got \"%s\"\n", secil_error_string(result));
+        return 1;
+    }
+    return 0;
+#endif
+}
+
+// --- A corrupt frame first ---
+
+static int corrupt_sender()
+{
+    // A compact header whose body and CRC are wrong, then a good frame
+    static const unsigned char corrupt[] = { 0xCA, 0xF2, 0x04, 0x08, 0x01, 0x10, 0x02, 0x00, 0x00 };
+    if (write(sim.fd, corrupt, sizeof(corrupt)) != sizeof(corrupt) || secil_send_heatingSetpoint(21) != SECIL_OK)
+    {
+        return 1;
+    }
+    usleep(300 * 1000);
+    return 0;
+}
+
+static int corrupt_receiver()
+{
+    // Skipping the corrupt frame is part of the same receive
+    secil_message message;
+    return expect_result(500, SECIL_OK, &message) && message.which_payload == secil_message_heatingSetpoint_tag ? 0 : 1;
+}
+
+// --- The sender restarts part way through a frame ---
+
+static int reset_sender()
+{
+    cut_after = 6;
+    cutting = true;
+    secil_send_heatingSetpoint(21);
+    cutting = false;
+
+    // Then the frames sent once it is back must not be taken as the rest of the one cut short
+    usleep(100 * 1000);
+    if (secil_send_hvacMode(1) != SECIL_OK || secil_send_hvacMode(2) != SECIL_OK)
+    {
+        return 1;
+    }
+    usleep(300 * 1000);
+    return 0;
+}
+
+static int reset_receiver()
+{
+    // Only the frame cut short is lost, as the receive gives up on it once its bytes stop arriving
+    secil_message message;
+    secil_set_inter_byte_timeout(GAP_CHAR_TIMES, GAP_BAUD, GAP_MIN_MS);
+    if (secil_receive(&message) != SECIL_ERROR_DECODE_FAILED)
+    {
+        printf("  The frame cut short was not abandoned\n");
+        return 1;
+    }
+    for (uint32_t mode = 1; mode <= 2; mode++)
+    {
+        secil_error_t result = secil_receive(&message);
+        if (result != SECIL_OK || message.which_payload != secil_message_hvacMode_tag || message.payload.hvacMode.hvacMode != mode)
+        {
+            printf("  Expected mode %u but got \"%s\"\n", (unsigned)mode, secil_error_string(result));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// --- A false header hides a real one ---
+
+static int false_header_sender()
+{
+    // A header whose length runs past the good frame right after it, then nothing more
+    static const unsigned char header[] = { 0xCA, 0xF2, 0x40 };
+    if (write(sim.fd, header, sizeof(header)) != sizeof(header) || secil_send_heatingSetpoint(21) != SECIL_OK)
+    {
+        return 1;
+    }
+    usleep(300 * 1000);
+    return 0;
+}
+
+static int false_header_receiver()
+{
+    secil_message message;
+    secil_set_inter_byte_timeout(GAP_CHAR_TIMES, GAP_BAUD, GAP_MIN_MS);
+    if (secil_receive(&message) != SECIL_ERROR_DECODE_FAILED)
+    {
+        printf("  The frame of the false header was not abandoned\n");
+        return 1;
+    }
+
+#if SECIL_HALF_DUPLEX
+    // Sending shares the buffer, so the bytes of the abandoned frame are dropped, the good frame among them too
+    secil_error_t result = secil_receive(&message);
+    return result == SECIL_ERROR_READ_TIMEOUT ? 0 : 1;
+#else
+    // The bytes after the false header are looked through again, and the good frame is found among them
+    secil_error_t result = secil_receive(&message);
+    if (result != SECIL_OK || message.which_payload != secil_message_heatingSetpoint_tag)
+    {
+        printf("  Expected the good frame but got \"%s\"\n", secil_error_string(result));
+        return 1;
+    }
+    return 0;
+#endif
+}
+
+// --- The transport fails ---
+
+static int closed_sender()
+{
+    return 0;
+}
+
+static int closed_receiver()
+{
+    // A closed link is a transport failure, not an expired deadline, and is reported at once
+    secil_message message;
+    usleep(100 * 1000);
+    return expect_result(500, SECIL_ERROR_READ_TIMEOUT, &message) ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    bool passed = true;
+
+    passed &= run_test("Nothing arrives", silent_sender, silent_receiver);
+    passed &= run_test("Trickle of bytes", trickle_sender, trickle_receiver);
+    passed &= run_test("Already arrived", waiting_sender, waiting_receiver);
+    passed &= run_test("Batch of what has arrived", batch_sender, batch_receiver);
+    passed &= run_test("Corrupt frame", corrupt_sender, corrupt_receiver);
+    passed &= run_test("Transport closed", closed_sender, closed_receiver);
+    passed &= run_test("Reset mid-frame", reset_sender, reset_receiver);
+    passed &= run_test("False header", false_header_sender, false_header_receiver);
+
+    return passed ? 0 : 1;
+}